@@ -2,7 +2,7 @@
 #define APPLYCAL_WRITER_H
 
 #include "forwardingwriter.h"
-#include "matrix2x2.h"
+#include "solutionapplier.h"
 
 #include <memory>
 #include <string>
@@ -13,16 +13,20 @@ class ApplySolutionsWriter : public ForwardingWriter
 	public:
 		ApplySolutionsWriter(std::unique_ptr<Writer> parentWriter, const std::string& filename);
 		
+		const char* KernelName() const { return _applier.KernelName(); }
+		
 		virtual ~ApplySolutionsWriter() final override;
 		
+		/** Solutions are full Jones matrices, so they can only be applied to rows with all four polarizations. */
+		virtual void SetPolarizationCount(size_t polarizationCount) final override;
+		
 		virtual void WriteBandInfo(const std::string& name, const std::vector<Writer::ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
 		
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		
 	private:
-		size_t _nChannels, _nSolutionAntennas, _nSolutionChannels;
+		SolutionApplier _applier;
 		std::vector<std::complex<float>> _correctedData;
-		std::vector<MC2x2> _solutions;
 };
 
 #endif
@@ -8,9 +8,9 @@ void AveragingWriter::WriteRow(double time, double timeCentroid, size_t antenna1
 	for(size_t ch=0; ch!=_avgChannelCount*_freqAvgFactor; ++ch)
 	{
 #ifndef USE_SSE
-		for(size_t p=0; p!=4; ++p)
+		for(size_t p=0; p!=_polarizationCount; ++p)
 		{
-			const size_t destIndex = (ch / _freqAvgFactor) * 4 + p;
+			const size_t destIndex = (ch / _freqAvgFactor) * _polarizationCount + p;
 			buffer._flaggedAndUnflaggedData[destIndex] += data[srcIndex];
 			if(!flags[srcIndex])
 			{
@@ -1,10 +1,12 @@
 #ifndef AVERAGING_MS_WRITER_H
 #define AVERAGING_MS_WRITER_H
 
+#include "memoryaccounting.h"
 #include "writer.h"
 
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 
 class UVWCalculater
 {
@@ -17,7 +19,8 @@ class AveragingWriter : public Writer
 	public:
 		AveragingWriter(std::unique_ptr<Writer>&& writer, size_t timeCount, size_t freqAvgFactor, UVWCalculater& uvwCalculater)
 		: _writer(std::move(writer)), _timeAvgFactor(timeCount), _freqAvgFactor(freqAvgFactor), _rowsAdded(0),
-		_originalChannelCount(0), _avgChannelCount(0), _antennaCount(0), _uvwCalculater(uvwCalculater)
+		_polarizationCount(4), _originalChannelCount(0), _avgChannelCount(0), _antennaCount(0), _uvwCalculater(uvwCalculater),
+		_bufferBytes(MemoryAccounting::AveragingCategory)
 		{
 		}
 		
@@ -26,6 +29,16 @@ class AveragingWriter : public Writer
 			destroyBuffers();
 		}
 		
+		virtual void SetPolarizationCount(size_t polarizationCount) final override
+		{
+#ifdef USE_SSE
+			if(polarizationCount != 4)
+				throw std::runtime_error("Averaging with SSE instructions requires four polarizations");
+#endif
+			_polarizationCount = polarizationCount;
+			_writer->SetPolarizationCount(polarizationCount);
+		}
+		
 		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override
 		{
 			if(channels.size()%_freqAvgFactor != 0)
@@ -130,14 +143,14 @@ class AveragingWriter : public Writer
 	private:
 		struct Buffer
 		{
-			Buffer(size_t avgChannelCount)
+			Buffer(size_t valueCount)
 			{
-				_rowData = new std::complex<float>[avgChannelCount*4];
-				_flaggedAndUnflaggedData = new std::complex<float>[avgChannelCount*4];
-				_rowFlags = new bool[avgChannelCount*4];
-				_rowWeights = new float[avgChannelCount*4];
-				_rowCounts = new size_t[avgChannelCount*4];
-				initZero(avgChannelCount);
+				_rowData = new std::complex<float>[valueCount];
+				_flaggedAndUnflaggedData = new std::complex<float>[valueCount];
+				_rowFlags = new bool[valueCount];
+				_rowWeights = new float[valueCount];
+				_rowCounts = new size_t[valueCount];
+				initZero(valueCount);
 			}
 			
 			~Buffer()
@@ -149,12 +162,12 @@ class AveragingWriter : public Writer
 				delete[] _rowCounts;
 			}
 			
-			void initZero(size_t avgChannelCount)
+			void initZero(size_t valueCount)
 			{
 				_rowTime = 0.0;
 				_rowTimestepCount = 0;
 				_interval = 0.0;
-				for(size_t ch=0; ch!=avgChannelCount*4; ++ch)
+				for(size_t ch=0; ch!=valueCount; ++ch)
 				{
 					_rowData[ch] = 0.0;
 					_flaggedAndUnflaggedData[ch] = 0.0;
@@ -180,7 +193,7 @@ class AveragingWriter : public Writer
 			double u, v, w;
 			_uvwCalculater.CalculateUVW(time, antenna1, antenna2, u, v, w);
 			
-			for(size_t ch=0;ch!=_avgChannelCount*4;++ch)
+			for(size_t ch=0;ch!=_avgChannelCount*_polarizationCount;++ch)
 			{
 				if(buffer._rowCounts[ch]==0)
 				{
@@ -198,7 +211,7 @@ class AveragingWriter : public Writer
 			
 			_writer->WriteRow(time, time, antenna1, antenna2, u, v, w, buffer._interval, buffer._rowData, buffer._rowFlags, buffer._rowWeights);
 			
-			buffer.initZero(_avgChannelCount);
+			buffer.initZero(_avgChannelCount*_polarizationCount);
 		}
 		
 		Buffer &getBuffer(size_t antenna1, size_t antenna2)
@@ -222,10 +235,12 @@ class AveragingWriter : public Writer
 				
 				for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
 				{
-					Buffer *buffer = new Buffer(_avgChannelCount);
+					Buffer *buffer = new Buffer(_avgChannelCount*_polarizationCount);
 					setBuffer(antenna1, antenna2, buffer);
 				}
 			}
+			const size_t bytesPerValue = 2 * sizeof(std::complex<float>) + sizeof(bool) + sizeof(float) + sizeof(size_t);
+			_bufferBytes.Set(_antennaCount * (_antennaCount + 1) / 2 * _avgChannelCount * _polarizationCount * bytesPerValue);
 		}
 		
 		void destroyBuffers()
@@ -239,13 +254,15 @@ class AveragingWriter : public Writer
 				}
 			}
 			_buffers.clear();
+			_bufferBytes.Set(0);
 		}
 		
 		std::unique_ptr<Writer> _writer;
-		size_t _timeAvgFactor, _freqAvgFactor, _rowsAdded;
+		size_t _timeAvgFactor, _freqAvgFactor, _rowsAdded, _polarizationCount;
 		size_t _originalChannelCount, _avgChannelCount, _antennaCount;
 		UVWCalculater& _uvwCalculater;
 		std::vector<Buffer*> _buffers;
+		TrackedBytes _bufferBytes;
 };
 
 #endif
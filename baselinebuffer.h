@@ -7,7 +7,8 @@ class BaselineBuffer
 {
 	public:
 		BaselineBuffer() :
-			nElementsPerRow(0)
+			nElementsPerRow(0),
+			node(0)
 		{
 			for(size_t p=0; p!=4; ++p)
 			{
@@ -16,7 +17,8 @@ class BaselineBuffer
 		}
 		
 		BaselineBuffer(const BaselineBuffer &source) :
-			nElementsPerRow(source.nElementsPerRow)
+			nElementsPerRow(source.nElementsPerRow),
+			node(source.node)
 		{
 			for(size_t p=0; p!=4; ++p)
 			{
@@ -28,6 +30,7 @@ class BaselineBuffer
 		BaselineBuffer& operator=(const BaselineBuffer &source)
 		{
 			nElementsPerRow = source.nElementsPerRow;
+			node = source.node;
 			for(size_t p=0; p!=4; ++p)
 			{
 				real[p] = source.real[p];
@@ -38,6 +41,8 @@ class BaselineBuffer
 		
 		float *real[4], *imag[4];
 		size_t nElementsPerRow;
+		// NUMA node of the thread pool on which the buffer was allocated
+		size_t node;
 };
 
 #endif
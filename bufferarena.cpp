@@ -0,0 +1,167 @@
+#include "bufferarena.h"
+#include "threadpool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+using namespace aoflagger;
+
+BufferArena::BufferArena(AOFlagger& flagger, ThreadPool& pool, bool useHugePages) :
+	_flagger(flagger),
+	_pool(pool),
+	_useHugePages(useHugePages),
+	_hugePageSize(size_t(2) << 20),
+	_height(0),
+	_widthCapacity(0),
+	_imageSetBytes(MemoryAccounting::ImageSetCategory),
+	_imageSetAllocationCount(0),
+	_flagMaskAllocationCount(0)
+{
+	std::ifstream pageSizeFile("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+	size_t pageSize = 0;
+	if(pageSizeFile >> pageSize && pageSize != 0)
+		_hugePageSize = pageSize;
+}
+
+BufferArena::~BufferArena()
+{
+	Release();
+}
+
+void BufferArena::PrepareImageSets(size_t baselineCount, size_t width, size_t height, size_t widthCapacity, const std::function<size_t(size_t)>& baselineNode, size_t keptStart, size_t keptCount)
+{
+	ThreadPool::TaskGroup tasks(_pool);
+	if(_imageSets.size() == baselineCount && _height == height && _widthCapacity >= widthCapacity)
+	{
+		for(size_t baseline=0; baseline!=baselineCount; ++baseline)
+		{
+			ImageSet* imageSet = &_imageSets[baseline];
+			tasks.RunOnNode(baselineNode(baseline), [imageSet, width, keptStart, keptCount]()
+			{
+				if(keptCount == 0)
+				{
+					imageSet->ResizeWithoutReallocation(width);
+					imageSet->Set(0.0f);
+				}
+				else {
+					// The stride does not change, so the rows stay in place
+					const size_t stride = imageSet->HorizontalStride();
+					for(size_t i=0; i!=imageSet->ImageCount(); ++i)
+					{
+						for(size_t y=0; y!=imageSet->Height(); ++y)
+						{
+							float* row = imageSet->ImageBuffer(i) + y*stride;
+							std::memmove(row, row + keptStart, keptCount * sizeof(float));
+							std::fill(row + keptCount, row + stride, 0.0f);
+						}
+					}
+					imageSet->ResizeWithoutReallocation(width);
+				}
+			});
+		}
+		tasks.Wait();
+	}
+	else if(keptCount != 0)
+		throw std::runtime_error("Scans of the previous chunk can't be kept when the image sets are reallocated");
+	else {
+		// Free the old buffers first, so that the old and new buffers are never in memory together
+		Release();
+		std::vector<std::unique_ptr<ImageSet>> newImageSets(baselineCount);
+		for(size_t baseline=0; baseline!=baselineCount; ++baseline)
+		{
+			std::unique_ptr<ImageSet>* imageSet = &newImageSets[baseline];
+			tasks.RunOnNode(baselineNode(baseline), [this, imageSet, width, height, widthCapacity]()
+			{
+				// The uninitialized variant is used so that the pages are advised before they are touched
+				imageSet->reset(new ImageSet(_flagger.MakeImageSet(width, height, 8, widthCapacity)));
+				for(size_t i=0; i!=(*imageSet)->ImageCount(); ++i)
+					adviseHugePages((*imageSet)->ImageBuffer(i), (*imageSet)->HorizontalStride() * height * sizeof(float));
+				(*imageSet)->Set(0.0f);
+			});
+		}
+		tasks.Wait();
+		_imageSets.reserve(baselineCount);
+		for(std::unique_ptr<ImageSet>& imageSet : newImageSets)
+			_imageSets.emplace_back(std::move(*imageSet));
+		_flagMasks.resize(baselineCount);
+		_height = height;
+		_widthCapacity = widthCapacity;
+		_imageSetAllocationCount += baselineCount;
+		if(baselineCount != 0)
+		{
+			const ImageSet& imageSet = _imageSets.front();
+			_imageSetBytes.Set(baselineCount * imageSet.ImageCount() * imageSet.HorizontalStride() * height * sizeof(float));
+		}
+	}
+}
+
+FlagMask& BufferArena::AcquireFlagMask(size_t baseline, size_t width, size_t height, bool initialValue)
+{
+	std::unique_ptr<FlagMask>& mask = _flagMasks[baseline];
+	if(!mask || mask->Width() != width || mask->Height() != height)
+	{
+		if(mask)
+			MemoryAccounting::Add(MemoryAccounting::FlagMaskCategory, -flagMaskBytes(*mask));
+		mask.reset();
+		mask.reset(new FlagMask(_flagger.MakeFlagMask(width, height)));
+		MemoryAccounting::Add(MemoryAccounting::FlagMaskCategory, flagMaskBytes(*mask));
+		adviseHugePages(mask->Buffer(), mask->HorizontalStride() * height);
+		_flagMaskAllocationCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	std::memset(mask->Buffer(), initialValue ? 1 : 0, mask->HorizontalStride() * height * sizeof(bool));
+	return *mask;
+}
+
+void BufferArena::StoreFlagMask(size_t baseline, FlagMask&& mask)
+{
+	std::unique_ptr<FlagMask>& storedMask = _flagMasks[baseline];
+	MemoryAccounting::Add(MemoryAccounting::FlagMaskCategory, flagMaskBytes(mask) - (storedMask ? flagMaskBytes(*storedMask) : 0));
+	if(storedMask)
+		*storedMask = std::move(mask);
+	else
+		storedMask.reset(new FlagMask(std::move(mask)));
+}
+
+void BufferArena::Release()
+{
+	for(const std::unique_ptr<FlagMask>& mask : _flagMasks)
+	{
+		if(mask)
+			MemoryAccounting::Add(MemoryAccounting::FlagMaskCategory, -flagMaskBytes(*mask));
+	}
+	_flagMasks.clear();
+	_imageSets.clear();
+	_imageSetBytes.Set(0);
+	_height = 0;
+	_widthCapacity = 0;
+}
+
+bool BufferArena::HugePagesAvailable()
+{
+	std::ifstream enabledFile("/sys/kernel/mm/transparent_hugepage/enabled");
+	std::string enabled;
+	if(!enabledFile || !std::getline(enabledFile, enabled))
+		return false;
+	return enabled.find("[never]") == std::string::npos;
+}
+
+void BufferArena::adviseHugePages(void* data, size_t size) const
+{
+#ifdef MADV_HUGEPAGE
+	if(!_useHugePages)
+		return;
+	// Only whole huge pages inside the buffer can be advised
+	const uintptr_t
+		start = (reinterpret_cast<uintptr_t>(data) + _hugePageSize - 1) / _hugePageSize * _hugePageSize,
+		end = (reinterpret_cast<uintptr_t>(data) + size) / _hugePageSize * _hugePageSize;
+	// Failure is not fatal: the memory then simply uses normal pages
+	if(end > start)
+		madvise(reinterpret_cast<void*>(start), end - start, MADV_HUGEPAGE);
+#endif
+}
@@ -0,0 +1,96 @@
+#ifndef BUFFER_ARENA_H
+#define BUFFER_ARENA_H
+
+#include "memoryaccounting.h"
+
+#include <aoflagger.h>
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class ThreadPool;
+
+/**
+ * Owns the large per-baseline buffers (the image sets with the visibilities
+ * and the flag masks) for the whole run, and reuses them for all chunks and
+ * all contiguous bands. Reallocating these buffers for every band or chunk
+ * fragments the heap, because their sizes differ slightly each time, which
+ * once caused about twice the expected memory use.
+ *
+ * Image sets are only reallocated when the number of channels changes or when
+ * more scans are needed than their capacity. Flag masks are reused when a chunk
+ * has the same number of scans as the previous chunk; the masks made by the
+ * flagger itself are still allocated by AOFlagger.
+ *
+ * Buffers are allocated (and hence first touched) by a worker of the NUMA node
+ * that processes the baseline. When huge pages are enabled, the buffers are
+ * advised to use transparent huge pages before they are first touched.
+ *
+ * The sizes of the buffers are counted in MemoryAccounting.
+ */
+class BufferArena
+{
+	public:
+		BufferArena(aoflagger::AOFlagger& flagger, ThreadPool& pool, bool useHugePages);
+		~BufferArena();
+
+		/**
+		 * Make sure that there is an image set for every baseline, with the given size
+		 * and all values set to zero. Existing image sets are reused when possible.
+		 * @param baselineNode Returns the NUMA node that processes a baseline index.
+		 * @param keptStart,keptCount The scans (columns) [keptStart, keptStart+keptCount) of the
+		 * previous chunk are moved to the start instead of being set to zero, e.g. for
+		 * overlapping chunks. This requires that the image sets can be reused.
+		 */
+		void PrepareImageSets(size_t baselineCount, size_t width, size_t height, size_t widthCapacity, const std::function<size_t(size_t)>& baselineNode, size_t keptStart = 0, size_t keptCount = 0);
+
+		aoflagger::ImageSet& BaselineImageSet(size_t baseline) { return _imageSets[baseline]; }
+		const aoflagger::ImageSet& BaselineImageSet(size_t baseline) const { return _imageSets[baseline]; }
+
+		/**
+		 * Returns the flag mask of a baseline with the given size and all values set
+		 * to @p initialValue. The mask of the previous chunk is reused when it has
+		 * the same size. Different baselines may be acquired concurrently.
+		 */
+		aoflagger::FlagMask& AcquireFlagMask(size_t baseline, size_t width, size_t height, bool initialValue);
+
+		/** Replace the flag mask of a baseline, e.g. by the result of the flagger. */
+		void StoreFlagMask(size_t baseline, aoflagger::FlagMask&& mask);
+
+		aoflagger::FlagMask& BaselineFlagMask(size_t baseline) { return *_flagMasks[baseline]; }
+		const aoflagger::FlagMask& BaselineFlagMask(size_t baseline) const { return *_flagMasks[baseline]; }
+
+		/** Free all buffers. */
+		void Release();
+
+		size_t ImageSetAllocationCount() const { return _imageSetAllocationCount; }
+		size_t FlagMaskAllocationCount() const { return _flagMaskAllocationCount; }
+
+		/** Whether the kernel supports transparent huge pages for madvise()d memory. */
+		static bool HugePagesAvailable();
+
+	private:
+		void adviseHugePages(void* data, size_t size) const;
+		static int64_t flagMaskBytes(const aoflagger::FlagMask& mask) { return mask.HorizontalStride() * mask.Height(); }
+
+		aoflagger::AOFlagger& _flagger;
+		ThreadPool& _pool;
+		bool _useHugePages;
+		size_t _hugePageSize;
+
+		std::vector<aoflagger::ImageSet> _imageSets;
+		size_t _height, _widthCapacity;
+		TrackedBytes _imageSetBytes;
+		// This unique_ptr is necessary because FlagMask was not properly nullable in aoflagger 2.11
+		std::vector<std::unique_ptr<aoflagger::FlagMask>> _flagMasks;
+		size_t _imageSetAllocationCount;
+		std::atomic<size_t> _flagMaskAllocationCount;
+
+		BufferArena(const BufferArena&) = delete;
+		void operator=(const BufferArena&) = delete;
+};
+
+#endif
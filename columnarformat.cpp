@@ -0,0 +1,265 @@
+#include "columnarformat.h"
+
+#include <complex>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+static_assert(sizeof(ColumnarFormat::Header) == 128, "The header of the columnar format should have no padding");
+
+namespace {
+	/** Writes the tab separated fields of one metadata record. */
+	class RecordWriter
+	{
+		public:
+			RecordWriter(std::ostringstream& stream, const char* type) : _stream(stream)
+			{
+				_stream << type;
+			}
+			~RecordWriter() { _stream << '\n'; }
+
+			RecordWriter& operator<<(const std::string& value)
+			{
+				// Tabs and new lines would break the record structure
+				std::string escaped(value);
+				for(char& c : escaped)
+				{
+					if(c == '\t' || c == '\n')
+						c = ' ';
+				}
+				_stream << '\t' << escaped;
+				return *this;
+			}
+			RecordWriter& operator<<(double value)
+			{
+				_stream << '\t' << value;
+				return *this;
+			}
+			RecordWriter& operator<<(int value)
+			{
+				_stream << '\t' << value;
+				return *this;
+			}
+			RecordWriter& operator<<(bool value)
+			{
+				_stream << '\t' << (value ? 1 : 0);
+				return *this;
+			}
+		private:
+			std::ostringstream& _stream;
+	};
+
+	/** Reads the fields of one metadata record. */
+	class RecordReader
+	{
+		public:
+			explicit RecordReader(const std::string& line) : _line(line), _position(0) { }
+
+			std::string NextString()
+			{
+				if(_position > _line.size())
+					throw std::runtime_error("Columnar file has an incomplete metadata record: " + _line);
+				size_t end = _line.find('\t', _position);
+				if(end == std::string::npos)
+					end = _line.size();
+				std::string field = _line.substr(_position, end - _position);
+				_position = end + 1;
+				return field;
+			}
+			double NextDouble()
+			{
+				std::istringstream stream(NextString());
+				double value;
+				if(!(stream >> value))
+					throw std::runtime_error("Columnar file has an invalid number in metadata record: " + _line);
+				return value;
+			}
+			int NextInt() { return int(NextDouble()); }
+			bool NextBool() { return NextDouble() != 0.0; }
+			bool AtEnd() const { return _position > _line.size(); }
+		private:
+			const std::string& _line;
+			size_t _position;
+	};
+}
+
+size_t ColumnarFormat::RowSize(Column column, size_t channelCount, size_t polarizationCount)
+{
+	switch(column)
+	{
+		case Time:
+		case TimeCentroid:
+		case Interval:
+			return sizeof(double);
+		case Antennas:
+			return 2 * sizeof(uint32_t);
+		case UVW:
+			return 3 * sizeof(double);
+		case Data:
+			return channelCount * polarizationCount * sizeof(std::complex<float>);
+		case Flags:
+			return (channelCount * polarizationCount + 7) / 8;
+		case Weights:
+			return channelCount * polarizationCount * sizeof(float);
+		case ColumnCount:
+			break;
+	}
+	throw std::runtime_error("Invalid column in columnar format");
+}
+
+void ColumnarFormat::LayoutColumns(Header& header)
+{
+	uint64_t offset = ColumnAlignment;
+	for(size_t column=0; column!=ColumnCount; ++column)
+	{
+		header.columnOffsets[column] = offset;
+		offset += ColumnSize(Column(column), header.channelCount, header.polarizationCount, header.rowCapacity);
+	}
+}
+
+uint64_t ColumnarFormat::ColumnsEnd(const Header& header)
+{
+	return header.columnOffsets[ColumnCount-1] + ColumnSize(Weights, header.channelCount, header.polarizationCount, header.rowCapacity);
+}
+
+std::string ColumnarFormat::Metadata::ToText() const
+{
+	std::ostringstream stream;
+	stream.precision(std::numeric_limits<double>::max_digits10);
+	if(hasArrayLocation)
+		RecordWriter(stream, "arraylocation") << arrayX << arrayY << arrayZ;
+	RecordWriter(stream, "band") << bandName << refFreq << totalBandwidth << bandFlagRow;
+	for(const Writer::ChannelInfo& channel : channels)
+		RecordWriter(stream, "channel") << channel.chanFreq << channel.chanWidth << channel.effectiveBW << channel.resolution;
+	RecordWriter(stream, "antennatime") << antennaTime;
+	for(const Writer::AntennaInfo& antenna : antennae)
+		RecordWriter(stream, "antenna") << antenna.name << antenna.station << antenna.type << antenna.mount << antenna.x << antenna.y << antenna.z << antenna.diameter << antenna.flag;
+	RecordWriter(stream, "polarization") << polarizationFlagRow;
+	for(const Writer::SourceInfo& source : sources)
+		RecordWriter(stream, "source") << source.sourceId << source.time << source.interval << source.spectralWindowId << source.numLines << source.name << source.calibrationGroup << source.code << source.directionRA << source.directionDec << source.properMotion[0] << source.properMotion[1];
+	for(const Writer::FieldInfo& field : fields)
+		RecordWriter(stream, "field") << field.name << field.code << field.time << field.numPoly << field.delayDirRA << field.delayDirDec << field.phaseDirRA << field.phaseDirDec << field.referenceDirRA << field.referenceDirDec << field.sourceId << field.flagRow;
+	for(const Writer::ObservationInfo& observation : observations)
+		RecordWriter(stream, "observation") << observation.telescopeName << observation.startTime << observation.endTime << observation.observer << observation.scheduleType << observation.project << observation.releaseDate << observation.flagRow;
+	for(const HistoryItem& item : history)
+	{
+		RecordWriter record(stream, "history");
+		record << item.commandLine << item.application;
+		for(const std::string& param : item.params)
+			record << param;
+	}
+	return stream.str();
+}
+
+ColumnarFormat::Metadata ColumnarFormat::Metadata::FromText(const std::string& text)
+{
+	Metadata metadata;
+	std::istringstream stream(text);
+	std::string line;
+	while(std::getline(stream, line))
+	{
+		if(line.empty())
+			continue;
+		RecordReader record(line);
+		const std::string type = record.NextString();
+		if(type == "arraylocation")
+		{
+			metadata.hasArrayLocation = true;
+			metadata.arrayX = record.NextDouble();
+			metadata.arrayY = record.NextDouble();
+			metadata.arrayZ = record.NextDouble();
+		}
+		else if(type == "band")
+		{
+			metadata.bandName = record.NextString();
+			metadata.refFreq = record.NextDouble();
+			metadata.totalBandwidth = record.NextDouble();
+			metadata.bandFlagRow = record.NextBool();
+		}
+		else if(type == "channel")
+		{
+			Writer::ChannelInfo channel;
+			channel.chanFreq = record.NextDouble();
+			channel.chanWidth = record.NextDouble();
+			channel.effectiveBW = record.NextDouble();
+			channel.resolution = record.NextDouble();
+			metadata.channels.push_back(channel);
+		}
+		else if(type == "antennatime")
+			metadata.antennaTime = record.NextDouble();
+		else if(type == "antenna")
+		{
+			Writer::AntennaInfo antenna;
+			antenna.name = record.NextString();
+			antenna.station = record.NextString();
+			antenna.type = record.NextString();
+			antenna.mount = record.NextString();
+			antenna.x = record.NextDouble();
+			antenna.y = record.NextDouble();
+			antenna.z = record.NextDouble();
+			antenna.diameter = record.NextDouble();
+			antenna.flag = record.NextBool();
+			metadata.antennae.push_back(antenna);
+		}
+		else if(type == "polarization")
+			metadata.polarizationFlagRow = record.NextBool();
+		else if(type == "source")
+		{
+			Writer::SourceInfo source;
+			source.sourceId = record.NextInt();
+			source.time = record.NextDouble();
+			source.interval = record.NextDouble();
+			source.spectralWindowId = record.NextInt();
+			source.numLines = record.NextInt();
+			source.name = record.NextString();
+			source.calibrationGroup = record.NextInt();
+			source.code = record.NextString();
+			source.directionRA = record.NextDouble();
+			source.directionDec = record.NextDouble();
+			source.properMotion[0] = record.NextDouble();
+			source.properMotion[1] = record.NextDouble();
+			metadata.sources.push_back(source);
+		}
+		else if(type == "field")
+		{
+			Writer::FieldInfo field;
+			field.name = record.NextString();
+			field.code = record.NextString();
+			field.time = record.NextDouble();
+			field.numPoly = record.NextInt();
+			field.delayDirRA = record.NextDouble();
+			field.delayDirDec = record.NextDouble();
+			field.phaseDirRA = record.NextDouble();
+			field.phaseDirDec = record.NextDouble();
+			field.referenceDirRA = record.NextDouble();
+			field.referenceDirDec = record.NextDouble();
+			field.sourceId = record.NextInt();
+			field.flagRow = record.NextBool();
+			metadata.fields.push_back(field);
+		}
+		else if(type == "observation")
+		{
+			Writer::ObservationInfo observation;
+			observation.telescopeName = record.NextString();
+			observation.startTime = record.NextDouble();
+			observation.endTime = record.NextDouble();
+			observation.observer = record.NextString();
+			observation.scheduleType = record.NextString();
+			observation.project = record.NextString();
+			observation.releaseDate = record.NextDouble();
+			observation.flagRow = record.NextBool();
+			metadata.observations.push_back(observation);
+		}
+		else if(type == "history")
+		{
+			HistoryItem item;
+			item.commandLine = record.NextString();
+			item.application = record.NextString();
+			while(!record.AtEnd())
+				item.params.push_back(record.NextString());
+			metadata.history.push_back(item);
+		}
+		// Unknown records are skipped, so that newer minor versions can add records
+	}
+	return metadata;
+}
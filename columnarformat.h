@@ -0,0 +1,104 @@
+#ifndef COLUMNAR_FORMAT_H
+#define COLUMNAR_FORMAT_H
+
+#include "writer.h"
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * A simple columnar visibility format ("cvis") that can be memory mapped and used
+ * without parsing. It is written by ColumnarWriter and can be converted to a
+ * measurement set with cvis2ms.
+ *
+ * All numbers are stored little endian. A file consists of:
+ * - the Header;
+ * - one array per Column, each starting at a multiple of ColumnAlignment bytes at
+ *   Header::columnOffsets[column]. Every column has room for Header::rowCapacity rows,
+ *   of which the first Header::rowCount are valid; the unused space may be a hole;
+ * - the metadata at Header::metadataOffset, as text (see Metadata).
+ *
+ * The per-row sizes of the columns are:
+ * - Time, TimeCentroid, Interval: one double (seconds, MJD for times);
+ * - Antennas: two uint32 antenna indices;
+ * - UVW: three doubles (metres);
+ * - Data: channelCount x polarizationCount complex floats, channel major;
+ * - Flags: channelCount x polarizationCount bits, most significant bit first, padded
+ *   to whole bytes per row;
+ * - Weights: channelCount x polarizationCount floats.
+ * Polarizations are the linear XX, XY, YX and YY, or XX and YY when polarizationCount is 2.
+ */
+class ColumnarFormat
+{
+	public:
+		enum Column { Time, TimeCentroid, Interval, Antennas, UVW, Data, Flags, Weights, ColumnCount };
+
+		struct Header
+		{
+			char fileIdentifier[4];
+			uint16_t versionMinor, versionMajor;
+			uint32_t channelCount, polarizationCount;
+			uint64_t rowCount, rowCapacity;
+			uint64_t metadataOffset, metadataSize;
+			uint64_t columnOffsets[ColumnCount];
+			char cotterVersion[16];
+		};
+
+		/**
+		 * All information that a Writer receives besides the rows. The text form has one
+		 * record per line, with tab separated fields of which the first is the record type.
+		 * Fields are written in the order of the members of the Writer structs; a history record
+		 * has the command line and application followed by the parameters.
+		 */
+		struct Metadata
+		{
+			Metadata() : hasArrayLocation(false), refFreq(0.0), totalBandwidth(0.0), bandFlagRow(false), antennaTime(0.0), polarizationFlagRow(false) { }
+
+			bool hasArrayLocation;
+			double arrayX, arrayY, arrayZ;
+			std::string bandName;
+			double refFreq, totalBandwidth;
+			bool bandFlagRow;
+			std::vector<Writer::ChannelInfo> channels;
+			double antennaTime;
+			std::vector<Writer::AntennaInfo> antennae;
+			bool polarizationFlagRow;
+			std::vector<Writer::SourceInfo> sources;
+			std::vector<Writer::FieldInfo> fields;
+			std::vector<Writer::ObservationInfo> observations;
+			struct HistoryItem
+			{
+				std::string commandLine, application;
+				std::vector<std::string> params;
+			};
+			std::vector<HistoryItem> history;
+
+			std::string ToText() const;
+			static Metadata FromText(const std::string& text);
+		};
+
+		static const char* FileIdentifier() { return "CVIS"; }
+		static const uint16_t VersionMajor = 1, VersionMinor = 0;
+		static const size_t ColumnAlignment = 4096;
+
+		/** Number of bytes of one row of a column. */
+		static size_t RowSize(Column column, size_t channelCount, size_t polarizationCount);
+
+		/** Number of bytes reserved for a column with the given capacity. */
+		static size_t ColumnSize(Column column, size_t channelCount, size_t polarizationCount, size_t rowCapacity)
+		{
+			const size_t size = RowSize(column, channelCount, polarizationCount) * rowCapacity;
+			return (size + ColumnAlignment - 1) / ColumnAlignment * ColumnAlignment;
+		}
+
+		/** Fill in the column offsets of a header for its channel count, polarization count and capacity. */
+		static void LayoutColumns(Header& header);
+
+		/** The end of the last column of a header, where the metadata starts. */
+		static uint64_t ColumnsEnd(const Header& header);
+};
+
+#endif
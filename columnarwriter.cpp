@@ -0,0 +1,265 @@
+#include "columnarwriter.h"
+
+#include "version.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+	// Large columns are written in pieces of this size, so that one column is also written in parallel
+	const size_t writePieceSize = size_t(8) << 20;
+
+	/** Reserve disk space without writing it; files systems that can't do this get a sparse file. */
+	void preallocate(int fd, uint64_t size)
+	{
+#ifdef __linux__
+		if(fallocate(fd, 0, 0, size) == 0)
+			return;
+#endif
+		if(ftruncate(fd, size) != 0)
+			throw std::runtime_error(std::string("Could not allocate room in columnar file: ") + std::strerror(errno));
+	}
+
+	/** Release the disk space of a range; failure is not fatal, because the range is simply unused. */
+	void releaseRange(int fd, uint64_t start, uint64_t end)
+	{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+		const uint64_t alignedStart = (start + ColumnarFormat::ColumnAlignment - 1) / ColumnarFormat::ColumnAlignment * ColumnarFormat::ColumnAlignment;
+		if(end > alignedStart)
+			fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, alignedStart, end - alignedStart);
+#endif
+	}
+}
+
+ColumnarWriter::ColumnarWriter(const std::string& filename, ThreadPool& threadPool, size_t expectedRowCount) :
+	_filename(filename),
+	_expectedRowCount(expectedRowCount),
+	_rowsAdded(0),
+	_rowsWritten(0),
+	_currentBlock(0),
+	_writeTasks(threadPool)
+{
+	_fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if(_fd < 0)
+		throw std::runtime_error("Cannot open file " + filename + " for writing: " + std::strerror(errno));
+	std::memset(&_header, 0, sizeof(_header));
+	std::memcpy(_header.fileIdentifier, ColumnarFormat::FileIdentifier(), 4);
+	_header.versionMajor = ColumnarFormat::VersionMajor;
+	_header.versionMinor = ColumnarFormat::VersionMinor;
+	_header.polarizationCount = 4;
+	std::strncpy(_header.cotterVersion, COTTER_VERSION_STR, sizeof(_header.cotterVersion)-1);
+	for(Block& block : _blocks)
+	{
+		block.rowCount = 0;
+		block.rowsFilled = 0;
+	}
+}
+
+ColumnarWriter::~ColumnarWriter()
+{
+	try {
+		finish();
+	} catch(std::exception& e) {
+		std::cerr << "Error while writing columnar file " << _filename << ": " << e.what() << '\n';
+	}
+	close(_fd);
+}
+
+void ColumnarWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	if(_rowsAdded != 0 && channels.size() != _header.channelCount)
+		throw std::runtime_error("The number of channels of a columnar file can not change after rows were added");
+	_metadata.bandName = name;
+	_metadata.channels = channels;
+	_metadata.refFreq = refFreq;
+	_metadata.totalBandwidth = totalBandwidth;
+	_metadata.bandFlagRow = flagRow;
+	_header.channelCount = channels.size();
+}
+
+void ColumnarWriter::WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params)
+{
+	ColumnarFormat::Metadata::HistoryItem item;
+	item.commandLine = commandLine;
+	item.application = application;
+	item.params = params;
+	_metadata.history.push_back(item);
+}
+
+void ColumnarWriter::AddRows(size_t count)
+{
+	if(_header.channelCount == 0)
+		throw std::runtime_error("WriteBandInfo() must be called before rows are added to a columnar file");
+	if(_rowsAdded != 0)
+		flushBlock();
+	reserve(std::max(_rowsAdded + count, _expectedRowCount));
+	_rowsAdded += count;
+
+	Block& block = _blocks[_currentBlock];
+	block.rowCount = count;
+	block.rowsFilled = 0;
+	for(size_t column=0; column!=ColumnarFormat::ColumnCount; ++column)
+		block.columns[column].resize(count * rowSize(ColumnarFormat::Column(column)));
+}
+
+void ColumnarWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float* weights)
+{
+	Block& block = _blocks[_currentBlock];
+	if(block.rowsFilled == block.rowCount)
+		throw std::runtime_error("Columnar writer received more rows than were added");
+	const size_t row = block.rowsFilled;
+	const size_t valueCount = _header.channelCount * _header.polarizationCount;
+
+	double* times = reinterpret_cast<double*>(block.columns[ColumnarFormat::Time].data());
+	double* timeCentroids = reinterpret_cast<double*>(block.columns[ColumnarFormat::TimeCentroid].data());
+	double* intervals = reinterpret_cast<double*>(block.columns[ColumnarFormat::Interval].data());
+	uint32_t* antennas = reinterpret_cast<uint32_t*>(block.columns[ColumnarFormat::Antennas].data());
+	double* uvws = reinterpret_cast<double*>(block.columns[ColumnarFormat::UVW].data());
+	times[row] = time;
+	timeCentroids[row] = timeCentroid;
+	intervals[row] = interval;
+	antennas[row*2] = antenna1;
+	antennas[row*2 + 1] = antenna2;
+	uvws[row*3] = u;
+	uvws[row*3 + 1] = v;
+	uvws[row*3 + 2] = w;
+
+	std::memcpy(&block.columns[ColumnarFormat::Data][row * rowSize(ColumnarFormat::Data)], data, valueCount * sizeof(std::complex<float>));
+	std::memcpy(&block.columns[ColumnarFormat::Weights][row * rowSize(ColumnarFormat::Weights)], weights, valueCount * sizeof(float));
+
+	unsigned char* packed = reinterpret_cast<unsigned char*>(&block.columns[ColumnarFormat::Flags][row * rowSize(ColumnarFormat::Flags)]);
+	for(size_t byte=0; byte!=rowSize(ColumnarFormat::Flags); ++byte)
+	{
+		unsigned char value = 0;
+		const size_t bitEnd = std::min<size_t>(8, valueCount - byte*8);
+		for(size_t bit=0; bit!=bitEnd; ++bit)
+		{
+			if(flags[byte*8 + bit])
+				value |= (unsigned char) (0x80 >> bit);
+		}
+		packed[byte] = value;
+	}
+
+	++block.rowsFilled;
+}
+
+void ColumnarWriter::flushBlock()
+{
+	// The tasks of the previous timestep use the other block
+	_writeTasks.Wait();
+	const Block& block = _blocks[_currentBlock];
+	if(block.rowsFilled != block.rowCount)
+		throw std::runtime_error("Columnar writer received a different number of rows than were added");
+
+	for(size_t column=0; column!=ColumnarFormat::ColumnCount; ++column)
+	{
+		const char* data = block.columns[column].data();
+		const size_t size = block.columns[column].size();
+		const uint64_t offset = _header.columnOffsets[column] + _rowsWritten * rowSize(ColumnarFormat::Column(column));
+		for(size_t piece=0; piece<size; piece+=writePieceSize)
+		{
+			const size_t pieceSize = std::min(writePieceSize, size - piece);
+			_writeTasks.Run([this, data, piece, pieceSize, offset]()
+			{
+				writeAt(data + piece, pieceSize, offset + piece);
+			});
+		}
+	}
+	_rowsWritten += block.rowCount;
+	_currentBlock = 1 - _currentBlock;
+}
+
+void ColumnarWriter::reserve(size_t rowCount)
+{
+	if(_header.rowCapacity >= rowCount && _header.rowCapacity != 0)
+		return;
+	// Nothing may be written while the columns move
+	_writeTasks.Wait();
+	ColumnarFormat::Header newHeader = _header;
+	newHeader.rowCapacity = std::max<uint64_t>(rowCount, _header.rowCapacity * 2);
+	ColumnarFormat::LayoutColumns(newHeader);
+	preallocate(_fd, ColumnarFormat::ColumnsEnd(newHeader));
+	if(_rowsWritten != 0)
+	{
+		std::cout << "Columnar file needs room for more rows than expected: moving " << _rowsWritten << " rows.\n";
+		// Columns only move to higher offsets, so moving the last column first never overwrites rows that still have to be moved
+		for(size_t column=ColumnarFormat::ColumnCount; column!=0; --column)
+		{
+			const ColumnarFormat::Column c = ColumnarFormat::Column(column-1);
+			moveRange(_header.columnOffsets[c], newHeader.columnOffsets[c], _rowsWritten * rowSize(c));
+		}
+	}
+	_header = newHeader;
+}
+
+void ColumnarWriter::moveRange(uint64_t from, uint64_t to, uint64_t size)
+{
+	// Copy backwards, because the ranges may overlap with to > from
+	std::vector<char> buffer(std::min<uint64_t>(writePieceSize, size));
+	uint64_t remaining = size;
+	while(remaining != 0)
+	{
+		const size_t pieceSize = std::min<uint64_t>(buffer.size(), remaining);
+		remaining -= pieceSize;
+		size_t bytesRead = 0;
+		while(bytesRead != pieceSize)
+		{
+			ssize_t result = pread(_fd, buffer.data() + bytesRead, pieceSize - bytesRead, from + remaining + bytesRead);
+			if(result <= 0)
+				throw std::runtime_error(std::string("Could not read back columnar file: ") + std::strerror(errno));
+			bytesRead += result;
+		}
+		writeAt(buffer.data(), pieceSize, to + remaining);
+	}
+}
+
+void ColumnarWriter::writeAt(const char* data, size_t size, uint64_t offset)
+{
+	while(size != 0)
+	{
+		ssize_t result = pwrite(_fd, data, size, offset);
+		if(result < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			throw std::runtime_error(std::string("Could not write to columnar file: ") + std::strerror(errno));
+		}
+		data += result;
+		size -= result;
+		offset += result;
+	}
+}
+
+void ColumnarWriter::finish()
+{
+	if(_rowsAdded != 0)
+		flushBlock();
+	_writeTasks.Wait();
+	if(_header.rowCapacity == 0)
+		ColumnarFormat::LayoutColumns(_header);
+
+	// Give back the room of the rows that were expected but not written
+	for(size_t column=0; column!=ColumnarFormat::ColumnCount; ++column)
+	{
+		const ColumnarFormat::Column c = ColumnarFormat::Column(column);
+		releaseRange(_fd,
+			_header.columnOffsets[c] + _rowsWritten * rowSize(c),
+			_header.columnOffsets[c] + ColumnarFormat::ColumnSize(c, _header.channelCount, _header.polarizationCount, _header.rowCapacity));
+	}
+
+	const std::string metadata = _metadata.ToText();
+	_header.rowCount = _rowsWritten;
+	_header.metadataOffset = ColumnarFormat::ColumnsEnd(_header);
+	_header.metadataSize = metadata.size();
+	writeAt(metadata.data(), metadata.size(), _header.metadataOffset);
+	if(ftruncate(_fd, _header.metadataOffset + _header.metadataSize) != 0)
+		throw std::runtime_error(std::string("Could not truncate columnar file: ") + std::strerror(errno));
+	writeAt(reinterpret_cast<const char*>(&_header), sizeof(_header), 0);
+}
@@ -0,0 +1,102 @@
+#ifndef COLUMNAR_WRITER_H
+#define COLUMNAR_WRITER_H
+
+#include "columnarformat.h"
+#include "threadpool.h"
+#include "writer.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Writes visibilities in the columnar format (see ColumnarFormat). The file is
+ * preallocated for the expected number of rows. The rows of a timestep (one
+ * AddRows() call) are collected in a block with one buffer per column; once the
+ * timestep is complete, the columns of the block are written with pwrite() in
+ * parallel on the thread pool, while the next timestep is collected in a second
+ * block.
+ *
+ * When more rows are written than expected, the columns are moved to make room;
+ * when fewer rows are written, the unused space of the columns is released.
+ * The metadata and the final header are written when the writer is destructed.
+ */
+class ColumnarWriter : public Writer
+{
+	public:
+		/**
+		 * @param expectedRowCount Number of rows to allocate room for. It does not need
+		 * to be exact, but the file is fastest to write when it is.
+		 */
+		ColumnarWriter(const std::string& filename, ThreadPool& threadPool, size_t expectedRowCount);
+		virtual ~ColumnarWriter() final override;
+
+		virtual void SetArrayLocation(double x, double y, double z) final override
+		{
+			_metadata.hasArrayLocation = true;
+			_metadata.arrayX = x;
+			_metadata.arrayY = y;
+			_metadata.arrayZ = z;
+		}
+
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override
+		{
+			_metadata.antennae = antennae;
+			_metadata.antennaTime = time;
+		}
+		virtual void SetPolarizationCount(size_t polarizationCount) final override
+		{
+			if(_rowsAdded != 0 && polarizationCount != _header.polarizationCount)
+				throw std::runtime_error("The number of polarizations of a columnar file can not change after rows were added");
+			_header.polarizationCount = polarizationCount;
+		}
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override
+		{
+			_metadata.polarizationFlagRow = flagRow;
+		}
+		virtual void WriteSource(const SourceInfo& source) final override
+		{
+			_metadata.sources.push_back(source);
+		}
+		virtual void WriteField(const FieldInfo& field) final override
+		{
+			_metadata.fields.push_back(field);
+		}
+		virtual void WriteObservation(const ObservationInfo& observation) final override
+		{
+			_metadata.observations.push_back(observation);
+		}
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override;
+
+		virtual void AddRows(size_t count) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float* weights) final override;
+
+	private:
+		struct Block
+		{
+			std::vector<char> columns[ColumnarFormat::ColumnCount];
+			size_t rowCount, rowsFilled;
+		};
+
+		void flushBlock();
+		void reserve(size_t rowCount);
+		void moveRange(uint64_t from, uint64_t to, uint64_t size);
+		void writeAt(const char* data, size_t size, uint64_t offset);
+		void finish();
+		size_t rowSize(ColumnarFormat::Column column) const
+		{
+			return ColumnarFormat::RowSize(column, _header.channelCount, _header.polarizationCount);
+		}
+
+		std::string _filename;
+		int _fd;
+		ColumnarFormat::Header _header;
+		ColumnarFormat::Metadata _metadata;
+		size_t _expectedRowCount, _rowsAdded, _rowsWritten;
+		Block _blocks[2];
+		size_t _currentBlock;
+		ThreadPool::TaskGroup _writeTasks;
+};
+
+#endif
@@ -1,18 +1,26 @@
 #include "cotter.h"
 
 #include "applysolutionswriter.h"
+#include "columnarwriter.h"
 #include "baselinebuffer.h"
 #include "flagreader.h"
 #include "flagwriter.h"
 #include "fitswriter.h"
 #include "geometry.h"
+#include "metrics.h"
 #include "mswriter.h"
 #include "mwafits.h"
 #include "mwams.h"
+#include "numatopology.h"
+#include "polarizationselectionwriter.h"
 #include "subbandpassband.h"
 #include "progressbar.h"
 #include "threadedwriter.h"
 #include "radeccoord.h"
+#include "sharedmemorywriter.h"
+#include "sinkwriter.h"
+#include "solutionapplier.h"
+#include "tracer.h"
 #include "version.h"
 
 #include <thread>
@@ -30,18 +38,33 @@ using namespace aoflagger;
 Cotter::Cotter() :
 	_unflaggedAntennaCount(0),
 	_threadCount(1),
-	_maxBufferSize(0),
+	_numaMode(false),
+	_useHugePages(false),
+	_memoryLimit(0),
+	_gpuMatrixBufferCount(1),
+	_dryRun(false),
 	_subbandCount(24),
 	_quackInitSampleCount(4),
 	_subbandEdgeFlagWidthKHz(80.0),
 	_subbandEdgeFlagCount(2),
+	_scanSelectionStart(0),
+	_scanSelectionEnd(0),
+	_channelSelectionStart(0),
+	_channelSelectionEnd(0),
+	_scansToSkip(0),
+	_streamWindow(0),
+	_streamOverlap(0),
+	_chunkOverlap(0),
+	_retainedScanCount(0),
 	_defaultFilename(true),
 	_rfiDetection(true),
 	_collectStatistics(true),
 	_collectHistograms(false),
 	_usePointingCentre(false),
 	_outputFormat(MSOutputFormat),
+	_sink(nullptr),
 	_applySolutionsBeforeAveraging(false),
+	_applySolutionsInBaselines(false),
 	_disableGeometricCorrections(false),
 	_removeFlaggedAntennae(true),
 	_removeAutoCorrelations(false),
@@ -53,10 +76,16 @@ Cotter::Cotter() :
 	_flagDCChannels(true),
 	_skipWriting(false),
 	_offlineGPUBoxFormat(false),
+	_countPerfEvents(false),
+	_flagFileVersion(1),
+	_sharedMemorySlotCount(4),
+	_polarizationCount(4),
+	_rowPolarizationCount(4),
 	_customRARad(0.0),
 	_customDecRad(0.0),
 	_initDurationToFlag(4.0),
 	_endDurationToFlag(0.0),
+	_metricsInterval(1.0),
 	_useDysco(false),
 	_dyscoDataBitRate(8),
 	_dyscoWeightBitRate(12),
@@ -64,7 +93,8 @@ Cotter::Cotter() :
 	_dyscoNormalization("AF"),
 	_dyscoDistTruncation(2.5),
 	_outputData(empty_aligned<std::complex<float>>()),
-	_outputWeights(empty_aligned<float>())
+	_outputWeights(empty_aligned<float>()),
+	_statisticsBytes(MemoryAccounting::StatisticsCategory)
 {
 }
 
@@ -73,6 +103,22 @@ Cotter::~Cotter() { }
 void Cotter::Run(double timeRes_s, double freqRes_kHz)
 {
 	_readWatch.Start();
+	if(!_traceFilename.empty() || _countPerfEvents)
+	{
+		if(!Tracer::IsCompiledIn())
+			std::cout << "WARNING! This build has no trace points (configured with ENABLE_TRACING=OFF): the trace and counters will be empty.\n";
+		// Before Enable(), so that the main thread opens its counters too
+		if(_countPerfEvents)
+			Tracer::EnableCounters();
+		// 24 bytes per event: 1.5 MB per thread that records spans
+		Tracer::Enable(65536);
+		Tracer::SetThreadName("main");
+	}
+	if(!_memoryLogFilename.empty())
+	{
+		MemoryAccounting::OpenTimeSeries(_memoryLogFilename);
+		MemoryAccounting::Sample("start");
+	}
 	bool lockPointing = false;
 	
 	if(_metaFilename.empty())
@@ -120,10 +166,51 @@ void Cotter::Run(double timeRes_s, double freqRes_kHz)
 	freqRes_kHz = freqAvgFactor*(1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels);
 	std::cout << "Output resolution: " << timeRes_s << " s / " << freqRes_kHz << " kHz (time avg: " << timeAvgFactor << "x, freq avg: " << freqAvgFactor << "x).\n";
 	
+	// The windows of the stream are the chunks, so their overlap is the chunk overlap
+	if(_streamWindow != 0)
+	{
+		if(_chunkOverlap != 0 && _chunkOverlap != _streamOverlap)
+			throw std::runtime_error("The overlap given to -stream differs from the one given to -chunkoverlap: when streaming, only give the overlap of the windows");
+		_chunkOverlap = _streamOverlap;
+	}
+	
+	// The overlapping scans of a chunk are processed again by the next chunk, which would
+	// apply the solutions to them twice
+	if(_chunkOverlap != 0 && !_solutionFilename.empty() && _applySolutionsInBaselines)
+	{
+		std::cout << "Solutions will be applied by the writer, because the chunks overlap.\n";
+		_applySolutionsInBaselines = false;
+	}
+	
+	if(_polarizationCount == 2)
+	{
+#ifdef USE_SSE
+		throw std::runtime_error("This build processes the timesteps with SSE instructions, which requires writing all four polarizations");
+#endif
+		std::cout << "Only the XX and YY polarizations will be written.\n";
+		// Solutions for unaveraged channels can be applied to the baselines directly,
+		// which avoids forming rows with the cross-polarizations that are then dropped
+		if(!_solutionFilename.empty() && _applySolutionsBeforeAveraging && !_applySolutionsInBaselines && _chunkOverlap == 0)
+		{
+			std::cout << "Solutions will be applied during baseline processing, because the cross-polarizations are not written.\n";
+			_applySolutionsInBaselines = true;
+		}
+	}
+	else if(_polarizationCount != 4)
+		throw std::runtime_error("Invalid number of output polarizations: only 4 (all) and 2 (XX and YY) are supported");
+	
+	// Full-Jones solutions that are applied by a writer need the cross-polarizations,
+	// so the rows keep them until the solutions have been applied
+	if(_polarizationCount == 2 && !_solutionFilename.empty() && !_applySolutionsInBaselines)
+		_rowPolarizationCount = 4;
+	else
+		_rowPolarizationCount = _polarizationCount;
+	
 	_subbandEdgeFlagCount = round(_subbandEdgeFlagWidthKHz / (1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels));
 	
 	_quackInitSampleCount = round(_initDurationToFlag / _mwaConfig.Header().integrationTime);
 	_quackEndSampleCount = round(_endDurationToFlag / _mwaConfig.Header().integrationTime);
+	applySelection();
 	std::cout << "The first " << _quackInitSampleCount << " samples (" << round(10.0 * _quackInitSampleCount * _mwaConfig.Header().integrationTime)/10.0 << " s), last " << _quackEndSampleCount << " samples (" << round(10.0 * _quackEndSampleCount * _mwaConfig.Header().integrationTime)/10.0 << " s) and " << _subbandEdgeFlagCount << " edge channels will be flagged.\n";
 	
 	if(_subbandPassbandFilename.empty())
@@ -137,12 +224,57 @@ void Cotter::Run(double timeRes_s, double freqRes_kHz)
 	if(_subbandEdgeFlagCount > _mwaConfig.Header().nChannels / (_subbandCount*2))
 		throw std::runtime_error("Tried to flag more edge channels than available");
 	
+	// Plan for the full bandwidth: the thread count and queue depths are fixed for the whole run
+	MemoryPlanner::Plan memoryPlan = makeMemoryPlan(selectedChannelsPerSubband() * _subbandCount, timeAvgFactor, freqAvgFactor, true);
+	if(memoryPlan.threadCount < _threadCount)
+	{
+		std::cout << "WARNING! Memory is short: using " << memoryPlan.threadCount << " instead of " << _threadCount << " threads, so that more scans fit in memory.\n";
+		_threadCount = memoryPlan.threadCount;
+	}
+	_gpuMatrixBufferCount = memoryPlan.gpuMatrixBufferCount;
+	if(_numaMode)
+	{
+		NUMATopology topology = NUMATopology::Detect();
+		std::cout << "NUMA topology: " << topology.Description() << ".\n";
+		if(topology.NodeCount() == 1)
+			std::cout << "Only one NUMA node available: NUMA mode has no effect.\n";
+		_threadPool.reset(new ThreadPool(_threadCount, memoryPlan.taskQueueCapacity, &topology));
+	}
+	else {
+		_threadPool.reset(new ThreadPool(_threadCount, memoryPlan.taskQueueCapacity));
+	}
+	if(_useHugePages && !BufferArena::HugePagesAvailable())
+		std::cout << "WARNING! Transparent huge pages are disabled on this system: normal pages will be used.\n";
+	_bufferArena.reset(new BufferArena(_flagger, *_threadPool, _useHugePages));
+	
+	std::unique_ptr<MetricsEmitter> metricsEmitter;
+	if(!_metricsDestination.empty())
+		metricsEmitter.reset(new MetricsEmitter(_metricsDestination, _metricsInterval, *_threadPool));
+	
 	processAllContiguousBands(timeAvgFactor, freqAvgFactor);
+	metricsEmitter.reset();
+	
+	if(!_dryRun)
+	{
+		std::cout << "Allocated " << _bufferArena->ImageSetAllocationCount() << " baseline image sets and " << _bufferArena->FlagMaskAllocationCount() << " flag masks.\n";
+		MemoryAccounting::WriteBreakdown(std::cout);
+	}
+	MemoryAccounting::Sample("end");
+	MemoryAccounting::CloseTimeSeries();
+	_bufferArena.reset();
 	
 	std::cout
 		<< "Wall-clock time in reading: " << _readWatch.ToString()
 		<< " processing: " << _processWatch.ToString()
 		<< " writing: " << _writeWatch.ToString() << '\n';
+	
+	if(!_traceFilename.empty() || _countPerfEvents)
+		Tracer::WriteSummary(std::cout);
+	if(!_traceFilename.empty())
+	{
+		std::cout << "Writing trace to " << _traceFilename << "...\n";
+		Tracer::WriteChromeTrace(_traceFilename);
+	}
 }
 
 void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFactor)
@@ -168,13 +300,21 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 		_curSbStart = 0;
 		_curSbEnd = _subbandCount;
 		
-		_channelFrequenciesHz.resize(_mwaConfig.Header().nChannels);
-		for(size_t ch=0; ch!=_mwaConfig.Header().nChannels; ++ch)
-			_channelFrequenciesHz[ch] = _mwaConfig.ChannelFrequencyHz(ch);
+		_channelFrequenciesHz.resize(nChannelsInCurSBRange());
+		std::vector<double>::iterator chFreqIter = _channelFrequenciesHz.begin();
+		for(size_t sb=0; sb!=_subbandCount; ++sb)
+		{
+			for(size_t ch=_channelSelectionStart; ch!=_channelSelectionEnd; ++ch)
+			{
+				*chFreqIter = _mwaConfig.ChannelFrequencyHz(sb*channelsPerSubband() + ch);
+				++chFreqIter;
+			}
+		}
 		
 		if(_defaultFilename)
 			_outputFilename = "preprocessed.ms";
 	
+		Metrics::SetBand(0, 1);
 		processOneContiguousBand(_outputFilename, timeAvgFactor, freqAvgFactor);
 	}
 	else {
@@ -200,7 +340,7 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 			_curSbStart = contiguousSBRanges[bandIndex].first;
 			_curSbEnd = contiguousSBRanges[bandIndex].second;
 			
-			size_t nChannels = nChannelsInCurSBRange(), nChannelPerSb = _mwaConfig.Header().nChannels / _subbandCount;
+			size_t nChannels = nChannelsInCurSBRange();
 			_channelFrequenciesHz.resize(nChannels);
 			int
 				chStartNo = _mwaConfig.HeaderExt().subbandNumbers[_curSbStart],
@@ -208,7 +348,7 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 			std::vector<double>::iterator chFreqIter = _channelFrequenciesHz.begin();
 			for(int coarseChannel=chStartNo; coarseChannel!=chEndNo+1; ++coarseChannel)
 			{
-				for(size_t ch=0; ch!=nChannelPerSb; ++ch)
+				for(size_t ch=_channelSelectionStart; ch!=_channelSelectionEnd; ++ch)
 				{
 					*chFreqIter = _mwaConfig.ChannelFrequencyHz(coarseChannel, ch);
 					++chFreqIter;
@@ -226,13 +366,45 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 			}
 			std::cout << " |=== BAND " << (bandIndex+1) << " / " << contiguousSBRanges.size() << " ===|\n";
 			std::cout << "Writing contiguous band " << (bandIndex+1) << " to " << bandFilename << ".\n";
+			Metrics::SetBand(bandIndex, contiguousSBRanges.size());
 			processOneContiguousBand(bandFilename, timeAvgFactor, freqAvgFactor);
 		}
 	}
 }
 
+MemoryPlanner::Plan Cotter::makeMemoryPlan(size_t nChannels, size_t timeAvgFactor, size_t freqAvgFactor, bool mayReduceThreads) const
+{
+	MemoryPlanner::Parameters parameters;
+	parameters.antennaCount = _mwaConfig.NAntennae();
+	parameters.channelCount = nChannels;
+	parameters.scanCount = _mwaConfig.Header().nScans;
+	parameters.fileCount = nChannels / selectedChannelsPerSubband();
+	parameters.overlapScanCount = _chunkOverlap;
+	if(timeAvgFactor != 1 || freqAvgFactor != 1)
+		parameters.averagedChannelCount = nChannels / freqAvgFactor;
+	else
+		parameters.averagedChannelCount = 0;
+	parameters.polarizationCount = _rowPolarizationCount;
+	parameters.flagWriterTimestepCount = (_outputFormat == FlagsOutputFormat) ? FlagWriter::ChunkBatchTimesteps : 0;
+	parameters.threadCount = _threadCount;
+	parameters.mayReduceThreads = mayReduceThreads;
+	parameters.rfiDetection = _rfiDetection;
+	parameters.collectStatistics = _collectStatistics;
+	parameters.collectHistograms = _collectHistograms;
+	parameters.memoryLimit = _memoryLimit;
+	return MemoryPlanner::Make(parameters);
+}
+
 void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor)
 {
+	const MemoryPlanner::Plan memoryPlan = makeMemoryPlan(nChannelsInCurSBRange(), timeAvgFactor, freqAvgFactor, false);
+	if(_dryRun)
+	{
+		std::cout << "Dry run: no data will be read or written.\n";
+		memoryPlan.Report(std::cout);
+		return;
+	}
+	
 	switch(_outputFormat)
 	{
 		case FlagsOutputFormat:
@@ -241,30 +413,56 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 				throw std::runtime_error("You have specified time or frequency averaging and outputting only flags: this is incompatible");
 			if(_removeFlaggedAntennae || _removeAutoCorrelations)
 				throw std::runtime_error("Can't prune flagged/auto-correlated antennas when writing flag file");
-			_writer.reset(new FlagWriter(outputFilename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbStart, _curSbEnd, _subbandOrder));
+			_writer.reset(new FlagWriter(outputFilename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbStart, _curSbEnd, _subbandOrder, *_threadPool, _flagFileVersion));
 			break;
 		case FitsOutputFormat:
-			_writer.reset(new ThreadedWriter(std::unique_ptr<FitsWriter>(new FitsWriter(outputFilename))));
+			_writer.reset(new ThreadedWriter(std::unique_ptr<FitsWriter>(new FitsWriter(outputFilename)), *_threadPool));
+			break;
+		case ColumnarOutputFormat: {
+			// Averaging might add rows to align the last timestep, which are included here
+			const size_t expectedRowCount = (_mwaConfig.Header().nScans + timeAvgFactor - 1) / timeAvgFactor * rowsPerTimescan();
+			_writer.reset(new ThreadedWriter(std::unique_ptr<ColumnarWriter>(new ColumnarWriter(outputFilename, *_threadPool, expectedRowCount)), *_threadPool));
+		} break;
+		case SharedMemoryOutputFormat: {
+			// Shared memory objects have a flat name space, so the directory is dropped
+			const size_t slashPos = outputFilename.rfind('/');
+			const std::string segmentName = "/" + (slashPos == std::string::npos ? outputFilename : outputFilename.substr(slashPos+1));
+			_writer.reset(new ThreadedWriter(std::unique_ptr<SharedMemoryWriter>(new SharedMemoryWriter(segmentName, _sharedMemorySlotCount, rowsPerTimescan())), *_threadPool));
+		} break;
+		case SinkOutputFormat:
+			_writer.reset(new ThreadedWriter(std::unique_ptr<SinkWriter>(new SinkWriter(*_sink)), *_threadPool));
 			break;
 		case MSOutputFormat: {
 			std::unique_ptr<MSWriter> msWriter(new MSWriter(outputFilename));
 			if(_useDysco)
 				msWriter->EnableCompression(_dyscoDataBitRate, _dyscoWeightBitRate, _dyscoDistribution, _dyscoDistTruncation, _dyscoNormalization);
-			_writer.reset(new ThreadedWriter(std::move(msWriter)));
+			_writer.reset(new ThreadedWriter(std::move(msWriter), *_threadPool));
 		} break;
 	}
-	if(!_solutionFilename.empty() && !_applySolutionsBeforeAveraging)
+	if(_rowPolarizationCount != _polarizationCount)
+		_writer.reset(new PolarizationSelectionWriter(std::move(_writer)));
+	if(!_solutionFilename.empty() && _applySolutionsInBaselines)
+	{
+		if(!_solutionApplier)
+		{
+			_solutionApplier.reset(new SolutionApplier(_solutionFilename));
+			std::cout << "Solutions will be applied during baseline processing, using the " << _solutionApplier->KernelName() << " kernel.\n";
+		}
+		_solutionApplier->SetChannelCount(nChannelsInCurSBRange());
+	}
+	else if(!_solutionFilename.empty() && !_applySolutionsBeforeAveraging)
 	{
 		_writer.reset(new ApplySolutionsWriter(std::move(_writer), _solutionFilename));
 	}
 	if(freqAvgFactor != 1 || timeAvgFactor != 1)
 	{
-		_writer.reset(new ThreadedWriter(std::unique_ptr<AveragingWriter>(new AveragingWriter(std::move(_writer), timeAvgFactor, freqAvgFactor, *this))));
+		_writer.reset(new ThreadedWriter(std::unique_ptr<AveragingWriter>(new AveragingWriter(std::move(_writer), timeAvgFactor, freqAvgFactor, *this)), *_threadPool));
 	}
-	if(!_solutionFilename.empty() && _applySolutionsBeforeAveraging)
+	if(!_solutionFilename.empty() && _applySolutionsBeforeAveraging && !_applySolutionsInBaselines)
 	{
 		_writer.reset(new ApplySolutionsWriter(std::move(_writer), _solutionFilename));
 	}
+	_writer->SetPolarizationCount(_rowPolarizationCount);
 	writeAntennae();
 	writeSPW();
 	writeSource();
@@ -288,22 +486,50 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	_hduOffsetsPerGPUBox.assign(_subbandCount, 9999);
 	const size_t
 		nChannels = nChannelsInCurSBRange(),
-		antennaCount = _mwaConfig.NAntennae();
-	size_t maxScansPerPart = _maxBufferSize / (nChannels*(antennaCount+1)*antennaCount*2);
-	
-	if(maxScansPerPart<1)
+		antennaCount = _mwaConfig.NAntennae(),
+		nBaselines = antennaCount*(antennaCount+1)/2;
+	memoryPlan.Report(std::cout);
+	if(!memoryPlan.fitsInLimit)
 	{
 		std::cout << "WARNING! The given amount of memory is not even enough for one scan and therefore below the minimum that Cotter will need; will use more memory. Expect swapping and very poor flagging accuracy.\nWARNING! This is a *VERY BAD* condition, so better make sure to resolve it!";
-		maxScansPerPart = 1;
-	} else if(maxScansPerPart<20 && _rfiDetection)
+	} else if(_streamWindow == 0 && memoryPlan.bufferedScansPerChunk<20 && memoryPlan.chunkCount>1 && _rfiDetection)
 	{
 		std::cout << "WARNING! This computer does not have enough memory for accurate flagging; expect non-optimal flagging accuracy.\n"; 
 	}
-	size_t partCount = 1 + _mwaConfig.Header().nScans / maxScansPerPart;
-	if(partCount == 1)
-		std::cout << "All " << _mwaConfig.Header().nScans << " scans fit in memory; no partitioning necessary.\n";
-	else
-		std::cout << "Observation does not fit fully in memory, will partition data in " << partCount << " chunks of at least " << (_mwaConfig.Header().nScans/partCount) << " scans.\n";
+	const size_t nScans = _mwaConfig.Header().nScans;
+	size_t partCount = memoryPlan.chunkCount;
+	// The planner drops the overlap when there is only one chunk, and limits it to what fits
+	size_t chunkOverlap = memoryPlan.overlapScanCount;
+	if(_streamWindow != 0)
+	{
+		partCount = std::max<size_t>((nScans + _streamWindow - 1) / _streamWindow, 1);
+		chunkOverlap = _chunkOverlap;
+		std::cout << "Streaming " << partCount << " windows of " << _streamWindow << " scans, flagged with " << chunkOverlap << " overlapping scans on both sides.\n";
+		if(memoryPlan.chunkCount > 1 && _streamWindow + 2*chunkOverlap > memoryPlan.bufferedScansPerChunk)
+			std::cout << "WARNING! A window of " << (_streamWindow + 2*chunkOverlap) << " scans including the overlap does not fit in the memory limit of " << memoryPlan.bufferedScansPerChunk << " scans.\n";
+		else if(_streamWindow + 2*chunkOverlap < 20 && partCount > 1 && _rfiDetection)
+			std::cout << "WARNING! Windows of less than 20 scans including the overlap give non-optimal flagging accuracy.\n";
+	}
+	else if(partCount == 1)
+		std::cout << "All " << nScans << " scans fit in memory; no partitioning necessary.\n";
+	else {
+		std::cout << "Observation does not fit fully in memory, will partition data in " << partCount << " chunks of at least " << (nScans/partCount) << " scans.\n";
+		if(chunkOverlap != 0)
+			std::cout << "Every chunk is flagged together with " << chunkOverlap << " scans of the neighbouring chunks on both sides.\n";
+		if(chunkOverlap < _chunkOverlap)
+			std::cout << "WARNING! Only an overlap of " << chunkOverlap << " scans fits in memory, instead of the requested " << _chunkOverlap << ".\n";
+	}
+	// The first scan that is written in a chunk
+	auto writeStart = [&](size_t chunkIndex) -> size_t {
+		if(_streamWindow != 0)
+			return std::min(chunkIndex * _streamWindow, nScans);
+		else
+			return nScans * chunkIndex / partCount;
+	};
+	// Number of scans that are flagged together, and the largest number of scans in a chunk
+	const size_t
+		flagWindowSize = std::min((_streamWindow != 0 ? _streamWindow : nScans/partCount) + 2*chunkOverlap, nScans),
+		maxChunkSize = std::min((_streamWindow != 0 ? _streamWindow : (nScans + partCount - 1) / partCount) + 2*chunkOverlap, nScans);
 	
 	_scanTimes.resize(_mwaConfig.Header().nScans);
 	for(size_t t=0; t!=_mwaConfig.Header().nScans; ++t)
@@ -314,7 +540,7 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	
 	std::vector<std::string> params;
 	std::stringstream paramStr;
-	paramStr << "timeavg=" << timeAvgFactor << ",freqavg=" << freqAvgFactor << ",windowSize=" << (_mwaConfig.Header().nScans/partCount);
+	paramStr << "timeavg=" << timeAvgFactor << ",freqavg=" << freqAvgFactor << ",windowSize=" << flagWindowSize;
 	params.push_back(paramStr.str());
 	_writer->WriteHistoryItem(_commandLine, "Cotter MWA preprocessor", params);
 	
@@ -322,52 +548,80 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	
 	std::vector<std::vector<std::string> >::const_iterator
 		currentFileSetPtr = _fileSets.begin();
+	_scansToSkip = _scanSelectionStart;
 	createReader(*currentFileSetPtr);
 	
 	_readWatch.Pause();
 	
+	// The end of the scans that were read from the files, which is before the end of the
+	// observation when the files have fewer scans than the header specifies
+	size_t availableScanEnd = nScans;
+	size_t previousChunkStart = 0, previousChunkEnd = 0;
 	for(size_t chunkIndex = 0; chunkIndex != partCount; ++chunkIndex)
 	{
 		std::cout << "=== Processing chunk " << (chunkIndex+1) << " of " << partCount << " ===\n";
+		TraceSpan chunkSpan(Tracer::ChunkStage);
 		_readWatch.Start();
+		TraceSpan readSpan(Tracer::ReadStage);
+		Metrics::SetChunk(chunkIndex, partCount);
+		Metrics::SetPhase(Metrics::ReadingPhase);
 		
-		_curChunkStart = _mwaConfig.Header().nScans*chunkIndex/partCount;
-		_curChunkEnd = _mwaConfig.Header().nScans*(chunkIndex+1)/partCount;
+		// A chunk consists of the scans that it writes, and the overlapping scans on both
+		// sides that are only flagged. The overlap with the previous chunk was already read,
+		// and is kept instead of read again.
+		_curWriteStart = writeStart(chunkIndex);
+		_curWriteEnd = writeStart(chunkIndex+1);
+		_curChunkStart = _curWriteStart > chunkOverlap ? _curWriteStart - chunkOverlap : 0;
+		_curChunkEnd = std::min(_curWriteEnd + chunkOverlap, nScans);
+		_retainedScanCount = previousChunkEnd > _curChunkStart ? previousChunkEnd - _curChunkStart : 0;
+		const size_t newScanCount = (_curChunkEnd - _curChunkStart) - _retainedScanCount;
 		
-		// Initialize buffers
-		if(chunkIndex == 0)
+		// Initialize buffers. These are kept between chunks and bands, and are only reallocated
+		// when their size no longer fits. I used to reallocate all buffers for every band, but this
+		// gave awful memory fragmentation issues, since the buffers can have slightly different sizes
+		// during each run. This led to ~2x as much memory usage. The buffers are allocated by the
+		// workers of the node that processes the baseline, so that the memory is first touched
+		// (and hence placed) on that node.
+		_bufferArena->PrepareImageSets(nBaselines, _curChunkEnd-_curChunkStart, nChannels, maxChunkSize,
+			std::bind(&Cotter::baselineIndexNode, this, std::placeholders::_1),
+			_curChunkStart - previousChunkStart, _retainedScanCount);
+		previousChunkStart = _curChunkStart;
+		previousChunkEnd = _curChunkEnd;
+		
+		// When cfitsio allows it, the flag files are read by the pool while the
+		// visibilities are read. The flag files can only be read once the HDU offsets
+		// are known, which requires the GPU files to be opened.
+		ThreadPool::TaskGroup flagReadTasks(*_threadPool);
+		if(!_flagFileTemplate.empty())
 		{
-			// First time: allocate the buffers
-			const size_t requiredWidthCapacity = (_mwaConfig.Header().nScans+partCount-1)/partCount;
-			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+			// Only the first chunk needs to open the files to learn the offsets. Opening them
+			// again later would restart reading at the start of the current file set.
+			if(_flagReader.get() == 0)
 			{
-				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-				{
-					_imageSetBuffers.emplace(
-						std::pair<size_t,size_t>(antenna1, antenna2),
-						_flagger.MakeImageSet(_curChunkEnd-_curChunkStart, nChannels, 8, 0.0f, requiredWidthCapacity)
-					);
-				}
+				_reader->Open();
+				_flagReader.reset(new FlagReader(_flagFileTemplate, _hduOffsetsPerGPUBox, _subbandOrder, _curSbStart, _curSbEnd));
 			}
-		} else {
-			// Resize the buffers, but don't reallocate. I used to reallocate all buffers
-			// here, but this gave awful memory fragmentation issues, since the buffers can have slightly
-			// different sizes during each run. This led to ~2x as much memory usage.
-			for(auto& buffer : _imageSetBuffers)
+			std::vector<bool*> flagDestinations(nBaselines);
+			size_t flagStride = 0;
+			for(size_t baseline=0; baseline!=nBaselines; ++baseline)
 			{
-				buffer.second.ResizeWithoutReallocation(_curChunkEnd-_curChunkStart);
-				buffer.second.Set(0.0f);
+				FlagMask& mask = _bufferArena->AcquireFlagMask(baseline, _curChunkEnd-_curChunkStart, _reader->ChannelCount(), false);
+				flagDestinations[baseline] = mask.Buffer();
+				flagStride = mask.HorizontalStride();
 			}
+			// The flag files cover the full observation
+			_flagReader->ReadChunk(_scanSelectionStart + _curChunkStart, _scanSelectionStart + _curChunkEnd, flagDestinations, flagStride, flagReadTasks);
 		}
 		
+		// The new scans are read behind the kept scans
 		size_t bufferPos = 0;
-		bool continueWithNextFile;
-		do {
-			initializeReader();
+		bool continueWithNextFile = (newScanCount != 0);
+		if(continueWithNextFile) do {
+			initializeReader(_retainedScanCount);
 			
 			bool firstRead = (bufferPos == 0 && chunkIndex == 0);
 			
-			bool moreAvailableInCurrentFile = _reader->Read(bufferPos, _curChunkEnd-_curChunkStart);
+			bool moreAvailableInCurrentFile = _reader->Read(bufferPos, newScanCount);
 			
 			if(firstRead && _reader->HasStartTime())
 			{
@@ -395,15 +649,18 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 					_mwaConfig.HeaderRW().refHour = startTimeTm.tm_hour;
 					_mwaConfig.HeaderRW().refMinute = startTimeTm.tm_min;
 					_mwaConfig.HeaderRW().refSecond = startTimeTm.tm_sec;
-					_mwaConfig.HeaderRW().dateFirstScanMJD = _mwaConfig.Header().GetDateFirstScanFromFields();
+					_mwaConfig.HeaderRW().dateFirstScanMJD = _mwaConfig.Header().GetDateFirstScanFromFields() +
+						_scanSelectionStart * _mwaConfig.Header().integrationTime / 86400.0;
 				}
 			}
 			
-			if(!moreAvailableInCurrentFile && bufferPos < (_curChunkEnd-_curChunkStart))
+			if(!moreAvailableInCurrentFile && bufferPos < newScanCount)
 			{
 				if(currentFileSetPtr != _fileSets.end())
 				{
-					// Go to the next set of GPU files and add them to the buffer
+					// Go to the next set of GPU files and add them to the buffer. Scans that were
+					// skipped in this set no longer need to be skipped in the next.
+					_scansToSkip -= std::min(_scansToSkip, _reader->ScanCount());
 					++currentFileSetPtr;
 					continueWithNextFile = (currentFileSetPtr!=_fileSets.end());
 					if(continueWithNextFile)
@@ -416,14 +673,14 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			}
 		} while(continueWithNextFile);
 		
-		if(bufferPos < _curChunkEnd-_curChunkStart)
+		if(bufferPos < newScanCount)
 		{
-			_missingEndScans = (_curChunkEnd-_curChunkStart)- bufferPos;
-			std::cout << "Warning: header specifies " << _mwaConfig.Header().nScans << " scans, but there are only " << (bufferPos+_curChunkStart) << " in the data.\n"
-			"Last " << _missingEndScans << " scan(s) will be flagged.\n";
-		} else {
-			_missingEndScans = 0;
+			availableScanEnd = std::min(availableScanEnd, _curChunkStart + _retainedScanCount + bufferPos);
+			std::cout << "Warning: header specifies " << nScans << " scans, but there are only " << availableScanEnd << " in the data.\n"
+			"Last " << (_curChunkEnd - availableScanEnd) << " scan(s) will be flagged.\n";
 		}
+		// Kept scans can also be missing, when the data ended in the previous chunk
+		_missingEndScans = _curChunkEnd - std::max(std::min(availableScanEnd, _curChunkEnd), _curChunkStart);
 		if(_curChunkEnd + _quackEndSampleCount > _mwaConfig.Header().nScans)
 		{
 			size_t extraSamples = (_curChunkEnd + _quackEndSampleCount) - _mwaConfig.Header().nScans;
@@ -434,58 +691,29 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 		_fullysetMask.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), true)));
 		_correlatorMask.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false)));
 		flagBadCorrelatorSamples(*_correlatorMask);
-		
-		for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+		// The statistics leave out samples that are flagged by the correlator, hence the
+		// overlapping scans are marked as such, so that these are counted only in the chunk
+		// that writes them
+		for(size_t ch=0; ch!=_correlatorMask->Height(); ++ch)
 		{
-			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-			{
-				_baselinesToProcess.push(std::pair<size_t,size_t>(antenna1, antenna2));
-				
-				// We will put a place holder in the flagbuffer map, so we don't have to write (and lock)
-				// during multi threaded processing.
-				_flagBuffers.emplace(
-					std::pair<size_t,size_t>(antenna1, antenna2),
-					nullptr
-				);
-			}
+			bool* channelPtr = _correlatorMask->Buffer() + ch*_correlatorMask->HorizontalStride();
+			std::fill(channelPtr, channelPtr + (_curWriteStart - _curChunkStart), true);
+			std::fill(channelPtr + (_curWriteEnd - _curChunkStart), channelPtr + (_curChunkEnd - _curChunkStart), true);
 		}
-		_baselinesToProcessCount = _baselinesToProcess.size();
+		
+		_baselinesToProcessCount = nBaselines;
+		_baselinesProcessedCount = 0;
 		
 		_readWatch.Pause();
+		readSpan.End();
 		_processWatch.Start();
+		TraceSpan processSpan(Tracer::ProcessStage);
+		Metrics::SetPhase(Metrics::ProcessingPhase);
 		
 		if(!_flagFileTemplate.empty())
 		{
-			_progressBar.reset(new ProgressBar("Reading flags"));
-			if(_flagReader.get() == 0)
-				_flagReader.reset(new FlagReader(_flagFileTemplate, _hduOffsetsPerGPUBox, _subbandOrder, _curSbStart, _curSbEnd));
-			// Create the flag masks
-			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
-			{
-				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-				{
-					std::unique_ptr<FlagMask>& baseline = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
-					baseline.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount())));
-				}
-			}
-			// Fill the flag masks by reading the files
-			for(size_t t=_curChunkStart; t!=_curChunkEnd; ++t)
-			{
-				_progressBar->SetProgress(t-_curChunkStart, _curChunkEnd-_curChunkStart);
-				size_t baselineIndex = 0;
-				for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
-				{
-					for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-					{
-						std::unique_ptr<FlagMask>& mask = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
-						size_t stride = mask->HorizontalStride();
-						bool* bufferPos = mask->Buffer() + (t - _curChunkStart);
-						_flagReader->Read(t, baselineIndex, bufferPos, stride);
-						++baselineIndex;
-					}
-				}
-			}
-			_progressBar.reset();
+			std::cout << "Waiting for flag files to be read...\n";
+			flagReadTasks.Wait();
 		}
 		
 		std::string taskDescription;
@@ -505,32 +733,72 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 		}
 		_progressBar.reset(new ProgressBar(taskDescription));
 		
-		std::vector<std::thread> threadGroup;
-		for(size_t i=0; i!=_threadCount; ++i)
-			threadGroup.emplace_back(std::bind(&Cotter::baselineProcessThreadFunc, this));
-		for(std::thread& t : threadGroup)
-			t.join();
+		_workerStatistics.resize(_threadPool->ThreadCount()+1);
+		MemoryAccounting::Sample("chunk " + std::to_string(chunkIndex+1) + " read");
+		ThreadPool::TaskGroup baselineTasks(*_threadPool);
+		for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+		{
+			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+				baselineTasks.RunOnNode(baselineNode(antenna1, antenna2), std::bind(&Cotter::processBaselineTask, this, antenna1, antenna2));
+		}
+		baselineTasks.Wait();
+		
+		// All worker statistics and the total exist together until they are merged
+		const size_t statisticsBytes = MemoryPlanner::StatisticsBytes(nBaselines, _mwaConfig.Header().nScans, nChannels, _collectHistograms);
+		size_t statisticsCount = _statistics ? 1 : 0;
+		for(const std::unique_ptr<QualityStatistics>& workerStatistics : _workerStatistics)
+			statisticsCount += workerStatistics ? 1 : 0;
+		_statisticsBytes.Set(statisticsCount * statisticsBytes);
+		MemoryAccounting::Sample("chunk " + std::to_string(chunkIndex+1) + " processed");
+		
+		for(std::unique_ptr<QualityStatistics>& workerStatistics : _workerStatistics)
+		{
+			if(workerStatistics)
+			{
+				if(!_statistics)
+					_statistics = std::move(workerStatistics);
+				else {
+					(*_statistics) += *workerStatistics;
+					workerStatistics.reset();
+				}
+			}
+		}
 		
+		_statisticsBytes.Set(_statistics ? statisticsBytes : 0);
 		_progressBar.reset();
 		_processWatch.Pause();
+		processSpan.End();
 		_writeWatch.Start();
+		TraceSpan writeSpan(Tracer::WriteStage);
+		Metrics::SetPhase(Metrics::WritingPhase);
 		
 		if(_skipWriting)
 		{
 			std::cout << "Skipping writing of visibilities.\n";
 		}
+		else if(_sink && !_sink->WantsTimesteps())
+		{
+			std::cout << "Visibility sink only uses baselines: skipping the timestep stage.\n";
+		}
+		else if(FlagWriter* flagWriter = dynamic_cast<FlagWriter*>(_writer.get()))
+		{
+			std::cout << "Writing flags of chunk...\n";
+			writeChunkFlags(*flagWriter);
+			Metrics::AddRowsWritten((_curWriteEnd-_curWriteStart) * rowsPerTimescan());
+		}
 		else {
 			_progressBar.reset(new ProgressBar("Writing"));
 			_outputFlags.reset(new bool[nChannels*4]);
 			_outputData = make_aligned<std::complex<float>>(nChannels*4, 16);
 			_outputWeights = make_aligned<float>(nChannels*4, 16);
-			for(size_t t=_curChunkStart; t!=_curChunkEnd; ++t)
+			for(size_t t=_curWriteStart; t!=_curWriteEnd; ++t)
 			{
-				_progressBar->SetProgress(t-_curChunkStart, _curChunkEnd-_curChunkStart);
+				_progressBar->SetProgress(t-_curWriteStart, _curWriteEnd-_curWriteStart);
 				if(_outputFormat == FlagsOutputFormat)
 					processAndWriteTimestepFlagsOnly(t);
 				else
 					processAndWriteTimestep(t);
+				Metrics::AddRowsWritten(rowsPerTimescan());
 			}
 			_outputData.reset();
 			_outputWeights.reset();
@@ -538,15 +806,14 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 			_progressBar.reset();
 		}
 		
-		_flagBuffers.clear();
-		
 		_correlatorMask.reset();
 		_fullysetMask.reset();
 		
 		_writeWatch.Pause();
+		MemoryAccounting::Sample("chunk " + std::to_string(chunkIndex+1) + " written");
+		MemoryAccounting::WriteLine(std::cout);
 	} // end for chunkIndex!=partCount
-	
-	_imageSetBuffers.clear();
+	Metrics::SetPhase(Metrics::FinishingPhase);
 	
 	_writeWatch.Start();
 	
@@ -573,13 +840,21 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	if(_outputFormat == MSOutputFormat)
 	{
 		std::cout << "Writing MWA fields to measurement set...\n";
-		writeMWAFieldsToMS(outputFilename, _mwaConfig.Header().nScans/partCount);
+		writeMWAFieldsToMS(outputFilename, flagWindowSize);
 	}
 	else if(_outputFormat == FitsOutputFormat)
 	{
 		std::cout << "Writing MWA fields to UVFits file...\n";
 		writeMWAFieldsToUVFits(outputFilename);
 	}
+	else if(_outputFormat == ColumnarOutputFormat)
+	{
+		std::cout << "The columnar file can be converted to a measurement set with cvis2ms, after which fixmwams adds the MWA fields.\n";
+	}
+	else if(_outputFormat == SharedMemoryOutputFormat)
+	{
+		std::cout << "All timesteps were published in shared memory; the consumer removes the segment after reading the last one.\n";
+	}
 	
 	_writeWatch.Pause();
 }
@@ -587,8 +862,12 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 void Cotter::createReader(const std::vector<std::string>& curFileset)
 {
 	_reader.reset();
-	_reader.reset(new GPUFileReader(_mwaConfig.NAntennae(), nChannelsInCurSBRange(), _threadCount, _offlineGPUBoxFormat));
+	_reader.reset(new GPUFileReader(_mwaConfig.NAntennae(), nChannelsInCurSBRange(), *_threadPool, _gpuMatrixBufferCount, _offlineGPUBoxFormat));
 	_reader->SetHDUOffsetsChangeCallback(std::bind(&Cotter::onHDUOffsetsChange, this, std::placeholders::_1));
+	_reader->SetScansToSkip(_scansToSkip);
+	_reader->SetIndexDirectory(_hduIndexDirectory);
+	if(hasChannelSelection())
+		_reader->SetChannelSelection(_channelSelectionStart);
 
 	// Add the gpubox files in the right order
 	for(size_t sb=_curSbStart; sb!=_curSbEnd; ++sb)
@@ -600,7 +879,7 @@ void Cotter::createReader(const std::vector<std::string>& curFileset)
 	_reader->Initialize(_mwaConfig.Header().integrationTime, _doAlign);
 }
 
-void Cotter::initializeReader()
+void Cotter::initializeReader(size_t firstScan)
 {
 	const size_t antennaCount = _mwaConfig.NAntennae();
 	
@@ -613,14 +892,15 @@ void Cotter::initializeReader()
 	{
 		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 		{
-			ImageSet &imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+			ImageSet &imageSet = _bufferArena->BaselineImageSet(baselineIndex(antenna1, antenna2));
 			BaselineBuffer buffer;
 			for(size_t p=0; p!=4; ++p)
 			{
-				buffer.real[p] = imageSet.ImageBuffer(p*2);
-				buffer.imag[p] = imageSet.ImageBuffer(p*2+1);
+				buffer.real[p] = imageSet.ImageBuffer(p*2) + firstScan;
+				buffer.imag[p] = imageSet.ImageBuffer(p*2+1) + firstScan;
 			}
 			buffer.nElementsPerRow = imageSet.HorizontalStride();
+			buffer.node = baselineNode(antenna1, antenna2);
 			_reader->SetDestBaselineBuffer(antenna1, antenna2, buffer);
 		}
 	}
@@ -628,6 +908,7 @@ void Cotter::initializeReader()
 
 void Cotter::processAndWriteTimestep(size_t timeIndex)
 {
+	TraceSpan rowSpan(Tracer::RowBuildStage);
 	const size_t antennaCount = _mwaConfig.NAntennae();
 	const size_t nChannels = nChannelsInCurSBRange();
 	const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + timeIndex * _mwaConfig.Header().integrationTime/86400.0;
@@ -656,8 +937,8 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 		{
 			if(outputBaseline(antenna1, antenna2))
 			{
-				const ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
-				const std::unique_ptr<FlagMask>& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				const ImageSet& imageSet = _bufferArena->BaselineImageSet(baselineIndex(antenna1, antenna2));
+				const FlagMask* flagMask = &_bufferArena->BaselineFlagMask(baselineIndex(antenna1, antenna2));
 				
 				const size_t stride = imageSet.HorizontalStride();
 				const size_t flagStride = flagMask->HorizontalStride();
@@ -680,14 +961,16 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 				
 				size_t bufferIndex = timeIndex - _curChunkStart;
 	#ifndef USE_SSE
-				for(size_t p=0; p!=4; ++p)
+				for(size_t outP=0; outP!=_rowPolarizationCount; ++outP)
 				{
+					// With two output polarizations, these are XX and YY
+					const size_t p = (_rowPolarizationCount == 4) ? outP : outP*3;
 					const float
 						*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
 						*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
 					const bool *flagPtr = flagMask -> Buffer()+bufferIndex;
-					std::complex<float> *outDataPtr = &_outputData[p];
-					bool *outputFlagPtr = &_outputFlags[p];
+					std::complex<float> *outDataPtr = &_outputData[outP];
+					bool *outputFlagPtr = &_outputFlags[outP];
 					for(size_t ch=0; ch!=nChannels; ++ch)
 					{
 						// Apply geometric phase delay (for w)
@@ -705,8 +988,8 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 						realPtr += stride;
 						imagPtr += stride;
 						flagPtr += flagStride;
-						outDataPtr += 4;
-						outputFlagPtr += 4;
+						outDataPtr += _rowPolarizationCount;
+						outputFlagPtr += _rowPolarizationCount;
 					}
 				}
 	#else
@@ -766,6 +1049,7 @@ void Cotter::processAndWriteTimestep(size_t timeIndex)
 
 void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 {
+	TraceSpan rowSpan(Tracer::RowBuildStage);
 	const size_t antennaCount = _mwaConfig.NAntennae();
 	const size_t nChannels = nChannelsInCurSBRange();
 	const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + timeIndex * _mwaConfig.Header().integrationTime/86400.0;
@@ -779,12 +1063,12 @@ void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 		{
 			if(outputBaseline(antenna1, antenna2))
 			{
-				const std::unique_ptr<FlagMask>& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				const FlagMask* flagMask = &_bufferArena->BaselineFlagMask(baselineIndex(antenna1, antenna2));
 				
 				const size_t flagStride = flagMask->HorizontalStride();
 				
 				size_t bufferIndex = timeIndex - _curChunkStart;
-				for(size_t p=0; p!=4; ++p)
+				for(size_t p=0; p!=_rowPolarizationCount; ++p)
 				{
 					const bool *flagPtr = flagMask->Buffer()+bufferIndex;
 					bool *outputFlagPtr = &_outputFlags[p];
@@ -792,7 +1076,7 @@ void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 					{
 						*outputFlagPtr = *flagPtr;
 						flagPtr += flagStride;
-						outputFlagPtr += 4;
+						outputFlagPtr += _rowPolarizationCount;
 					}
 				}
 				
@@ -802,6 +1086,28 @@ void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 	}
 }
 
+void Cotter::writeChunkFlags(FlagWriter& flagWriter)
+{
+	// The rows are not formed: the flag writer packs the masks of the baselines directly
+	const size_t antennaCount = _mwaConfig.NAntennae();
+	std::vector<FlagWriter::BaselineFlags> baselines;
+	for(size_t antenna1=0; antenna1!=antennaCount; ++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+		{
+			if(outputBaseline(antenna1, antenna2))
+			{
+				const FlagMask& flagMask = _bufferArena->BaselineFlagMask(baselineIndex(antenna1, antenna2));
+				FlagWriter::BaselineFlags flags;
+				flags.flags = flagMask.Buffer() + (_curWriteStart - _curChunkStart);
+				flags.stride = flagMask.HorizontalStride();
+				baselines.push_back(flags);
+			}
+		}
+	}
+	flagWriter.WriteChunk(_curWriteEnd - _curWriteStart, baselines);
+}
+
 void Cotter::CalculateUVW(double date, size_t antenna1, size_t antenna2, double &u, double &v, double &w)
 {
 	// TODO we could cache the station uvw per timestep for improved performance
@@ -823,41 +1129,36 @@ void Cotter::CalculateUVW(double date, size_t antenna1, size_t antenna2, double
 	w = w1 - w2;
 }
 
-void Cotter::baselineProcessThreadFunc()
+void Cotter::processBaselineTask(size_t antenna1, size_t antenna2)
 {
-	QualityStatistics threadStatistics =
-		_flagger.MakeQualityStatistics(&_scanTimes[_curChunkStart], _curChunkEnd-_curChunkStart, &_channelFrequenciesHz[0], _channelFrequenciesHz.size(), 4, _collectHistograms);
-	
-	std::unique_lock<std::mutex> lock(_mutex);
-	while(!_baselinesToProcess.empty())
-	{
-		std::pair<size_t, size_t> baseline = _baselinesToProcess.front();
-		size_t currentTaskCount = _baselinesToProcess.size();
-		_progressBar->SetProgress(_baselinesToProcessCount - currentTaskCount, _baselinesToProcessCount);
-		_baselinesToProcess.pop();
-		lock.unlock();
-		
-		processBaseline(baseline.first, baseline.second, threadStatistics);
-		lock.lock();
-	}
-	
-	// Mutex still needs to be locked
-	if(!_statistics)
-		_statistics.reset(new QualityStatistics(threadStatistics));
-	else
-		(*_statistics) += threadStatistics;
+	// Statistics are collected per worker, so that no locking is required while collecting them
+	std::unique_ptr<QualityStatistics>& statistics = _workerStatistics[_threadPool->WorkerIndex()];
+	if(!statistics)
+		statistics.reset(new QualityStatistics(
+			_flagger.MakeQualityStatistics(&_scanTimes[_curChunkStart], _curChunkEnd-_curChunkStart, &_channelFrequenciesHz[0], _channelFrequenciesHz.size(), 4, _collectHistograms)
+		));
+	
+	processBaseline(antenna1, antenna2, *statistics);
+	
+	Metrics::AddBaselinesProcessed(1);
+	const size_t processedCount = _baselinesProcessedCount.fetch_add(1, std::memory_order_relaxed) + 1;
+	_progressBar->SetProgress(processedCount, _baselinesToProcessCount);
 }
 
 void Cotter::processBaseline(size_t antenna1, size_t antenna2, QualityStatistics &statistics)
 {
-	ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t,size_t>(antenna1, antenna2))->second;
+	const size_t baseline = baselineIndex(antenna1, antenna2);
+	ImageSet& imageSet = _bufferArena->BaselineImageSet(baseline);
 	const MWAInput
 		&input1X = _mwaConfig.AntennaXInput(antenna1),
 		&input1Y = _mwaConfig.AntennaYInput(antenna1),
 		&input2X = _mwaConfig.AntennaXInput(antenna2),
 		&input2Y = _mwaConfig.AntennaYInput(antenna2);
+	
+	TraceSpan correctionSpan(Tracer::CorrectionStage);
 		
-	// Correct conjugated baselines
+	// Correct conjugated baselines. The corrections don't depend on time, so they are
+	// only applied to the new scans of the chunk.
 	if(_reader->IsConjugated(antenna1, antenna2, 0, 0)) {
 		correctConjugated(imageSet, 1);
 	}
@@ -890,9 +1191,9 @@ void Cotter::processBaseline(size_t antenna1, size_t antenna2, QualityStatistics
 			
 			for(size_t ch=0; ch!=channelsPerSubband; ++ch)
 			{
-				float *channelPtr = imageSet.ImageBuffer(i) + (ch+sb*channelsPerSubband) * imageSet.HorizontalStride();
-				const float correctionFactor = _subbandCorrectionFactors[i/2][ch] * subbandGainCorrection;
-				for(size_t x=0; x!=imageSet.Width(); ++x)
+				float *channelPtr = imageSet.ImageBuffer(i) + (ch+sb*channelsPerSubband) * imageSet.HorizontalStride() + _retainedScanCount;
+				const float correctionFactor = _subbandCorrectionFactors[i/2][ch + _channelSelectionStart] * subbandGainCorrection;
+				for(size_t x=_retainedScanCount; x<imageSet.Width(); ++x)
 				{
 					*channelPtr *= correctionFactor;
 					++channelPtr;
@@ -901,56 +1202,91 @@ void Cotter::processBaseline(size_t antenna1, size_t antenna2, QualityStatistics
 		}
 	}
 	
-	std::unique_ptr<FlagMask> flagMask;
+	correctionSpan.End();
+	
+	const size_t width = _curChunkEnd-_curChunkStart, height = _reader->ChannelCount();
+	FlagMask *flagMask;
 	FlagMask *correlatorMask;
 	// Perform RFI detection, if baseline is not flagged.
 	bool skipFlagging = input1X.isFlagged || input1Y.isFlagged || input2X.isFlagged || input2Y.isFlagged || _isAntennaFlaggedMap[antenna1] || _isAntennaFlaggedMap[antenna2];
 	if(skipFlagging)
 	{
 		if(_flagFileTemplate.empty())
-			flagMask.reset(new FlagMask(*_fullysetMask));
+			flagMask = &_bufferArena->AcquireFlagMask(baseline, width, height, true);
 		else
-			flagMask = std::move(_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
+			flagMask = &_bufferArena->BaselineFlagMask(baseline);
 		correlatorMask = _fullysetMask.get();
 	}
 	else 
 	{
 		if(!_flagFileTemplate.empty())
 		{
-			flagMask = std::move(_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
 			if(antenna1 == antenna2)
-			{
-				flagMask.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false)));
-			}
+				flagMask = &_bufferArena->AcquireFlagMask(baseline, width, height, false);
+			else
+				flagMask = &_bufferArena->BaselineFlagMask(baseline);
 		}
 		else if(_rfiDetection && (antenna1 != antenna2))
-			flagMask.reset(new FlagMask(_flagger.Run(*_strategy, imageSet)));
+		{
+			TraceSpan flaggingSpan(Tracer::FlaggingStage);
+			_bufferArena->StoreFlagMask(baseline, _flagger.Run(*_strategy, imageSet));
+			flagMask = &_bufferArena->BaselineFlagMask(baseline);
+		}
 		else
-			flagMask.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false)));
+			flagMask = &_bufferArena->AcquireFlagMask(baseline, width, height, false);
 		flagBadCorrelatorSamples(*flagMask);
 		correlatorMask = _correlatorMask.get();
 	}
 	
 	// Collect statistics
 	if(_collectStatistics)
+	{
+		TraceSpan statisticsSpan(Tracer::StatisticsStage);
 		_flagger.CollectStatistics(statistics, imageSet, *flagMask, *correlatorMask, antenna1, antenna2);
+	}
 	
 	// If this is an auto-correlation, it wouldn't have been flagged yet
 	// to allow collecting its statistics. But we want to flag it...
 	if(antenna1 == antenna2 && _flagAutos)
+		_bufferArena->AcquireFlagMask(baseline, width, height, true);
+	
+	// Applied after flagging and statistics, which should see the same data as when the
+	// solutions are applied by the writer.
+	if(_solutionApplier)
 	{
-		flagMask.reset(new FlagMask(*_fullysetMask));
+		TraceSpan solutionsSpan(Tracer::SolutionsStage);
+		applySolutions(imageSet, antenna1, antenna2);
 	}
 	
-	_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second = std::move(flagMask);
+	if(_sink)
+	{
+		const FlagMask& finalMask = _bufferArena->BaselineFlagMask(baseline);
+		VisibilitySink::BaselineBlock block;
+		block.antenna1 = antenna1;
+		block.antenna2 = antenna2;
+		// The overlapping scans are passed by the chunk that writes them
+		const size_t writeOffset = _curWriteStart - _curChunkStart;
+		block.timestepStart = _curWriteStart;
+		block.timestepCount = _curWriteEnd - _curWriteStart;
+		block.channelCount = height;
+		block.times = &_scanTimes[_curWriteStart];
+		block.channelFrequencies = _channelFrequenciesHz.data();
+		for(size_t i=0; i!=8; ++i)
+			block.planes[i] = imageSet.ImageBuffer(i) + writeOffset;
+		block.stride = imageSet.HorizontalStride();
+		block.flags = finalMask.Buffer() + writeOffset;
+		block.flagStride = finalMask.HorizontalStride();
+		_sink->ProcessBaseline(block);
+	}
 }
 
 void Cotter::correctConjugated(ImageSet& imageSet, size_t imgImageIndex) const
 {
-	float *imags = imageSet.ImageBuffer(imgImageIndex);
+	// Scans that were kept from the previous chunk are already corrected
 	for(size_t y=0; y!=imageSet.Height(); ++y)
 	{
-		for(size_t x=0; x!=imageSet.HorizontalStride(); ++x)
+		float *imags = imageSet.ImageBuffer(imgImageIndex) + y * imageSet.HorizontalStride() + _retainedScanCount;
+		for(size_t x=_retainedScanCount; x<imageSet.Width(); ++x)
 		{
 			*imags = -*imags;
 			++imags;
@@ -971,9 +1307,9 @@ void Cotter::correctCableLength(ImageSet& imageSet, size_t polarization, double
 		float rotSin = rotSinl, rotCos = rotCosl;
 		
 		/// @todo This should use actual time step count in window
-		float *realPtr = reals + y * imageSet.HorizontalStride();
-		float *imagPtr = imags + y * imageSet.HorizontalStride();
-		for(size_t x=0; x!=imageSet.Width(); ++x)
+		float *realPtr = reals + y * imageSet.HorizontalStride() + _retainedScanCount;
+		float *imagPtr = imags + y * imageSet.HorizontalStride() + _retainedScanCount;
+		for(size_t x=_retainedScanCount; x<imageSet.Width(); ++x)
 		{
 			float r = *realPtr;
 			*realPtr = rotCos * r - rotSin * (*imagPtr);
@@ -984,6 +1320,29 @@ void Cotter::correctCableLength(ImageSet& imageSet, size_t polarization, double
 	}
 }
 
+void Cotter::applySolutions(ImageSet& imageSet, size_t antenna1, size_t antenna2) const
+{
+	float* planes[8];
+	for(size_t i=0; i!=8; ++i)
+		planes[i] = imageSet.ImageBuffer(i);
+	// The time is calculated as by processAndWriteTimestep(), so that the same interval is
+	// selected as when the writer applies the solutions
+	auto timestepInterval = [&](size_t x) -> size_t {
+		const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + (_curChunkStart + x) * _mwaConfig.Header().integrationTime/86400.0;
+		return _solutionApplier->IntervalIndex(dateMJD*86400.0);
+	};
+	size_t start = 0;
+	while(start != imageSet.Width())
+	{
+		const size_t interval = timestepInterval(start);
+		size_t end = start + 1;
+		while(end != imageSet.Width() && timestepInterval(end) == interval)
+			++end;
+		_solutionApplier->ApplyToPlanes(interval, antenna1, antenna2, planes, imageSet.HorizontalStride(), start, end);
+		start = end;
+	}
+}
+
 void Cotter::writeAntennae()
 {
 	double arrayX, arrayY, arrayZ;
@@ -1224,38 +1583,32 @@ void Cotter::initPerInputSubbandGains()
 
 void Cotter::flagBadCorrelatorSamples(FlagMask &flagMask) const
 {
-	// Flag MWA side and centre channels
+	// Flag MWA side and centre channels. These are given as channels of the full subband,
+	// and are skipped when they are outside the channel selection.
 	const size_t
 		scanCount = _curChunkEnd - _curChunkStart,
 		curSBCount = _curSbEnd - _curSbStart,
 		chPerSb = flagMask.Height() / curSBCount;
+	std::vector<size_t> channelsToFlag;
+	for(size_t ch=0; ch!=_subbandEdgeFlagCount; ++ch)
+	{
+		channelsToFlag.push_back(ch);
+		channelsToFlag.push_back(channelsPerSubband()-1-ch);
+	}
+	if(_flagDCChannels)
+		channelsToFlag.push_back(channelsPerSubband()/2);
 	for(size_t sb=0; sb!=curSBCount; ++sb)
 	{
 		bool *sbStart = flagMask.Buffer() + (sb*chPerSb)*flagMask.HorizontalStride();
 		
-		// Flag first edges of sb
-		for(size_t ch=0; ch!=_subbandEdgeFlagCount; ++ch)
-		{
-			bool *channelPtr = sbStart + ch * flagMask.HorizontalStride();
-			bool *endPtr = sbStart + ch * flagMask.HorizontalStride() + scanCount;
-			while(channelPtr != endPtr) { *channelPtr=true; ++channelPtr; }
-		}
-		
-		// Flag centre channel of sb
-		if(_flagDCChannels)
-		{
-			size_t halfBand = chPerSb/2;
-			bool *channelPtr = sbStart + halfBand*flagMask.HorizontalStride();
-			bool *endPtr = sbStart + halfBand*flagMask.HorizontalStride() + scanCount;
-			while(channelPtr != endPtr) { *channelPtr=true; ++channelPtr; }
-		}
-		
-		// Flag last edge channels of sb
-		for(size_t ch=chPerSb-_subbandEdgeFlagCount; ch!=chPerSb; ++ch)
+		for(size_t ch : channelsToFlag)
 		{
-			bool *channelPtr = sbStart + ch * flagMask.HorizontalStride();
-			bool *endPtr = sbStart + ch * flagMask.HorizontalStride() + scanCount;
-			while(channelPtr != endPtr) { *channelPtr=true; ++channelPtr; }
+			if(ch >= _channelSelectionStart && ch < _channelSelectionEnd)
+			{
+				bool *channelPtr = sbStart + (ch - _channelSelectionStart) * flagMask.HorizontalStride();
+				bool *endPtr = channelPtr + scanCount;
+				while(channelPtr != endPtr) { *channelPtr=true; ++channelPtr; }
+			}
 		}
 	}
 	
@@ -1303,6 +1656,47 @@ void Cotter::flagBadCorrelatorSamples(FlagMask &flagMask) const
 	}
 }
 
+void Cotter::applySelection()
+{
+	const size_t observationScanCount = _mwaConfig.Header().nScans;
+	if(_scanSelectionEnd == 0)
+		_scanSelectionEnd = observationScanCount;
+	if(_scanSelectionStart >= _scanSelectionEnd || _scanSelectionEnd > observationScanCount)
+	{
+		std::ostringstream s;
+		s << "Invalid scan range " << _scanSelectionStart << "-" << _scanSelectionEnd << ": the observation has " << observationScanCount << " scans";
+		throw std::runtime_error(s.str());
+	}
+	if(_channelSelectionEnd == 0)
+		_channelSelectionEnd = channelsPerSubband();
+	if(_channelSelectionStart >= _channelSelectionEnd || _channelSelectionEnd > channelsPerSubband())
+	{
+		std::ostringstream s;
+		s << "Invalid channel range " << _channelSelectionStart << "-" << _channelSelectionEnd << ": the coarse channels have " << channelsPerSubband() << " fine channels";
+		throw std::runtime_error(s.str());
+	}
+	
+	const bool hasScanSelection = (_scanSelectionEnd - _scanSelectionStart != observationScanCount);
+	// Flag files always hold all scans and all channels of a coarse channel
+	if(_outputFormat == FlagsOutputFormat && (hasScanSelection || hasChannelSelection()))
+		throw std::runtime_error("A scan or channel range can not be used when writing flag files");
+	if(!_flagFileTemplate.empty() && hasChannelSelection())
+		throw std::runtime_error("A channel range can not be used when reading flags from flag files");
+	
+	if(hasScanSelection)
+	{
+		std::cout << "Selected scans " << _scanSelectionStart << "-" << _scanSelectionEnd << " of " << observationScanCount << ".\n";
+		// The quacked samples are at the start and end of the observation, which might be outside the selection
+		const size_t scansAfterSelection = observationScanCount - _scanSelectionEnd;
+		_quackInitSampleCount = (_quackInitSampleCount > _scanSelectionStart) ? _quackInitSampleCount - _scanSelectionStart : 0;
+		_quackEndSampleCount = (_quackEndSampleCount > scansAfterSelection) ? _quackEndSampleCount - scansAfterSelection : 0;
+		_mwaConfig.HeaderRW().nScans = _scanSelectionEnd - _scanSelectionStart;
+		_mwaConfig.HeaderRW().dateFirstScanMJD += _scanSelectionStart * _mwaConfig.Header().integrationTime / 86400.0;
+	}
+	if(hasChannelSelection())
+		std::cout << "Selected fine channels " << _channelSelectionStart << "-" << _channelSelectionEnd << " of each coarse channel.\n";
+}
+
 void Cotter::initializeWeights(aligned_ptr<float>& outputWeights)
 {
 	// Weights are normalized so that default res of 10 kHz, 1s has weight of "1" per sample
@@ -1311,11 +1705,14 @@ void Cotter::initializeWeights(aligned_ptr<float>& outputWeights)
 	size_t curSBRangeSize = _curSbEnd - _curSbStart;
 	for(size_t sb=0; sb!=curSBRangeSize; ++sb)
 	{
-		size_t channelsPerSubband = _mwaConfig.Header().nChannels / _subbandCount;
+		size_t channelsPerSubband = selectedChannelsPerSubband();
 		for(size_t ch=0; ch!=channelsPerSubband; ++ch)
 		{
-			for(size_t p=0; p!=4; ++p)
-				outputWeights[(ch+channelsPerSubband*sb)*4 + p] = weightFactor / (_subbandCorrectionFactors[p][ch]);
+			for(size_t outP=0; outP!=_rowPolarizationCount; ++outP)
+			{
+				const size_t p = (_rowPolarizationCount == 4) ? outP : outP*3;
+				outputWeights[(ch+channelsPerSubband*sb)*_rowPolarizationCount + outP] = weightFactor / (_subbandCorrectionFactors[p][ch + _channelSelectionStart]);
+			}
 		}
 	}
 }
@@ -3,13 +3,18 @@
 
 #include "aligned_ptr.h"
 #include "averagingwriter.h"
+#include "bufferarena.h"
 #include "gpufilereader.h"
+#include "memoryaccounting.h"
+#include "memoryplanner.h"
 #include "mwaconfig.h"
 #include "stopwatch.h"
 #include "progressbar.h"
+#include "threadpool.h"
 
 #include <aoflagger.h>
 
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <queue>
@@ -24,13 +29,14 @@ namespace aoflagger {
 	class Strategy;
 }
 
+class FlagWriter;
 class GPUFileReader;
 class MSWriter;
 
 class Cotter : private UVWCalculater
 {
 	public:
-		enum OutputFormat { MSOutputFormat, FitsOutputFormat, FlagsOutputFormat };
+		enum OutputFormat { MSOutputFormat, FitsOutputFormat, FlagsOutputFormat, ColumnarOutputFormat, SharedMemoryOutputFormat, SinkOutputFormat };
 		
 		Cotter();
 		~Cotter();
@@ -39,8 +45,19 @@ class Cotter : private UVWCalculater
 		
 		void SetOutputFilename(const std::string& outputFilename) { _outputFilename = outputFilename; _defaultFilename = false; }
 		void SetOutputFormat(enum OutputFormat format) { _outputFormat = format; }
+		/**
+		 * Pass the visibilities to a sink instead of writing them to a file. The sink
+		 * is not owned and should stay alive while Run() is called.
+		 */
+		void SetVisibilitySink(class VisibilitySink* sink)
+		{
+			_sink = sink;
+			_outputFormat = SinkOutputFormat;
+		}
 		void SetFileSets(const std::vector<std::vector<std::string> >& fileSets) { _fileSets = fileSets; }
 		void SetThreadCount(size_t threadCount) { _threadCount = threadCount; }
+		void SetNUMAMode(bool numaMode) { _numaMode = numaMode; }
+		void SetUseHugePages(bool useHugePages) { _useHugePages = useHugePages; }
 		void SetRFIDetection(bool performRFIDetection) { _rfiDetection = performRFIDetection; }
 		void SetCollectStatistics(bool collectStatistics) { _collectStatistics = collectStatistics; }
 		void SetCollectHistograms(bool collectHistograms) { _collectHistograms = collectHistograms; }
@@ -49,7 +66,8 @@ class Cotter : private UVWCalculater
 		void SetAntennaLocationsFilename(const char *filename) { _antennaLocationsFilename = filename; }
 		void SetHeaderFilename(const char *filename) { _headerFilename = filename; }
 		void SetInstrConfigFilename(const char *filename) { _instrConfigFilename = filename; }
-		void SetMaxBufferSize(const size_t bufferSizeInSamples) { _maxBufferSize = bufferSizeInSamples; }
+		void SetMemoryLimit(size_t memoryLimitInBytes) { _memoryLimit = memoryLimitInBytes; }
+		void SetDryRun(bool dryRun) { _dryRun = dryRun; }
 		void SetDisableGeometricCorrections(bool disableCorrections) { _disableGeometricCorrections = disableCorrections; }
 		void SetOverridePhaseCentre(long double newRARad, long double newDecRad)
 		{
@@ -76,12 +94,58 @@ class Cotter : private UVWCalculater
 		void SetApplySBGains(bool applySBGains) { _applySBGains = applySBGains; }
 		void SetFlagDCChannels(bool flagDCChannels) { _flagDCChannels = flagDCChannels; }
 		void SetFlagFileTemplate(const std::string& flagFileTemplate) { _flagFileTemplate = flagFileTemplate; }
+		void SetFlagFileVersion(unsigned flagFileVersion) { _flagFileVersion = flagFileVersion; }
+		void SetSharedMemorySlotCount(size_t slotCount) { _sharedMemorySlotCount = slotCount; }
+		/**
+		 * Number of polarizations that are written: 4 for XX, XY, YX and YY (default), or 2
+		 * for only XX and YY. Flagging and statistics always use all four.
+		 */
+		void SetPolarizationCount(size_t polarizationCount) { _polarizationCount = polarizationCount; }
 		void SetSaveQualityStatistics(const std::string& file) { _qualityStatisticsFilename = file; }
+		/** Trace the stages of all threads, and write them as Chrome trace events to the given file. */
+		void SetTraceFilename(const std::string& traceFilename) { _traceFilename = traceFilename; }
+		/** Count the hardware events (cycles, instructions, cache misses) of the stages, and print them at the end. */
+		void SetCountPerfEvents(bool countPerfEvents) { _countPerfEvents = countPerfEvents; }
+		/** Write the memory use per subsystem at every stage of every chunk as a JSON time series. */
+		void SetMemoryLogFilename(const std::string& memoryLogFilename) { _memoryLogFilename = memoryLogFilename; }
+		/**
+		 * Periodically write the progress and throughput as JSON lines to a file, or to a
+		 * Unix socket when the destination has the form "unix:<path>". See MetricsEmitter.
+		 */
+		void SetMetricsDestination(const std::string& metricsDestination) { _metricsDestination = metricsDestination; }
+		void SetMetricsInterval(double metricsIntervalSeconds) { _metricsInterval = metricsIntervalSeconds; }
 		void SetSkipWriting(bool skipWriting) { _skipWriting = skipWriting; }
 		void FlagAntenna(size_t antIndex) { _userFlaggedAntennae.push_back(antIndex); }
 		void FlagSubband(size_t sbIndex) { _flaggedSubbands.insert(sbIndex); }
 		void SetSubbandEdgeFlagWidth(double edgeFlagWidth) { _subbandEdgeFlagWidthKHz = edgeFlagWidth; }
 		void SetOfflineGPUBoxFormat(bool offlineFormat) { _offlineGPUBoxFormat = offlineFormat; }
+		/** Cache the HDU layout of the GPU files in this directory, see GPUFileIndex. */
+		void SetHDUIndexDirectory(const std::string& hduIndexDirectory) { _hduIndexDirectory = hduIndexDirectory; }
+		/**
+		 * Only process the scans from scanStart up to (not including) scanEnd. The other
+		 * scans are not read from the GPU files. An end of zero selects up to the last scan.
+		 */
+		void SetScanSelection(size_t scanStart, size_t scanEnd) { _scanSelectionStart = scanStart; _scanSelectionEnd = scanEnd; }
+		/**
+		 * Only process the fine channels from channelStart up to (not including) channelEnd
+		 * of every coarse channel. An end of zero selects up to the last channel.
+		 */
+		void SetChannelSelection(size_t channelStart, size_t channelEnd) { _channelSelectionStart = channelStart; _channelSelectionEnd = channelEnd; }
+		/**
+		 * Process the observation in windows of a fixed number of scans, instead of in as
+		 * few chunks as fit in memory. The rows of a window are written as soon as the window
+		 * is flagged, so that the latency and memory use are set by the window length instead of
+		 * by the observation length. Every window is flagged together with @p overlapScans
+		 * scans on both sides, which are not written; these are kept from the previous
+		 * window instead of being read again.
+		 */
+		void SetStreaming(size_t windowScans, size_t overlapScans) { _streamWindow = windowScans; _streamOverlap = overlapScans; }
+		/**
+		 * When the observation is split in chunks, flag every chunk together with the given
+		 * number of scans of the neighbouring chunks on both sides, so that the flagger does
+		 * not see the chunk boundaries. The memory plan includes these scans.
+		 */
+		void SetChunkOverlap(size_t overlapScans) { _chunkOverlap = overlapScans; }
 		void SetUseDysco(bool useDysco) { _useDysco = useDysco; }
 		void SetAdvancedDyscoOptions(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization)
 		{
@@ -93,14 +157,19 @@ class Cotter : private UVWCalculater
 		}
 		void SetSolutionFile(const char* solutionFilename) { _solutionFilename = solutionFilename; }
 		void SetApplyBeforeAveraging(bool beforeAvg) { _applySolutionsBeforeAveraging = beforeAvg; }
+		void SetApplyInBaselineProcessing(bool inBaselines) { _applySolutionsInBaselines = inBaselines; }
 		size_t SubbandCount() const { return _subbandCount; }
 		
 	private:
 		MWAConfig _mwaConfig;
+		// Declared before the reader and writers, because these use the pool and should be destructed first
+		std::unique_ptr<ThreadPool> _threadPool;
 		std::unique_ptr<Writer> _writer;
 		std::unique_ptr<GPUFileReader> _reader;
 		aoflagger::AOFlagger _flagger;
 		std::unique_ptr<aoflagger::Strategy> _strategy;
+		// Owns the image sets and flag masks of all baselines, indexed by baselineIndex()
+		std::unique_ptr<BufferArena> _bufferArena;
 		
 		std::vector<double> _subbandCorrectionFactors[4];
 		std::unique_ptr<bool[]> _isAntennaFlaggedMap;
@@ -110,45 +179,64 @@ class Cotter : private UVWCalculater
 		
 		std::vector<std::vector<std::string> > _fileSets;
 		size_t _threadCount;
-		size_t _maxBufferSize;
+		bool _numaMode, _useHugePages;
+		size_t _memoryLimit;
+		size_t _gpuMatrixBufferCount;
+		bool _dryRun;
 		size_t _subbandCount;
 		size_t _quackInitSampleCount, _quackEndSampleCount;
 		double _subbandEdgeFlagWidthKHz;
 		size_t _subbandEdgeFlagCount;
 		size_t _missingEndScans;
+		size_t _scanSelectionStart, _scanSelectionEnd, _channelSelectionStart, _channelSelectionEnd;
+		// Number of scans that the next reader should skip to reach the start of the scan selection
+		size_t _scansToSkip;
+		// Scans written per chunk when streaming (zero when not streaming), and the number of
+		// scans before and after the written scans that are only used for flagging
+		size_t _streamWindow, _streamOverlap, _chunkOverlap;
 		size_t _curChunkStart, _curChunkEnd, _curSbStart, _curSbEnd;
+		// The scans of the current chunk that are written; the other scans of the chunk overlap
+		// with the previous or next chunk
+		size_t _curWriteStart, _curWriteEnd;
+		// Number of scans at the start of the current chunk that were kept from the previous chunk
+		size_t _retainedScanCount;
 		bool _defaultFilename, _rfiDetection, _collectStatistics, _collectHistograms, _usePointingCentre;
 		enum OutputFormat _outputFormat;
+		class VisibilitySink* _sink;
 		std::string _outputFilename, _commandLine;
 		std::string _metaFilename, _antennaLocationsFilename, _headerFilename, _instrConfigFilename;
-		std::string _subbandPassbandFilename, _flagFileTemplate, _qualityStatisticsFilename;
-		bool _applySolutionsBeforeAveraging;
+		std::string _subbandPassbandFilename, _flagFileTemplate, _qualityStatisticsFilename, _traceFilename, _memoryLogFilename, _metricsDestination;
+		std::string _hduIndexDirectory;
+		bool _applySolutionsBeforeAveraging, _applySolutionsInBaselines;
 		std::string _solutionFilename;
+		// Only used when the solutions are applied during baseline processing
+		std::unique_ptr<class SolutionApplier> _solutionApplier;
 		std::vector<size_t> _userFlaggedAntennae;
 		std::set<size_t> _flaggedSubbands;
 		
-		std::map<std::pair<size_t, size_t>, aoflagger::ImageSet> _imageSetBuffers;
-		// This unique_ptr is necessary because FlagMask was not properly nullable in aoflagger 2.11
-		// (due to a bug). Once aoflagger 2.12 is rolled out, it would be neater to remove the unique_ptr wrapper.
-		std::map<std::pair<size_t, size_t>, std::unique_ptr<aoflagger::FlagMask>> _flagBuffers;
 		std::vector<double> _channelFrequenciesHz;
 		std::vector<double> _scanTimes;
-		std::queue<std::pair<size_t,size_t> > _baselinesToProcess;
 		std::unique_ptr<ProgressBar> _progressBar;
 		size_t _baselinesToProcessCount;
+		std::atomic<size_t> _baselinesProcessedCount;
 		std::vector<size_t> _subbandOrder;
 		std::vector<int> _hduOffsetsPerGPUBox;
 		std::unique_ptr<class FlagReader> _flagReader;
 		
-		std::mutex _mutex;
 		std::unique_ptr<aoflagger::QualityStatistics> _statistics;
+		// Indexed by ThreadPool::WorkerIndex(); merged into _statistics after each chunk
+		std::vector<std::unique_ptr<aoflagger::QualityStatistics>> _workerStatistics;
 		std::unique_ptr<aoflagger::FlagMask> _correlatorMask, _fullysetMask;
 		
 		bool _disableGeometricCorrections, _removeFlaggedAntennae, _removeAutoCorrelations, _flagAutos;
 		bool _overridePhaseCentre, _doAlign, _doFlagMissingSubbands, _applySBGains, _flagDCChannels, _skipWriting;
-		bool _offlineGPUBoxFormat;
+		bool _offlineGPUBoxFormat, _countPerfEvents;
+		unsigned _flagFileVersion;
+		size_t _sharedMemorySlotCount, _polarizationCount;
+		/** Polarizations of the rows that are formed; four when a writer still needs the cross-polarizations. */
+		size_t _rowPolarizationCount;
 		long double _customRARad, _customDecRad;
-		double _initDurationToFlag, _endDurationToFlag;
+		double _initDurationToFlag, _endDurationToFlag, _metricsInterval;
 		
 		bool _useDysco;
 		size_t _dyscoDataBitRate;
@@ -160,17 +248,23 @@ class Cotter : private UVWCalculater
 		std::unique_ptr<bool[]> _outputFlags;
 		aligned_ptr<std::complex<float>> _outputData;
 		aligned_ptr<float> _outputWeights;
+		// Estimated size of the quality statistics, which are allocated by AOFlagger
+		TrackedBytes _statisticsBytes;
 		
+		MemoryPlanner::Plan makeMemoryPlan(size_t nChannels, size_t timeAvgFactor, size_t freqAvgFactor, bool mayReduceThreads) const;
 		void processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFactor);
 		void processOneContiguousBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor);
 		void createReader(const std::vector<std::string> &curFileset);
-		void initializeReader();
+		/** Set the destination buffers of the reader, such that scans are stored from the given scan of the chunk onwards. */
+		void initializeReader(size_t firstScan);
 		void processAndWriteTimestep(size_t timeIndex);
 		void processAndWriteTimestepFlagsOnly(size_t timeIndex);
-		void baselineProcessThreadFunc();
+		void writeChunkFlags(FlagWriter& flagWriter);
+		void processBaselineTask(size_t antenna1, size_t antenna2);
 		void processBaseline(size_t antenna1, size_t antenna2, aoflagger::QualityStatistics &statistics);
 		void correctConjugated(aoflagger::ImageSet& imageSet, size_t imageIndex) const;
 		void correctCableLength(aoflagger::ImageSet& imageSet, size_t polarization, double cableDelay) const;
+		void applySolutions(aoflagger::ImageSet& imageSet, size_t antenna1, size_t antenna2) const;
 		void writeAntennae();
 		void writeSPW();
 		void writeSource();
@@ -182,6 +276,7 @@ class Cotter : private UVWCalculater
 		void flagBadCorrelatorSamples(aoflagger::FlagMask &flagMask) const;
 		void initializeWeights(aligned_ptr<float>& outputWeights);
 		void initializeSbOrder();
+		void applySelection();
 		void writeAlignmentScans();
 		void writeMWAFieldsToMS(const std::string& outputFilename, size_t flagWindowSize);
 		void writeMWAFieldsToUVFits(const std::string& outputFilename);
@@ -206,6 +301,23 @@ class Cotter : private UVWCalculater
 				output = output && (antenna1 != antenna2);
 			return output;
 		}
+		size_t baselineIndex(size_t antenna1, size_t antenna2) const
+		{
+			return antenna1*(2*_mwaConfig.NAntennae() - antenna1 + 1)/2 + (antenna2 - antenna1);
+		}
+		/**
+		 * The NUMA node that owns the buffers of the given baseline. Baselines
+		 * are partitioned in contiguous ranges over the nodes of the thread pool.
+		 */
+		size_t baselineNode(size_t antenna1, size_t antenna2) const
+		{
+			return baselineIndexNode(baselineIndex(antenna1, antenna2));
+		}
+		size_t baselineIndexNode(size_t baselineIndex) const
+		{
+			const size_t nBaselines = _mwaConfig.NAntennae()*(_mwaConfig.NAntennae()+1)/2;
+			return baselineIndex * _threadPool->NodeCount() / nBaselines;
+		}
 		bool isGPUBoxMissing(size_t gpuBoxIndex) const
 		{
 			for(std::vector<std::vector<std::string> >::const_iterator i=_fileSets.begin(); i!=_fileSets.end(); ++i)
@@ -216,9 +328,21 @@ class Cotter : private UVWCalculater
 			}
 			return false;
 		}
+		size_t channelsPerSubband() const
+		{
+			return _mwaConfig.Header().nChannels / _subbandCount;
+		}
+		size_t selectedChannelsPerSubband() const
+		{
+			return _channelSelectionEnd - _channelSelectionStart;
+		}
+		bool hasChannelSelection() const
+		{
+			return selectedChannelsPerSubband() != channelsPerSubband();
+		}
 		size_t nChannelsInCurSBRange() const
 		{
-			return _mwaConfig.Header().nChannels * (_curSbEnd - _curSbStart) / _subbandCount;
+			return selectedChannelsPerSubband() * (_curSbEnd - _curSbStart);
 		}
 		static std::string twoDigits(int value)
 		{
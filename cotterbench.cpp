@@ -0,0 +1,563 @@
+#include "averagingwriter.h"
+#include "columnarwriter.h"
+#include "cotter.h"
+#include "fitswriter.h"
+#include "flagwriter.h"
+#include "gpufilereader.h"
+#include "mswriter.h"
+#include "sinkwriter.h"
+#include "syntheticobservation.h"
+#include "threadedwriter.h"
+#include "threadpool.h"
+#include "tracer.h"
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/**
+ * Benchmarks Cotter on a synthetic observation (see SyntheticObservation), so that
+ * optimisations can be measured without real observations. It runs:
+ * - the generation of the files;
+ * - the GPU file reader on its own (HDU reads and the shuffle of the baselines);
+ * - complete runs of Cotter for the selected output formats, of which the stages are
+ *   measured with the tracer (the stages run on several threads, so their throughput is
+ *   per thread-second);
+ * - every writer on its own, with rows of random visibilities.
+ * Every benchmark prints one line with its time and throughput, which can be compared
+ * between commits when the same parameters and thread count are used.
+ *
+ * Usage: cotter_bench [options]; run with -help for the options.
+ */
+
+namespace {
+
+struct Options
+{
+	SyntheticObservation::Parameters observation;
+	size_t threadCount;
+	std::string directory, formats;
+	bool keep, generateOnly, verbose, countPerfEvents;
+	bool runReader, runEndToEnd, runWriters;
+};
+
+/** Discards everything, to silence Cotter during the end-to-end runs. */
+class NullBuffer : public std::streambuf
+{
+	protected:
+		virtual int overflow(int c) final override { return c; }
+};
+
+/** Writer that discards its rows, to measure the writers that forward to another writer. */
+class NullWriter : public Writer
+{
+	public:
+		virtual void SetPolarizationCount(size_t polarizationCount) final override { }
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override { }
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override { }
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override { }
+		virtual void WriteSource(const SourceInfo& source) final override { }
+		virtual void WriteField(const FieldInfo& field) final override { }
+		virtual void WriteObservation(const ObservationInfo& observation) final override { }
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override { }
+		virtual void AddRows(size_t count) final override { }
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float* weights) final override { }
+};
+
+class NullSink : public VisibilitySink
+{
+};
+
+class ZeroUVW : public UVWCalculater
+{
+	public:
+		virtual void CalculateUVW(double date, size_t antenna1, size_t antenna2, double& u, double& v, double& w) final override
+		{
+			u = 0.0; v = 0.0; w = 0.0;
+		}
+};
+
+void usage()
+{
+	std::cout <<
+		"Usage: cotter_bench [options]\n"
+		"Writes a synthetic observation and benchmarks Cotter on it.\n"
+		"Options:\n"
+		"  -tiles <n>         Number of unflagged tiles, at most 128 (default: 128)\n"
+		"  -channels <n>      Fine channels per coarse channel (default: 8)\n"
+		"  -scans <n>         Number of scans (default: 8)\n"
+		"  -inttime <s>       Integration time in seconds (default: 2)\n"
+		"  -noise <sigma>     Standard deviation of the noise (default: 1)\n"
+		"  -rfi <p> <a>       Chance that a channel of a scan has RFI, and its amplitude in units\n"
+		"                     of the noise (default: 0.01 50)\n"
+		"  -seed <n>          Seed of the random generators (default: 1)\n"
+		"  -j <n>             Number of threads (default: number of cores)\n"
+		"  -dir <path>        Directory for the synthetic files and outputs (default: a new directory\n"
+		"                     in /tmp, which is removed afterwards)\n"
+		"  -keep              Do not remove the files afterwards\n"
+		"  -generate          Only write the synthetic observation, and print the command line to run\n"
+		"                     cotter on it\n"
+		"  -formats <list>    Output formats of the end-to-end runs, comma separated from ms, uvfits,\n"
+		"                     cvis and mwaf (default: ms)\n"
+		"  -noreader, -noe2e, -nowriters\n"
+		"                     Skip the reader, end-to-end or writer benchmarks\n"
+		"  -verbose           Show the output of Cotter in the end-to-end runs\n"
+		"  -perf              Count the hardware events of the stages, and print them per stage and\n"
+		"                     thread at the end, summed over all benchmarks\n";
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const std::string& name, double seconds, double amount, const std::string& unit)
+{
+	std::cout << "  " << std::left << std::setw(34) << name << std::right
+		<< std::fixed << std::setprecision(3) << std::setw(10) << seconds << " s"
+		<< std::setprecision(2) << std::setw(12) << (seconds > 0.0 ? amount / seconds : 0.0) << ' ' << unit << "/s\n";
+}
+
+int removeFile(const char* path, const struct stat*, int, struct FTW*)
+{
+	return std::remove(path);
+}
+
+void removeDirectory(const std::string& directory)
+{
+	if(nftw(directory.c_str(), removeFile, 16, FTW_DEPTH | FTW_PHYS) != 0)
+		std::cerr << "Could not remove " << directory << '\n';
+}
+
+void benchmarkReader(const SyntheticObservation& observation, const std::vector<std::string>& files, ThreadPool& threadPool)
+{
+	const size_t
+		antennaCount = SyntheticObservation::TileCount,
+		channelCount = observation.ChannelCount(),
+		scanCount = observation.GetParameters().scanCount,
+		planeSize = channelCount * scanCount;
+	GPUFileReader reader(antennaCount, channelCount, threadPool, 4, false);
+	for(const std::string& file : files)
+		reader.AddFile(file.c_str());
+	reader.Initialize(observation.GetParameters().integrationTime, true);
+	reader.SetHDUOffsetsChangeCallback([](const std::vector<int>&) { });
+	for(size_t input=0; input!=antennaCount*2; ++input)
+		reader.SetCorrInputToOutput(input, input/2, input%2);
+
+	std::vector<float> storage(observation.BaselineCount() * 8 * planeSize);
+	size_t baselineIndex = 0;
+	for(size_t antenna1=0; antenna1!=antennaCount; ++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+		{
+			BaselineBuffer buffer;
+			for(size_t p=0; p!=4; ++p)
+			{
+				buffer.real[p] = &storage[(baselineIndex*8 + p*2) * planeSize];
+				buffer.imag[p] = &storage[(baselineIndex*8 + p*2 + 1) * planeSize];
+			}
+			buffer.nElementsPerRow = scanCount;
+			reader.SetDestBaselineBuffer(antenna1, antenna2, buffer);
+			++baselineIndex;
+		}
+	}
+
+	const Tracer::StageTotal
+		hduReadBefore = Tracer::Total(Tracer::HDUReadStage),
+		shuffleBefore = Tracer::Total(Tracer::ShuffleStage);
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t bufferPos = 0;
+	reader.Read(bufferPos, scanCount);
+	const double seconds = secondsSince(start);
+	if(bufferPos != scanCount)
+		throw std::runtime_error("The reader did not read all scans of the synthetic observation");
+
+	const double visibilityCount = double(observation.BaselineCount()) * 4 * planeSize;
+	report("reader", seconds, visibilityCount * 1e-6, "Mvis");
+	if(Tracer::IsCompiledIn())
+	{
+		report("reader: HDU read (per thread)", Tracer::Total(Tracer::HDUReadStage).seconds - hduReadBefore.seconds, observation.DataBytes() / (1024.0*1024.0), "MB");
+		report("reader: shuffle (per thread)", Tracer::Total(Tracer::ShuffleStage).seconds - shuffleBefore.seconds, visibilityCount * 1e-6, "Mvis");
+	}
+}
+
+void benchmarkEndToEnd(const SyntheticObservation& observation, const std::string& metaFilename, const std::vector<std::string>& files, const std::string& format, const Options& options)
+{
+	Cotter cotter;
+	std::string outputFilename = options.directory + "/output";
+	if(format == "ms")
+	{
+		outputFilename += ".ms";
+		cotter.SetOutputFormat(Cotter::MSOutputFormat);
+	}
+	else if(format == "uvfits")
+	{
+		outputFilename += ".uvfits";
+		cotter.SetCollectStatistics(false);
+		cotter.SetFlagAutoCorrelations(false);
+		cotter.SetOutputFormat(Cotter::FitsOutputFormat);
+	}
+	else if(format == "cvis")
+	{
+		outputFilename += ".cvis";
+		cotter.SetCollectStatistics(false);
+		cotter.SetOutputFormat(Cotter::ColumnarOutputFormat);
+	}
+	else if(format == "mwaf")
+	{
+		outputFilename += "%%.mwaf";
+		cotter.SetCollectStatistics(false);
+		cotter.SetOutputFormat(Cotter::FlagsOutputFormat);
+		cotter.SetRemoveFlaggedAntennae(false);
+	}
+	else
+		throw std::runtime_error("Unknown output format for the end-to-end benchmark: " + format);
+	cotter.SetOutputFilename(outputFilename);
+	cotter.SetMetaFilename(metaFilename.c_str());
+	cotter.SetFileSets(std::vector<std::vector<std::string>>(1, files));
+	cotter.SetThreadCount(options.threadCount);
+	const long pageCount = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGE_SIZE);
+	cotter.SetMemoryLimit(size_t(pageCount) * size_t(pageSize) / 2);
+
+	const Tracer::Stage stages[] = {
+		Tracer::ChunkStage, Tracer::ShuffleStage, Tracer::CorrectionStage, Tracer::FlaggingStage,
+		Tracer::StatisticsStage, Tracer::RowBuildStage, Tracer::StoragePutStage
+	};
+	Tracer::StageTotal before[Tracer::StageCount];
+	for(Tracer::Stage stage : stages)
+		before[stage] = Tracer::Total(stage);
+
+	const SyntheticObservation::Parameters& parameters = observation.GetParameters();
+	const double channelWidthKHz = 1280.0 / parameters.channelsPerSubband;
+	NullBuffer nullBuffer;
+	std::streambuf* coutBuffer = std::cout.rdbuf();
+	if(!options.verbose)
+		std::cout.rdbuf(&nullBuffer);
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	try {
+		cotter.Run(parameters.integrationTime, channelWidthKHz);
+	} catch(...) {
+		std::cout.rdbuf(coutBuffer);
+		throw;
+	}
+	const double seconds = secondsSince(start);
+	std::cout.rdbuf(coutBuffer);
+
+	const double visibilityCount = double(observation.BaselineCount()) * 4 * observation.ChannelCount() * parameters.scanCount;
+	report("cotter -> " + format, seconds, visibilityCount * 1e-6, "Mvis");
+	if(Tracer::IsCompiledIn())
+	{
+		Tracer::StageTotal delta[Tracer::StageCount];
+		for(Tracer::Stage stage : stages)
+		{
+			const Tracer::StageTotal after = Tracer::Total(stage);
+			delta[stage].spanCount = after.spanCount - before[stage].spanCount;
+			delta[stage].seconds = after.seconds - before[stage].seconds;
+		}
+		// Every chunk processes all baselines for the scans of that chunk
+		const size_t chunkCount = std::max<uint64_t>(delta[Tracer::ChunkStage].spanCount, 1);
+		const Tracer::Stage baselineStages[] = { Tracer::CorrectionStage, Tracer::FlaggingStage, Tracer::StatisticsStage };
+		report("  shuffle (per thread)", delta[Tracer::ShuffleStage].seconds, visibilityCount * 1e-6, "Mvis");
+		for(Tracer::Stage stage : baselineStages)
+		{
+			if(delta[stage].spanCount != 0)
+			{
+				const double stageVisibilities = double(delta[stage].spanCount) / chunkCount * 4 * observation.ChannelCount() * parameters.scanCount;
+				report(std::string("  ") + Tracer::StageName(stage) + " (per thread)", delta[stage].seconds, stageVisibilities * 1e-6, "Mvis");
+			}
+		}
+		if(delta[Tracer::RowBuildStage].spanCount != 0)
+			report("  row build", delta[Tracer::RowBuildStage].seconds, delta[Tracer::RowBuildStage].spanCount, "timesteps");
+		if(delta[Tracer::StoragePutStage].spanCount != 0)
+			report("  storage put (per thread)", delta[Tracer::StoragePutStage].seconds, delta[Tracer::StoragePutStage].spanCount, "puts");
+	}
+}
+
+void initializeWriter(Writer& writer, size_t antennaCount, size_t channelCount, double startTime, double endTime)
+{
+	writer.SetPolarizationCount(4);
+	std::vector<Writer::AntennaInfo> antennae(antennaCount);
+	for(size_t i=0; i!=antennaCount; ++i)
+	{
+		Writer::AntennaInfo& antenna = antennae[i];
+		std::ostringstream name;
+		name << "Tile" << std::setw(3) << std::setfill('0') << (i+1);
+		antenna.name = name.str();
+		antenna.station = "MWA";
+		antenna.type = "GROUND-BASED";
+		antenna.mount = "ALT-AZ";
+		antenna.x = double(i);
+		antenna.y = 0.0;
+		antenna.z = 0.0;
+		antenna.diameter = 4;
+		antenna.flag = false;
+	}
+	writer.WriteAntennae(antennae, startTime);
+
+	const double channelWidth = 30720000.0 / channelCount;
+	std::vector<Writer::ChannelInfo> channels(channelCount);
+	for(size_t ch=0; ch!=channelCount; ++ch)
+	{
+		channels[ch].chanFreq = 138880000.0 + ch * channelWidth;
+		channels[ch].chanWidth = channelWidth;
+		channels[ch].effectiveBW = channelWidth;
+		channels[ch].resolution = channelWidth;
+	}
+	writer.WriteBandInfo("MWA_BAND_154.2", channels, channels[channelCount/2].chanFreq, channelCount * channelWidth, false);
+
+	Writer::SourceInfo source;
+	source.sourceId = 0;
+	source.time = (startTime + endTime) * 0.5;
+	source.interval = endTime - startTime;
+	source.spectralWindowId = 0;
+	source.numLines = 0;
+	source.name = "synthetic";
+	source.calibrationGroup = 0;
+	source.directionRA = 0.0;
+	source.directionDec = -27.0 * (M_PI/180.0);
+	source.properMotion[0] = 0.0;
+	source.properMotion[1] = 0.0;
+	writer.WriteSource(source);
+
+	Writer::FieldInfo field;
+	field.name = "synthetic";
+	field.time = startTime;
+	field.numPoly = 0;
+	field.delayDirRA = source.directionRA;
+	field.delayDirDec = source.directionDec;
+	field.phaseDirRA = field.delayDirRA;
+	field.phaseDirDec = field.delayDirDec;
+	field.referenceDirRA = field.delayDirRA;
+	field.referenceDirDec = field.delayDirDec;
+	field.sourceId = -1;
+	field.flagRow = false;
+	writer.WriteField(field);
+
+	writer.WritePolarizationForLinearPols(false);
+
+	Writer::ObservationInfo observation;
+	observation.telescopeName = "MWA";
+	observation.startTime = startTime;
+	observation.endTime = endTime;
+	observation.observer = "cotter_bench";
+	observation.scheduleType = "MWA";
+	observation.project = "C001";
+	observation.releaseDate = 0;
+	observation.flagRow = false;
+	writer.WriteObservation(observation);
+}
+
+/**
+ * Writes all timesteps of the observation as rows of random visibilities, and reports
+ * the throughput including the destruction, in which most writers flush.
+ */
+void benchmarkWriter(const std::string& name, std::unique_ptr<Writer> writer, const SyntheticObservation& observation)
+{
+	const size_t
+		antennaCount = SyntheticObservation::TileCount,
+		channelCount = observation.ChannelCount(),
+		scanCount = observation.GetParameters().scanCount,
+		valueCount = channelCount * 4;
+	const double
+		integrationTime = observation.GetParameters().integrationTime,
+		startTime = 56580.5753 * 86400.0;
+
+	std::mt19937 rng(observation.GetParameters().seed);
+	std::normal_distribution<float> noise(0.0, observation.GetParameters().noiseSigma);
+	// A few different rows, so that the writers don't see a single repeated pattern
+	const size_t patternCount = 16;
+	std::vector<std::complex<float>> data(valueCount * patternCount);
+	for(std::complex<float>& value : data)
+		value = std::complex<float>(noise(rng), noise(rng));
+	std::unique_ptr<bool[]> flags(new bool[valueCount * patternCount]);
+	for(size_t i=0; i!=valueCount * patternCount; ++i)
+		flags[i] = (i % 97 == 0);
+	std::vector<float> weights(valueCount, 1.0);
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	initializeWriter(*writer, antennaCount, channelCount, startTime, startTime + scanCount * integrationTime);
+	size_t rowIndex = 0;
+	for(size_t scan=0; scan!=scanCount; ++scan)
+	{
+		const double time = startTime + (scan + 0.5) * integrationTime;
+		writer->AddRows(observation.BaselineCount());
+		for(size_t antenna1=0; antenna1!=antennaCount; ++antenna1)
+		{
+			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+			{
+				const size_t pattern = rowIndex % patternCount;
+				writer->WriteRow(time, time, antenna1, antenna2, double(antenna2) - double(antenna1), 0.0, 0.0, integrationTime,
+					&data[pattern * valueCount], &flags[pattern * valueCount], weights.data());
+				++rowIndex;
+			}
+		}
+	}
+	writer.reset();
+	const double seconds = secondsSince(start);
+	report("writer: " + name, seconds, double(rowIndex) * valueCount * 1e-6, "Mvis");
+}
+
+void benchmarkWriters(const SyntheticObservation& observation, const Options& options, ThreadPool& threadPool)
+{
+	const std::string prefix = options.directory + "/writer";
+	const size_t rowCount = observation.BaselineCount() * observation.GetParameters().scanCount;
+	std::vector<size_t> subbandOrder(SyntheticObservation::SubbandCount);
+	for(size_t sb=0; sb!=subbandOrder.size(); ++sb)
+		subbandOrder[sb] = sb;
+	ZeroUVW uvwCalculater;
+	NullSink sink;
+
+	benchmarkWriter("ms", std::unique_ptr<Writer>(new MSWriter(prefix + ".ms")), observation);
+	benchmarkWriter("uvfits", std::unique_ptr<Writer>(new FitsWriter(prefix + ".uvfits")), observation);
+	benchmarkWriter("cvis", std::unique_ptr<Writer>(new ColumnarWriter(prefix + ".cvis", threadPool, rowCount)), observation);
+	benchmarkWriter("mwaf", std::unique_ptr<Writer>(new FlagWriter(prefix + "%%.mwaf", 1065880128, observation.GetParameters().scanCount,
+		0, SyntheticObservation::SubbandCount, subbandOrder, threadPool)), observation);
+	benchmarkWriter("sink", std::unique_ptr<Writer>(new SinkWriter(sink)), observation);
+	benchmarkWriter("threaded (null)", std::unique_ptr<Writer>(new ThreadedWriter(std::unique_ptr<Writer>(new NullWriter()), threadPool)), observation);
+	benchmarkWriter("averaging 2x2 (null)", std::unique_ptr<Writer>(new AveragingWriter(std::unique_ptr<Writer>(new NullWriter()), 2, 2, uvwCalculater)), observation);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	options.threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	options.formats = "ms";
+	options.keep = false;
+	options.generateOnly = false;
+	options.verbose = false;
+	options.countPerfEvents = false;
+	options.runReader = true;
+	options.runEndToEnd = true;
+	options.runWriters = true;
+
+	int argi = 1;
+	while(argi != argc)
+	{
+		const std::string param = argv[argi];
+		const bool hasValue = argi+1 != argc;
+		if(param == "-tiles" && hasValue)
+			options.observation.activeTileCount = std::atol(argv[++argi]);
+		else if(param == "-channels" && hasValue)
+			options.observation.channelsPerSubband = std::atol(argv[++argi]);
+		else if(param == "-scans" && hasValue)
+			options.observation.scanCount = std::atol(argv[++argi]);
+		else if(param == "-inttime" && hasValue)
+			options.observation.integrationTime = std::atof(argv[++argi]);
+		else if(param == "-noise" && hasValue)
+			options.observation.noiseSigma = std::atof(argv[++argi]);
+		else if(param == "-rfi" && argi+2 < argc)
+		{
+			options.observation.rfiProbability = std::atof(argv[++argi]);
+			options.observation.rfiStrength = std::atof(argv[++argi]);
+		}
+		else if(param == "-seed" && hasValue)
+			options.observation.seed = std::atol(argv[++argi]);
+		else if(param == "-j" && hasValue)
+			options.threadCount = std::atol(argv[++argi]);
+		else if(param == "-dir" && hasValue)
+			options.directory = argv[++argi];
+		else if(param == "-keep")
+			options.keep = true;
+		else if(param == "-generate")
+			options.generateOnly = true;
+		else if(param == "-formats" && hasValue)
+			options.formats = argv[++argi];
+		else if(param == "-noreader")
+			options.runReader = false;
+		else if(param == "-noe2e")
+			options.runEndToEnd = false;
+		else if(param == "-nowriters")
+			options.runWriters = false;
+		else if(param == "-verbose")
+			options.verbose = true;
+		else if(param == "-perf")
+			options.countPerfEvents = true;
+		else {
+			usage();
+			return param == "-help" ? 0 : 1;
+		}
+		++argi;
+	}
+
+	bool isTemporaryDirectory = false;
+	if(options.directory.empty())
+	{
+		char directoryTemplate[] = "/tmp/cotter_bench_XXXXXX";
+		if(mkdtemp(directoryTemplate) == nullptr)
+		{
+			std::cerr << "Could not create a temporary directory\n";
+			return 1;
+		}
+		options.directory = directoryTemplate;
+		isTemporaryDirectory = !options.keep && !options.generateOnly;
+	}
+
+	SyntheticObservation observation(options.observation);
+	const SyntheticObservation::Parameters& parameters = observation.GetParameters();
+	std::cout << "Synthetic observation: " << parameters.activeTileCount << " of " << SyntheticObservation::TileCount << " tiles, "
+		<< observation.ChannelCount() << " channels, " << parameters.scanCount << " scans of " << parameters.integrationTime << " s, "
+		<< std::fixed << std::setprecision(1) << (observation.DataBytes() / (1024.0*1024.0)) << " MB in " << options.directory << ".\n"
+		<< "Using " << options.threadCount << " threads" << (Tracer::IsCompiledIn() ? "" : "; tracing is not compiled in, so the stages are not measured") << ".\n";
+
+	const std::string metaFilename = options.directory + "/synthetic.metafits";
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	observation.WriteMetaFits(metaFilename);
+	const std::vector<std::string> files = observation.WriteGPUBoxFiles(options.directory + "/synthetic");
+	report("generate", secondsSince(start), observation.DataBytes() / (1024.0*1024.0), "MB");
+
+	if(options.generateOnly)
+	{
+		std::cout << "To run cotter on the synthetic observation:\n  cotter -m " << metaFilename << " -o " << options.directory << "/synthetic.ms";
+		for(const std::string& file : files)
+			std::cout << ' ' << file;
+		std::cout << '\n';
+		return 0;
+	}
+
+	if(Tracer::IsCompiledIn())
+	{
+		if(options.countPerfEvents)
+			Tracer::EnableCounters();
+		Tracer::Enable(65536);
+		Tracer::SetThreadName("main");
+	}
+
+	{
+		ThreadPool threadPool(options.threadCount, options.threadCount * 4);
+		if(options.runReader)
+			benchmarkReader(observation, files, threadPool);
+		if(options.runWriters)
+			benchmarkWriters(observation, options, threadPool);
+	}
+
+	if(options.runEndToEnd)
+	{
+		std::istringstream formatStream(options.formats);
+		std::string format;
+		while(std::getline(formatStream, format, ','))
+			benchmarkEndToEnd(observation, metaFilename, files, format, options);
+	}
+
+	if(options.countPerfEvents && Tracer::IsCompiledIn())
+		Tracer::WriteSummary(std::cout);
+
+	if(isTemporaryDirectory)
+		removeDirectory(options.directory);
+	else
+		std::cout << "The files are kept in " << options.directory << ".\n";
+	return 0;
+}
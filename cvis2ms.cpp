@@ -0,0 +1,120 @@
+#include "columnarformat.h"
+#include "mswriter.h"
+#include "version.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <complex>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+int main(int argc, char* argv[])
+{
+	int argi = 1;
+	bool useDysco = false;
+	if(argi < argc && std::string(argv[argi]) == "-use-dysco")
+	{
+		useDysco = true;
+		++argi;
+	}
+	if(argc - argi != 2)
+	{
+		std::cout <<
+			"cvis2ms converts a columnar visibility file (.cvis) written by Cotter into a measurement set.\n"
+			"Use fixmwams afterwards to add the MWA-specific keywords and tables.\n\n"
+			"Syntax: cvis2ms [-use-dysco] <input.cvis> <output.ms>\n";
+		return -1;
+	}
+	const char* inputFilename = argv[argi];
+	const char* outputFilename = argv[argi+1];
+
+	int fd = open(inputFilename, O_RDONLY);
+	struct stat fileStat;
+	if(fd < 0 || fstat(fd, &fileStat) != 0)
+		throw std::runtime_error(std::string("Could not open ") + inputFilename);
+	const size_t fileSize = fileStat.st_size;
+	if(fileSize < sizeof(ColumnarFormat::Header))
+		throw std::runtime_error("File is too small to be a columnar file");
+	void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED)
+		throw std::runtime_error("Could not map the columnar file into memory");
+	madvise(mapping, fileSize, MADV_SEQUENTIAL);
+	const char* file = static_cast<const char*>(mapping);
+
+	ColumnarFormat::Header header;
+	std::memcpy(&header, file, sizeof(header));
+	if(std::memcmp(header.fileIdentifier, ColumnarFormat::FileIdentifier(), 4) != 0)
+		throw std::runtime_error("Input is not a columnar visibility file");
+	if(header.versionMajor != ColumnarFormat::VersionMajor)
+		throw std::runtime_error("Unsupported version of the columnar format");
+	if(header.metadataOffset + header.metadataSize > fileSize || ColumnarFormat::ColumnsEnd(header) > fileSize)
+		throw std::runtime_error("Columnar file is truncated");
+	const ColumnarFormat::Metadata metadata = ColumnarFormat::Metadata::FromText(std::string(file + header.metadataOffset, header.metadataSize));
+	if(metadata.channels.size() != header.channelCount || (header.polarizationCount != 4 && header.polarizationCount != 2))
+		throw std::runtime_error("Columnar file has an inconsistent number of channels or polarizations");
+
+	std::cout << "Converting " << header.rowCount << " rows with " << header.channelCount << " channels (file written by Cotter " << std::string(header.cotterVersion, strnlen(header.cotterVersion, sizeof(header.cotterVersion))) << ")...\n";
+
+	MSWriter writer(outputFilename);
+	if(useDysco)
+		writer.EnableCompression(8, 12, "TruncatedGaussian", 2.5, "AF");
+	// Same order as Cotter
+	writer.SetPolarizationCount(header.polarizationCount);
+	if(metadata.hasArrayLocation)
+		writer.SetArrayLocation(metadata.arrayX, metadata.arrayY, metadata.arrayZ);
+	writer.WriteAntennae(metadata.antennae, metadata.antennaTime);
+	writer.WriteBandInfo(metadata.bandName, metadata.channels, metadata.refFreq, metadata.totalBandwidth, metadata.bandFlagRow);
+	for(const Writer::SourceInfo& source : metadata.sources)
+		writer.WriteSource(source);
+	for(const Writer::FieldInfo& field : metadata.fields)
+		writer.WriteField(field);
+	writer.WritePolarizationForLinearPols(metadata.polarizationFlagRow);
+	for(const Writer::ObservationInfo& observation : metadata.observations)
+		writer.WriteObservation(observation);
+	for(const ColumnarFormat::Metadata::HistoryItem& item : metadata.history)
+		writer.WriteHistoryItem(item.commandLine, item.application, item.params);
+
+	const double* times = reinterpret_cast<const double*>(file + header.columnOffsets[ColumnarFormat::Time]);
+	const double* timeCentroids = reinterpret_cast<const double*>(file + header.columnOffsets[ColumnarFormat::TimeCentroid]);
+	const double* intervals = reinterpret_cast<const double*>(file + header.columnOffsets[ColumnarFormat::Interval]);
+	const uint32_t* antennas = reinterpret_cast<const uint32_t*>(file + header.columnOffsets[ColumnarFormat::Antennas]);
+	const double* uvws = reinterpret_cast<const double*>(file + header.columnOffsets[ColumnarFormat::UVW]);
+	const std::complex<float>* data = reinterpret_cast<const std::complex<float>*>(file + header.columnOffsets[ColumnarFormat::Data]);
+	const unsigned char* packedFlags = reinterpret_cast<const unsigned char*>(file + header.columnOffsets[ColumnarFormat::Flags]);
+	const float* weights = reinterpret_cast<const float*>(file + header.columnOffsets[ColumnarFormat::Weights]);
+	const size_t
+		valueCount = header.channelCount * header.polarizationCount,
+		flagRowSize = ColumnarFormat::RowSize(ColumnarFormat::Flags, header.channelCount, header.polarizationCount);
+	std::unique_ptr<bool[]> flags(new bool[valueCount]);
+
+	// Rows are added per timestep, as Cotter does
+	size_t row = 0;
+	while(row != header.rowCount)
+	{
+		size_t timestepEnd = row + 1;
+		while(timestepEnd != header.rowCount && times[timestepEnd] == times[row])
+			++timestepEnd;
+		writer.AddRows(timestepEnd - row);
+		for(; row != timestepEnd; ++row)
+		{
+			const unsigned char* packed = packedFlags + row * flagRowSize;
+			for(size_t i=0; i!=valueCount; ++i)
+				flags[i] = (packed[i / 8] & (0x80 >> (i % 8))) != 0;
+			writer.WriteRow(times[row], timeCentroids[row], antennas[row*2], antennas[row*2+1],
+				uvws[row*3], uvws[row*3+1], uvws[row*3+2], intervals[row],
+				data + row * valueCount, flags.get(), weights + row * valueCount);
+		}
+	}
+
+	munmap(mapping, fileSize);
+	std::cout << "Done.\n";
+	return 0;
+}
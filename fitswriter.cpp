@@ -6,7 +6,7 @@
 
 #define VLIGHT 299792458.0  // speed of light in m/s
 
-FitsWriter::FitsWriter(const std::string& filename) : _nRowsWritten(0), _groupHeadersInitialized(false)
+FitsWriter::FitsWriter(const std::string& filename) : _nRowsWritten(0), _polarizationCount(4), _groupHeadersInitialized(false)
 {
 	/** If the file already exists, remove it */
 	FILE *fp = std::fopen(filename.c_str(), "r");
@@ -51,7 +51,7 @@ void FitsWriter::initGroupHeader()
 	long naxes[NAXIS];
   naxes[0] = 0;
   naxes[1] = 3;  // real, imaginary, weight
-  naxes[2] = 4;  // polarization count
+  naxes[2] = _polarizationCount;
   naxes[3] = _bandInfo.channels.size();
   naxes[4] = 1;
   naxes[5] = 1;
@@ -100,7 +100,7 @@ void FitsWriter::initGroupHeader()
 	
   setKeywordToString("CTYPE3", "STOKES");
 	setKeywordToFloat("CRVAL3", -5); // Pol type = -5 : linear polarizations
-	setKeywordToFloat("CDELT3", -1); // Required for linear pols
+	setKeywordToFloat("CDELT3", -1); // Required for linear pols: XX, YY, XY, YX
   setKeywordToFloat("CRPIX3", 1.0);
 	
 	setKeywordToString("CTYPE4", "FREQ");
@@ -197,8 +197,8 @@ void FitsWriter::WriteRow(double time, double timeCentroid, size_t antenna1, siz
 {
 	const size_t nGroupParameters = 5;
 	
-	// 3 dimensions (real,imag,weight), 4 pol, nch
-	const size_t nElements = 3 * 4 * _bandInfo.channels.size();
+	// 3 dimensions (real,imag,weight), 4 or 2 pol, nch
+	const size_t nElements = 3 * _polarizationCount * _bandInfo.channels.size();
 	
 	// TODO might be efficient to declare this outside function
 	std::vector<float> rowData(nElements + nGroupParameters); 
@@ -214,44 +214,24 @@ void FitsWriter::WriteRow(double time, double timeCentroid, size_t antenna1, siz
 	const float *weightPtr = weights;
 	const bool *flagPtr = flags;
 	const std::complex<float> *dataPtr = data;
+	// uvfits orders the linear polarizations as XX, YY, XY, YX
+	const size_t nPol = _polarizationCount;
+	const size_t order[4] = { 0, nPol-1, 1, 2 };
 	for(size_t ch=0; ch != _bandInfo.channels.size(); ++ch)
 	{
-		const std::complex<float> xx = *dataPtr; ++dataPtr;
-		const std::complex<float> xy = *dataPtr; ++dataPtr;
-		const std::complex<float> yx = *dataPtr; ++dataPtr;
-		const std::complex<float> yy = *dataPtr; ++dataPtr;
-		const float weightXX = (*flagPtr) ? -(*weightPtr) : (*weightPtr); ++ weightPtr; ++flagPtr;
-		const float weightXY = (*flagPtr) ? -(*weightPtr) : (*weightPtr); ++ weightPtr; ++flagPtr;
-		const float weightYX = (*flagPtr) ? -(*weightPtr) : (*weightPtr); ++ weightPtr; ++flagPtr;
-		const float weightYY = (*flagPtr) ? -(*weightPtr) : (*weightPtr); ++ weightPtr; ++flagPtr;
-		
-		*rowDataPtr = xx.real();
-		++rowDataPtr;
-		*rowDataPtr = xx.imag();
-		++rowDataPtr;
-		*rowDataPtr = weightXX;
-		++rowDataPtr;
-		
-		*rowDataPtr = yy.real();
-		++rowDataPtr;
-		*rowDataPtr = yy.imag();
-		++rowDataPtr;
-		*rowDataPtr = weightYY;
-		++rowDataPtr;
-		
-		*rowDataPtr = xy.real();
-		++rowDataPtr;
-		*rowDataPtr = xy.imag();
-		++rowDataPtr;
-		*rowDataPtr = weightXY;
-		++rowDataPtr;
-		
-		*rowDataPtr = yx.real();
-		++rowDataPtr;
-		*rowDataPtr = yx.imag();
-		++rowDataPtr;
-		*rowDataPtr = weightYX;
-		++rowDataPtr;
+		for(size_t i=0; i!=nPol; ++i)
+		{
+			const size_t p = order[i];
+			*rowDataPtr = dataPtr[p].real();
+			++rowDataPtr;
+			*rowDataPtr = dataPtr[p].imag();
+			++rowDataPtr;
+			*rowDataPtr = flagPtr[p] ? -weightPtr[p] : weightPtr[p];
+			++rowDataPtr;
+		}
+		dataPtr += nPol;
+		weightPtr += nPol;
+		flagPtr += nPol;
 	}
 	
 	int status = 0;
@@ -7,6 +7,7 @@
 #include <fitsio.h>
 
 #include <complex>
+#include <stdexcept>
 #include <vector>
 #include <string>
 
@@ -30,6 +31,13 @@ class FitsWriter : public Writer, private FitsUser
 			_arrayZ = z;
 		}
 		
+		virtual void SetPolarizationCount(size_t polarizationCount) final override
+		{
+			if(polarizationCount != 4 && polarizationCount != 2)
+				throw std::runtime_error("A uvfits file can only be written with four (XX, XY, YX, YY) or two (XX, YY) polarizations");
+			_polarizationCount = polarizationCount;
+		}
+		
 		virtual void AddRows(size_t count) final override;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		virtual bool AreAntennaPositionsLocal() const final override { return true; }
@@ -95,7 +103,7 @@ class FitsWriter : public Writer, private FitsUser
 		std::vector<AntennaInfo> _antennae;
 		double _antennaDate;
 		std::string _telescopeName;
-		size_t _nRowsWritten;
+		size_t _nRowsWritten, _polarizationCount;
 		bool _groupHeadersInitialized;
 		
 		struct {
@@ -0,0 +1,125 @@
+#include "flagfileformat.h"
+
+#include <cstring>
+#include <stdexcept>
+
+static_assert(sizeof(FlagFileFormat::Header) == 64, "The header of the flag file format should have no padding");
+
+namespace {
+	void appendUInt16(std::vector<unsigned char>& output, uint16_t value)
+	{
+		output.push_back(value & 0xFF);
+		output.push_back(value >> 8);
+	}
+
+	uint16_t readUInt16(const unsigned char* data)
+	{
+		return uint16_t(data[0]) | (uint16_t(data[1]) << 8);
+	}
+
+	void checkSize(const unsigned char* data, const unsigned char* end, size_t size)
+	{
+		if(size_t(end - data) < size)
+			throw std::runtime_error("Flag file is corrupt: a baseline extends beyond the end of its timestep");
+	}
+}
+
+void FlagFileFormat::EncodeBaseline(const unsigned char* flags, size_t channelCount, std::vector<unsigned char>& output)
+{
+	// Count the runs, starting with an unflagged run
+	size_t runCount = 1, flaggedCount = 0;
+	bool current = false;
+	for(size_t ch=0; ch!=channelCount; ++ch)
+	{
+		const bool flag = flags[ch] != 0;
+		if(flag != current)
+		{
+			++runCount;
+			current = flag;
+		}
+		if(flag)
+			++flaggedCount;
+	}
+
+	if(flaggedCount == 0)
+		output.push_back(AllUnflagged);
+	else if(flaggedCount == channelCount)
+		output.push_back(AllFlagged);
+	else {
+		const size_t
+			bitPackedSize = (channelCount + 7) / 8,
+			runLengthSize = 2 + 2 * runCount;
+		if(runLengthSize < bitPackedSize && channelCount <= 0xFFFF)
+		{
+			output.push_back(RunLength);
+			appendUInt16(output, runCount);
+			current = false;
+			size_t runLength = 0;
+			for(size_t ch=0; ch!=channelCount; ++ch)
+			{
+				const bool flag = flags[ch] != 0;
+				if(flag != current)
+				{
+					appendUInt16(output, runLength);
+					runLength = 0;
+					current = flag;
+				}
+				++runLength;
+			}
+			appendUInt16(output, runLength);
+		}
+		else {
+			output.push_back(BitPacked);
+			const size_t start = output.size();
+			output.resize(start + bitPackedSize, 0);
+			unsigned char* packed = &output[start];
+			for(size_t ch=0; ch!=channelCount; ++ch)
+			{
+				if(flags[ch] != 0)
+					packed[ch / 8] |= (unsigned char) (0x80 >> (ch % 8));
+			}
+		}
+	}
+}
+
+const unsigned char* FlagFileFormat::DecodeBaseline(const unsigned char* data, const unsigned char* end, size_t channelCount, bool* destination, size_t destinationStride)
+{
+	checkSize(data, end, 1);
+	const unsigned char encoding = *data;
+	++data;
+	switch(encoding)
+	{
+		case AllUnflagged:
+		case AllFlagged:
+			for(size_t ch=0; ch!=channelCount; ++ch)
+				destination[ch * destinationStride] = (encoding == AllFlagged);
+			return data;
+		case BitPacked:
+			checkSize(data, end, (channelCount + 7) / 8);
+			for(size_t ch=0; ch!=channelCount; ++ch)
+				destination[ch * destinationStride] = (data[ch / 8] & (0x80 >> (ch % 8))) != 0;
+			return data + (channelCount + 7) / 8;
+		case RunLength: {
+			checkSize(data, end, 2);
+			const size_t runCount = readUInt16(data);
+			data += 2;
+			checkSize(data, end, 2 * runCount);
+			size_t ch = 0;
+			bool flag = false;
+			for(size_t run=0; run!=runCount; ++run)
+			{
+				const size_t runEnd = ch + readUInt16(data + run * 2);
+				if(runEnd > channelCount)
+					throw std::runtime_error("Flag file is corrupt: run lengths exceed the number of channels");
+				for(; ch!=runEnd; ++ch)
+					destination[ch * destinationStride] = flag;
+				flag = !flag;
+			}
+			if(ch != channelCount)
+				throw std::runtime_error("Flag file is corrupt: run lengths do not cover all channels");
+			return data + 2 * runCount;
+		}
+		default:
+			throw std::runtime_error("Flag file is corrupt: unknown baseline encoding");
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef FLAG_FILE_FORMAT_H
+#define FLAG_FILE_FORMAT_H
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Version 2 of the mwaf flag file format. Version 1 is a FITS file with a bit-packed
+ * row per timestep and baseline, which can only be read through cfitsio. Version 2 is a
+ * plain binary file that can be memory mapped, in which the flags of every baseline are
+ * compressed, and that has an index to find the flags of a timestep directly.
+ *
+ * All numbers are stored little endian. A file consists of:
+ * - the Header;
+ * - for every stored timestep, a block with the encoded flags of all baselines, in the
+ *   order (0,0), (0,1), ... (1,1), (1,2), ...;
+ * - the index at Header::indexOffset: storedTimestepCount+1 uint64 file offsets of the
+ *   blocks, of which the last is the end of the last block.
+ * As in version 1, the first stored timestep is the timestep given by the HDU offset of
+ * the gpubox file.
+ *
+ * The flags of a baseline start with one Encoding byte, followed by:
+ * - AllUnflagged, AllFlagged: nothing;
+ * - BitPacked: (channelCount+7)/8 bytes with one bit per channel, most significant bit first;
+ * - RunLength: a uint16 run count, followed by that many uint16 run lengths. The runs
+ *   alternate between unflagged and flagged channels, starting with unflagged channels (the
+ *   first run may therefore have length zero).
+ * The writer picks the smallest encoding for each baseline.
+ */
+class FlagFileFormat
+{
+	public:
+		struct Header
+		{
+			char fileIdentifier[4];
+			uint16_t versionMinor, versionMajor;
+			uint32_t timestepCount, antennaCount, channelCount, polarizationCount, gpuBoxIndex;
+			uint32_t storedTimestepCount;
+			uint64_t gpsTime;
+			uint64_t indexOffset;
+			char cotterVersion[16];
+		};
+
+		enum Encoding : unsigned char { AllUnflagged = 0, AllFlagged = 1, BitPacked = 2, RunLength = 3 };
+
+		static const char* FileIdentifier() { return "MWAF"; }
+		static const uint16_t VersionMajor = 2, VersionMinor = 0;
+
+		/**
+		 * Append the encoded flags of one baseline to @p output.
+		 * @param flags One byte per channel that is zero when unflagged.
+		 */
+		static void EncodeBaseline(const unsigned char* flags, size_t channelCount, std::vector<unsigned char>& output);
+
+		/**
+		 * Decode the flags of one baseline. Flag ch is written to destination[ch*destinationStride].
+		 * @returns The start of the next baseline.
+		 */
+		static const unsigned char* DecodeBaseline(const unsigned char* data, const unsigned char* end, size_t channelCount, bool* destination, size_t destinationStride);
+};
+
+#endif
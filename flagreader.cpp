@@ -0,0 +1,286 @@
+#include "flagreader.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+
+namespace {
+	// Upper limit for the size of the packed rows that are read at once from a file
+	const size_t maxBatchBytesPerFile = size_t(16) << 20;
+
+	/**
+	 * Spread the 8 bits of a byte over 8 bytes, most significant bit first, such that
+	 * the bytes (in memory order on a little-endian machine) are 0 or 1.
+	 */
+	inline uint64_t spreadBits(unsigned char packed)
+	{
+		return ((uint64_t(packed) * 0x8040201008040201ULL) >> 7) & 0x0101010101010101ULL;
+	}
+}
+
+FlagReader::FlagReader(const std::string& templateName, const std::vector<int>& hduOffsetsPerGPUBox, const std::vector<size_t>& subbandToGPUBoxFileIndex, size_t sbStart, size_t sbEnd) :
+	_hduOffsets(hduOffsetsPerGPUBox),
+	_files(sbEnd - sbStart, nullptr),
+	_colNums(sbEnd - sbStart),
+	_mappedFiles(sbEnd - sbStart),
+	_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex),
+	_sbStart(sbStart),
+	_sbEnd(sbEnd),
+	_packBuffers(sbEnd - sbStart),
+	_isReentrant(fits_is_reentrant() != 0)
+{
+	size_t numberPos = templateName.find("%%");
+	if(numberPos == std::string::npos)
+		throw std::runtime_error("When reading flag files, the name of the flag file should be specified with two percent symbols (\"%%\"), e.g. \"Flagfile%%.mwaf\". These will be replaced by the gpubox number.");
+	std::string name(templateName);
+
+	for(size_t sb=_sbStart; sb!=_sbEnd; ++sb)
+	{
+		size_t fileIndex = sb - _sbStart;
+		size_t gpuBoxNumber = _subbandToGPUBoxFileIndex[sb] + 1;
+		name[numberPos] = (char) ('0' + (gpuBoxNumber/10));
+		name[numberPos+1] = (char) ('0' + (gpuBoxNumber%10));
+		
+		// Version 2 files start with an identifier, FITS files with "SIMPLE"
+		char identifier[4] = { 0, 0, 0, 0 };
+		FILE* file = std::fopen(name.c_str(), "rb");
+		if(file == 0)
+			throw std::runtime_error("Cannot open file " + name);
+		size_t identifierSize = std::fread(identifier, 1, 4, file);
+		std::fclose(file);
+		
+		int nChans, nAnt, nScans;
+		if(identifierSize == 4 && std::memcmp(identifier, FlagFileFormat::FileIdentifier(), 4) == 0)
+			mapFile(fileIndex, name, nChans, nAnt, nScans);
+		else
+			openFitsFile(fileIndex, name, nChans, nAnt, nScans);
+		if(sb==_sbStart)
+		{
+			_channelsPerGPUBox = nChans;
+			_antennaCount = nAnt;
+			_baselineCount = (nAnt * (nAnt+1)) / 2;
+			_scanCount = nScans;
+			_packedRowSize = (_channelsPerGPUBox + 7) / 8;
+		}
+		else {
+			if(nChans != int(_channelsPerGPUBox))
+				throw std::runtime_error("The flag files have an inconsistent number of frequency channels");
+			if(nAnt != int(_antennaCount))
+				throw std::runtime_error("The flag files have an inconsistent number of antennas");
+		}
+	}
+}
+
+FlagReader::~FlagReader()
+{
+	for(std::vector<fitsfile*>::iterator i=_files.begin(); i!=_files.end(); ++i)
+	{
+		if(*i != nullptr)
+		{
+			int status = 0;
+			fits_close_file(*i, &status);
+		}
+	}
+	for(const MappedFile& mappedFile : _mappedFiles)
+	{
+		if(mappedFile.data != nullptr)
+			munmap(const_cast<unsigned char*>(mappedFile.data), mappedFile.size);
+	}
+}
+
+void FlagReader::openFitsFile(size_t fileIndex, const std::string& filename, int& nChans, int& nAnt, int& nScans)
+{
+	int status = 0;
+	if(fits_open_file(&_files[fileIndex], filename.c_str(), READONLY, &status))
+		throwError(status, std::string("Cannot open file ") + filename);
+	
+	fits_read_key(_files[fileIndex], TINT, "NCHANS", &nChans, 0 /*comment*/, &status);
+	fits_read_key(_files[fileIndex], TINT, "NANTENNA", &nAnt, 0 /*comment*/, &status);
+	fits_read_key(_files[fileIndex], TINT, "NSCANS", &nScans, 0 /*comment*/, &status);
+	checkStatus(status);
+	
+	int hduType;
+	fits_movabs_hdu(_files[fileIndex], 2, &hduType, &status);
+	checkStatus(status);
+	fits_get_colnum(_files[fileIndex], CASESEN, const_cast<char*>("FLAGS"), &_colNums[fileIndex], &status);
+	checkStatus(status);
+}
+
+void FlagReader::mapFile(size_t fileIndex, const std::string& filename, int& nChans, int& nAnt, int& nScans)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Cannot open file " + filename);
+	struct stat fileStatus;
+	if(fstat(fd, &fileStatus) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("Cannot determine size of file " + filename);
+	}
+	MappedFile& mappedFile = _mappedFiles[fileIndex];
+	mappedFile.size = fileStatus.st_size;
+	void* data = mmap(nullptr, mappedFile.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		throw std::runtime_error("Cannot map file " + filename);
+	mappedFile.data = static_cast<const unsigned char*>(data);
+	// The blocks are mostly read sequentially
+	madvise(data, mappedFile.size, MADV_SEQUENTIAL);
+	
+	if(mappedFile.size < sizeof(FlagFileFormat::Header))
+		throw std::runtime_error("Flag file " + filename + " is too small");
+	mappedFile.header = reinterpret_cast<const FlagFileFormat::Header*>(mappedFile.data);
+	const FlagFileFormat::Header& header = *mappedFile.header;
+	if(header.versionMajor != FlagFileFormat::VersionMajor)
+		throw std::runtime_error("Flag file " + filename + " has an unsupported format version");
+	if(header.indexOffset == 0)
+		throw std::runtime_error("Flag file " + filename + " is incomplete: the writer did not finish");
+	if(header.indexOffset + (uint64_t(header.storedTimestepCount) + 1) * sizeof(uint64_t) > mappedFile.size)
+		throw std::runtime_error("Flag file " + filename + " is corrupt: the index is beyond the end of the file");
+	mappedFile.index = reinterpret_cast<const uint64_t*>(mappedFile.data + header.indexOffset);
+	nChans = header.channelCount;
+	nAnt = header.antennaCount;
+	nScans = header.timestepCount;
+}
+
+size_t FlagReader::timestepsPerBatch() const
+{
+	return std::max<size_t>(1, maxBatchBytesPerFile / (_baselineCount * _packedRowSize));
+}
+
+void FlagReader::ReadChunk(size_t timestepStart, size_t timestepEnd, const std::vector<bool*>& destinations, size_t destinationStride, ThreadPool::TaskGroup& tasks)
+{
+	if(destinations.size() != _baselineCount)
+		throw std::runtime_error("The number of baselines in the flag files does not match the observation");
+	const size_t batchSize = timestepsPerBatch();
+	// The tasks may outlive the caller's vector
+	std::shared_ptr<std::vector<bool*>> sharedDestinations(new std::vector<bool*>(destinations));
+	for(size_t fileIndex=0; fileIndex!=_mappedFiles.size(); ++fileIndex)
+	{
+		if(_mappedFiles[fileIndex].data != nullptr)
+		{
+			tasks.Run([this, fileIndex, timestepStart, timestepEnd, sharedDestinations, destinationStride]()
+			{
+				const size_t firstTimestep = firstStoredTimestep(fileIndex, timestepStart, timestepEnd);
+				decodeRange(fileIndex, firstTimestep, timestepEnd, timestepStart, *sharedDestinations, destinationStride);
+			});
+		}
+	}
+	if(_isReentrant)
+	{
+		for(size_t fileIndex=0; fileIndex!=_files.size(); ++fileIndex)
+		{
+			if(_files[fileIndex] == nullptr)
+				continue;
+			tasks.Run([this, fileIndex, timestepStart, timestepEnd, sharedDestinations, destinationStride, batchSize]()
+			{
+				size_t batchStart = firstStoredTimestep(fileIndex, timestepStart, timestepEnd);
+				while(batchStart != timestepEnd)
+				{
+					size_t batchEnd = std::min(batchStart + batchSize, timestepEnd);
+					readBatch(fileIndex, batchStart, batchEnd);
+					unpackBatch(fileIndex, batchStart, batchEnd, timestepStart, *sharedDestinations, destinationStride);
+					batchStart = batchEnd;
+				}
+			});
+		}
+	}
+	else {
+		// cfitsio may only be used by one thread at a time
+		for(size_t batchStart=timestepStart; batchStart!=timestepEnd; )
+		{
+			const size_t batchEnd = std::min(batchStart + batchSize, timestepEnd);
+			ThreadPool::TaskGroup unpackTasks(tasks.Pool());
+			for(size_t fileIndex=0; fileIndex!=_files.size(); ++fileIndex)
+			{
+				if(_files[fileIndex] == nullptr)
+					continue;
+				const size_t fileBatchStart = firstStoredTimestep(fileIndex, batchStart, batchEnd);
+				if(fileBatchStart != batchEnd)
+				{
+					readBatch(fileIndex, fileBatchStart, batchEnd);
+					unpackTasks.Run([this, fileIndex, fileBatchStart, batchEnd, timestepStart, &destinations, destinationStride]()
+					{
+						unpackBatch(fileIndex, fileBatchStart, batchEnd, timestepStart, destinations, destinationStride);
+					});
+				}
+			}
+			unpackTasks.Wait();
+			batchStart = batchEnd;
+		}
+	}
+}
+
+void FlagReader::readBatch(size_t fileIndex, size_t timestepStart, size_t timestepEnd)
+{
+	const int offset = _hduOffsets[_subbandToGPUBoxFileIndex[fileIndex + _sbStart]];
+	const size_t
+		firstRow = size_t((long long) timestepStart - offset) * _baselineCount + 1,
+		byteCount = (timestepEnd - timestepStart) * _baselineCount * _packedRowSize;
+	std::vector<unsigned char>& packBuffer = _packBuffers[fileIndex];
+	packBuffer.resize(byteCount);
+	// Reading bytes from an 'X' column gives 8 packed bits per byte, and continues over
+	// the rows, so that all rows of the batch are read at once.
+	int status = 0;
+	fits_read_col(_files[fileIndex], TBYTE, /*colnum*/ _colNums[fileIndex], /*firstrow*/ firstRow, /*firstelem*/ 1,
+		/*nelements*/ byteCount, /*(*)nulval*/ 0, &packBuffer[0], 0 /*(*)anynul*/, &status);
+	checkStatus(status);
+}
+
+void FlagReader::unpackBatch(size_t fileIndex, size_t timestepStart, size_t timestepEnd, size_t chunkStart, const std::vector<bool*>& destinations, size_t destinationStride) const
+{
+	const unsigned char* packBuffer = &_packBuffers[fileIndex][0];
+	const size_t
+		timestepCount = timestepEnd - timestepStart,
+		timestepSize = _baselineCount * _packedRowSize;
+	for(size_t baseline=0; baseline!=_baselineCount; ++baseline)
+	{
+		bool* baselineDestination = destinations[baseline] + fileIndex * _channelsPerGPUBox * destinationStride + (timestepStart - chunkStart);
+		const unsigned char* baselinePacked = packBuffer + baseline * _packedRowSize;
+		// Every packed byte holds 8 channels: these are written as 8 sequential streams
+		// over the timesteps of the batch.
+		for(size_t byteIndex=0; byteIndex!=_packedRowSize; ++byteIndex)
+		{
+			const size_t channelCount = std::min<size_t>(8, _channelsPerGPUBox - byteIndex*8);
+			bool* channelDestination = baselineDestination + byteIndex * 8 * destinationStride;
+			const unsigned char* packed = baselinePacked + byteIndex;
+			for(size_t t=0; t!=timestepCount; ++t)
+			{
+				uint64_t spread = spreadBits(*packed);
+				unsigned char flags[8];
+				std::memcpy(flags, &spread, 8);
+				for(size_t ch=0; ch!=channelCount; ++ch)
+					channelDestination[ch * destinationStride + t] = flags[ch] != 0;
+				packed += timestepSize;
+			}
+		}
+	}
+}
+
+void FlagReader::decodeRange(size_t fileIndex, size_t timestepStart, size_t timestepEnd, size_t chunkStart, const std::vector<bool*>& destinations, size_t destinationStride) const
+{
+	const MappedFile& mappedFile = _mappedFiles[fileIndex];
+	const int offset = _hduOffsets[_subbandToGPUBoxFileIndex[fileIndex + _sbStart]];
+	for(size_t timestep=timestepStart; timestep!=timestepEnd; ++timestep)
+	{
+		const size_t storedTimestep = (long long) timestep - offset;
+		if(storedTimestep >= mappedFile.header->storedTimestepCount)
+			throw std::runtime_error("Flag file has fewer timesteps than requested");
+		const uint64_t blockStart = mappedFile.index[storedTimestep], blockEnd = mappedFile.index[storedTimestep + 1];
+		if(blockStart > blockEnd || blockEnd > mappedFile.header->indexOffset)
+			throw std::runtime_error("Flag file is corrupt: invalid index");
+		const unsigned char
+			*data = mappedFile.data + blockStart,
+			*end = mappedFile.data + blockEnd;
+		for(size_t baseline=0; baseline!=_baselineCount; ++baseline)
+		{
+			bool* destination = destinations[baseline] + fileIndex * _channelsPerGPUBox * destinationStride + (timestep - chunkStart);
+			data = FlagFileFormat::DecodeBaseline(data, end, _channelsPerGPUBox, destination, destinationStride);
+		}
+	}
+}
@@ -2,110 +2,87 @@
 #define FLAG_READER_H
 
 #include "fitsuser.h"
+#include "flagfileformat.h"
+#include "threadpool.h"
 
 #include <fitsio.h>
 
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <algorithm>
 #include <cmath>
 
+/**
+ * Reads the flags from a set of .mwaf files, one per gpubox. The rows of
+ * many timesteps are read from a file with a single cfitsio call, and the
+ * packed bits are unpacked directly into the flag masks. Every file is read
+ * by its own task. Files in format version 2 are memory mapped and decoded
+ * without cfitsio.
+ */
 class FlagReader : private FitsUser
 {
 public:
-	FlagReader(const std::string& templateName, const std::vector<int>& hduOffsetsPerGPUBox, const std::vector<size_t>& subbandToGPUBoxFileIndex, size_t sbStart, size_t sbEnd)
-		:
-		_hduOffsets(hduOffsetsPerGPUBox),
-		_files(sbEnd - sbStart),
-		_colNums(sbEnd - sbStart),
-		_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex),
-		_sbStart(sbStart),
-		_sbEnd(sbEnd)
-	{
-		size_t numberPos = templateName.find("%%");
-		if(numberPos == std::string::npos)
-			throw std::runtime_error("When reading flag files, the name of the flag file should be specified with two percent symbols (\"%%\"), e.g. \"Flagfile%%.mwaf\". These will be replaced by the gpubox number.");
-		std::string name(templateName);
-
-		int status = 0;
-		for(size_t sb=_sbStart; sb!=_sbEnd; ++sb)
-		{
-			size_t fileIndex = sb - _sbStart;
-			size_t gpuBoxNumber = _subbandToGPUBoxFileIndex[sb] + 1;
-			name[numberPos] = (char) ('0' + (gpuBoxNumber/10));
-			name[numberPos+1] = (char) ('0' + (gpuBoxNumber%10));
-			if(fits_open_file(&_files[fileIndex], name.c_str(), READONLY, &status))
-				throwError(status, std::string("Cannot open file ") + name);
-			
-			int nChans, nAnt, nScans;
-			fits_read_key(_files[fileIndex], TINT, "NCHANS", &nChans, 0 /*comment*/, &status);
-			fits_read_key(_files[fileIndex], TINT, "NANTENNA", &nAnt, 0 /*comment*/, &status);
-			fits_read_key(_files[fileIndex], TINT, "NSCANS", &nScans, 0 /*comment*/, &status);
-			checkStatus(status);
-			if(sb==_sbStart)
-			{
-				_channelsPerGPUBox = nChans;
-				_antennaCount = nAnt;
-				_baselineCount = (nAnt * (nAnt+1)) / 2;
-				_scanCount = nScans;
-				_buffer.resize(_channelsPerGPUBox);
-			}
-			else {
-				if(nChans != int(_channelsPerGPUBox))
-					throw std::runtime_error("The flag files have an inconsistent number of frequency channels");
-				if(nAnt != int(_antennaCount))
-					throw std::runtime_error("The flag files have an inconsistent number of antennas");
-			}
-			
-			int hduType;
-			fits_movabs_hdu(_files[fileIndex], 2, &hduType, &status);
-			checkStatus(status);
-			fits_get_colnum(_files[fileIndex], CASESEN, const_cast<char*>("FLAGS"), &_colNums[fileIndex], &status);
-			checkStatus(status);
-		}
-	}
+	/**
+	 * Open the flag files. Both the FITS format (version 1) and the binary format
+	 * (version 2, see FlagFileFormat) are supported; the version is detected per file.
+	 */
+	FlagReader(const std::string& templateName, const std::vector<int>& hduOffsetsPerGPUBox, const std::vector<size_t>& subbandToGPUBoxFileIndex, size_t sbStart, size_t sbEnd);
 	
-	~FlagReader()
-	{
-		for(std::vector<fitsfile*>::iterator i=_files.begin(); i!=_files.end(); ++i)
-		{
-			int status = 0;
-			fits_close_file(*i, &status);
-		}
-	}
+	~FlagReader();
 	
-	void Read(size_t timestep, size_t baseline, bool* bufferStartPos, size_t bufferStride)
-	{
-		int status = 0;
-		for(size_t subband=_sbStart; subband!=_sbEnd; ++subband)
-		{
-			size_t fileIndex = subband - _sbStart;
-			int offset = _hduOffsets[_subbandToGPUBoxFileIndex[subband]];
-			if(int(timestep) >= offset)
-			{
-				size_t row = (timestep - offset) * _baselineCount + baseline + 1;
-				fits_read_col(_files[fileIndex], TBIT, /*colnum*/ _colNums[fileIndex], /*firstrow*/ row, /*firstelem*/ 1,
-				/*nelements*/ _channelsPerGPUBox, /*(*)nulval*/ 0, &_buffer[0], 0 /*(*)anynul*/, &status);
-				for(size_t ch=0; ch!=_channelsPerGPUBox; ++ch)
-				{
-					size_t channelIndex = ch + fileIndex*_channelsPerGPUBox;
-					bufferStartPos[channelIndex*bufferStride] = bool(_buffer[ch]);
-				}
-			}
-		}
-	}
+	/**
+	 * Read the flags of all baselines for the timesteps in [timestepStart, timestepEnd).
+	 * The flags of channel ch and timestep t of a baseline are stored in
+	 * destinations[baseline][ch * destinationStride + t - timestepStart]. Timesteps before
+	 * the HDU offset of a file are left untouched.
+	 *
+	 * When cfitsio is reentrant, the files are read and unpacked by tasks added to @p tasks,
+	 * and this call returns immediately: the destinations should not be used before
+	 * the tasks have finished. Otherwise, the FITS files are read by the calling thread and
+	 * only the unpacking is done in parallel. Version 2 files are always decoded by tasks.
+	 */
+	void ReadChunk(size_t timestepStart, size_t timestepEnd, const std::vector<bool*>& destinations, size_t destinationStride, ThreadPool::TaskGroup& tasks);
 	
 	size_t ChannelsPerGPUBox() const { return _channelsPerGPUBox; }
 	size_t AntennaCount() const { return _antennaCount; }
 	size_t ScanCount() const { return _scanCount; }
 private:
 	std::vector<int> _hduOffsets;
+	// Per file, either the FITS file (version 1) or the mapping (version 2) is set
 	std::vector<fitsfile*> _files;
 	std::vector<int> _colNums;
-	std::vector<char> _buffer;
+	struct MappedFile
+	{
+		MappedFile() : data(nullptr), size(0), header(nullptr), index(nullptr) { }
+		const unsigned char* data;
+		size_t size;
+		const FlagFileFormat::Header* header;
+		const uint64_t* index;
+	};
+	std::vector<MappedFile> _mappedFiles;
 	const std::vector<size_t> _subbandToGPUBoxFileIndex;
 	size_t _channelsPerGPUBox, _antennaCount, _baselineCount, _scanCount;
 	size_t _sbStart, _sbEnd;
+	// Number of bytes of one bit-packed row
+	size_t _packedRowSize;
+	std::vector<std::vector<unsigned char>> _packBuffers;
+	bool _isReentrant;
+	
+	size_t timestepsPerBatch() const;
+	void readBatch(size_t fileIndex, size_t timestepStart, size_t timestepEnd);
+	void unpackBatch(size_t fileIndex, size_t timestepStart, size_t timestepEnd, size_t chunkStart, const std::vector<bool*>& destinations, size_t destinationStride) const;
+	void openFitsFile(size_t fileIndex, const std::string& filename, int& nChans, int& nAnt, int& nScans);
+	void mapFile(size_t fileIndex, const std::string& filename, int& nChans, int& nAnt, int& nScans);
+	void decodeRange(size_t fileIndex, size_t timestepStart, size_t timestepEnd, size_t chunkStart, const std::vector<bool*>& destinations, size_t destinationStride) const;
+	/** First timestep of [timestepStart, timestepEnd) that is stored in the file. */
+	size_t firstStoredTimestep(size_t fileIndex, size_t timestepStart, size_t timestepEnd) const
+	{
+		int offset = _hduOffsets[_subbandToGPUBoxFileIndex[fileIndex + _sbStart]];
+		if(offset <= 0)
+			return timestepStart;
+		return std::min(std::max(timestepStart, size_t(offset)), timestepEnd);
+	}
 };
 
 #endif
@@ -1,7 +1,11 @@
 #include "flagwriter.h"
+#include "tracer.h"
 
 #include <stdexcept>
 #include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
 
 #include "version.h"
 
@@ -9,23 +13,41 @@ const uint16_t
 	FlagWriter::VERSION_MINOR = 0,
 	FlagWriter::VERSION_MAJOR = 1;
 
-FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t sbStart, size_t sbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex) :
+constexpr size_t FlagWriter::ChunkBatchTimesteps;
+
+FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t sbStart, size_t sbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex, ThreadPool& threadPool, unsigned formatVersion) :
 	_timestepCount(timestepCount),
 	_antennaCount(0),
 	_channelCount(0),
 	_channelsPerGPUBox(0),
-	_polarizationCount(0),
-//	_rowStride(0),
+	_polarizationCount(4),
+	_packedRowSize(0),
 	_rowsAdded(0),
 	_rowsWritten(0),
 	_sbStart(sbStart),
 	_sbEnd(sbEnd),
 	_gpsTime(gpsTime),
-	_files(sbEnd - sbStart),
-	_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex)
+	_formatVersion(formatVersion),
+	_blockOffsets(sbEnd - sbStart),
+	_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex),
+	_currentSlab(0),
+	_slabSize(0),
+	_slabRowCount(0),
+	_slabRowsFilled(0),
+	_packBuffers(sbEnd - sbStart),
+	_bufferBytes(MemoryAccounting::FlagWriterCategory),
+	// Without a reentrant cfitsio, only the packing is done in parallel
+	_isReentrant(fits_is_reentrant() != 0),
+	_fileTasks(threadPool)
 {
 	if(_sbEnd - _sbStart == 0)
 		throw std::runtime_error("Flagwriter was initialized with zero gpuboxes");
+	if(_formatVersion != 1 && _formatVersion != 2)
+		throw std::runtime_error("Unsupported flag file format version requested");
+	if(_formatVersion == 1)
+		_files.resize(sbEnd - sbStart);
+	else
+		_binaryFiles.resize(sbEnd - sbStart);
 		
 	size_t numberPos = filename.find("%%");
 	if(numberPos == std::string::npos)
@@ -44,23 +66,56 @@ FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestep
 			std::remove(name.c_str());
 		}
   
-		int status = 0;
-		if(fits_create_file(&_files[i-_sbStart], name.c_str(), &status))
-			throwError(status, "Cannot open flag file " + name + " for writing.");
+		if(_formatVersion == 1)
+		{
+			int status = 0;
+			if(fits_create_file(&_files[i-_sbStart], name.c_str(), &status))
+				throwError(status, "Cannot open flag file " + name + " for writing.");
+		}
+		else {
+			_binaryFiles[i-_sbStart] = std::fopen(name.c_str(), "wb");
+			if(_binaryFiles[i-_sbStart] == 0)
+				throw std::runtime_error("Cannot open flag file " + name + " for writing.");
+		}
 	}
 }
 
 FlagWriter::~FlagWriter()
 {
+	try {
+		if(_rowsAdded != _rowsWritten)
+			flushSlab();
+		_fileTasks.Wait();
+		if(_rowsAdded != 0)
+		{
+			for(size_t i=0; i!=_binaryFiles.size(); ++i)
+				finishBinaryFile(i);
+		}
+	} catch(std::exception& e) {
+		std::cerr << "Error while writing flag files: " << e.what() << '\n';
+	}
 	for(std::vector<fitsfile*>::iterator i=_files.begin(); i!=_files.end(); ++i)
 	{
 		int status = 0;
 		fits_close_file(*i, &status);
 	}
+	for(std::vector<FILE*>::iterator i=_binaryFiles.begin(); i!=_binaryFiles.end(); ++i)
+		std::fclose(*i);
 }
 
 void FlagWriter::writeHeader()
 {
+	if(_formatVersion == 2)
+	{
+		for(size_t i=0; i!=_binaryFiles.size(); ++i)
+		{
+			_blockOffsets[i].assign(1, sizeof(FlagFileFormat::Header));
+			// The index offset stays zero until the file is finished
+			writeBinaryHeader(i, 0);
+		}
+		return;
+	}
+	
 	std::ostringstream formatOStr;
 	formatOStr << _channelsPerGPUBox << 'X';
 	std::string formatStr = formatOStr.str();
@@ -106,10 +161,7 @@ void FlagWriter::setStride()
 	_channelsPerGPUBox = _channelCount / (_sbEnd-_sbStart);
 	
 	// we assume we write only one polarization here
-//	_rowStride = (_channelsPerGPUBox + 7) / 8;
-	
-	_singlePolBuffer.resize(_channelsPerGPUBox);
-//	_packBuffer.resize(_rowStride);
+	_packedRowSize = (_channelsPerGPUBox + 7) / 8;
 }
 
 void FlagWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
@@ -119,34 +171,322 @@ void FlagWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
 	_hduOffsets = offsets;
 }
 
-void FlagWriter::writeRow(size_t antenna1, size_t antenna2, const bool* flags)
+void FlagWriter::flushSlab()
 {
-	++_rowsWritten;
+	// The tasks of the previous timestep use the other slab and the pack buffers
+	_fileTasks.Wait();
+	if(_slabRowsFilled != _slabRowCount)
+		throw std::runtime_error("Flag writer received a different number of rows than were added");
+	
 	const size_t baselineCount = _antennaCount * (_antennaCount+1) / 2;
-	for(size_t subband=_sbStart; subband != _sbEnd; ++subband)
+	const bool* slab = _slabs[_currentSlab].get();
+	const size_t firstRow = _rowsWritten, rowCount = _slabRowCount;
+	if(_formatVersion == 2)
 	{
-		std::vector<unsigned char>::iterator singlePolIter = _singlePolBuffer.begin();
-		for(size_t i=0; i!=_channelsPerGPUBox; ++i)
+		if(rowCount != baselineCount)
+			throw std::runtime_error("Version 2 flag files can only be written when all baselines are written");
+		const size_t timestep = firstRow / baselineCount;
+		for(size_t fileIndex=0; fileIndex!=_binaryFiles.size(); ++fileIndex)
 		{
-			*singlePolIter = *flags ? 1 : 0;
-			++flags;
-			
-			for(size_t p=1; p!=_polarizationCount; ++p)
+			// Timesteps before the HDU offset of the file are not stored
+			if((long long) timestep >= hduOffset(fileIndex))
 			{
-				*singlePolIter |= *flags ? 1 : 0;
-				++flags;
+				_fileTasks.Run([this, fileIndex, slab, rowCount]()
+				{
+					encodeSlab(fileIndex, slab, rowCount);
+				});
 			}
-			++singlePolIter;
 		}
-		
-		int status = 0;
-		int offset = _hduOffsets[_subbandToGPUBoxFileIndex[subband]];
-		if(_rowsWritten > offset * baselineCount + 1)
+		_rowsWritten += rowCount;
+		_currentSlab = 1 - _currentSlab;
+		return;
+	}
+	std::vector<size_t> firstFileRows(_files.size(), 0), fileRowCounts(_files.size(), 0);
+	for(size_t fileIndex=0; fileIndex!=_files.size(); ++fileIndex)
+	{
+		// Rows before the HDU offset of the file are not written
+		const long long
+			skippedRows = (long long) hduOffset(fileIndex) * baselineCount,
+			firstWrittenRow = std::max<long long>(firstRow, skippedRows);
+		if(firstWrittenRow >= (long long) (firstRow + rowCount))
+			continue;
+		const size_t
+			firstSlabRow = firstWrittenRow - firstRow,
+			writtenRowCount = firstRow + rowCount - firstWrittenRow,
+			firstFileRow = firstWrittenRow - skippedRows + 1;
+		firstFileRows[fileIndex] = firstFileRow;
+		fileRowCounts[fileIndex] = writtenRowCount;
+		_fileTasks.Run([this, fileIndex, slab, firstSlabRow, firstFileRow, writtenRowCount]()
+		{
+			packSlab(fileIndex, slab, firstSlabRow, writtenRowCount);
+			if(_isReentrant)
+				writePacked(fileIndex, _packBuffers[fileIndex].data(), firstFileRow, writtenRowCount);
+		});
+	}
+	if(!_isReentrant)
+	{
+		_fileTasks.Wait();
+		for(size_t fileIndex=0; fileIndex!=_files.size(); ++fileIndex)
+		{
+			if(fileRowCounts[fileIndex] != 0)
+				writePacked(fileIndex, _packBuffers[fileIndex].data(), firstFileRows[fileIndex], fileRowCounts[fileIndex]);
+		}
+	}
+	_rowsWritten += rowCount;
+	_currentSlab = 1 - _currentSlab;
+}
+
+void FlagWriter::packSlab(size_t fileIndex, const bool* slab, size_t firstSlabRow, size_t rowCount)
+{
+	std::vector<unsigned char>& packBuffer = _packBuffers[fileIndex];
+	packBuffer.assign(rowCount * _packedRowSize, 0);
+	const size_t rowSize = _channelCount * _polarizationCount;
+	for(size_t row=0; row!=rowCount; ++row)
+	{
+		// The polarizations are combined into a single flag
+		const bool* flags = slab + (firstSlabRow + row) * rowSize + fileIndex * _channelsPerGPUBox * _polarizationCount;
+		unsigned char* packedRow = &packBuffer[row * _packedRowSize];
+		for(size_t ch=0; ch!=_channelsPerGPUBox; ++ch)
+		{
+			bool flag = false;
+			for(size_t p=0; p!=_polarizationCount; ++p)
+				flag = flag || flags[p];
+			flags += _polarizationCount;
+			// Bits of an 'X' column are stored starting with the most significant bit
+			if(flag)
+				packedRow[ch / 8] |= (unsigned char) (0x80 >> (ch % 8));
+		}
+	}
+}
+
+void FlagWriter::writePacked(size_t fileIndex, const unsigned char* packed, size_t firstFileRow, size_t rowCount)
+{
+	TraceSpan putSpan(Tracer::StoragePutStage);
+	// Writing bytes to an 'X' column writes 8 packed bits per byte, and continues
+	// over the rows, so that all rows are written at once.
+	int status = 0;
+	fits_write_col(_files[fileIndex], TBYTE, 1 /*colnum*/, firstFileRow /*firstrow*/,
+		1 /*firstelem*/, rowCount * _packedRowSize /*nelements*/, const_cast<unsigned char*>(packed), &status);
+	checkStatus(status);
+}
+
+void FlagWriter::encodeSlab(size_t fileIndex, const bool* slab, size_t rowCount)
+{
+	std::vector<unsigned char>& encoded = _packBuffers[fileIndex];
+	encoded.clear();
+	std::vector<unsigned char> singlePolFlags(_channelsPerGPUBox);
+	const size_t rowSize = _channelCount * _polarizationCount;
+	for(size_t row=0; row!=rowCount; ++row)
+	{
+		const bool* flags = slab + row * rowSize + fileIndex * _channelsPerGPUBox * _polarizationCount;
+		for(size_t ch=0; ch!=_channelsPerGPUBox; ++ch)
+		{
+			bool flag = false;
+			for(size_t p=0; p!=_polarizationCount; ++p)
+				flag = flag || flags[p];
+			flags += _polarizationCount;
+			singlePolFlags[ch] = flag ? 1 : 0;
+		}
+		FlagFileFormat::EncodeBaseline(singlePolFlags.data(), _channelsPerGPUBox, encoded);
+	}
+	appendBlock(fileIndex, encoded);
+}
+
+void FlagWriter::appendBlock(size_t fileIndex, const std::vector<unsigned char>& block)
+{
+	TraceSpan putSpan(Tracer::StoragePutStage);
+	if(std::fwrite(block.data(), 1, block.size(), _binaryFiles[fileIndex]) != block.size())
+		throw std::runtime_error("Could not write to flag file");
+	_blockOffsets[fileIndex].push_back(_blockOffsets[fileIndex].back() + block.size());
+}
+
+void FlagWriter::WriteChunk(size_t timestepCount, const std::vector<BaselineFlags>& baselines)
+{
+	const size_t baselineCount = _antennaCount * (_antennaCount+1) / 2;
+	if(baselines.size() != baselineCount)
+		throw std::runtime_error("The flags of all baselines are required to write a chunk to the flag files");
+	if(_rowsAdded == 0)
+		writeHeader();
+	else if(_rowsAdded != _rowsWritten)
+		flushSlab();
+	_fileTasks.Wait();
+	
+	std::vector<BaselineFlags> batchBaselines(baselines);
+	for(size_t batchStart=0; batchStart < timestepCount; batchStart += ChunkBatchTimesteps)
+	{
+		for(size_t baseline=0; baseline!=baselineCount; ++baseline)
+			batchBaselines[baseline].flags = baselines[baseline].flags + batchStart;
+		writeChunkBatch(std::min(ChunkBatchTimesteps, timestepCount - batchStart), batchBaselines);
+	}
+}
+
+void FlagWriter::writeChunkBatch(size_t timestepCount, const std::vector<BaselineFlags>& baselines)
+{
+	const size_t baselineCount = baselines.size();
+	// A tile covers a range of baselines of one file for all timesteps of the batch, so that the
+	// masks are read along their rows
+	const size_t
+		fileCount = _sbEnd - _sbStart,
+		tileSize = 128,
+		tileCount = (baselineCount + tileSize - 1) / tileSize,
+		firstTimestep = _rowsWritten / baselineCount;
+	if(_formatVersion == 1)
+	{
+		for(size_t fileIndex=0; fileIndex!=fileCount; ++fileIndex)
+			_packBuffers[fileIndex].assign(timestepCount * baselineCount * _packedRowSize, 0);
+	}
+	else {
+		// The tiles are kept between batches, so that their buffers are reused
+		_encodedTiles.resize(fileCount * tileCount);
+	}
+	for(size_t fileIndex=0; fileIndex!=fileCount; ++fileIndex)
+	{
+		for(size_t tile=0; tile!=tileCount; ++tile)
+		{
+			const size_t baselineStart = tile * tileSize, baselineEnd = std::min(baselineStart + tileSize, baselineCount);
+			_fileTasks.Run([this, fileIndex, tile, tileCount, &baselines, baselineStart, baselineEnd, timestepCount]()
+			{
+				if(_formatVersion == 1)
+					packTile(fileIndex, baselines, baselineStart, baselineEnd, timestepCount);
+				else
+					encodeTile(fileIndex, baselines, baselineStart, baselineEnd, timestepCount, _encodedTiles[fileIndex * tileCount + tile]);
+			});
+		}
+	}
+	_fileTasks.Wait();
+	updateBufferBytes();
+	
+	for(size_t fileIndex=0; fileIndex!=fileCount; ++fileIndex)
+	{
+		// Timesteps before the HDU offset of the file are not stored
+		const size_t skippedTimesteps = std::max<long long>(0, std::min<long long>(hduOffset(fileIndex) - (long long) firstTimestep, timestepCount));
+		if(skippedTimesteps == timestepCount)
+			continue;
+		std::function<void()> writeFile;
+		if(_formatVersion == 1)
+		{
+			const size_t
+				firstFileRow = (firstTimestep + skippedTimesteps - hduOffset(fileIndex)) * baselineCount + 1,
+				rowCount = (timestepCount - skippedTimesteps) * baselineCount;
+			writeFile = [this, fileIndex, skippedTimesteps, baselineCount, firstFileRow, rowCount]()
+			{
+				writePacked(fileIndex, &_packBuffers[fileIndex][skippedTimesteps * baselineCount * _packedRowSize], firstFileRow, rowCount);
+			};
+		}
+		else {
+			writeFile = [this, fileIndex, skippedTimesteps, timestepCount, tileCount]()
+			{
+				std::vector<unsigned char> block;
+				for(size_t timestep=skippedTimesteps; timestep!=timestepCount; ++timestep)
+				{
+					block.clear();
+					for(size_t tile=0; tile!=tileCount; ++tile)
+					{
+						const EncodedTile& encoded = _encodedTiles[fileIndex * tileCount + tile];
+						block.insert(block.end(), encoded.data.begin() + encoded.timestepOffsets[timestep], encoded.data.begin() + encoded.timestepOffsets[timestep+1]);
+					}
+					appendBlock(fileIndex, block);
+				}
+			};
+		}
+		if(_formatVersion == 2 || _isReentrant)
+			_fileTasks.Run(writeFile);
+		else
+			writeFile();
+	}
+	_fileTasks.Wait();
+	
+	_rowsAdded += timestepCount * baselineCount;
+	_rowsWritten += timestepCount * baselineCount;
+}
+
+void FlagWriter::packTile(size_t fileIndex, const std::vector<BaselineFlags>& baselines, size_t baselineStart, size_t baselineEnd, size_t timestepCount)
+{
+	const size_t baselineCount = baselines.size();
+	unsigned char* packed = _packBuffers[fileIndex].data();
+	for(size_t baseline=baselineStart; baseline!=baselineEnd; ++baseline)
+	{
+		const BaselineFlags& mask = baselines[baseline];
+		for(size_t ch=0; ch!=_channelsPerGPUBox; ++ch)
+		{
+			const bool* flags = mask.flags + (fileIndex * _channelsPerGPUBox + ch) * mask.stride;
+			// Bits of an 'X' column are stored starting with the most significant bit
+			const unsigned char bit = (unsigned char) (0x80 >> (ch % 8));
+			unsigned char* packedByte = packed + baseline * _packedRowSize + ch / 8;
+			for(size_t timestep=0; timestep!=timestepCount; ++timestep)
+			{
+				if(flags[timestep])
+					packedByte[timestep * baselineCount * _packedRowSize] |= bit;
+			}
+		}
+	}
+}
+
+void FlagWriter::encodeTile(size_t fileIndex, const std::vector<BaselineFlags>& baselines, size_t baselineStart, size_t baselineEnd, size_t timestepCount, EncodedTile& encoded)
+{
+	// The flags of the tile are transposed to one row of channels per timestep and baseline,
+	// so that the timesteps are encoded one after the other into a single buffer
+	const size_t tileBaselineCount = baselineEnd - baselineStart;
+	std::vector<unsigned char> transposed(timestepCount * tileBaselineCount * _channelsPerGPUBox);
+	for(size_t baseline=baselineStart; baseline!=baselineEnd; ++baseline)
+	{
+		const BaselineFlags& mask = baselines[baseline];
+		unsigned char* row = &transposed[(baseline - baselineStart) * _channelsPerGPUBox];
+		for(size_t ch=0; ch!=_channelsPerGPUBox; ++ch)
 		{
-			size_t unalignedRow = _rowsWritten - offset * baselineCount;
-			fits_write_col(_files[subband-_sbStart], TBIT, 1 /*colnum*/, unalignedRow /*firstrow*/,
-				1 /*firstelem*/, _channelsPerGPUBox /*nelements*/, &_singlePolBuffer[0], &status);
-			checkStatus(status);
+			const bool* flags = mask.flags + (fileIndex * _channelsPerGPUBox + ch) * mask.stride;
+			for(size_t timestep=0; timestep!=timestepCount; ++timestep)
+				row[timestep * tileBaselineCount * _channelsPerGPUBox + ch] = flags[timestep] ? 1 : 0;
 		}
 	}
+	encoded.data.clear();
+	encoded.timestepOffsets.assign(1, 0);
+	for(size_t timestep=0; timestep!=timestepCount; ++timestep)
+	{
+		for(size_t i=0; i!=tileBaselineCount; ++i)
+			FlagFileFormat::EncodeBaseline(&transposed[(timestep * tileBaselineCount + i) * _channelsPerGPUBox], _channelsPerGPUBox, encoded.data);
+		encoded.timestepOffsets.push_back(encoded.data.size());
+	}
+}
+
+void FlagWriter::updateBufferBytes()
+{
+	size_t bytes = 0;
+	for(const std::vector<unsigned char>& buffer : _packBuffers)
+		bytes += buffer.capacity();
+	for(const EncodedTile& tile : _encodedTiles)
+		bytes += tile.data.capacity() + tile.timestepOffsets.capacity() * sizeof(size_t);
+	_bufferBytes.Set(bytes);
+}
+
+void FlagWriter::writeBinaryHeader(size_t fileIndex, uint64_t indexOffset)
+{
+	FlagFileFormat::Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.fileIdentifier, FlagFileFormat::FileIdentifier(), 4);
+	header.versionMajor = FlagFileFormat::VersionMajor;
+	header.versionMinor = FlagFileFormat::VersionMinor;
+	header.timestepCount = _timestepCount;
+	header.antennaCount = _antennaCount;
+	header.channelCount = _channelsPerGPUBox;
+	header.polarizationCount = 1;
+	header.gpuBoxIndex = _subbandToGPUBoxFileIndex[fileIndex + _sbStart] + 1;
+	header.storedTimestepCount = _blockOffsets[fileIndex].size() - 1;
+	header.gpsTime = _gpsTime;
+	header.indexOffset = indexOffset;
+	std::strncpy(header.cotterVersion, COTTER_VERSION_STR, sizeof(header.cotterVersion)-1);
+	FILE* file = _binaryFiles[fileIndex];
+	if(std::fseek(file, 0, SEEK_SET) != 0 || std::fwrite(&header, sizeof(header), 1, file) != 1)
+		throw std::runtime_error("Could not write header of flag file");
+}
+
+void FlagWriter::finishBinaryFile(size_t fileIndex)
+{
+	// The index follows the last block
+	const std::vector<uint64_t>& offsets = _blockOffsets[fileIndex];
+	FILE* file = _binaryFiles[fileIndex];
+	if(std::fseek(file, offsets.back(), SEEK_SET) != 0 ||
+		std::fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file) != offsets.size())
+		throw std::runtime_error("Could not write index of flag file");
+	writeBinaryHeader(fileIndex, offsets.back());
 }
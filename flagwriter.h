@@ -3,16 +3,39 @@
 
 #include "writer.h"
 #include "fitsuser.h"
+#include "flagfileformat.h"
+#include "memoryaccounting.h"
+#include "threadpool.h"
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <memory>
 #include <fitsio.h>
 
+/**
+ * Writes the flags to one .mwaf file per gpubox. The rows of a timestep are
+ * collected in a slab; once the timestep is complete, every file packs its part
+ * of the slab into bits and writes all rows of the timestep with a single
+ * cfitsio call. The files are packed (and, when cfitsio is reentrant, written)
+ * in parallel on the thread pool, while the next timestep is collected in a
+ * second slab.
+ *
+ * With format version 2 (see FlagFileFormat), every file encodes the timestep
+ * into a compressed block and appends it to the file; the index and the final
+ * header are written when the writer is destructed.
+ *
+ * WriteChunk() is a faster alternative to the rows, which packs the flags of
+ * several timesteps directly from the masks of the baselines. A chunk is packed
+ * in batches of ChunkBatchTimesteps timesteps, which bounds the size of the
+ * packed or encoded buffers.
+ */
 class FlagWriter : public Writer, private FitsUser
 {
 	public:
-		FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t sbStart, size_t sbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex);
+		FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t sbStart, size_t sbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex, ThreadPool& threadPool, unsigned formatVersion = 1);
 		
 		~FlagWriter();
 		
@@ -28,10 +51,13 @@ class FlagWriter : public Writer, private FitsUser
 			setStride();
 		}
 		
+		void SetPolarizationCount(size_t polarizationCount) override final
+		{
+			_polarizationCount = polarizationCount;
+		}
+		
 		void WritePolarizationForLinearPols(bool flagRow) override final
 		{
-			_polarizationCount = 4;
-			setStride();
 		}
 		
 		void WriteSource(const Writer::SourceInfo &source) override final
@@ -50,12 +76,25 @@ class FlagWriter : public Writer, private FitsUser
 		{
 			if(_rowsAdded == 0)
 				writeHeader();
+			else if(_rowsAdded != _rowsWritten)
+				flushSlab();
 			_rowsAdded += rowCount;
+			_slabRowCount = rowCount;
+			_slabRowsFilled = 0;
+			size_t slabSize = rowCount * _channelCount * _polarizationCount;
+			if(_slabSize != slabSize)
+			{
+				_slabs[_currentSlab].reset(new bool[slabSize]);
+				_slabs[1 - _currentSlab].reset(new bool[slabSize]);
+				_slabSize = slabSize;
+			}
 		}
 		
 		void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 		{
-			writeRow(antenna1, antenna2, flags);
+			const size_t rowSize = _channelCount * _polarizationCount;
+			std::copy(flags, flags + rowSize, &_slabs[_currentSlab][_slabRowsFilled * rowSize]);
+			++_slabRowsFilled;
 		}
 		
 		void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params)
@@ -68,18 +107,53 @@ class FlagWriter : public Writer, private FitsUser
 		}
 		
 		virtual void SetOffsetsPerGPUBox(const std::vector<int>& offsets);
+		
+		/** Flags of one baseline for a number of timesteps, laid out as in a FlagMask. */
+		struct BaselineFlags
+		{
+			const bool* flags;
+			size_t stride;
+		};
+		
+		/**
+		 * Write the next timesteps directly from the flag masks of the baselines, instead of
+		 * through AddRows() and WriteRow(). The baselines should be given in the order of the
+		 * rows, and all baselines should be given. The flag of a channel and timestep of a
+		 * baseline is flags[channel * stride + timestep]. The files are packed in tiles of
+		 * baselines in parallel; the masks are no longer used when this call returns.
+		 */
+		void WriteChunk(size_t timestepCount, const std::vector<BaselineFlags>& baselines);
+		
+		/** Maximum number of timesteps that WriteChunk() packs at once. */
+		static constexpr size_t ChunkBatchTimesteps = 16;
 	private:
+		/** For version 2: the encoded baselines of a tile for a batch of timesteps. */
+		struct EncodedTile
+		{
+			std::vector<unsigned char> data;
+			/** Start of every timestep in the data, plus the end. */
+			std::vector<size_t> timestepOffsets;
+		};
+		
+		void writeChunkBatch(size_t timestepCount, const std::vector<BaselineFlags>& baselines);
 		void writeHeader();
-		void writeRow(size_t antenna1, size_t antenna2, const bool* flags);
+		void flushSlab();
+		void packSlab(size_t fileIndex, const bool* slab, size_t firstSlabRow, size_t rowCount);
+		void writePacked(size_t fileIndex, const unsigned char* packed, size_t firstFileRow, size_t rowCount);
+		void encodeSlab(size_t fileIndex, const bool* slab, size_t rowCount);
+		void appendBlock(size_t fileIndex, const std::vector<unsigned char>& block);
+		void packTile(size_t fileIndex, const std::vector<BaselineFlags>& baselines, size_t baselineStart, size_t baselineEnd, size_t timestepCount);
+		void encodeTile(size_t fileIndex, const std::vector<BaselineFlags>& baselines, size_t baselineStart, size_t baselineEnd, size_t timestepCount, EncodedTile& encoded);
+		void updateBufferBytes();
+		void writeBinaryHeader(size_t fileIndex, uint64_t indexOffset);
+		void finishBinaryFile(size_t fileIndex);
 		void setStride();
-		struct Header
+		
+		/** Number of timesteps that are not stored in a file, because they precede its data. */
+		int hduOffset(size_t fileIndex) const
 		{
-			char fileIdentifier[4];
-			uint16_t versionMinor, versionMajor;
-			uint32_t timestepCount, antennaCount, channelCount, polarizationCount, gpuBoxIndex;
-			uint64_t gpsTime;
-			char baselineSelection;
-		};
+			return _hduOffsets.empty() ? 0 : _hduOffsets[_subbandToGPUBoxFileIndex[fileIndex + _sbStart]];
+		}
 		
 		void updateIntKey(size_t i, const char* keywordName, int value)
 		{
@@ -89,17 +163,33 @@ class FlagWriter : public Writer, private FitsUser
 		}
 		
 		size_t _timestepCount, _antennaCount, _channelCount, _channelsPerGPUBox, _polarizationCount;
-		//size_t _rowStride;
+		// Number of bytes of one bit-packed row in a file
+		size_t _packedRowSize;
 		size_t _rowsAdded, _rowsWritten, _sbStart, _sbEnd;
 		int _gpsTime;
+		unsigned _formatVersion;
+		// The files for version 1 (FITS) or version 2 (binary)
 		std::vector<fitsfile*> _files;
+		std::vector<FILE*> _binaryFiles;
+		// For version 2: the file offsets of the timestep blocks written so far, plus the end
+		std::vector<std::vector<uint64_t>> _blockOffsets;
 		
 		const static uint16_t VERSION_MINOR, VERSION_MAJOR;
 		
 		std::vector<size_t> _subbandToGPUBoxFileIndex;
-		std::vector<unsigned char> _singlePolBuffer;
 		std::vector<int> _hduOffsets;
-		//std::vector<unsigned char> _packBuffer;
+		
+		// Two slabs with the unpacked flags of all rows of a timestep: one is filled while
+		// the other is being packed and written
+		std::unique_ptr<bool[]> _slabs[2];
+		size_t _currentSlab, _slabSize, _slabRowCount, _slabRowsFilled;
+		// One bit-packed or encoded buffer per file
+		std::vector<std::vector<unsigned char>> _packBuffers;
+		// For version 2: the encoded tiles of WriteChunk(), per file and tile
+		std::vector<EncodedTile> _encodedTiles;
+		TrackedBytes _bufferBytes;
+		bool _isReentrant;
+		ThreadPool::TaskGroup _fileTasks;
 };
 
 #endif
@@ -56,6 +56,11 @@ class ForwardingWriter : public Writer
 			_writer->SetOffsetsPerGPUBox(offsets);
 		}
 		
+		virtual void SetPolarizationCount(size_t polarizationCount) override
+		{
+			_writer->SetPolarizationCount(polarizationCount);
+		}
+		
 		virtual void AddRows(size_t rowCount) override
 		{
 			_writer->AddRows(rowCount);
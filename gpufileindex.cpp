@@ -0,0 +1,201 @@
+#include "gpufileindex.h"
+#include "zstdfitsfile.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+bool GPUFileIndex::Load(const std::string& indexFilename, const std::string& gpuBoxFilename)
+{
+	uint64_t fileSize;
+	int64_t modificationTime;
+	if(!fileIdentity(gpuBoxFilename, fileSize, modificationTime))
+		return false;
+	std::ifstream file(indexFilename, std::ios::binary);
+	if(!file)
+		return false;
+	Header header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if(!file || std::memcmp(header.fileIdentifier, "GIDX", 4) != 0 || header.version != Version || header.storage > ZstdStorage)
+		return false;
+	// A rewritten or replaced gpubox file makes the index stale
+	if(header.fileSize != fileSize || header.modificationTime != modificationTime)
+		return false;
+	std::vector<HDU> hdus(header.hduCount);
+	file.read(reinterpret_cast<char*>(hdus.data()), hdus.size() * sizeof(HDU));
+	if(!file)
+		return false;
+	_fileSize = fileSize;
+	_modificationTime = modificationTime;
+	_startTime = header.startTime;
+	_storage = Storage(header.storage);
+	_hdus = std::move(hdus);
+	return true;
+}
+
+bool GPUFileIndex::Save(const std::string& indexFilename) const
+{
+	Header header;
+	std::memcpy(header.fileIdentifier, "GIDX", 4);
+	header.version = Version;
+	header.fileSize = _fileSize;
+	header.modificationTime = _modificationTime;
+	header.startTime = _startTime;
+	header.storage = _storage;
+	header.hduCount = _hdus.size();
+
+	std::ostringstream temporaryName;
+	temporaryName << indexFilename << ".tmp" << getpid();
+	{
+		std::ofstream file(temporaryName.str(), std::ios::binary | std::ios::trunc);
+		if(!file)
+			return false;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(_hdus.data()), _hdus.size() * sizeof(HDU));
+		if(!file)
+		{
+			file.close();
+			std::remove(temporaryName.str().c_str());
+			return false;
+		}
+	}
+	if(std::rename(temporaryName.str().c_str(), indexFilename.c_str()) != 0)
+	{
+		std::remove(temporaryName.str().c_str());
+		return false;
+	}
+	return true;
+}
+
+void GPUFileIndex::Build(fitsfile* fptr, const std::string& gpuBoxFilename)
+{
+	if(!fileIdentity(gpuBoxFilename, _fileSize, _modificationTime))
+		throw std::runtime_error("Cannot access file " + gpuBoxFilename);
+
+	int status = 0, hduCount = 0, hduType = 0;
+	fits_get_num_hdus(fptr, &hduCount, &status);
+	checkStatus(status);
+	fits_movabs_hdu(fptr, 1, &hduType, &status);
+	checkStatus(status);
+	long startTime;
+	fits_read_key(fptr, TLONG, "TIME", &startTime, 0, &status);
+	checkStatus(status);
+	_startTime = startTime;
+
+	// cfitsio transparently uncompresses e.g. gzipped files, in which case the
+	// offsets are not those of the file on disk
+	const bool isPlain = isPlainFits(gpuBoxFilename);
+	bool hasOnlyFloats = true, hasOnlyCompressedImages = true;
+	_hdus.assign(hduCount, HDU{0, 0, 0, 0, 0});
+	for(int hduNumber=1; hduNumber<=hduCount; ++hduNumber)
+	{
+		fits_movabs_hdu(fptr, hduNumber, &hduType, &status);
+		checkStatus(status);
+		if(hduType != IMAGE_HDU)
+			continue;
+		int bitpix = 0, naxis = 0;
+		long naxes[2] = { 0, 0 };
+		fits_get_img_param(fptr, 2, &bitpix, &naxis, naxes, &status);
+		checkStatus(status);
+		// The primary HDU of the online format has no image
+		if(naxis != 2)
+			continue;
+		LONGLONG headerStart, dataStart, dataEnd;
+		fits_get_hduaddrll(fptr, &headerStart, &dataStart, &dataEnd, &status);
+		checkStatus(status);
+		HDU& hdu = _hdus[hduNumber-1];
+		hdu.headerOffset = headerStart;
+		hdu.dataOffset = dataStart;
+		hdu.dataEnd = dataEnd;
+		hdu.width = naxes[0];
+		hdu.height = naxes[1];
+
+		double scale = 1.0, zero = 0.0;
+		int keyStatus = 0;
+		fits_read_key(fptr, TDOUBLE, "BSCALE", &scale, 0, &keyStatus);
+		keyStatus = 0;
+		fits_read_key(fptr, TDOUBLE, "BZERO", &zero, 0, &keyStatus);
+		const bool isCompressed = fits_is_compressed_image(fptr, &status) != 0;
+		checkStatus(status);
+		if(bitpix != FLOAT_IMG || scale != 1.0 || zero != 0.0 || isCompressed)
+			hasOnlyFloats = false;
+		if(!isCompressed)
+			hasOnlyCompressedImages = false;
+	}
+	if(!isPlain)
+		_storage = CfitsioStorage;
+	else if(hasOnlyFloats)
+		_storage = PlainStorage;
+	else if(hasOnlyCompressedImages)
+		_storage = TileCompressedStorage;
+	else
+		_storage = CfitsioStorage;
+	// The missing BSCALE and BZERO keywords leave messages on the error stack
+	fits_clear_errmsg();
+}
+
+void GPUFileIndex::BuildZstd(const std::string& gpuBoxFilename)
+{
+	if(!fileIdentity(gpuBoxFilename, _fileSize, _modificationTime))
+		throw std::runtime_error("Cannot access file " + gpuBoxFilename);
+	_storage = ZstdStorage;
+	_hdus.clear();
+	
+	// The sizes of the HDUs can't be extrapolated from the first ones: one HDU of a
+	// different size would go unnoticed, and be cached. Reaching a header decompresses
+	// all data before it anyway, so every header is read.
+	ZstdFitsFile file(gpuBoxFilename);
+	ZstdFitsFile::Keywords keywords;
+	while(true)
+	{
+		const uint64_t headerOffset = file.Position();
+		if(!file.ReadHeader(keywords))
+			break;
+		const uint64_t dataSize = ZstdFitsFile::PaddedDataSize(keywords);
+		HDU hdu{headerOffset, file.Position(), file.Position() + dataSize, 0, 0};
+		if(ZstdFitsFile::IntValue(keywords, "NAXIS") == 2)
+		{
+			hdu.width = ZstdFitsFile::IntValue(keywords, "NAXIS1");
+			hdu.height = ZstdFitsFile::IntValue(keywords, "NAXIS2");
+		}
+		if(_hdus.empty())
+			_startTime = ZstdFitsFile::IntValue(keywords, "TIME");
+		_hdus.push_back(hdu);
+		file.Skip(dataSize);
+	}
+	if(_hdus.empty())
+		throw std::runtime_error("Compressed file " + gpuBoxFilename + " is empty");
+}
+
+std::string GPUFileIndex::IndexFilename(const std::string& directory, const std::string& gpuBoxFilename)
+{
+	const size_t slashPos = gpuBoxFilename.rfind('/');
+	const std::string baseName = (slashPos == std::string::npos) ? gpuBoxFilename : gpuBoxFilename.substr(slashPos+1);
+	return directory + '/' + baseName + ".hduindex";
+}
+
+bool GPUFileIndex::fileIdentity(const std::string& filename, uint64_t& size, int64_t& modificationTime)
+{
+	struct stat fileStatus;
+	if(stat(filename.c_str(), &fileStatus) != 0)
+		return false;
+	size = fileStatus.st_size;
+	modificationTime = int64_t(fileStatus.st_mtim.tv_sec) * 1000000000 + fileStatus.st_mtim.tv_nsec;
+	return true;
+}
+
+bool GPUFileIndex::isPlainFits(const std::string& filename)
+{
+	char identifier[6] = { 0, 0, 0, 0, 0, 0 };
+	FILE* file = std::fopen(filename.c_str(), "rb");
+	if(file == 0)
+		return false;
+	size_t identifierSize = std::fread(identifier, 1, 6, file);
+	std::fclose(file);
+	return identifierSize == 6 && std::memcmp(identifier, "SIMPLE", 6) == 0;
+}
@@ -0,0 +1,110 @@
+#ifndef GPU_FILE_INDEX_H
+#define GPU_FILE_INDEX_H
+
+#include "fitsuser.h"
+
+#include <fitsio.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * The layout of a gpubox file: its start time and where the image of each HDU
+ * is stored. Building the index walks all HDU headers of the file, which on a
+ * cold file system is most of the startup time of Cotter. The index can therefore
+ * be saved to a small sidecar file, which stays valid as long as the size and
+ * modification time of the gpubox file are unchanged.
+ *
+ * How the GPUFileReader reads the images depends on the Storage of the file:
+ * uncompressed, unscaled 32-bit floats in a plain FITS file are read with pread()
+ * at the indexed offsets instead of moving through the HDUs with cfitsio, and the
+ * compressed bytes of tile-compressed HDUs are read the same way and uncompressed
+ * by the workers. Files that are compressed with zstd as a whole are indexed without
+ * cfitsio, see ZstdFitsFile; the offsets of such files are positions in the
+ * decompressed file.
+ *
+ * The sidecar consists of a Header followed by one HDU entry per HDU, in native
+ * byte order; it is only meant to be read back on the same kind of machine.
+ */
+class GPUFileIndex : private FitsUser
+{
+	public:
+		enum Storage {
+			/** Read with cfitsio, e.g. gzipped files. */
+			CfitsioStorage,
+			/** Uncompressed floats that can be read directly. */
+			PlainStorage,
+			/** All images are tile compressed, e.g. with fpack. */
+			TileCompressedStorage,
+			/** The whole file is compressed with zstd. */
+			ZstdStorage
+		};
+
+		struct HDU
+		{
+			/** Offsets of the header, the data and the end of the data in the file. */
+			uint64_t headerOffset, dataOffset, dataEnd;
+			/**
+			 * Number of floats per row (naxis1) and number of rows (naxis2) of the
+			 * uncompressed image; zero when the HDU has no image.
+			 */
+			uint32_t width, height;
+		};
+
+		GPUFileIndex() : _fileSize(0), _modificationTime(0), _startTime(0), _storage(CfitsioStorage) { }
+
+		/**
+		 * Reads the index from @p indexFilename. Returns false when it does not exist,
+		 * can't be read, or does not belong to the current version of @p gpuBoxFilename.
+		 */
+		bool Load(const std::string& indexFilename, const std::string& gpuBoxFilename);
+		/**
+		 * Writes the index to @p indexFilename. The file is written under a temporary name
+		 * and renamed, so that concurrent runs never see a partial index. Returns false
+		 * on failure, e.g. when the directory is not writable.
+		 */
+		bool Save(const std::string& indexFilename) const;
+		/** Builds the index of a file that was opened with cfitsio. */
+		void Build(fitsfile* fptr, const std::string& gpuBoxFilename);
+		/**
+		 * Builds the index of a zstd-compressed file. Every header is read, which
+		 * decompresses the whole file; the index is therefore worth caching.
+		 */
+		void BuildZstd(const std::string& gpuBoxFilename);
+
+		size_t HDUCount() const { return _hdus.size(); }
+		/** @param hduNumber The one-based HDU number, as used by cfitsio. */
+		const HDU& GetHDU(size_t hduNumber) const { return _hdus[hduNumber-1]; }
+		/** Value of the TIME keyword in the primary header. */
+		long StartTime() const { return _startTime; }
+		enum Storage GetStorage() const { return _storage; }
+
+		/** Name of the sidecar of a gpubox file in @p directory. */
+		static std::string IndexFilename(const std::string& directory, const std::string& gpuBoxFilename);
+	private:
+		struct Header
+		{
+			char fileIdentifier[4];
+			uint32_t version;
+			uint64_t fileSize;
+			int64_t modificationTime;
+			int64_t startTime;
+			uint32_t storage;
+			uint32_t hduCount;
+		};
+
+		static const uint32_t Version = 2;
+
+		/** Size and modification time (in ns) of a file; false when it can't be accessed. */
+		static bool fileIdentity(const std::string& filename, uint64_t& size, int64_t& modificationTime);
+		static bool isPlainFits(const std::string& filename);
+
+		uint64_t _fileSize;
+		int64_t _modificationTime, _startTime;
+		enum Storage _storage;
+		std::vector<HDU> _hdus;
+};
+
+#endif
@@ -1,45 +1,55 @@
 #include "gpufilereader.h"
+#include "metrics.h"
 #include "progressbar.h"
+#include "tracer.h"
+#include "zstdfitsfile.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
 #include <complex>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
-#include <thread>
 
 void GPUFileReader::openFiles()
 {
-	int status = 0;
+	const size_t fileCount = _filenames.size();
+	_fitsFiles.assign(fileCount, nullptr);
+	_fds.assign(fileCount, -1);
+	_zstdFiles.clear();
+	_zstdFiles.resize(fileCount);
+	_fitsHDUCounts.assign(fileCount, 0);
+	_indices.assign(fileCount, GPUFileIndex());
+	
+	// Indexing a file walks all its HDU headers, which is mostly waiting for the file
+	// system, so the files are opened concurrently when cfitsio allows it. The messages
+	// are collected to print them in the order of the files.
+	std::vector<std::string> messages(fileCount);
+	ThreadPool::TaskGroup openTasks(_threadPool);
+	for(size_t i=0; i!=fileCount; ++i)
+	{
+		if(_isReentrant)
+			openTasks.Run([this, i, &messages]() { openFile(i, messages[i]); });
+		else
+			openFile(i, messages[i]);
+	}
+	openTasks.Wait();
+	
 	bool hasWarnedAboutDifferentTimes = false;
 	_hasStartTime = false;
-	std::vector<long> startTimePerFile(_filenames.size());
-	for(size_t i=0; i!=_filenames.size(); ++i)
+	std::vector<long> startTimePerFile(fileCount);
+	for(size_t i=0; i!=fileCount; ++i)
 	{
-		const std::string &curFilename = _filenames[i];
-		fitsfile *fptr = 0;
-		if(curFilename.empty())
-		{
-			std::cout << "(Skipping unavailable file)\n";
-			_fitsFiles.push_back(0);
-			_fitsHDUCounts.push_back(0);
-		}
-		else if(!fits_open_file(&fptr, curFilename.c_str(), READONLY, &status))
+		std::cout << messages[i];
+		if(!_filenames[i].empty())
 		{
-			_fitsFiles.push_back(fptr);
-			
-			int hduCount;
-			fits_get_num_hdus(fptr, &hduCount, &status);
-			checkStatus(status);
-			
-			_fitsHDUCounts.push_back(hduCount);
-			std::cout << "There are " << hduCount << " HDUs in file " << _filenames[i];
-			if(_offlineFormat)
-				std::cout << " (offline format: all are used!)";
-			std::cout << '\n';
-			
-			long thisFileTime;
-			fits_read_key(fptr, TLONG, "TIME", &thisFileTime, 0, &status);
-			checkStatus(status);
+			long thisFileTime = _indices[i].StartTime();
 			
 			if(!_hasStartTime) 
 			{
@@ -66,10 +76,6 @@ void GPUFileReader::openFiles()
 				hasWarnedAboutDifferentTimes = true;
 			}
 		}
-		else {
-			throwError(status, std::string("Cannot open file ") + _filenames[i]);
-			exit(1);
-		}
 	}
 	_isOpen = true;
 	_hduOffsetsPerFile.resize(_filenames.size());
@@ -92,6 +98,76 @@ void GPUFileReader::openFiles()
 	_onHDUOffsetsChange(_hduOffsetsPerFile);
 }
 
+void GPUFileReader::openFile(size_t fileIndex, std::string& message)
+{
+	TraceSpan openSpan(Tracer::FileOpenStage);
+	const std::string &curFilename = _filenames[fileIndex];
+	if(curFilename.empty())
+	{
+		message = "(Skipping unavailable file)\n";
+		return;
+	}
+	
+	GPUFileIndex& index = _indices[fileIndex];
+	const std::string indexFilename = _indexDirectory.empty() ? std::string() : GPUFileIndex::IndexFilename(_indexDirectory, curFilename);
+	const bool isIndexCached = !indexFilename.empty() && index.Load(indexFilename, curFilename);
+	std::ostringstream str;
+	if(!isIndexCached)
+	{
+		if(ZstdFitsFile::IsZstdFile(curFilename))
+			index.BuildZstd(curFilename);
+		else {
+			int status = 0;
+			fitsfile *fptr = 0;
+			if(fits_open_file(&fptr, curFilename.c_str(), READONLY, &status))
+				throwError(status, std::string("Cannot open file ") + curFilename);
+			_fitsFiles[fileIndex] = fptr;
+			index.Build(fptr, curFilename);
+		}
+		if(!indexFilename.empty() && !index.Save(indexFilename))
+			str << "WARNING: could not write HDU index " << indexFilename << ".\n";
+	}
+	// Tile-compressed HDUs are uncompressed with cfitsio by the workers, which requires
+	// a reentrant cfitsio; otherwise, cfitsio reads them as any other file
+	const GPUFileIndex::Storage storage = index.GetStorage();
+	const bool isReadDirectly =
+		storage == GPUFileIndex::PlainStorage ||
+		(storage == GPUFileIndex::TileCompressedStorage && _isReentrant);
+	if(isReadDirectly || storage == GPUFileIndex::ZstdStorage)
+	{
+		if(_fitsFiles[fileIndex] != 0)
+		{
+			int status = 0;
+			fits_close_file(_fitsFiles[fileIndex], &status);
+			_fitsFiles[fileIndex] = 0;
+			checkStatus(status);
+		}
+		if(isReadDirectly)
+		{
+			_fds[fileIndex] = open(curFilename.c_str(), O_RDONLY | O_CLOEXEC);
+			if(_fds[fileIndex] < 0)
+				throw std::runtime_error("Cannot open file " + curFilename + ": " + std::strerror(errno));
+		}
+		else
+			_zstdFiles[fileIndex].reset(new ZstdFitsFile(curFilename));
+	}
+	else if(_fitsFiles[fileIndex] == 0)
+	{
+		int status = 0;
+		if(fits_open_file(&_fitsFiles[fileIndex], curFilename.c_str(), READONLY, &status))
+			throwError(status, std::string("Cannot open file ") + curFilename);
+	}
+	
+	_fitsHDUCounts[fileIndex] = index.HDUCount();
+	str << "There are " << index.HDUCount() << " HDUs in file " << curFilename;
+	if(isIndexCached)
+		str << " (from index)";
+	if(_offlineFormat)
+		str << " (offline format: all are used!)";
+	str << '\n';
+	message = str.str();
+}
+
 void GPUFileReader::closeFiles()
 {
 	for(size_t i=0; i!=_fitsFiles.size(); ++i)
@@ -105,43 +181,87 @@ void GPUFileReader::closeFiles()
 		}
 	}
 	_fitsFiles.clear();
+	for(int fd : _fds)
+	{
+		if(fd >= 0)
+			close(fd);
+	}
+	_fds.clear();
+	_zstdFiles.clear();
 	_isOpen = false;
 }
 
-bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
-	// If we are already past the end of the files, stop immediately
-	if(_currentHDU > _stopHDU)
-		return false;
-	
-	const size_t nPol = 4;
-	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
-	const size_t gpuMatrixSizePerFile = _nChannelsInTotal * nBaselines * nPol / _filenames.size(); // cuda matrix length per file
-
-	_shuffleTasks.clear();
-	_availableGPUMatrixBuffers.clear();
-	std::vector<std::vector<std::complex<float> > > gpuMatrixBuffers(_threadCount);
-	std::vector<std::thread> threadGroup;
-	for(size_t i=0; i!=_threadCount; ++i)
+void GPUFileReader::readBytes(int fd, uint64_t offset, size_t size, char* buffer)
+{
+	size_t remaining = size;
+	while(remaining != 0)
 	{
-		gpuMatrixBuffers[i].resize(gpuMatrixSizePerFile);
-		_availableGPUMatrixBuffers.write(&gpuMatrixBuffers[i][0]);
-		threadGroup.emplace_back(&GPUFileReader::shuffleThreadFunc, this);
+		const ssize_t result = pread(fd, buffer, remaining, offset);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			throw std::runtime_error(std::string("Error reading GPU file: ") + (result == 0 ? "file is truncated" : std::strerror(errno)));
+		buffer += result;
+		offset += result;
+		remaining -= result;
 	}
+}
 
+void GPUFileReader::readImageData(int fd, uint64_t offset, size_t floatCount, float* destination)
+{
+	readBytes(fd, offset, floatCount * sizeof(float), reinterpret_cast<char*>(destination));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// FITS stores big-endian floats
+	uint32_t* words = reinterpret_cast<uint32_t*>(destination);
+	for(size_t i=0; i!=floatCount; ++i)
+		words[i] = __builtin_bswap32(words[i]);
+#endif
+}
+
+void GPUFileReader::Open()
+{
 	if(!_isOpen)
 	{
 		openFiles();
 		
-		_currentHDU = _offlineFormat ? 1 : 2; // header to start reading
+		_currentHDU = (_offlineFormat ? 1 : 2) + _scansToSkip; // header to start reading
 		findStopHDU();
 	}
+}
+
+bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
+	// If we are already past the end of the files, stop immediately
+	if(_currentHDU > _stopHDU)
+		return false;
+	
+	const size_t nPol = 4;
+	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
+	const size_t channelsPerFile = _nChannelsInTotal / _filenames.size(); // channels read from each file
+	const size_t gpuMatrixSizePerFile = channelsPerFile * nBaselines * nPol; // cuda matrix length per file
+
+	allocateGPUMatrixBuffers(gpuMatrixSizePerFile);
+	ThreadPool::TaskGroup shuffleTasks(_threadPool);
+
+	Open();
 	
 	initMapping();
 
 	ProgressBar progressBar("Reading GPU files");
 	
+	// Files compressed with zstd are decompressed in order, each by its own task, so
+	// that they are decompressed in parallel. These tasks wait for matrix buffers,
+	// hence they run as long-running tasks. They submit shuffle tasks, so they should
+	// be finished before the shuffle tasks are waited for.
+	ThreadPool::TaskGroup fileTasks(_threadPool);
 	size_t endingBufferPos = bufferLength;
 	bool moreAvailable = false;
+	// The HDUs to read from each file are determined first, so that the progress is
+	// the number of HDUs read of all files
+	std::vector<size_t>
+		fileHDUs(_filenames.size(), 0),
+		fileBufferPositions(_filenames.size(), 0),
+		hduCounts(_filenames.size(), 0);
+	size_t totalHDUCount = 0;
 	for (size_t iFile = 0; iFile != _filenames.size(); ++iFile) {
 		if(!_filenames[iFile].empty())
 		{
@@ -160,70 +280,38 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 				}
 			}
 			size_t fileStopHDU = _fitsHDUCounts[iFile];
-			size_t hdusAvailable = fileStopHDU - fileHDU + 1;
+			size_t hdusAvailable = fileHDU <= fileStopHDU ? fileStopHDU - fileHDU + 1 : 0;
 			if(endingBufferPos > bufferPos + hdusAvailable) endingBufferPos = bufferPos + hdusAvailable;
 			
-			while (fileHDU <= fileStopHDU && fileBufferPos < bufferLength)
+			const size_t hduCount = fileBufferPos < bufferLength ? std::min(hdusAvailable, bufferLength - fileBufferPos) : 0;
+			fileHDUs[iFile] = fileHDU;
+			fileBufferPositions[iFile] = fileBufferPos;
+			hduCounts[iFile] = hduCount;
+			totalHDUCount += hduCount;
+			if(fileHDU + hduCount <= fileStopHDU)
+				moreAvailable = true;
+		}
+	}
+	
+	ReadProgress progress{{0}, totalHDUCount, progressBar};
+	for (size_t iFile = 0; iFile != _filenames.size(); ++iFile) {
+		if(hduCounts[iFile] != 0)
+		{
+			const size_t fileHDU = fileHDUs[iFile], fileBufferPos = fileBufferPositions[iFile], hduCount = hduCounts[iFile];
+			if(_zstdFiles[iFile])
 			{
-				progressBar.SetProgress(fileHDU + iFile*fileStopHDU, fileStopHDU*_filenames.size());
-
-				fitsfile *fptr = _fitsFiles[iFile];
-
-				int status = 0, hduType = 0;
-				fits_movabs_hdu(fptr, fileHDU, &hduType, &status);
-				checkStatus(status);
-				if (hduType == BINARY_TBL) {
-					throw std::runtime_error("GPU file seems not to contain image headers; format not understood.");
-				}
-				else {
-
-					long fpixel = 1;
-					float nullval = 0;
-					int anynull = 0x0;
-					long naxes[2];
-
-					fits_get_img_size(fptr, 2, naxes, &status);
-					checkStatus(status);
-
-					size_t channelsInFile = naxes[1];
-					size_t baselTimesPolInFile = naxes[0];
-
-					if(_nChannelsInTotal != (channelsInFile*_filenames.size())) {
-						std::stringstream s;
-						s << "Number of GPU files (" << _filenames.size() << ") in time range x row count of image chunk in file (" << channelsInFile << ") != "
-						<< "total channels count (" << _nChannelsInTotal << "): are the FITS files the dimension you expected them to be?";
-						throw std::runtime_error(s.str());
-					}
-					// Test the first axis; note that we assert the number of floats, not complex, hence the factor of two.
-					if(baselTimesPolInFile != nBaselines * nPol * 2) {
-						std::stringstream s;
-						s << "Unexpected number of visibilities in axis of GPU file. Expected=" << (nBaselines*nPol*2) << ", actual=" << baselTimesPolInFile;
-						throw std::runtime_error(s.str());
-					}
-
-					std::complex<float> *matrixPtr = 0;
-					_availableGPUMatrixBuffers.read(matrixPtr);
-					fits_read_img(fptr, TFLOAT, fpixel, channelsInFile * baselTimesPolInFile, &nullval, (float *) matrixPtr, &anynull, &status);
-					checkStatus(status);
-					
-					ShuffleTask shuffleTask;
-					shuffleTask.iFile = iFile;
-					shuffleTask.channelsInFile = channelsInFile;
-					shuffleTask.fileBufferPos = fileBufferPos;
-					shuffleTask.gpuMatrix = matrixPtr;
-					_shuffleTasks.write(shuffleTask);
-				}
-				++fileHDU;
-				++fileBufferPos;
+				fileTasks.RunLongRunning([this, iFile, fileHDU, fileBufferPos, hduCount, channelsPerFile, &shuffleTasks, &progress]()
+				{
+					readHDUs(iFile, fileHDU, fileBufferPos, hduCount, channelsPerFile, shuffleTasks, progress);
+				});
 			}
-			if(fileHDU <= fileStopHDU)
-				moreAvailable = true;
+			else
+				readHDUs(iFile, fileHDU, fileBufferPos, hduCount, channelsPerFile, shuffleTasks, progress);
 		}
 	}
 	
-	_shuffleTasks.write_end();
-	for(std::thread& t : threadGroup)
-		t.join();
+	fileTasks.Wait();
+	shuffleTasks.Wait();
 	
 	_currentHDU += endingBufferPos - bufferPos;
 	bufferPos = endingBufferPos;
@@ -233,17 +321,180 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 	return moreAvailable;
 }
 
-void GPUFileReader::shuffleThreadFunc()
+void GPUFileReader::readHDUs(size_t iFile, size_t fileHDU, size_t fileBufferPos, size_t hduCount, size_t channelsPerFile, ThreadPool::TaskGroup& shuffleTasks, ReadProgress& progress)
+{
+	const size_t nPol = 4;
+	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
+	const GPUFileIndex::Storage storage = _indices[iFile].GetStorage();
+	ZstdFitsFile* zstdFile = _zstdFiles[iFile].get();
+	// Without a fitsfile, the layout is taken from the index, without reading the header
+	fitsfile *fptr = _fitsFiles[iFile];
+	for(size_t i=0; i!=hduCount; ++i)
+	{
+		TraceSpan readSpan(Tracer::HDUReadStage);
+
+		int status = 0, hduType = 0;
+		long naxes[2];
+		if(fptr == 0)
+		{
+			const GPUFileIndex::HDU& hdu = _indices[iFile].GetHDU(fileHDU);
+			hduType = (hdu.height == 0) ? BINARY_TBL : IMAGE_HDU;
+			naxes[0] = hdu.width;
+			naxes[1] = hdu.height;
+		}
+		else {
+			fits_movabs_hdu(fptr, fileHDU, &hduType, &status);
+			checkStatus(status);
+		}
+		if (hduType == BINARY_TBL) {
+			throw std::runtime_error("GPU file seems not to contain image headers; format not understood.");
+		}
+
+		long fpixel = 1;
+		float nullval = 0;
+		int anynull = 0x0;
+
+		if(fptr != 0)
+		{
+			fits_get_img_size(fptr, 2, naxes, &status);
+			checkStatus(status);
+		}
+
+		size_t channelsInFile = naxes[1];
+		size_t baselTimesPolInFile = naxes[0];
+
+		if(_hasChannelSelection) {
+			if(_channelSelectionStart + channelsPerFile > channelsInFile) {
+				std::stringstream s;
+				s << "Selected channels " << _channelSelectionStart << "-" << (_channelSelectionStart + channelsPerFile) << " are not available in GPU file with " << channelsInFile << " channels.";
+				throw std::runtime_error(s.str());
+			}
+		}
+		else if(_nChannelsInTotal != (channelsInFile*_filenames.size())) {
+			std::stringstream s;
+			s << "Number of GPU files (" << _filenames.size() << ") in time range x row count of image chunk in file (" << channelsInFile << ") != "
+			<< "total channels count (" << _nChannelsInTotal << "): are the FITS files the dimension you expected them to be?";
+			throw std::runtime_error(s.str());
+		}
+		// Test the first axis; note that we assert the number of floats, not complex, hence the factor of two.
+		if(baselTimesPolInFile != nBaselines * nPol * 2) {
+			std::stringstream s;
+			s << "Unexpected number of visibilities in axis of GPU file. Expected=" << (nBaselines*nPol*2) << ", actual=" << baselTimesPolInFile;
+			throw std::runtime_error(s.str());
+		}
+
+		std::complex<float> *matrixPtr = 0;
+		TraceSpan waitSpan(Tracer::BufferWaitStage);
+		_availableGPUMatrixBuffers.read(matrixPtr);
+		waitSpan.End();
+		// Every row of the image is a channel, so the selected channels are one contiguous range of pixels
+		fpixel += _channelSelectionStart * baselTimesPolInFile;
+		const size_t pixelCount = channelsPerFile * baselTimesPolInFile;
+		size_t bytesRead = pixelCount * sizeof(float);
+		std::vector<char>* compressedHDU = 0;
+		if(zstdFile != 0)
+			zstdFile->ReadImage(fileHDU, fpixel-1, pixelCount, (float *) matrixPtr);
+		else if(fptr == 0 && storage == GPUFileIndex::PlainStorage)
+			readImageData(_fds[iFile], _indices[iFile].GetHDU(fileHDU).dataOffset + (fpixel-1) * sizeof(float), pixelCount, (float *) matrixPtr);
+		else if(fptr == 0)
+		{
+			// Only the compressed bytes are read here; the HDU is uncompressed by the
+			// first shuffle task that needs it
+			compressedHDU = &compressedBufferOf(matrixPtr);
+			readCompressedHDU(_fds[iFile], _indices[iFile].GetHDU(fileHDU), *compressedHDU);
+			bytesRead = compressedHDU->size();
+		}
+		else {
+			fits_read_img(fptr, TFLOAT, fpixel, pixelCount, &nullval, (float *) matrixPtr, &anynull, &status);
+			checkStatus(status);
+		}
+		readSpan.End();
+		progress.progressBar.SetProgress(progress.hdusRead.fetch_add(1) + 1, progress.totalHDUCount);
+		Metrics::AddBytesRead(bytesRead);
+		Metrics::AddShuffleQueueDepth(1);
+		
+		// Every node shuffles the baselines that are stored on that node. The matrix
+		// is returned once all nodes are done with it.
+		const size_t nodeCount = _threadPool.NodeCount();
+		std::shared_ptr<std::atomic<size_t>> nodesRemaining(new std::atomic<size_t>(nodeCount));
+		std::shared_ptr<std::once_flag> decompressed(new std::once_flag());
+		for(size_t node=0; node!=nodeCount; ++node)
+		{
+			shuffleTasks.RunOnNode(node, [this, iFile, channelsPerFile, fileBufferPos, matrixPtr, node, nodesRemaining, compressedHDU, decompressed, fpixel, pixelCount]()
+			{
+				if(compressedHDU != 0)
+					std::call_once(*decompressed, &GPUFileReader::decompressHDU, *compressedHDU, fpixel, pixelCount, (float *) matrixPtr);
+				TraceSpan shuffleSpan(Tracer::ShuffleStage);
+				shuffleBuffer(iFile, channelsPerFile, fileBufferPos, matrixPtr, node);
+				shuffleSpan.End();
+				if(nodesRemaining->fetch_sub(1) == 1)
+				{
+					Metrics::AddShuffleQueueDepth(-1);
+					_availableGPUMatrixBuffers.write(matrixPtr);
+				}
+			});
+		}
+		++fileHDU;
+		++fileBufferPos;
+	}
+}
+
+std::vector<char>& GPUFileReader::compressedBufferOf(const std::complex<float>* matrixPtr)
+{
+	size_t index = 0;
+	while(_gpuMatrixBuffers[index].data() != matrixPtr)
+		++index;
+	return _compressedBuffers[index];
+}
+
+void GPUFileReader::readCompressedHDU(int fd, const GPUFileIndex::HDU& hdu, std::vector<char>& buffer)
+{
+	// The HDU is stored behind an empty primary HDU, so that cfitsio can open the
+	// buffer as a file of its own
+	const size_t fitsBlockSize = 2880, fitsCardSize = 80;
+	const char* primaryCards[] = { "SIMPLE  =                    T", "BITPIX  =                    8", "NAXIS   =                    0", "EXTEND  =                    T", "END" };
+	buffer.resize(fitsBlockSize + (hdu.dataEnd - hdu.headerOffset));
+	std::fill(buffer.begin(), buffer.begin() + fitsBlockSize, ' ');
+	for(size_t card=0; card!=sizeof(primaryCards)/sizeof(primaryCards[0]); ++card)
+		std::memcpy(buffer.data() + card*fitsCardSize, primaryCards[card], std::strlen(primaryCards[card]));
+	readBytes(fd, hdu.headerOffset, hdu.dataEnd - hdu.headerOffset, buffer.data() + fitsBlockSize);
+}
+
+void GPUFileReader::decompressHDU(std::vector<char>& buffer, size_t fpixel, size_t pixelCount, float* destination)
 {
-	ShuffleTask task;
-	while(_shuffleTasks.read(task))
+	TraceSpan decompressSpan(Tracer::DecompressStage);
+	void* memory = buffer.data();
+	size_t memorySize = buffer.size();
+	int status = 0, hduType = 0, anynull = 0;
+	float nullval = 0;
+	fitsfile* fptr = 0;
+	if(fits_open_memfile(&fptr, "gpubox", READONLY, &memory, &memorySize, 0, nullptr, &status))
+		throwError(status, "Cannot open compressed HDU");
+	fits_movabs_hdu(fptr, 2, &hduType, &status);
+	fits_read_img(fptr, TFLOAT, fpixel, pixelCount, &nullval, destination, &anynull, &status);
+	int closeStatus = 0;
+	fits_close_file(fptr, &closeStatus);
+	checkStatus(status);
+	checkStatus(closeStatus);
+}
+
+void GPUFileReader::allocateGPUMatrixBuffers(size_t gpuMatrixSizePerFile)
+{
+	if(_gpuMatrixBuffers.empty() || _gpuMatrixBuffers.front().size() != gpuMatrixSizePerFile)
 	{
-		shuffleBuffer(task.iFile, task.channelsInFile, task.fileBufferPos, task.gpuMatrix);
-		_availableGPUMatrixBuffers.write(task.gpuMatrix);
+		_availableGPUMatrixBuffers.clear();
+		_gpuMatrixBuffers.resize(_gpuMatrixBufferCount);
+		_compressedBuffers.resize(_gpuMatrixBufferCount);
+		for(std::vector<std::complex<float>>& buffer : _gpuMatrixBuffers)
+		{
+			buffer.assign(gpuMatrixSizePerFile, std::complex<float>());
+			_availableGPUMatrixBuffers.write(buffer.data());
+		}
+		_gpuMatrixBytes.Set(_gpuMatrixBufferCount * gpuMatrixSizePerFile * sizeof(std::complex<float>));
 	}
 }
 
-void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix)
+void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix, size_t node)
 {
 	const size_t nPol = 4;
 	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
@@ -256,12 +507,17 @@ void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fi
 	{
 		for(size_t antenna2=0; antenna2<=antenna1; ++antenna2)
 		{
-			size_t channelStart = iFile * channelsInFile;
-			size_t channelEnd = (iFile+1) * channelsInFile;
-			size_t index = correlationIndex * nPol;
 			// Because possibly antenna2 <= antenna1 in the GPU file, and Casa MS expects it the other way
 			// around, we change the order and take the complex conjugates later.
 			BaselineBuffer &buffer = getMappedBuffer(antenna2, antenna1);
+			if(buffer.node != node)
+			{
+				++correlationIndex;
+				continue;
+			}
+			size_t channelStart = iFile * channelsInFile;
+			size_t channelEnd = (iFile+1) * channelsInFile;
+			size_t index = correlationIndex * nPol;
 			size_t destChanIndex = fileBufferPos + channelStart * _bufferSize;
 			for(size_t ch=channelStart; ch!=channelEnd; ++ch)
 			{
@@ -356,11 +612,13 @@ void GPUFileReader::initMapping()
 						_isConjugated[conjIndex] = isConjugated;
 						getMappedBuffer(a1, a2).real[p1 * 2 + p2] = getBuffer(actA1, actA2).real[actP1 * 2 + actP2];
 						getMappedBuffer(a1, a2).imag[p1 * 2 + p2] = getBuffer(actA1, actA2).imag[actP1 * 2 + actP2];
+						getMappedBuffer(a1, a2).node = getBuffer(actA1, actA2).node;
 					} else {
 						size_t conjIndex = (actA2 * 2 + actP2) * _nAntenna * 2 + (actA1 * 2 + actP1);
 						_isConjugated[conjIndex] = isConjugated;
 						getMappedBuffer(a1, a2).real[p1 * 2 + p2] = getBuffer(actA2, actA1).real[actP2 * 2 + actP1];
 						getMappedBuffer(a1, a2).imag[p1 * 2 + p2] = getBuffer(actA2, actA1).imag[actP2 * 2 + actP1];
+						getMappedBuffer(a1, a2).node = getBuffer(actA2, actA1).node;
 					}
 				}
 			}
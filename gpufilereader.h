@@ -1,8 +1,18 @@
+#ifndef GPU_FILE_READER_H
+#define GPU_FILE_READER_H
+
 #include "baselinebuffer.h"
 #include "fitsuser.h"
-#include "lane.h"
+#include "gpufileindex.h"
+#include "lockfree_lane.h"
+#include "memoryaccounting.h"
+#include "threadpool.h"
+#include "zstdfitsfile.h"
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 #include <ctime>
@@ -36,21 +46,26 @@
 class GPUFileReader : private FitsUser
 {
 	public:
-		GPUFileReader(size_t nAntenna, size_t nChannelsInTotal, size_t threadCount, bool offlineFormat) :
-			_shuffleTasks(threadCount),
-			_availableGPUMatrixBuffers(threadCount),
+		GPUFileReader(size_t nAntenna, size_t nChannelsInTotal, ThreadPool& threadPool, size_t gpuMatrixBufferCount, bool offlineFormat) :
+			_threadPool(threadPool),
+			_gpuMatrixBufferCount(std::max<size_t>(gpuMatrixBufferCount, 1)),
+			_availableGPUMatrixBuffers(_gpuMatrixBufferCount),
+			_gpuMatrixBytes(MemoryAccounting::ReaderCategory),
 			_isOpen(false),
 			_nAntenna(nAntenna),
 			_nChannelsInTotal(nChannelsInTotal),
 			_bufferSize(0),
 			_currentHDU(0),
 			_stopHDU(0),
+			_scansToSkip(0),
+			_channelSelectionStart(0),
+			_hasChannelSelection(false),
 			_startTime(0),
 			_hasStartTime(false),
-			_threadCount(threadCount),
 			_integrationTime(0.0),
 			_doAlign(true),
-			_offlineFormat(offlineFormat)
+			_offlineFormat(offlineFormat),
+			_isReentrant(fits_is_reentrant() != 0)
 		{ }
 		~GPUFileReader() { closeFiles(); }
 		
@@ -67,6 +82,35 @@ class GPUFileReader : private FitsUser
 		size_t AntennaCount() { return _nAntenna; }
 		size_t ChannelCount() { return _nChannelsInTotal; }
 		
+		/**
+		 * Skip the first scans of the files: their HDUs are not read at all. Should be set
+		 * before Open(). The HDU offsets that align the files are relative to the first scan
+		 * that is read, so the files stay aligned.
+		 */
+		void SetScansToSkip(size_t scanCount) { _scansToSkip = scanCount; }
+		/**
+		 * Only read the fine channels of each file that start at the given channel. The
+		 * number of channels that is read from each file is the channel count
+		 * given to the constructor divided by the number of files. Only those rows are read
+		 * from the images.
+		 */
+		void SetChannelSelection(size_t channelStart)
+		{
+			_channelSelectionStart = channelStart;
+			_hasChannelSelection = true;
+		}
+		/**
+		 * Keep an index of the HDUs of every file in the given directory. Files for which
+		 * the directory holds an up-to-date index are opened without reading their headers.
+		 */
+		void SetIndexDirectory(const std::string& indexDirectory) { _indexDirectory = indexDirectory; }
+		/** Number of scans in the files, including the skipped ones. Valid after Open(). */
+		size_t ScanCount() const
+		{
+			const size_t firstHDU = _offlineFormat ? 1 : 2;
+			return _stopHDU >= firstHDU ? _stopHDU - firstHDU + 1 : 0;
+		}
+		
 		void ResetBuffers()
 		{
 			_bufferSize = 0;
@@ -86,11 +130,18 @@ class GPUFileReader : private FitsUser
 			_corrInputToOutput[input] = outputAnt*2 + outputPol;
 		}
 		
+		/** Open the files, if not yet done. This determines the start time and the HDU offsets. */
+		void Open();
 		bool Read(size_t &bufferPos, size_t bufferLength);
 		bool IsConjugated(size_t ant1, size_t ant2, size_t pol1, size_t pol2) const
 		{
 			return _isConjugated[(ant1 * 2 + pol1) * _nAntenna * 2 + (ant2 * 2 + pol2)];
 		}
+		/** The correlator input of an antenna/polarization index (antenna * 2 + pol) of the GPU files. */
+		static size_t PFBOutputToInput(size_t pfbOutput)
+		{
+			return single_pfb_output_to_input[pfbOutput % 64] + (pfbOutput / 64) * 64;
+		}
 		std::time_t StartTime() const { return _startTime; }
 		bool HasStartTime() const { return _hasStartTime; }
 		
@@ -99,26 +150,43 @@ class GPUFileReader : private FitsUser
 			_onHDUOffsetsChange = onHDUOffsetsChange;
 		}
 	private:
-		struct ShuffleTask
-		{
-			size_t iFile, channelsInFile, fileBufferPos;
-			std::complex<float> *gpuMatrix;
-		};
-		ao::lane<ShuffleTask> _shuffleTasks;
-		ao::lane<std::complex<float> *> _availableGPUMatrixBuffers;
+		ThreadPool& _threadPool;
+		// These buffers are allocated on the first read and reused for all following
+		// reads. The lane of available buffers limits the number of shuffle tasks that
+		// are in flight.
+		size_t _gpuMatrixBufferCount;
+		std::vector<std::vector<std::complex<float>>> _gpuMatrixBuffers;
+		ao::lockfree_lane<std::complex<float> *> _availableGPUMatrixBuffers;
+		TrackedBytes _gpuMatrixBytes;
+		// The compressed HDU that belongs to each matrix buffer, for tile-compressed files
+		std::vector<std::vector<char>> _compressedBuffers;
 		
 		const static int single_pfb_output_to_input[64];
 		std::vector<int> pfb_output_to_input;
 		
-		GPUFileReader(const GPUFileReader &) : _shuffleTasks(0), _availableGPUMatrixBuffers(0) { }
-		void operator=(const GPUFileReader &) { }
+		GPUFileReader(const GPUFileReader &) = delete;
+		void operator=(const GPUFileReader &) = delete;
 		void openFiles();
+		void openFile(size_t fileIndex, std::string& message);
 		void closeFiles();
+		static void readBytes(int fd, uint64_t offset, size_t size, char* buffer);
+		static void readImageData(int fd, uint64_t offset, size_t floatCount, float* destination);
+		/** Counts the HDUs that are read from all files during a Read() call, which may read the files concurrently. */
+		struct ReadProgress
+		{
+			std::atomic<size_t> hdusRead;
+			size_t totalHDUCount;
+			class ProgressBar& progressBar;
+		};
+		void readHDUs(size_t iFile, size_t fileHDU, size_t fileBufferPos, size_t hduCount, size_t channelsPerFile, ThreadPool::TaskGroup& shuffleTasks, ReadProgress& progress);
+		std::vector<char>& compressedBufferOf(const std::complex<float>* matrixPtr);
+		static void readCompressedHDU(int fd, const GPUFileIndex::HDU& hdu, std::vector<char>& buffer);
+		static void decompressHDU(std::vector<char>& buffer, size_t fpixel, size_t pixelCount, float* destination);
 		void findStopHDU();
 		void initMapping();
 		void initializePFBMapping();
-		void shuffleThreadFunc();
-		void shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix);
+		void allocateGPUMatrixBuffers(size_t gpuMatrixSizePerFile);
+		void shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix, size_t node);
 		BaselineBuffer &getBuffer(size_t antenna1, size_t antenna2)
 		{
 			return _buffers[_nAntenna*antenna1 + antenna2];
@@ -130,9 +198,17 @@ class GPUFileReader : private FitsUser
 		
 		bool _isOpen;
 		size_t _nAntenna, _nChannelsInTotal, _bufferSize, _currentHDU, _stopHDU;
+		size_t _scansToSkip, _channelSelectionStart;
+		bool _hasChannelSelection;
 		std::vector<std::string> _filenames;
 		std::vector<size_t> _fitsHDUCounts;
 		std::vector<fitsfile *> _fitsFiles;
+		// Files whose images are read directly have a descriptor instead of a fitsfile,
+		// and zstd-compressed files are read by a ZstdFitsFile
+		std::vector<int> _fds;
+		std::vector<std::unique_ptr<ZstdFitsFile>> _zstdFiles;
+		std::vector<GPUFileIndex> _indices;
+		std::string _indexDirectory;
 		
 		std::vector<BaselineBuffer> _buffers;
 		std::vector<BaselineBuffer> _mappedBuffers;
@@ -140,9 +216,10 @@ class GPUFileReader : private FitsUser
 		std::vector<bool> _isConjugated;
 		std::time_t _startTime;
 		bool _hasStartTime;
-		size_t _threadCount;
 		std::vector<int> _hduOffsetsPerFile;
 		double _integrationTime;
-		bool _doAlign, _offlineFormat;
+		bool _doAlign, _offlineFormat, _isReentrant;
 		std::function<void(const std::vector<int>&)> _onHDUOffsetsChange;
 };
+
+#endif
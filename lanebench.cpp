@@ -0,0 +1,147 @@
+#include "lane.h"
+#include "lockfree_lane.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Contention benchmark that compares ao::lane with ao::lockfree_lane.
+ * Every configuration moves the same number of elements from a set of
+ * producer threads to a set of consumer threads, and reports the throughput
+ * and the number of times threads had to block (the latter only for the
+ * lock-free lane, as the lane only counts this in debug mode).
+ *
+ * Usage: lanebench [element count] [lane capacity]
+ */
+
+namespace {
+
+struct Result
+{
+	double seconds;
+	size_t readWaits, writeWaits;
+};
+
+template<typename Lane>
+void fillWaitCounts(const Lane&, Result& result)
+{
+	result.readWaits = 0;
+	result.writeWaits = 0;
+}
+
+template<typename Tp>
+void fillWaitCounts(const ao::lockfree_lane<Tp>& lane, Result& result)
+{
+	result.readWaits = lane.read_wait_count();
+	result.writeWaits = lane.write_wait_count();
+}
+
+template<typename Lane>
+Result runBenchmark(size_t producerCount, size_t consumerCount, size_t elementCount, size_t capacity, size_t batchSize)
+{
+	Lane lane(capacity);
+	std::vector<size_t> checksums(consumerCount, 0);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> consumers;
+	for(size_t c=0; c!=consumerCount; ++c)
+	{
+		consumers.emplace_back([&lane, &checksums, c]()
+		{
+			size_t value, sum = 0;
+			while(lane.read(value))
+				sum += value;
+			checksums[c] = sum;
+		});
+	}
+	std::vector<std::thread> producers;
+	for(size_t p=0; p!=producerCount; ++p)
+	{
+		producers.emplace_back([&lane, p, producerCount, elementCount, batchSize]()
+		{
+			size_t first = elementCount * p / producerCount, last = elementCount * (p+1) / producerCount;
+			if(batchSize == 1)
+			{
+				for(size_t i=first; i!=last; ++i)
+					lane.write(i);
+			}
+			else {
+				std::vector<size_t> batch(batchSize);
+				for(size_t i=first; i<last; i+=batchSize)
+				{
+					size_t n = std::min(batchSize, last-i);
+					for(size_t j=0; j!=n; ++j)
+						batch[j] = i + j;
+					lane.write(batch.data(), n);
+				}
+			}
+		});
+	}
+	for(std::thread& t : producers)
+		t.join();
+	lane.write_end();
+	for(std::thread& t : consumers)
+		t.join();
+
+	Result result;
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fillWaitCounts(lane, result);
+
+	size_t sum = 0;
+	for(size_t s : checksums)
+		sum += s;
+	if(sum != elementCount * (elementCount-1) / 2)
+	{
+		std::cerr << "Checksum mismatch: elements were lost or duplicated!\n";
+		std::exit(1);
+	}
+	return result;
+}
+
+void report(const std::string& name, size_t elementCount, const Result& result)
+{
+	std::cout << "  " << std::left << std::setw(16) << name << std::right
+		<< std::setw(10) << std::fixed << std::setprecision(2) << (elementCount / result.seconds * 1e-6) << " Mops/s";
+	if(result.readWaits != 0 || result.writeWaits != 0)
+		std::cout << "  (blocked reads: " << result.readWaits << ", blocked writes: " << result.writeWaits << ")";
+	std::cout << '\n';
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	size_t elementCount = 2000000, capacity = 64;
+	if(argc >= 2)
+		elementCount = std::atol(argv[1]);
+	if(argc >= 3)
+		capacity = std::atol(argv[2]);
+
+	const size_t hardwareThreads = std::max<size_t>(2, std::thread::hardware_concurrency());
+	const size_t configurations[][3] = {
+		// producers, consumers, batch size
+		{ 1, 1, 1 },
+		{ 1, 1, 16 },
+		{ 1, hardwareThreads/2, 1 },
+		{ hardwareThreads/2, 1, 1 },
+		{ hardwareThreads/2, hardwareThreads/2, 1 },
+		{ hardwareThreads, hardwareThreads, 1 }
+	};
+
+	std::cout << "Moving " << elementCount << " elements through lanes of capacity " << capacity << ".\n";
+	for(const size_t* configuration : configurations)
+	{
+		size_t producerCount = configuration[0], consumerCount = configuration[1], batchSize = configuration[2];
+		std::cout << producerCount << " producer(s), " << consumerCount << " consumer(s), batch size " << batchSize << ":\n";
+		report("lane", elementCount,
+			runBenchmark<ao::lane<size_t>>(producerCount, consumerCount, elementCount, capacity, batchSize));
+		report("lockfree_lane", elementCount,
+			runBenchmark<ao::lockfree_lane<size_t>>(producerCount, consumerCount, elementCount, capacity, batchSize));
+	}
+}
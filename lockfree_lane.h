@@ -0,0 +1,412 @@
+#ifndef AO_LOCKFREE_LANE_H
+#define AO_LOCKFREE_LANE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace ao
+{
+
+/**
+ * @brief A lock-free variant of the @ref lane.
+ * @details
+ * The lockfree_lane has the same interface and semantics as the
+ * lane, including write_end() and the multi-element read and write methods,
+ * but its fast path takes no lock: elements are stored in a bounded
+ * multi-producer/multi-consumer ring in which every cell carries a sequence
+ * number (D. Vyukov's bounded MPMC queue). It can therefore also be used as
+ * a single-producer/single-consumer lane.
+ *
+ * When a read or write can not continue, the thread spins a short while
+ * before it blocks on a condition variable. The opposite side only takes the
+ * mutex to notify when a thread is actually blocked, so in the uncontended
+ * case no system calls are made at all.
+ *
+ * The number of times a reader or writer had to block is always counted,
+ * and can be queried with read_wait_count() and write_wait_count(). These
+ * counters are only changed in the slow path.
+ *
+ * As with the lane, construction, assignment, clear() and resize() are
+ * not thread safe. Elements that are written concurrently with write_end()
+ * may or may not be read; write_end() should be called after all writes have
+ * returned.
+ *
+ * The capacity is rounded up to a power of two.
+ *
+ * @tparam Tp Type of elements to be stored in the lane. Must be default
+ * constructible and move assignable.
+ */
+template<typename Tp>
+class lockfree_lane
+{
+	public:
+		typedef std::size_t size_type;
+
+		typedef Tp value_type;
+
+		lockfree_lane() noexcept :
+			_cells(nullptr),
+			_mask(0),
+			_isEnded(false)
+		{
+			init_positions();
+		}
+
+		explicit lockfree_lane(size_t capacity) :
+			_cells(nullptr),
+			_mask(0),
+			_isEnded(false)
+		{
+			allocate(capacity);
+		}
+
+		~lockfree_lane()
+		{
+			delete[] _cells;
+		}
+
+		lockfree_lane(const lockfree_lane<Tp>&) = delete;
+		lockfree_lane<Tp>& operator=(const lockfree_lane<Tp>&) = delete;
+
+		/** @brief Clear the contents and reset the state of the lane.
+		 * @details After calling clear(), it is as if write_end() has not been called.
+		 * This method is not thread safe.
+		 */
+		void clear() noexcept
+		{
+			for(size_t i=0; i!=capacity(); ++i)
+			{
+				_cells[i].value = Tp();
+				_cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+			init_positions();
+			_isEnded.store(false, std::memory_order_release);
+		}
+
+		/** @brief Write a single element. Blocks while the lane is full.
+		 * @details If this call comes after a call to write_end(), it is ignored.
+		 */
+		void write(const value_type& element)
+		{
+			Tp copy(element);
+			write(std::move(copy));
+		}
+
+		/** @brief Write a single element by moving it in. Blocks while the lane is full.
+		 * @details If this call comes after a call to write_end(), it is ignored.
+		 */
+		void write(value_type&& element)
+		{
+			if(_isEnded.load(std::memory_order_acquire))
+				return;
+			for(size_t spin=0; spin!=spin_limit(); ++spin)
+			{
+				if(try_write(element))
+				{
+					wake_reader();
+					return;
+				}
+				relax();
+			}
+			std::unique_lock<std::mutex> lock(_mutex);
+			_writeWaiterCount.fetch_add(1, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			bool isFirstAttempt = true;
+			while(!_isEnded.load(std::memory_order_acquire))
+			{
+				if(try_write(element))
+				{
+					// The mutex is already held, so notify directly
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if(_readWaiterCount.load(std::memory_order_relaxed) != 0)
+						_readingPossibleCondition.notify_one();
+					break;
+				}
+				if(isFirstAttempt)
+				{
+					_writeWaitCount.fetch_add(1, std::memory_order_relaxed);
+					isFirstAttempt = false;
+				}
+				_writingPossibleCondition.wait(lock);
+			}
+			_writeWaiterCount.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		/** @brief Write multiple elements. Like with the lane, a sequence of
+		 * elements might get interleaved with the elements of other writers. */
+		void write(const value_type* elements, size_t n)
+		{
+			for(size_t i=0; i!=n; ++i)
+				write(elements[i]);
+		}
+
+		void move_write(value_type* elements, size_t n)
+		{
+			for(size_t i=0; i!=n; ++i)
+				write(std::move(elements[i]));
+		}
+
+		/** @brief Read a single element. Blocks while the lane is empty.
+		 * @returns false when the lane is empty and write_end() has been called.
+		 */
+		bool read(value_type& destination)
+		{
+			for(size_t spin=0; spin!=spin_limit(); ++spin)
+			{
+				bool isEnded = _isEnded.load(std::memory_order_acquire);
+				if(try_read(destination))
+				{
+					wake_writer();
+					return true;
+				}
+				// Elements that were written before write_end() were visible to try_read()
+				if(isEnded)
+					return false;
+				relax();
+			}
+			std::unique_lock<std::mutex> lock(_mutex);
+			_readWaiterCount.fetch_add(1, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			bool isFirstAttempt = true, result;
+			while(true)
+			{
+				bool isEnded = _isEnded.load(std::memory_order_acquire);
+				if(try_read(destination))
+				{
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if(_writeWaiterCount.load(std::memory_order_relaxed) != 0)
+						_writingPossibleCondition.notify_one();
+					result = true;
+					break;
+				}
+				if(isEnded)
+				{
+					result = false;
+					break;
+				}
+				if(isFirstAttempt)
+				{
+					_readWaitCount.fetch_add(1, std::memory_order_relaxed);
+					isFirstAttempt = false;
+				}
+				_readingPossibleCondition.wait(lock);
+			}
+			_readWaiterCount.fetch_sub(1, std::memory_order_relaxed);
+			return result;
+		}
+
+		/** @brief Read up to n elements. Blocks until n elements have been read, or
+		 * until the lane is empty and write_end() has been called.
+		 * @returns The number of elements read.
+		 */
+		size_t read(value_type* destinations, size_t n)
+		{
+			size_t i = 0;
+			while(i != n && read(destinations[i]))
+				++i;
+			return i;
+		}
+
+		/** @brief Signal that no more elements will be written. Blocked readers return
+		 * once the remaining elements have been read. */
+		void write_end()
+		{
+			_isEnded.store(true, std::memory_order_seq_cst);
+			std::lock_guard<std::mutex> lock(_mutex);
+			_writingPossibleCondition.notify_all();
+			_readingPossibleCondition.notify_all();
+		}
+
+		size_t capacity() const noexcept
+		{
+			return _cells == nullptr ? 0 : _mask + 1;
+		}
+
+		/** @brief Number of elements in the lane. When other threads are accessing
+		 * the lane, this is only an estimate. */
+		size_t size() const
+		{
+			size_t
+				readPos = _readPosition.load(std::memory_order_acquire),
+				writePos = _writePosition.load(std::memory_order_acquire);
+			return writePos > readPos ? writePos - readPos : 0;
+		}
+
+		bool empty() const
+		{
+			return size() == 0;
+		}
+
+		/** @brief Change the capacity of the lane. This will erase all data in the lane. */
+		void resize(size_t new_capacity)
+		{
+			delete[] _cells;
+			_cells = nullptr;
+			allocate(new_capacity);
+			_isEnded.store(false, std::memory_order_release);
+		}
+
+		/** @brief Number of times a reader had to block because the lane was empty. */
+		size_t read_wait_count() const noexcept
+		{
+			return _readWaitCount.load(std::memory_order_relaxed);
+		}
+
+		/** @brief Number of times a writer had to block because the lane was full. */
+		size_t write_wait_count() const noexcept
+		{
+			return _writeWaitCount.load(std::memory_order_relaxed);
+		}
+
+	private:
+		enum { spin_count = 128, cache_line_size = 64 };
+
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			Tp value;
+		};
+
+		Cell* _cells;
+		size_t _mask;
+
+		// The positions are padded to separate cache lines, so that readers and writers
+		// don't invalidate each other's lines. Padding is used instead of alignas, because
+		// C++11's operator new does not honour extended alignment.
+		char _padding1[cache_line_size];
+		std::atomic<size_t> _writePosition;
+		char _padding2[cache_line_size - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> _readPosition;
+		char _padding3[cache_line_size - sizeof(std::atomic<size_t>)];
+		std::atomic<bool> _isEnded;
+		std::atomic<size_t> _readWaiterCount, _writeWaiterCount;
+		std::atomic<size_t> _readWaitCount, _writeWaitCount;
+
+		std::mutex _mutex;
+		std::condition_variable _writingPossibleCondition, _readingPossibleCondition;
+
+		void allocate(size_t capacity)
+		{
+			size_t roundedCapacity = 1;
+			while(roundedCapacity < capacity)
+				roundedCapacity *= 2;
+			_cells = new Cell[roundedCapacity];
+			_mask = roundedCapacity - 1;
+			for(size_t i=0; i!=roundedCapacity; ++i)
+				_cells[i].sequence.store(i, std::memory_order_relaxed);
+			init_positions();
+		}
+
+		void init_positions() noexcept
+		{
+			_writePosition.store(0, std::memory_order_relaxed);
+			_readPosition.store(0, std::memory_order_relaxed);
+			_readWaiterCount.store(0, std::memory_order_relaxed);
+			_writeWaiterCount.store(0, std::memory_order_relaxed);
+			_readWaitCount.store(0, std::memory_order_relaxed);
+			_writeWaitCount.store(0, std::memory_order_relaxed);
+		}
+
+		// Spinning only makes sense when the other side can run at the same time
+		static size_t spin_limit() noexcept
+		{
+			static const size_t limit = std::thread::hardware_concurrency() > 1 ? spin_count : 0;
+			return limit;
+		}
+
+		static void relax() noexcept
+		{
+#if defined(__x86_64__) || defined(__i386__)
+			_mm_pause();
+#else
+			std::this_thread::yield();
+#endif
+		}
+
+		bool try_write(value_type& element)
+		{
+			if(_cells == nullptr)
+				return false;
+			size_t pos = _writePosition.load(std::memory_order_relaxed);
+			Cell* cell;
+			while(true)
+			{
+				cell = &_cells[pos & _mask];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				std::ptrdiff_t difference = std::ptrdiff_t(sequence) - std::ptrdiff_t(pos);
+				if(difference == 0)
+				{
+					if(_writePosition.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if(difference < 0)
+					return false; // full
+				else
+					pos = _writePosition.load(std::memory_order_relaxed);
+			}
+			cell->value = std::move(element);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool try_read(value_type& destination)
+		{
+			if(_cells == nullptr)
+				return false;
+			size_t pos = _readPosition.load(std::memory_order_relaxed);
+			Cell* cell;
+			while(true)
+			{
+				cell = &_cells[pos & _mask];
+				size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				std::ptrdiff_t difference = std::ptrdiff_t(sequence) - std::ptrdiff_t(pos + 1);
+				if(difference == 0)
+				{
+					if(_readPosition.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if(difference < 0)
+					return false; // empty
+				else
+					pos = _readPosition.load(std::memory_order_relaxed);
+			}
+			destination = std::move(cell->value);
+			cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+			return true;
+		}
+
+		// The waiter counts are incremented before a blocked thread checks the lane
+		// for the last time, and the fences make sure that either that check
+		// succeeds or the waiter is seen here. Hence, the mutex is only taken when
+		// a thread is actually blocked.
+		void wake_reader()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(_readWaiterCount.load(std::memory_order_relaxed) != 0)
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_readingPossibleCondition.notify_one();
+			}
+		}
+
+		void wake_writer()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(_writeWaiterCount.load(std::memory_order_relaxed) != 0)
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_writingPossibleCondition.notify_one();
+			}
+		}
+};
+
+}
+
+#endif
@@ -49,6 +49,24 @@ bool isFitsFile(const std::string &filename)
 	return false;
 }
 
+bool isColumnarFile(const std::string &filename)
+{
+	if(filename.size() > 5)
+	{
+		return boost::to_upper_copy(filename.substr(filename.size()-5)) == ".CVIS";
+	}
+	return false;
+}
+
+bool isSharedMemoryName(const std::string &filename)
+{
+	if(filename.size() > 4)
+	{
+		return boost::to_upper_copy(filename.substr(filename.size()-4)) == ".SHM";
+	}
+	return false;
+}
+
 bool isMWAFlagFile(const std::string &filename)
 {
 	if(filename.size() > 5)
@@ -65,13 +83,51 @@ void usage()
 	"  -o <filename>      Save output to given filename. Default is 'preprocessed.ms'.\n"
 	"                     If the files' extension is .uvfits, it will be outputted in uvfits format\n"
 	"                     and extension .mwaf is the flag-only format for input into the RTS.\n"
+	"                     Extension .cvis writes a memory-mappable columnar format, which can be\n"
+	"                     converted to a measurement set with cvis2ms.\n"
+	"                     Extension .shm publishes the timesteps in a POSIX shared memory segment of\n"
+	"                     that name, for a consumer on the same node (see sharedmemoryreader.h).\n"
+	"  -shm-slots <n>     Number of timesteps that fit in the shared memory ring (default: 4).\n"
+	"  -pols <xx,yy|all>  Write only the XX and YY polarizations, or all four (default). Flagging and\n"
+	"                     statistics still use all polarizations, and solutions are then applied before\n"
+	"                     the cross-polarizations are dropped.\n"
+	"  -flagversion <n>   Version of the .mwaf format to write: 1 (FITS, default) or 2 (compressed,\n"
+	"                     indexed binary format). Both versions can be read with -flagfiles.\n"
 	"  -m <filename>      Read meta data from given fits filename..\n"
 	"  -a <filename>      Read antenna locations from given text file (overrides the metadata).\n"
 	"  -h <filename>      Read header data from given text file (overrides the metadata.)\n"
 	"  -i <filename>      Read meta data from given fits filename (overrides the metadata).\n"
 	"  -mem <percentage>  Use at most the given percentage of memory.\n"
 	"  -absmem <gb>       Use at most the given amount of memory, specified in gigabytes.\n"
+	"                     Memory limits of the cgroup that Cotter runs in are always honoured.\n"
+	"  -dryrun            Print the memory plan (chunking, threads and predicted peak memory) and\n"
+	"                     exit without reading or writing data.\n"
+	"  -stream <window> <overlap>\n"
+	"                     Process the observation in windows of the given number of scans, instead of in\n"
+	"                     as few chunks as fit in memory, and write each window as soon as it is flagged.\n"
+	"                     Every window is flagged together with <overlap> scans on both sides, which are\n"
+	"                     kept from the previous window instead of read again, but not written twice.\n"
+	"  -chunkoverlap <n>  When the observation does not fit in memory, flag every chunk together with n scans\n"
+	"                     of the neighbouring chunks on both sides (default: 0). This avoids flagging\n"
+	"                     artefacts at the chunk boundaries; the chunks are made smaller to fit the overlap.\n"
+	"  -memlog <file>     Write the memory use per subsystem (image sets, flag masks, reader, averaging,\n"
+	"                     writer queues, flag writer and statistics) and the process RSS after every\n"
+	"                     stage of every chunk as a JSON time series. A breakdown is always printed\n"
+	"                     after every chunk and at the end.\n"
+	"  -metrics <dest>    Write the progress and throughput (stage, chunk, percent done, bytes read/s,\n"
+	"                     baselines/s, rows written/s, queue depths and ETA) as one JSON object per\n"
+	"                     line to the given file, or to a Unix socket with 'unix:<path>'.\n"
+	"  -metricsinterval <s> Interval between the metrics lines in seconds (default: 1).\n"
+	"  -trace <file.json> Record what every thread does in each stage, print a summary per stage and\n"
+	"                     thread, and write the spans as Chrome trace events (for chrome://tracing or\n"
+	"                     Perfetto).\n"
+	"  -perf              Count the cycles, instructions and cache misses of every stage and thread with\n"
+	"                     the hardware performance counters (Linux perf_event_open), and print them with\n"
+	"                     an estimate of the memory bandwidth in the summary at the end.\n"
 	"  -j <ncpus>         Number of CPUs to use. Default is to use all.\n"
+	"  -numa              Partition the baselines over the NUMA nodes, and keep their buffers and\n"
+	"                     the threads that process them on the same node.\n"
+	"  -hugepages         Ask the kernel to back the visibility and flag buffers with transparent huge pages.\n"
 	"  -timeres <s>       Average nr of sec of timesteps together before writing to measurement set.\n"
 	"  -freqres <kHz>     Average kHz bandwidth of channels together before writing to measurement set.\n"
 	"                     When averaging: flagging, collecting statistics and cable length fixes are done\n"
@@ -94,6 +150,11 @@ void usage()
 	"  -sbstart <number>  Number of first GPU box. Default: 1.\n"
 	"  -sbpassband <file> Read the sub-band passband from given file instead of using default passband.\n"
 	"                     (default passband does a reasonably good job)\n"
+	"  -scanrange <start> <end>\n"
+	"                     Only read and process the zero-indexed scans start up to (not including) end.\n"
+	"  -chanrange <start> <end>\n"
+	"                     Only read and process the zero-indexed fine channels start up to (not including)\n"
+	"                     end of each sub-band. Can not be combined with -flagfiles.\n"
 	"  -flagantenna <lst> Mark the comma-separated list of zero-indexed antennae as flagged antennae.\n"
 	"  -flagsubband <lst> Flag the comma-separated list of zero-indexed sub-bands.\n"
 	"  -edgewidth <kHz>   Flag the given width of edge channels of each sub-band (default: 80 kHz).\n"
@@ -106,11 +167,15 @@ void usage()
 	"                     These will be stored in the quality statistics tables viewable with aoqplot.\n"
 	"  -offline-gpubox-format Assume the GPU Box do not have an initial HDU for metadata. This is\n"
 	"                     used for offline correlation of VCS observations.\n"
+	"  -hduindex <dir>    Keep an index of the HDUs of every GPU file in the given directory. Later runs\n"
+	"                     on the same files then start without reading all headers.\n"
 	"  -skipwrite         Skip the writing step completely: only collect statistics.\n"
 	"  -apply <file>      Apply a solution file after averaging. The solution file should have as many\n"
 	"                     channels as that the observation will have after the given averaging settings.\n"
 	"  -full-apply <file> Apply a solution file before averaging. The solution file should have as many\n"
 	"                     channels as the observation.\n"
+	"  -parallel-apply <file> Like -full-apply, but apply the solutions while processing the baselines,\n"
+	"                     which uses all threads instead of one.\n"
 	"  -use-dysco         Compress the Measurement Set using Dysco.\n"
 	"  -dysco-config <data bits> <weight bits> <distribution> <truncation> <normalization>\n"
 	"                     Set advanced Dysco options.\n"
@@ -170,6 +235,16 @@ int cotterMain(int argc, const char* const* argv)
 					cotter.SetFlagAutoCorrelations(false);
 					cotter.SetOutputFormat(Cotter::FitsOutputFormat);
 				}
+				else if(isColumnarFile(outputFilename))
+				{
+					cotter.SetCollectStatistics(saveQualityStatistics);
+					cotter.SetOutputFormat(Cotter::ColumnarOutputFormat);
+				}
+				else if(isSharedMemoryName(outputFilename))
+				{
+					cotter.SetCollectStatistics(saveQualityStatistics);
+					cotter.SetOutputFormat(Cotter::SharedMemoryOutputFormat);
+				}
 				else if(isMWAFlagFile(outputFilename))
 				{
 					cotter.SetCollectStatistics(saveQualityStatistics);
@@ -202,6 +277,14 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				nCPUs = atoi(argv[argi]);
 			}
+			else if(param == "numa")
+			{
+				cotter.SetNUMAMode(true);
+			}
+			else if(param == "hugepages")
+			{
+				cotter.SetUseHugePages(true);
+			}
 			else if(param == "mem")
 			{
 				++argi;
@@ -212,6 +295,49 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				memLimit = atof(argv[argi]);
 			}
+			else if(param == "dryrun")
+			{
+				cotter.SetDryRun(true);
+			}
+			else if(param == "stream")
+			{
+				++argi;
+				size_t windowScans = atoi(argv[argi]);
+				++argi;
+				size_t overlapScans = atoi(argv[argi]);
+				if(windowScans == 0)
+					throw std::runtime_error("The window of -stream should have at least one scan");
+				cotter.SetStreaming(windowScans, overlapScans);
+			}
+			else if(param == "chunkoverlap")
+			{
+				++argi;
+				cotter.SetChunkOverlap(atoi(argv[argi]));
+			}
+			else if(param == "memlog")
+			{
+				++argi;
+				cotter.SetMemoryLogFilename(argv[argi]);
+			}
+			else if(param == "metrics")
+			{
+				++argi;
+				cotter.SetMetricsDestination(argv[argi]);
+			}
+			else if(param == "metricsinterval")
+			{
+				++argi;
+				cotter.SetMetricsInterval(atof(argv[argi]));
+			}
+			else if(param == "trace")
+			{
+				++argi;
+				cotter.SetTraceFilename(argv[argi]);
+			}
+			else if(param == "perf")
+			{
+				cotter.SetCountPerfEvents(true);
+			}
 			else if(param == "noflagautos")
 			{
 				cotter.SetFlagAutoCorrelations(false);
@@ -305,6 +431,22 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				cotter.SetReadSubbandPassbandFile(argv[argi]);
 			}
+			else if(param == "scanrange")
+			{
+				++argi;
+				size_t scanStart = atoi(argv[argi]);
+				++argi;
+				size_t scanEnd = atoi(argv[argi]);
+				cotter.SetScanSelection(scanStart, scanEnd);
+			}
+			else if(param == "chanrange")
+			{
+				++argi;
+				size_t channelStart = atoi(argv[argi]);
+				++argi;
+				size_t channelEnd = atoi(argv[argi]);
+				cotter.SetChannelSelection(channelStart, channelEnd);
+			}
 			else if(param == "initflag")
 			{
 				++argi;
@@ -346,6 +488,29 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				cotter.SetSubbandEdgeFlagWidth(atoi(argv[argi]));
 			}
+			else if(param == "flagversion")
+			{
+				++argi;
+				cotter.SetFlagFileVersion(atoi(argv[argi]));
+			}
+			else if(param == "shm-slots")
+			{
+				++argi;
+				cotter.SetSharedMemorySlotCount(atoi(argv[argi]));
+			}
+			else if(param == "pols")
+			{
+				++argi;
+				const std::string pols = argv[argi];
+				if(pols == "xx,yy" || pols == "XX,YY")
+					cotter.SetPolarizationCount(2);
+				else if(pols == "all")
+					cotter.SetPolarizationCount(4);
+				else {
+					std::cout << "Invalid value for -pols: " << pols << " (should be xx,yy or all)\n";
+					return -1;
+				}
+			}
 			else if(param == "flagfiles")
 			{
 				++argi;
@@ -369,17 +534,31 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				cotter.SetOfflineGPUBoxFormat(true);
 			}
+			else if(param == "hduindex")
+			{
+				++argi;
+				cotter.SetHDUIndexDirectory(argv[argi]);
+			}
 			else if(param == "apply")
 			{
 				++argi;
 				cotter.SetSolutionFile(argv[argi]);
 				cotter.SetApplyBeforeAveraging(false);
+				cotter.SetApplyInBaselineProcessing(false);
 			}
 			else if(param == "full-apply")
 			{
 				++argi;
 				cotter.SetSolutionFile(argv[argi]);
 				cotter.SetApplyBeforeAveraging(true);
+				cotter.SetApplyInBaselineProcessing(false);
+			}
+			else if(param == "parallel-apply")
+			{
+				++argi;
+				cotter.SetSolutionFile(argv[argi]);
+				cotter.SetApplyBeforeAveraging(true);
+				cotter.SetApplyInBaselineProcessing(true);
 			}
 			else if(param == "use-dysco")
 			{
@@ -479,9 +658,15 @@ int cotterMain(int argc, const char* const* argv)
 		memSize = int64_t(memLimit * (1024.0*1024.0*1024.0));
 		memPercentage = 100.0;
 	}
+	int64_t cgroupLimit = MemoryPlanner::CGroupMemoryLimit();
+	if(cgroupLimit != 0 && cgroupLimit < memSize)
+	{
+		std::cout << "Memory is limited by cgroup to " << round(double(cgroupLimit) / (1024.0*1024.0*102.4))/10.0 << " GB.\n";
+		memSize = cgroupLimit;
+	}
 	
 	cotter.SetFileSets(fileSets);
-	cotter.SetMaxBufferSize(memSize*memPercentage/(100*(sizeof(float)*2+1)));
+	cotter.SetMemoryLimit(memSize*memPercentage/100.0);
 	if(nCPUs == 0)
 		cotter.SetThreadCount(sysconf(_SC_NPROCESSORS_ONLN));
 	else
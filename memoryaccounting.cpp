@@ -0,0 +1,176 @@
+#include "memoryaccounting.h"
+#include "memoryplanner.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	std::atomic<int64_t> currentBytes[MemoryAccounting::CategoryCount];
+	std::atomic<int64_t> peakBytes[MemoryAccounting::CategoryCount];
+
+	std::mutex timeSeriesMutex;
+	std::ofstream timeSeriesFile;
+	bool isFirstSample = true;
+	std::chrono::steady_clock::time_point timeSeriesEpoch;
+
+	// The names in the JSON time series
+	const char* categoryKey(MemoryAccounting::Category category)
+	{
+		switch(category)
+		{
+			case MemoryAccounting::ImageSetCategory: return "imageSets";
+			case MemoryAccounting::FlagMaskCategory: return "flagMasks";
+			case MemoryAccounting::ReaderCategory: return "reader";
+			case MemoryAccounting::AveragingCategory: return "averaging";
+			case MemoryAccounting::WriterQueueCategory: return "writerQueues";
+			case MemoryAccounting::FlagWriterCategory: return "flagWriter";
+			case MemoryAccounting::StatisticsCategory: return "statistics";
+			case MemoryAccounting::CategoryCount: break;
+		}
+		return "unknown";
+	}
+
+	size_t trackedBytes()
+	{
+		size_t total = 0;
+		for(size_t c=0; c!=MemoryAccounting::CategoryCount; ++c)
+			total += MemoryAccounting::Current(MemoryAccounting::Category(c));
+		return total;
+	}
+}
+
+void MemoryAccounting::Add(Category category, int64_t bytes)
+{
+	if(bytes == 0)
+		return;
+	const int64_t value = currentBytes[category].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	int64_t peak = peakBytes[category].load(std::memory_order_relaxed);
+	while(value > peak && !peakBytes[category].compare_exchange_weak(peak, value, std::memory_order_relaxed))
+	{ }
+}
+
+size_t MemoryAccounting::Current(Category category)
+{
+	const int64_t value = currentBytes[category].load(std::memory_order_relaxed);
+	return value > 0 ? value : 0;
+}
+
+size_t MemoryAccounting::Peak(Category category)
+{
+	return peakBytes[category].load(std::memory_order_relaxed);
+}
+
+MemoryAccounting::ProcessMemory MemoryAccounting::ReadProcessMemory()
+{
+	ProcessMemory memory{0, 0};
+	// The values are given in kB, e.g. 'VmRSS:	  123456 kB'
+	std::ifstream statusFile("/proc/self/status");
+	std::string key;
+	size_t value;
+	while(statusFile >> key)
+	{
+		if(key == "VmRSS:" && statusFile >> value)
+			memory.rss = value * 1024;
+		else if(key == "VmHWM:" && statusFile >> value)
+			memory.peakRss = value * 1024;
+		statusFile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+	}
+	return memory;
+}
+
+void MemoryAccounting::WriteLine(std::ostream& stream)
+{
+	const ProcessMemory memory = ReadProcessMemory();
+	stream << "Memory: RSS " << MemoryPlanner::FormatBytes(memory.rss) << " (peak " << MemoryPlanner::FormatBytes(memory.peakRss) << ")";
+	// Categories that were never used, such as averaging without averaging, are left out
+	const char* separator = "; ";
+	for(size_t c=0; c!=CategoryCount; ++c)
+	{
+		if(Peak(Category(c)) != 0)
+		{
+			stream << separator << CategoryName(Category(c)) << ' ' << MemoryPlanner::FormatBytes(Current(Category(c)));
+			separator = ", ";
+		}
+	}
+	stream << '\n';
+}
+
+void MemoryAccounting::WriteBreakdown(std::ostream& stream)
+{
+	const ProcessMemory memory = ReadProcessMemory();
+	const std::ios_base::fmtflags oldFlags = stream.flags();
+	stream << "Memory use per subsystem:\n"
+		<< "  " << std::left << std::setw(22) << "subsystem" << std::right << std::setw(12) << "current" << std::setw(12) << "peak" << '\n';
+	for(size_t c=0; c!=CategoryCount; ++c)
+	{
+		stream << "  " << std::left << std::setw(22) << CategoryName(Category(c)) << std::right
+			<< std::setw(12) << MemoryPlanner::FormatBytes(Current(Category(c)))
+			<< std::setw(12) << MemoryPlanner::FormatBytes(Peak(Category(c))) << '\n';
+	}
+	const size_t tracked = trackedBytes();
+	stream << "  " << std::left << std::setw(22) << "untracked" << std::right
+		<< std::setw(12) << (memory.rss > tracked ? MemoryPlanner::FormatBytes(memory.rss - tracked) : std::string("-")) << '\n'
+		<< "  " << std::left << std::setw(22) << "process RSS" << std::right
+		<< std::setw(12) << MemoryPlanner::FormatBytes(memory.rss) << std::setw(12) << MemoryPlanner::FormatBytes(memory.peakRss) << '\n';
+	stream.flags(oldFlags);
+}
+
+void MemoryAccounting::OpenTimeSeries(const std::string& filename)
+{
+	std::lock_guard<std::mutex> lock(timeSeriesMutex);
+	timeSeriesFile.open(filename);
+	if(!timeSeriesFile)
+		throw std::runtime_error("Could not create memory time series file " + filename);
+	timeSeriesFile << "[";
+	isFirstSample = true;
+	timeSeriesEpoch = std::chrono::steady_clock::now();
+}
+
+void MemoryAccounting::Sample(const std::string& label)
+{
+	std::lock_guard<std::mutex> lock(timeSeriesMutex);
+	if(!timeSeriesFile.is_open())
+		return;
+	const ProcessMemory memory = ReadProcessMemory();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeSeriesEpoch).count();
+	// The labels are written by Cotter itself, and need no escaping
+	timeSeriesFile << (isFirstSample ? "\n" : ",\n")
+		<< "{\"time\":" << std::fixed << std::setprecision(3) << seconds
+		<< ",\"label\":\"" << label << "\",\"rss\":" << memory.rss << ",\"peakRss\":" << memory.peakRss;
+	for(size_t c=0; c!=CategoryCount; ++c)
+		timeSeriesFile << ",\"" << categoryKey(Category(c)) << "\":" << Current(Category(c));
+	timeSeriesFile << '}' << std::flush;
+	isFirstSample = false;
+}
+
+void MemoryAccounting::CloseTimeSeries()
+{
+	std::lock_guard<std::mutex> lock(timeSeriesMutex);
+	if(timeSeriesFile.is_open())
+	{
+		timeSeriesFile << "\n]\n";
+		timeSeriesFile.close();
+	}
+}
+
+const char* MemoryAccounting::CategoryName(Category category)
+{
+	switch(category)
+	{
+		case ImageSetCategory: return "image sets";
+		case FlagMaskCategory: return "flag masks";
+		case ReaderCategory: return "reader buffers";
+		case AveragingCategory: return "averaging buffers";
+		case WriterQueueCategory: return "writer queues";
+		case FlagWriterCategory: return "flag writer";
+		case StatisticsCategory: return "statistics (estimate)";
+		case CategoryCount: break;
+	}
+	return "unknown";
+}
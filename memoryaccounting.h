@@ -0,0 +1,85 @@
+#ifndef MEMORY_ACCOUNTING_H
+#define MEMORY_ACCOUNTING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/**
+ * Counts the bytes of the large allocations of Cotter per subsystem, to see which
+ * of them grew when a run uses more memory than the MemoryPlanner predicted. The
+ * owners of the buffers report their sizes with a TrackedBytes member; the counts
+ * are atomic, so that buffers may be allocated from several threads.
+ *
+ * The counted bytes are compared with the resident set size (RSS) of the process
+ * and its high-water mark, which also include the untracked allocations, such as
+ * those of the libraries and the flagger's working memory. The sizes of the quality
+ * statistics are internal to AOFlagger, and are the estimate of the planner.
+ *
+ * Optionally, samples are written as a JSON time series. Every sample is flushed,
+ * so that the file is useful after Cotter got killed; the closing bracket of the
+ * array is then missing.
+ */
+class MemoryAccounting
+{
+	public:
+		enum Category {
+			ImageSetCategory, FlagMaskCategory, ReaderCategory, AveragingCategory,
+			WriterQueueCategory, FlagWriterCategory, StatisticsCategory,
+			CategoryCount
+		};
+
+		struct ProcessMemory
+		{
+			/** Zero when /proc/self/status can't be read. */
+			size_t rss, peakRss;
+		};
+
+		/** Adds a (possibly negative) number of bytes to a category. */
+		static void Add(Category category, int64_t bytes);
+		static size_t Current(Category category);
+		/** The largest value of Current() since the start of the process. */
+		static size_t Peak(Category category);
+		static ProcessMemory ReadProcessMemory();
+
+		/** Writes a one-line breakdown of the current sizes, e.g. after a chunk. */
+		static void WriteLine(std::ostream& stream);
+		/** Writes a table with the current and peak sizes. */
+		static void WriteBreakdown(std::ostream& stream);
+
+		/** Starts writing samples to a JSON file; throws when the file can't be created. */
+		static void OpenTimeSeries(const std::string& filename);
+		/** Writes a sample to the time series, if one is open. */
+		static void Sample(const std::string& label);
+		static void CloseTimeSeries();
+
+		static const char* CategoryName(Category category);
+};
+
+/**
+ * The size of a buffer that is counted in a category of MemoryAccounting. The
+ * bytes are removed from the category on destruction.
+ */
+class TrackedBytes
+{
+	public:
+		explicit TrackedBytes(MemoryAccounting::Category category) : _category(category), _bytes(0) { }
+		~TrackedBytes() { Set(0); }
+
+		void Set(size_t bytes)
+		{
+			MemoryAccounting::Add(_category, int64_t(bytes) - int64_t(_bytes));
+			_bytes = bytes;
+		}
+		size_t Get() const { return _bytes; }
+
+		TrackedBytes(const TrackedBytes&) = delete;
+		TrackedBytes& operator=(const TrackedBytes&) = delete;
+
+	private:
+		MemoryAccounting::Category _category;
+		size_t _bytes;
+};
+
+#endif
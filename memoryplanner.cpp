@@ -0,0 +1,241 @@
+#include "memoryplanner.h"
+
+#include <algorithm>
+#include <complex>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <string>
+
+namespace {
+	// Bytes per visibility in the image sets: real and imaginary floats for 4 polarizations
+	const size_t visibilityBytesPerSample = 8 * sizeof(float);
+	// The flagger makes a few full-size copies of a baseline while flagging it
+	const size_t flaggerCopiesPerThread = 3;
+	// Statistics are kept per baseline, per timestep and per channel, for every polarization
+	const size_t statisticBytesPerEntry = 4 * 128;
+	const size_t histogramBytesPerBaseline = 4 * 8192;
+	// Libraries, metadata, output writers and other small allocations
+	const size_t baseBytes = size_t(256) << 20;
+	// Below this number of scans per chunk, flagging becomes inaccurate
+	const size_t minimumScansForFlagging = 20;
+
+	size_t readLimitFile(const std::string& filename)
+	{
+		std::ifstream file(filename);
+		std::string value;
+		if(!file || !(file >> value) || value == "max")
+			return 0;
+		unsigned long long limit = std::strtoull(value.c_str(), nullptr, 10);
+		// cgroup v1 reports a huge number (rounded down to the page size) when unlimited
+		if(limit >= (std::numeric_limits<unsigned long long>::max() >> 2))
+			return 0;
+		return limit;
+	}
+}
+
+std::string MemoryPlanner::FormatBytes(size_t bytes)
+{
+	std::ostringstream str;
+	if(bytes >= (size_t(1) << 30))
+		str << std::fixed << std::setprecision(2) << double(bytes) / double(size_t(1) << 30) << " GB";
+	else
+		str << std::fixed << std::setprecision(1) << double(bytes) / double(size_t(1) << 20) << " MB";
+	return str.str();
+}
+
+size_t MemoryPlanner::StatisticsBytes(size_t baselineCount, size_t scanCount, size_t channelCount, bool collectHistograms)
+{
+	size_t bytes = (baselineCount + scanCount + channelCount) * statisticBytesPerEntry;
+	if(collectHistograms)
+		bytes += baselineCount * histogramBytesPerBaseline;
+	return bytes;
+}
+
+MemoryPlanner::Plan MemoryPlanner::evaluate(const Parameters& parameters, size_t threadCount, size_t gpuMatrixBufferCount)
+{
+	const size_t
+		nBaselines = parameters.antennaCount * (parameters.antennaCount + 1) / 2,
+		nChannels = parameters.channelCount;
+
+	Plan plan;
+	plan.threadCount = threadCount;
+	plan.gpuMatrixBufferCount = gpuMatrixBufferCount;
+	plan.taskQueueCapacity = std::max<size_t>(threadCount * 16, 256);
+	plan.memoryLimit = parameters.memoryLimit;
+	plan.baseBytes = baseBytes;
+
+	plan.readerBytes = gpuMatrixBufferCount * nChannels * nBaselines * 4 * sizeof(std::complex<float>) / std::max<size_t>(parameters.fileCount, 1);
+
+	if(parameters.averagedChannelCount != 0)
+	{
+		// Data, unflagged data, flags, weights and counts (see AveragingWriter::Buffer)
+		const size_t bytesPerChannel = parameters.polarizationCount * (2 * sizeof(std::complex<float>) + sizeof(bool) + sizeof(float) + sizeof(size_t));
+		plan.averagingBytes = nBaselines * parameters.averagedChannelCount * bytesPerChannel;
+	}
+	else {
+		plan.averagingBytes = 0;
+	}
+
+	if(parameters.collectStatistics)
+	{
+		// One statistics object per worker, one for the calling thread and the total
+		const size_t statisticsCount = threadCount + 2;
+		plan.statisticsBytes = statisticsCount * StatisticsBytes(nBaselines, parameters.scanCount, nChannels, parameters.collectHistograms);
+	}
+	else {
+		plan.statisticsBytes = 0;
+	}
+
+	// The output row buffers of Cotter and of at most two threaded writers
+	const size_t rowBytes = nChannels * 4 * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float));
+	plan.queueBytes = 3 * rowBytes + plan.taskQueueCapacity * sizeof(std::function<void()>);
+
+	if(parameters.flagWriterTimestepCount != 0)
+	{
+		// The bit-packed flags of all files for a batch of timesteps (an encoded baseline is at
+		// most one byte larger), plus the transposed flags of a tile of 128 baselines per thread
+		const size_t
+			timestepCount = std::min(parameters.flagWriterTimestepCount, std::max<size_t>(parameters.scanCount, 1)),
+			fileCount = std::max<size_t>(parameters.fileCount, 1),
+			channelsPerFile = nChannels / fileCount;
+		plan.flagWriterBytes = timestepCount * nBaselines * fileCount * ((channelsPerFile + 7) / 8 + 1) +
+			threadCount * 128 * timestepCount * channelsPerFile;
+	}
+	else {
+		plan.flagWriterBytes = 0;
+	}
+
+	const size_t fixedBytes = plan.baseBytes + plan.readerBytes + plan.averagingBytes + plan.statisticsBytes + plan.queueBytes + plan.flagWriterBytes;
+	const size_t
+		visibilityBytesPerScan = nBaselines * nChannels * visibilityBytesPerSample,
+		// One mask per baseline, plus the correlator and 'fully set' masks
+		flagBytesPerScan = (nBaselines + 2) * nChannels,
+		flaggerBytesPerScan = parameters.rfiDetection ? threadCount * flaggerCopiesPerThread * nChannels * visibilityBytesPerSample : 0,
+		bytesPerScan = visibilityBytesPerScan + flagBytesPerScan + flaggerBytesPerScan;
+
+	size_t maxScansPerChunk = 0;
+	if(parameters.memoryLimit > fixedBytes)
+		maxScansPerChunk = (parameters.memoryLimit - fixedBytes) / bytesPerScan;
+	plan.fitsInLimit = maxScansPerChunk >= 1;
+	maxScansPerChunk = std::max<size_t>(maxScansPerChunk, 1);
+
+	const size_t scanCount = std::max<size_t>(parameters.scanCount, 1);
+	if(scanCount <= maxScansPerChunk)
+	{
+		plan.chunkCount = 1;
+		plan.overlapScanCount = 0;
+	}
+	else {
+		// The overlap takes buffer space from the written scans, but at least one scan
+		// per chunk is written
+		plan.overlapScanCount = std::min(parameters.overlapScanCount, (maxScansPerChunk - 1) / 2);
+		const size_t maxWrittenScans = maxScansPerChunk - 2 * plan.overlapScanCount;
+		plan.chunkCount = (scanCount + maxWrittenScans - 1) / maxWrittenScans;
+	}
+	// Spread the scans evenly over the chunks
+	plan.scansPerChunk = (scanCount + plan.chunkCount - 1) / plan.chunkCount;
+	plan.bufferedScansPerChunk = std::min(plan.scansPerChunk + 2 * plan.overlapScanCount, scanCount);
+
+	plan.visibilityBytes = plan.bufferedScansPerChunk * visibilityBytesPerScan;
+	plan.flagMaskBytes = plan.bufferedScansPerChunk * flagBytesPerScan;
+	plan.flaggerBytes = plan.bufferedScansPerChunk * flaggerBytesPerScan;
+	return plan;
+}
+
+MemoryPlanner::Plan MemoryPlanner::Make(const Parameters& parameters)
+{
+	const size_t requestedThreads = std::max<size_t>(parameters.threadCount, 1);
+	Plan plan = evaluate(parameters, requestedThreads, requestedThreads);
+	if(!parameters.mayReduceThreads)
+		return plan;
+
+	// When memory is short, first use fewer GPU matrix buffers and then fewer threads, until
+	// enough scans fit in a chunk for accurate flagging. This is only done when it helps:
+	// otherwise, the speed is kept. The overlapping scans are flagged too, so they count.
+	const size_t targetScans = std::min(parameters.scanCount, parameters.rfiDetection ? minimumScansForFlagging : size_t(1));
+	if(plan.bufferedScansPerChunk >= targetScans && plan.fitsInLimit)
+		return plan;
+	const Plan minimalPlan = evaluate(parameters, 1, 1);
+	if(minimalPlan.bufferedScansPerChunk < targetScans && plan.fitsInLimit)
+		return plan;
+	size_t threads = requestedThreads;
+	while(plan.bufferedScansPerChunk < targetScans || !plan.fitsInLimit)
+	{
+		size_t gpuMatrixBuffers = std::min<size_t>(threads, 2);
+		if(plan.gpuMatrixBufferCount > gpuMatrixBuffers)
+			plan = evaluate(parameters, threads, gpuMatrixBuffers);
+		else if(threads > 1)
+		{
+			threads = threads / 2;
+			plan = evaluate(parameters, threads, std::min<size_t>(threads, 2));
+		}
+		else
+			break;
+	}
+	return plan;
+}
+
+void MemoryPlanner::Plan::Report(std::ostream& stream) const
+{
+	stream
+		<< "Memory plan: " << chunkCount << " chunk(s) of at most " << scansPerChunk << " scans, ";
+	if(overlapScanCount != 0)
+		stream << "overlapping by " << overlapScanCount << " scans on both sides, ";
+	stream
+		<< threadCount << " thread(s), " << gpuMatrixBufferCount << " GPU matrix buffer(s), task queue of " << taskQueueCapacity << ".\n"
+		<< "  Visibility buffers:  " << FormatBytes(visibilityBytes) << '\n'
+		<< "  Flag masks:          " << FormatBytes(flagMaskBytes) << '\n'
+		<< "  Flagger working set: " << FormatBytes(flaggerBytes) << '\n'
+		<< "  Reader buffers:      " << FormatBytes(readerBytes) << '\n'
+		<< "  Averaging buffers:   " << FormatBytes(averagingBytes) << '\n'
+		<< "  Quality statistics:  " << FormatBytes(statisticsBytes) << '\n'
+		<< "  Queues:              " << FormatBytes(queueBytes) << '\n'
+		<< "  Flag writer:         " << FormatBytes(flagWriterBytes) << '\n'
+		<< "  Base:                " << FormatBytes(baseBytes) << '\n'
+		<< "  Predicted peak RSS:  " << FormatBytes(PeakBytes()) << " (limit: " << FormatBytes(memoryLimit) << ")\n";
+	if(!fitsInLimit)
+		stream << "  The limit is not even enough for one scan per chunk!\n";
+}
+
+size_t MemoryPlanner::CGroupMemoryLimit()
+{
+	size_t limit = 0;
+	auto applyLimit = [&limit](size_t newLimit)
+	{
+		if(newLimit != 0 && (limit == 0 || newLimit < limit))
+			limit = newLimit;
+	};
+
+	// Each line has the form 'hierarchy-id:controllers:path'. The v2 hierarchy has id 0
+	// and no controllers.
+	std::ifstream cgroupFile("/proc/self/cgroup");
+	std::string line;
+	while(std::getline(cgroupFile, line))
+	{
+		size_t firstColon = line.find(':'), secondColon = line.find(':', firstColon + 1);
+		if(firstColon == std::string::npos || secondColon == std::string::npos)
+			continue;
+		const std::string
+			controllers = line.substr(firstColon + 1, secondColon - firstColon - 1),
+			path = line.substr(secondColon + 1);
+		if(controllers.empty())
+			applyLimit(readLimitFile("/sys/fs/cgroup" + path + "/memory.max"));
+		else {
+			std::istringstream controllerList(controllers);
+			std::string controller;
+			while(std::getline(controllerList, controller, ','))
+			{
+				if(controller == "memory")
+					applyLimit(readLimitFile("/sys/fs/cgroup/memory" + path + "/memory.limit_in_bytes"));
+			}
+		}
+	}
+	// Inside a container with its own cgroup namespace, the limit is at the root of the mount
+	applyLimit(readLimitFile("/sys/fs/cgroup/memory.max"));
+	applyLimit(readLimitFile("/sys/fs/cgroup/memory/memory.limit_in_bytes"));
+	return limit;
+}
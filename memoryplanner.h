@@ -0,0 +1,90 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+/**
+ * Models the major allocations of a Cotter run, and uses the model to decide
+ * in how many chunks the observation is split, how many threads are used and how
+ * deep the queues are, such that the predicted peak memory use stays within the
+ * given limit.
+ *
+ * The model contains:
+ * - the visibility buffers (8 float planes per baseline) and flag masks, which
+ *   scale with the number of scans per chunk, including the scans that overlap
+ *   with the neighbouring chunks;
+ * - the working memory of the flagger, which is a few copies of a baseline per thread;
+ * - the reader's GPU matrix buffers;
+ * - the averaging buffers;
+ * - the quality statistics, one per worker plus the total;
+ * - the writer and task queues;
+ * - the packed flags of the flag writer, when flag files are written;
+ * - a constant for the libraries and the output writers.
+ * The values for the flagger and the statistics are estimates of the internals of
+ * AOFlagger, and are on the safe side.
+ */
+class MemoryPlanner
+{
+	public:
+		struct Parameters
+		{
+			size_t antennaCount, channelCount, scanCount, fileCount;
+			/**
+			 * Number of scans on both sides of a chunk that are flagged together with the
+			 * chunk, but written by the neighbouring chunk.
+			 */
+			size_t overlapScanCount;
+			/** Number of channels after averaging, or zero when not averaging. */
+			size_t averagedChannelCount;
+			/** Number of polarizations that are written (4 or 2). */
+			size_t polarizationCount;
+			/** Number of timesteps that the flag writer packs at once, or zero when no flag files are written. */
+			size_t flagWriterTimestepCount;
+			size_t threadCount;
+			/** Whether the planner may lower the thread count when memory is short. */
+			bool mayReduceThreads;
+			bool rfiDetection, collectStatistics, collectHistograms;
+			size_t memoryLimit;
+		};
+
+		struct Plan
+		{
+			/** The scans per chunk are the written scans; the overlap is only used when there is more than one chunk. */
+			size_t chunkCount, scansPerChunk, overlapScanCount;
+			/** Number of scans in the buffers of a chunk, including the overlap. */
+			size_t bufferedScansPerChunk;
+			size_t threadCount, gpuMatrixBufferCount, taskQueueCapacity;
+			/** False if not even one scan fits in the limit. */
+			bool fitsInLimit;
+			size_t memoryLimit;
+			// Predicted memory use per category, in bytes
+			size_t visibilityBytes, flagMaskBytes, flaggerBytes, readerBytes, averagingBytes, statisticsBytes, queueBytes, flagWriterBytes, baseBytes;
+
+			size_t PeakBytes() const
+			{
+				return visibilityBytes + flagMaskBytes + flaggerBytes + readerBytes + averagingBytes + statisticsBytes + queueBytes + flagWriterBytes + baseBytes;
+			}
+			void Report(std::ostream& stream) const;
+		};
+
+		static Plan Make(const Parameters& parameters);
+
+		/**
+		 * Returns the memory limit of the cgroup (v2 or v1) that the process is in, or
+		 * zero when there is no limit.
+		 */
+		static size_t CGroupMemoryLimit();
+
+		/** Estimated size of one QualityStatistics object of AOFlagger. */
+		static size_t StatisticsBytes(size_t baselineCount, size_t scanCount, size_t channelCount, bool collectHistograms);
+
+		/** Formats a size in MB or GB. */
+		static std::string FormatBytes(size_t bytes);
+
+	private:
+		static Plan evaluate(const Parameters& parameters, size_t threadCount, size_t gpuMatrixBufferCount);
+};
+
+#endif
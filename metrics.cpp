@@ -0,0 +1,179 @@
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+std::atomic<int> Metrics::_phase(Metrics::StartingPhase);
+std::atomic<size_t> Metrics::_bandIndex(0), Metrics::_bandCount(1), Metrics::_chunkIndex(0), Metrics::_chunkCount(1);
+std::atomic<uint32_t> Metrics::_progress(0);
+constexpr uint32_t Metrics::ProgressScale;
+std::atomic<uint64_t> Metrics::_bytesRead(0), Metrics::_baselinesProcessed(0), Metrics::_rowsWritten(0);
+std::atomic<int64_t> Metrics::_shuffleQueueDepth(0), Metrics::_writerQueueDepth(0);
+
+const char* Metrics::PhaseName(Phase phase)
+{
+	switch(phase)
+	{
+		case StartingPhase: return "starting";
+		case ReadingPhase: return "reading";
+		case ProcessingPhase: return "processing";
+		case WritingPhase: return "writing";
+		case FinishingPhase: return "finishing";
+		case DonePhase: return "done";
+		case PhaseCount: break;
+	}
+	return "unknown";
+}
+
+MetricsEmitter::MetricsEmitter(const std::string& destination, double intervalSeconds, ThreadPool& threadPool) :
+	_fd(-1),
+	_isSocket(destination.compare(0, 5, "unix:") == 0),
+	_intervalSeconds(intervalSeconds),
+	_threadPool(threadPool),
+	_isFinishing(false),
+	_startTime(std::chrono::steady_clock::now()),
+	_emitterTask(threadPool)
+{
+	if(_isSocket)
+	{
+		const std::string path = destination.substr(5);
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if(path.empty() || path.size() >= sizeof(address.sun_path))
+			throw std::runtime_error("Invalid metrics socket path: " + path);
+		std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+		_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(_fd < 0 || connect(_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+		{
+			const std::string error = std::strerror(errno);
+			if(_fd >= 0)
+				close(_fd);
+			throw std::runtime_error("Could not connect to metrics socket " + path + ": " + error);
+		}
+	}
+	else {
+		_fd = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(_fd < 0)
+			throw std::runtime_error("Could not create metrics file " + destination + ": " + std::strerror(errno));
+	}
+	if(_intervalSeconds <= 0.0)
+		_intervalSeconds = 1.0;
+	_emitterTask.RunLongRunning(std::bind(&MetricsEmitter::emitterLoop, this));
+}
+
+MetricsEmitter::~MetricsEmitter()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isFinishing = true;
+	}
+	_finishCondition.notify_all();
+	_emitterTask.Wait();
+	if(_fd >= 0)
+		close(_fd);
+}
+
+void MetricsEmitter::emitterLoop()
+{
+	Sample previous{0.0, 0, 0, 0};
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(_fd >= 0)
+	{
+		if(!_isFinishing)
+			_finishCondition.wait_for(lock, std::chrono::duration<double>(_intervalSeconds));
+		const bool isFinal = _isFinishing;
+		lock.unlock();
+		emit(previous, isFinal);
+		lock.lock();
+		if(isFinal)
+			break;
+	}
+}
+
+void MetricsEmitter::emit(Sample& previous, bool isFinal)
+{
+	Sample current;
+	current.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - _startTime).count();
+	current.bytesRead = Metrics::_bytesRead.load(std::memory_order_relaxed);
+	current.baselinesProcessed = Metrics::_baselinesProcessed.load(std::memory_order_relaxed);
+	current.rowsWritten = Metrics::_rowsWritten.load(std::memory_order_relaxed);
+	const double interval = std::max(current.time - previous.time, 1e-6);
+
+	const Metrics::Phase phase = isFinal ? Metrics::DonePhase : Metrics::Phase(Metrics::_phase.load(std::memory_order_relaxed));
+	const size_t
+		bandIndex = Metrics::_bandIndex.load(std::memory_order_relaxed),
+		bandCount = std::max<size_t>(Metrics::_bandCount.load(std::memory_order_relaxed), 1),
+		chunkIndex = Metrics::_chunkIndex.load(std::memory_order_relaxed),
+		chunkCount = std::max<size_t>(Metrics::_chunkCount.load(std::memory_order_relaxed), 1);
+	const double stageFraction = double(Metrics::_progress.load(std::memory_order_relaxed)) / Metrics::ProgressScale;
+	// Reading, processing and writing are weighted equally within a chunk
+	double phaseFraction = 0.0;
+	if(phase == Metrics::ReadingPhase || phase == Metrics::ProcessingPhase || phase == Metrics::WritingPhase)
+		phaseFraction = (double(phase - Metrics::ReadingPhase) + stageFraction) / 3.0;
+	double fraction = (double(bandIndex) + (double(chunkIndex) + phaseFraction) / chunkCount) / bandCount;
+	// Finishing writes the statistics and metadata of a band after its last chunk
+	if(phase == Metrics::FinishingPhase)
+		fraction = double(bandIndex + 1) / bandCount;
+	else if(phase == Metrics::DonePhase)
+		fraction = 1.0;
+
+	std::ostringstream line;
+	line << std::fixed << std::setprecision(3)
+		<< "{\"time\":" << current.time
+		<< ",\"pid\":" << getpid()
+		<< ",\"stage\":\"" << Metrics::PhaseName(phase) << '"'
+		<< ",\"band\":" << (bandIndex + 1) << ",\"bands\":" << bandCount
+		<< ",\"chunk\":" << (chunkIndex + 1) << ",\"chunks\":" << chunkCount
+		<< ",\"stagePercent\":" << std::setprecision(1) << (stageFraction * 100.0)
+		<< ",\"percent\":" << (fraction * 100.0)
+		<< ",\"bytesReadPerSecond\":" << std::setprecision(0) << double(current.bytesRead - previous.bytesRead) / interval
+		<< ",\"baselinesProcessedPerSecond\":" << std::setprecision(1) << double(current.baselinesProcessed - previous.baselinesProcessed) / interval
+		<< ",\"rowsWrittenPerSecond\":" << double(current.rowsWritten - previous.rowsWritten) / interval
+		<< ",\"bytesRead\":" << current.bytesRead
+		<< ",\"baselinesProcessed\":" << current.baselinesProcessed
+		<< ",\"rowsWritten\":" << current.rowsWritten
+		<< ",\"taskQueue\":" << _threadPool.QueuedTaskCount()
+		<< ",\"shuffleQueue\":" << std::max<int64_t>(Metrics::_shuffleQueueDepth.load(std::memory_order_relaxed), 0)
+		<< ",\"writerQueue\":" << std::max<int64_t>(Metrics::_writerQueueDepth.load(std::memory_order_relaxed), 0);
+	// The estimate is only given once there is enough progress to extrapolate from
+	if(fraction >= 0.01 && fraction < 1.0)
+		line << ",\"etaSeconds\":" << std::setprecision(0) << current.time * (1.0 - fraction) / fraction;
+	line << "}\n";
+	previous = current;
+
+	const std::string text = line.str();
+	ssize_t result;
+	if(_isSocket)
+	{
+		// A full socket buffer drops the line, but once part of a line is sent, the rest is
+		// sent too, so that the reader never sees a broken line
+		result = send(_fd, text.data(), text.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		size_t sent = result > 0 ? result : 0;
+		while(sent != 0 && sent < text.size() && result > 0)
+		{
+			result = send(_fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+			if(result > 0)
+				sent += result;
+		}
+	}
+	else
+		result = write(_fd, text.data(), text.size());
+	if(result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	{
+		std::cerr << "WARNING: writing metrics failed (" << std::strerror(errno) << "): no more metrics will be written.\n";
+		close(_fd);
+		_fd = -1;
+	}
+}
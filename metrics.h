@@ -0,0 +1,118 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * Live progress and throughput counters of a run, for orchestrators that watch
+ * many Cotter jobs. The counters are updated with relaxed atomics, so that they can
+ * be updated from the workers without locks; a MetricsEmitter periodically samples
+ * them and writes them as JSON lines.
+ *
+ * The progress of the current stage is taken from the ProgressBar, which is used by
+ * all stages.
+ */
+class Metrics
+{
+	public:
+		enum Phase { StartingPhase, ReadingPhase, ProcessingPhase, WritingPhase, FinishingPhase, DonePhase, PhaseCount };
+
+		static void SetPhase(Phase phase) { _phase.store(phase, std::memory_order_relaxed); }
+		static void SetBand(size_t bandIndex, size_t bandCount)
+		{
+			_bandIndex.store(bandIndex, std::memory_order_relaxed);
+			_bandCount.store(bandCount, std::memory_order_relaxed);
+		}
+		static void SetChunk(size_t chunkIndex, size_t chunkCount)
+		{
+			_chunkIndex.store(chunkIndex, std::memory_order_relaxed);
+			_chunkCount.store(chunkCount, std::memory_order_relaxed);
+		}
+		/** Starts the progress of a new stage at zero. */
+		static void ResetProgress() { _progress.store(0, std::memory_order_relaxed); }
+		/**
+		 * Progress of the current stage. The progress is stored as a single fraction, so
+		 * that it is sampled consistently, and only an increase is stored, so that tasks
+		 * that report concurrently don't make it jump back.
+		 */
+		static void SetProgress(size_t taskIndex, size_t taskCount)
+		{
+			const uint32_t progress = taskCount == 0 ? 0 : uint32_t(std::min(double(taskIndex) / taskCount, 1.0) * ProgressScale);
+			uint32_t current = _progress.load(std::memory_order_relaxed);
+			while(progress > current && !_progress.compare_exchange_weak(current, progress, std::memory_order_relaxed))
+			{ }
+		}
+
+		static void AddBytesRead(size_t bytes) { _bytesRead.fetch_add(bytes, std::memory_order_relaxed); }
+		static void AddBaselinesProcessed(size_t count) { _baselinesProcessed.fetch_add(count, std::memory_order_relaxed); }
+		static void AddRowsWritten(size_t count) { _rowsWritten.fetch_add(count, std::memory_order_relaxed); }
+		/** Number of GPU matrices that have been read but are not yet shuffled. */
+		static void AddShuffleQueueDepth(int64_t delta) { _shuffleQueueDepth.fetch_add(delta, std::memory_order_relaxed); }
+		/** Number of rows that are buffered in the threaded writers. */
+		static void AddWriterQueueDepth(int64_t delta) { _writerQueueDepth.fetch_add(delta, std::memory_order_relaxed); }
+
+		static const char* PhaseName(Phase phase);
+
+	private:
+		friend class MetricsEmitter;
+
+		static std::atomic<int> _phase;
+		static std::atomic<size_t> _bandIndex, _bandCount, _chunkIndex, _chunkCount;
+		/** The progress of the stage, as a fraction of ProgressScale. */
+		static std::atomic<uint32_t> _progress;
+		static constexpr uint32_t ProgressScale = 1000000;
+		static std::atomic<uint64_t> _bytesRead, _baselinesProcessed, _rowsWritten;
+		static std::atomic<int64_t> _shuffleQueueDepth, _writerQueueDepth;
+};
+
+/**
+ * Writes the Metrics as one JSON object per line every interval, to a file or, when
+ * the destination starts with "unix:", to a Unix stream socket on which the orchestrator
+ * listens. The rates are computed over the interval. The estimated time to completion
+ * assumes that reading, processing and writing each take a third of a chunk.
+ *
+ * Lines are dropped when a socket is not read fast enough, and emitting stops when the
+ * destination fails, so that the metrics never stall or abort the run.
+ */
+class MetricsEmitter
+{
+	public:
+		/** Throws when the destination can't be opened. */
+		MetricsEmitter(const std::string& destination, double intervalSeconds, ThreadPool& threadPool);
+		/** Writes a last line and stops. */
+		~MetricsEmitter();
+
+		MetricsEmitter(const MetricsEmitter&) = delete;
+		MetricsEmitter& operator=(const MetricsEmitter&) = delete;
+
+	private:
+		struct Sample
+		{
+			double time;
+			uint64_t bytesRead, baselinesProcessed, rowsWritten;
+		};
+
+		void emitterLoop();
+		void emit(Sample& previous, bool isFinal);
+
+		int _fd;
+		bool _isSocket;
+		double _intervalSeconds;
+		ThreadPool& _threadPool;
+		std::mutex _mutex;
+		std::condition_variable _finishCondition;
+		bool _isFinishing;
+		std::chrono::steady_clock::time_point _startTime;
+		ThreadPool::TaskGroup _emitterTask;
+};
+
+#endif
@@ -11,6 +11,8 @@
 
 #include <casacore/measures/Measures/MFrequency.h>
 
+#include <stdexcept>
+
 using namespace casacore;
 
 class MSWriterData
@@ -47,7 +49,8 @@ MSWriter::MSWriter(const std::string& filename) :
 	_isInitialized(false),
 	_rowIndex(0),
 	_filename(filename),
-	_useDysco(false)
+	_useDysco(false),
+	_polarizationCount(4)
 {
 }
 
@@ -87,7 +90,7 @@ void MSWriter::initialize()
 	ms.createDefaultSubtables(Table::New);
 	
 	ArrayColumnDesc<std::complex<float> > dataColumnDesc = ArrayColumnDesc<std::complex<float> >(MS::columnName(casacore::MSMainEnums::DATA));
-	casacore::IPosition dataShape(2, 4, _bandInfo.channels.size());
+	casacore::IPosition dataShape(2, _polarizationCount, _bandInfo.channels.size());
 	if (_useDysco && _data->_dyscoDataBitRate != 0) {
 		dataColumnDesc.setShape(dataShape);
 		dataColumnDesc.setOptions(ColumnDesc::Direct | ColumnDesc::FixedShape);
@@ -301,18 +304,26 @@ void MSWriter::writePolarizationForLinearPols()
 	
 	size_t rowIndex = polTable.nrow();
 	polTable.addRow(1);
-	numCorrCol.put(rowIndex, 4);
-	
-	casacore::Vector<int> cTypeVec(4);
-	cTypeVec[0] = 9; cTypeVec[1] = 10; cTypeVec[2] = 11; cTypeVec[3] = 12;
-	corrTypeCol.put(rowIndex, cTypeVec);
+	numCorrCol.put(rowIndex, _polarizationCount);
 	
-	casacore::Array<int> cProdArr(IPosition(2, 2, 4));
+	casacore::Vector<int> cTypeVec(_polarizationCount);
+	casacore::Array<int> cProdArr(IPosition(2, 2, _polarizationCount));
 	casacore::Array<int>::iterator i=cProdArr.begin();
-	*i = 0; ++i; *i = 0; ++i;
-	*i = 0; ++i; *i = 1; ++i;
-	*i = 1; ++i; *i = 0; ++i;
-	*i = 1; ++i; *i = 1;
+	if(_polarizationCount == 4)
+	{
+		cTypeVec[0] = 9; cTypeVec[1] = 10; cTypeVec[2] = 11; cTypeVec[3] = 12;
+		*i = 0; ++i; *i = 0; ++i;
+		*i = 0; ++i; *i = 1; ++i;
+		*i = 1; ++i; *i = 0; ++i;
+		*i = 1; ++i; *i = 1;
+	}
+	else {
+		// XX and YY
+		cTypeVec[0] = 9; cTypeVec[1] = 12;
+		*i = 0; ++i; *i = 0; ++i;
+		*i = 1; ++i; *i = 1;
+	}
+	corrTypeCol.put(rowIndex, cTypeVec);
 	corrProductCol.put(rowIndex, cProdArr);
 	
 	flagRowCol.put(rowIndex, false);
@@ -484,6 +495,13 @@ void MSWriter::writeObservation()
 	flagRowCol.put(rowIndex, _observation.flagRow);
 }
 
+void MSWriter::SetPolarizationCount(size_t polarizationCount)
+{
+	if(polarizationCount != 4 && polarizationCount != 2)
+		throw std::runtime_error("A measurement set can only be written with four (XX, XY, YX, YY) or two (XX, YY) polarizations");
+	_polarizationCount = polarizationCount;
+}
+
 void MSWriter::AddRows(size_t count)
 {
 	if(!_isInitialized)
@@ -509,7 +527,7 @@ void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_
 	_data->_scanNumberCol.put(_rowIndex, 1);
 	_data->_stateIdCol.put(_rowIndex, -1);
 	
-	size_t nPol = 4;
+	size_t nPol = _polarizationCount;
 	
 	casacore::Vector<float> sigmaArr(nPol);
 	for(size_t p=0; p!=nPol; ++p) sigmaArr[p] = 1.0;
@@ -23,6 +23,8 @@ class MSWriter : public Writer
 		virtual void WriteObservation(const ObservationInfo& observation) final override;
 		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override;
 		
+		virtual void SetPolarizationCount(size_t polarizationCount) final override;
+		
 		virtual void AddRows(size_t count) final override;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		
@@ -52,6 +54,7 @@ class MSWriter : public Writer
 		std::vector<AntennaInfo> _antennae;
 		double _antennaDate;
 		bool _flagPolarizationRow;
+		size_t _polarizationCount;
 		
 		struct {
 			std::string name;
@@ -0,0 +1,112 @@
+#include "numatopology.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+NUMATopology NUMATopology::Detect()
+{
+	cpu_set_t allowedCPUs;
+	CPU_ZERO(&allowedCPUs);
+	if(sched_getaffinity(0, sizeof(allowedCPUs), &allowedCPUs) != 0)
+		throw std::runtime_error("Could not determine the CPU affinity of the process");
+
+	NUMATopology topology;
+	std::vector<int> remainingCPUs;
+	for(int cpu=0; cpu!=CPU_SETSIZE; ++cpu)
+	{
+		if(CPU_ISSET(cpu, &allowedCPUs))
+			remainingCPUs.push_back(cpu);
+	}
+
+	// Node indices need not be contiguous, so the possible range is scanned
+	std::ifstream possibleFile("/sys/devices/system/node/possible");
+	std::string possibleList;
+	if(possibleFile && std::getline(possibleFile, possibleList))
+	{
+		for(int node : parseCPUList(possibleList))
+		{
+			std::ostringstream filename;
+			filename << "/sys/devices/system/node/node" << node << "/cpulist";
+			std::ifstream cpuListFile(filename.str());
+			std::string cpuList;
+			if(!cpuListFile || !std::getline(cpuListFile, cpuList))
+				continue;
+			std::vector<int> nodeCPUs;
+			for(int cpu : parseCPUList(cpuList))
+			{
+				std::vector<int>::iterator iter = std::find(remainingCPUs.begin(), remainingCPUs.end(), cpu);
+				if(iter != remainingCPUs.end())
+				{
+					nodeCPUs.push_back(cpu);
+					remainingCPUs.erase(iter);
+				}
+			}
+			if(!nodeCPUs.empty())
+			{
+				topology._nodeCPUs.push_back(nodeCPUs);
+				topology._systemNodeIndices.push_back(node);
+			}
+		}
+	}
+	// CPUs that are not listed in any node (or a system without node info)
+	if(!remainingCPUs.empty())
+	{
+		if(topology._nodeCPUs.empty())
+		{
+			topology._nodeCPUs.push_back(remainingCPUs);
+			topology._systemNodeIndices.push_back(0);
+		}
+		else {
+			topology._nodeCPUs.front().insert(topology._nodeCPUs.front().end(), remainingCPUs.begin(), remainingCPUs.end());
+		}
+	}
+	return topology;
+}
+
+std::vector<int> NUMATopology::parseCPUList(const std::string& cpuList)
+{
+	// Format is e.g. "0-7,16-23" or "0"
+	std::vector<int> result;
+	std::istringstream stream(cpuList);
+	std::string range;
+	while(std::getline(stream, range, ','))
+	{
+		if(range.empty() || range == "\n")
+			continue;
+		size_t dash = range.find('-');
+		int first = std::atoi(range.substr(0, dash).c_str()), last = first;
+		if(dash != std::string::npos)
+			last = std::atoi(range.substr(dash+1).c_str());
+		for(int i=first; i<=last; ++i)
+			result.push_back(i);
+	}
+	return result;
+}
+
+void NUMATopology::PinCurrentThread(const std::vector<int>& cpus)
+{
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	for(int cpu : cpus)
+		CPU_SET(cpu, &cpuSet);
+	// Failing to pin is not fatal: it only reduces memory locality
+	pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+}
+
+std::string NUMATopology::Description() const
+{
+	std::ostringstream str;
+	for(size_t node=0; node!=_nodeCPUs.size(); ++node)
+	{
+		if(node != 0)
+			str << ", ";
+		str << "node " << _systemNodeIndices[node] << ": " << _nodeCPUs[node].size() << " CPUs";
+	}
+	return str.str();
+}
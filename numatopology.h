@@ -0,0 +1,39 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * Describes the NUMA nodes of the machine and the CPUs that belong to them.
+ * The topology is read from sysfs, so that no dependency on libnuma is
+ * required. Only CPUs that the process is allowed to run on are included;
+ * nodes without usable CPUs are left out. When no topology information
+ * is available, a single node with all usable CPUs is returned.
+ */
+class NUMATopology
+{
+	public:
+		static NUMATopology Detect();
+
+		size_t NodeCount() const { return _nodeCPUs.size(); }
+		const std::vector<int>& NodeCPUs(size_t node) const { return _nodeCPUs[node]; }
+		/** The node index as used by the kernel, e.g. for the name in sysfs. */
+		int SystemNodeIndex(size_t node) const { return _systemNodeIndices[node]; }
+
+		/** Restrict the calling thread to the given CPUs, e.g. those of a node. */
+		static void PinCurrentThread(const std::vector<int>& cpus);
+
+		std::string Description() const;
+
+	private:
+		NUMATopology() { }
+
+		static std::vector<int> parseCPUList(const std::string& cpuList);
+
+		std::vector<std::vector<int>> _nodeCPUs;
+		std::vector<int> _systemNodeIndices;
+};
+
+#endif
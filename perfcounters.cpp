@@ -0,0 +1,93 @@
+#include "perfcounters.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace {
+	int openEvent(uint64_t config, int groupFd)
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config;
+		// The leader starts disabled, so that the group is started at once
+		attr.disabled = (groupFd == -1) ? 1 : 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		// pid 0 and cpu -1: the calling thread, on whichever CPU it runs
+		return syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+	}
+}
+
+PerfCounters::PerfCounters() :
+	_groupFd(-1),
+	_wasMultiplexed(false)
+{
+	const uint64_t configs[CounterCount] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES
+	};
+	for(size_t i=0; i!=CounterCount; ++i)
+		_fds[i] = -1;
+	for(size_t i=0; i!=CounterCount; ++i)
+	{
+		_fds[i] = openEvent(configs[i], i==0 ? -1 : _fds[0]);
+		if(_fds[i] < 0)
+		{
+			_error = std::string("could not open the ") + Name(Counter(i)) + " counter: " + std::strerror(errno);
+			if(errno == EACCES || errno == EPERM)
+				_error += " (see /proc/sys/kernel/perf_event_paranoid)";
+			for(size_t j=0; j!=i; ++j)
+				close(_fds[j]);
+			return;
+		}
+	}
+	_groupFd = _fds[0];
+	ioctl(_groupFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(_groupFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounters::~PerfCounters()
+{
+	if(IsOpen())
+	{
+		for(size_t i=0; i!=CounterCount; ++i)
+			close(_fds[i]);
+	}
+}
+
+void PerfCounters::Read(uint64_t values[CounterCount])
+{
+	// The layout of a group read: nr, time enabled, time running, followed by nr values
+	uint64_t buffer[3 + CounterCount];
+	if(!IsOpen() || read(_groupFd, buffer, sizeof(buffer)) != ssize_t(sizeof(buffer)) || buffer[0] != CounterCount)
+	{
+		for(size_t i=0; i!=CounterCount; ++i)
+			values[i] = 0;
+		return;
+	}
+	if(buffer[2] < buffer[1])
+		_wasMultiplexed = true;
+	for(size_t i=0; i!=CounterCount; ++i)
+		values[i] = buffer[3 + i];
+}
+
+const char* PerfCounters::Name(Counter counter)
+{
+	switch(counter)
+	{
+		case Cycles: return "cycles";
+		case Instructions: return "instructions";
+		case CacheReferences: return "cache references";
+		case CacheMisses: return "cache misses";
+		case CounterCount: break;
+	}
+	return "unknown";
+}
@@ -0,0 +1,55 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * The hardware performance counters of the calling thread, opened with the Linux
+ * perf_event_open() system call, so that no external tools are needed. The counters
+ * are opened as one group, so that the kernel schedules them together and their values
+ * belong to the same interval. Only user space is counted, which is allowed with the
+ * default perf_event_paranoid setting of 2.
+ *
+ * The cache misses are the generic "cache misses" event, which the kernel maps to
+ * misses of the last level cache. Every miss loads a cache line from memory, so the
+ * memory bandwidth of a thread can be estimated as misses * CacheLineSize / time.
+ */
+class PerfCounters
+{
+	public:
+		enum Counter { Cycles, Instructions, CacheReferences, CacheMisses, CounterCount };
+
+		static const size_t CacheLineSize = 64;
+
+		/** Opens and starts the counters for the calling thread; see IsOpen(). */
+		PerfCounters();
+		~PerfCounters();
+
+		PerfCounters(const PerfCounters&) = delete;
+		PerfCounters& operator=(const PerfCounters&) = delete;
+
+		/** False when the kernel or the hardware does not provide the counters; Error() then says why. */
+		bool IsOpen() const { return _groupFd >= 0; }
+		const std::string& Error() const { return _error; }
+
+		/** Reads the values since opening. Should be called from the thread that opened the counters. */
+		void Read(uint64_t values[CounterCount]);
+
+		/**
+		 * True when the kernel had to share the hardware counters with other events, in
+		 * which case the counters did not run all the time and the values are too low.
+		 */
+		bool WasMultiplexed() const { return _wasMultiplexed; }
+
+		static const char* Name(Counter counter);
+
+	private:
+		int _groupFd;
+		int _fds[CounterCount];
+		bool _wasMultiplexed;
+		std::string _error;
+};
+
+#endif
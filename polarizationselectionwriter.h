@@ -0,0 +1,60 @@
+#ifndef POLARIZATION_SELECTION_WRITER_H
+#define POLARIZATION_SELECTION_WRITER_H
+
+#include "forwardingwriter.h"
+
+#include <complex>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Receives rows with all four polarizations and forwards only XX and YY. This allows
+ * writers that need the cross-polarizations, like the solution writer, to run before
+ * the polarizations are dropped.
+ */
+class PolarizationSelectionWriter : public ForwardingWriter
+{
+	public:
+		PolarizationSelectionWriter(std::unique_ptr<Writer>&& parentWriter)
+		: ForwardingWriter(std::move(parentWriter))
+		{
+		}
+		
+		virtual void SetPolarizationCount(size_t polarizationCount) final override
+		{
+			if(polarizationCount != 4)
+				throw std::runtime_error("Selecting XX and YY requires rows with four polarizations");
+			ForwardingWriter::SetPolarizationCount(2);
+		}
+		
+		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override
+		{
+			_data.resize(channels.size()*2);
+			_flags.reset(new bool[channels.size()*2]);
+			_weights.resize(channels.size()*2);
+			ForwardingWriter::WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
+		}
+		
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override
+		{
+			const size_t channelCount = _data.size() / 2;
+			for(size_t ch=0; ch!=channelCount; ++ch)
+			{
+				_data[ch*2] = data[ch*4];
+				_data[ch*2+1] = data[ch*4+3];
+				_flags[ch*2] = flags[ch*4];
+				_flags[ch*2+1] = flags[ch*4+3];
+				_weights[ch*2] = weights[ch*4];
+				_weights[ch*2+1] = weights[ch*4+3];
+			}
+			ForwardingWriter::WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, _data.data(), _flags.get(), _weights.data());
+		}
+		
+	private:
+		std::vector<std::complex<float>> _data;
+		std::unique_ptr<bool[]> _flags;
+		std::vector<float> _weights;
+};
+
+#endif
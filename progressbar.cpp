@@ -1,4 +1,5 @@
 #include "progressbar.h"
+#include "metrics.h"
 
 #include <iostream>
 
@@ -6,6 +7,7 @@ ProgressBar::ProgressBar(const std::string& taskDescription) :
 	_taskDescription(taskDescription),
 	_displayedDots(0)
 {
+	Metrics::ResetProgress();
 	std::cout << taskDescription << ":";
 	if(taskDescription.size() < 40)
 		std::cout << " 0%" << std::flush;
@@ -20,11 +22,16 @@ ProgressBar::~ProgressBar()
 
 void ProgressBar::SetProgress(size_t taskIndex, size_t taskCount)
 {
+	Metrics::SetProgress(taskIndex, taskCount);
 	unsigned progress = (taskIndex * 100 / taskCount);
 	unsigned dots = progress / 2;
 	
-	if(dots > _displayedDots)
+	if(dots > _displayedDots.load(std::memory_order_relaxed))
 	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		// Another thread might have printed these dots in the meantime
+		if(dots <= _displayedDots)
+			return;
 		while(dots != _displayedDots)
 		{
 			++_displayedDots;
@@ -1,8 +1,14 @@
 #ifndef PROGRESSBAR_H
 #define PROGRESSBAR_H
 
+#include <atomic>
+#include <mutex>
 #include <string>
 
+/**
+ * Prints the progress of a task as dots, and reports it to the Metrics. SetProgress()
+ * may be called from several threads; it only takes a lock when dots are printed.
+ */
 class ProgressBar
 {
 	public:
@@ -13,7 +19,8 @@ class ProgressBar
 		
 	private:
 		const std::string _taskDescription;
-		unsigned _displayedDots;
+		std::mutex _mutex;
+		std::atomic<unsigned> _displayedDots;
 };
 
 #endif
@@ -0,0 +1,70 @@
+#include "sharedmemoryformat.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+static_assert(sizeof(SharedMemoryFormat::Header) == 160, "The header of the shared memory format should have no padding");
+
+namespace {
+	uint64_t roundUp(uint64_t value, uint64_t alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+}
+
+void SharedMemoryFormat::Layout(Header& header, size_t metadataSize)
+{
+	header.controlOffset = PageSize;
+	header.metadataOffset = header.controlOffset + roundUp(sizeof(Control), PageSize);
+	header.metadataSize = metadataSize;
+	header.slotsOffset = header.metadataOffset + roundUp(metadataSize, PageSize);
+
+	uint64_t offset = roundUp(sizeof(SlotHeader), ColumnAlignment);
+	for(size_t column=0; column!=ColumnarFormat::ColumnCount; ++column)
+	{
+		header.slotColumnOffsets[column] = offset;
+		offset += roundUp(ColumnarFormat::RowSize(ColumnarFormat::Column(column), header.channelCount, header.polarizationCount) * header.slotRowCapacity, ColumnAlignment);
+	}
+	header.slotSize = roundUp(offset, PageSize);
+	header.totalSize = header.slotsOffset + header.slotSize * header.slotCount;
+}
+
+void SharedMemoryFormat::InitializeControl(Control& control)
+{
+	std::memset(&control, 0, sizeof(control));
+	pthread_mutexattr_t mutexAttributes;
+	pthread_mutexattr_init(&mutexAttributes);
+	pthread_mutexattr_setpshared(&mutexAttributes, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mutexAttributes, PTHREAD_MUTEX_ROBUST);
+	int result = pthread_mutex_init(&control.mutex, &mutexAttributes);
+	pthread_mutexattr_destroy(&mutexAttributes);
+	if(result != 0)
+		throw std::runtime_error(std::string("Could not initialize shared memory mutex: ") + std::strerror(result));
+
+	pthread_condattr_t conditionAttributes;
+	pthread_condattr_init(&conditionAttributes);
+	pthread_condattr_setpshared(&conditionAttributes, PTHREAD_PROCESS_SHARED);
+	result = pthread_cond_init(&control.condition, &conditionAttributes);
+	pthread_condattr_destroy(&conditionAttributes);
+	if(result != 0)
+		throw std::runtime_error(std::string("Could not initialize shared memory condition: ") + std::strerror(result));
+}
+
+void SharedMemoryFormat::Lock(Control& control)
+{
+	int result = pthread_mutex_lock(&control.mutex);
+	if(result == EOWNERDEAD)
+		pthread_mutex_consistent(&control.mutex);
+	else if(result != 0)
+		throw std::runtime_error(std::string("Could not lock shared memory mutex: ") + std::strerror(result));
+}
+
+void SharedMemoryFormat::Wait(Control& control)
+{
+	int result = pthread_cond_wait(&control.condition, &control.mutex);
+	if(result == EOWNERDEAD)
+		pthread_mutex_consistent(&control.mutex);
+	else if(result != 0)
+		throw std::runtime_error(std::string("Could not wait for shared memory condition: ") + std::strerror(result));
+}
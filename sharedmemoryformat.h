@@ -0,0 +1,98 @@
+#ifndef SHARED_MEMORY_FORMAT_H
+#define SHARED_MEMORY_FORMAT_H
+
+#include "columnarformat.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cstddef>
+
+/**
+ * Layout of the POSIX shared memory segment through which SharedMemoryWriter
+ * publishes timesteps to a consumer on the same node; consumers use
+ * SharedMemoryReader. The segment is a ring buffer of slots, each holding the
+ * rows of one timestep (one AddRows() call).
+ *
+ * The segment consists of:
+ * - the Header, at offset 0;
+ * - the Control block at Header::controlOffset, with a process-shared mutex and
+ *   condition that guard the sequence counters. It is only accessed through the
+ *   writer and reader classes;
+ * - the metadata at Header::metadataOffset, in the text form of ColumnarFormat::Metadata;
+ * - Header::slotCount slots of Header::slotSize bytes, starting at Header::slotsOffset.
+ *
+ * A slot starts with a SlotHeader, followed by the columns of the timestep in the
+ * layout of ColumnarFormat (same columns and per-row sizes), at
+ * Header::slotColumnOffsets relative to the slot start.
+ *
+ * Timestep n (counting from zero) is written to slot n % slotCount. It is published
+ * when Control::writeSequence becomes n+1, and the slot is given back by the
+ * consumer by setting Control::readSequence to n+1. The writer waits while the ring
+ * is full, so a slow consumer slows down the writer. There can be one consumer.
+ *
+ * The identifier is written last, so a segment with a valid identifier is complete.
+ */
+class SharedMemoryFormat
+{
+	public:
+		struct Header
+		{
+			char fileIdentifier[4];
+			uint16_t versionMinor, versionMajor;
+			uint32_t channelCount, polarizationCount;
+			uint64_t totalSize;
+			uint64_t controlOffset;
+			uint64_t metadataOffset, metadataSize;
+			uint64_t slotCount, slotRowCapacity, slotsOffset, slotSize;
+			uint64_t slotColumnOffsets[ColumnarFormat::ColumnCount];
+			char cotterVersion[16];
+		};
+
+		struct Control
+		{
+			pthread_mutex_t mutex;
+			pthread_cond_t condition;
+			uint64_t writeSequence, readSequence;
+			uint32_t isFinished, isConsumerAttached;
+		};
+
+		struct SlotHeader
+		{
+			uint64_t sequence, rowCount;
+		};
+
+		static const char* FileIdentifier() { return "CSHM"; }
+		static const uint16_t VersionMajor = 1, VersionMinor = 0;
+		static const size_t PageSize = 4096, ColumnAlignment = 64;
+
+		/**
+		 * Fill in the offsets and sizes of a header from its channel count, polarization count,
+		 * slot count and slot row capacity, for metadata of the given size.
+		 */
+		static void Layout(Header& header, size_t metadataSize);
+
+		/** Initialize the process-shared mutex and condition of a new control block. */
+		static void InitializeControl(Control& control);
+
+		/**
+		 * Lock the mutex of a control block. When a process died while holding it, the
+		 * lock is recovered: the counters are only changed as a whole, so they are valid.
+		 */
+		static void Lock(Control& control);
+		static void Unlock(Control& control)
+		{
+			pthread_mutex_unlock(&control.mutex);
+		}
+
+		/** Wait for a change of the counters; the control block should be locked. */
+		static void Wait(Control& control);
+
+		/** Notify the other process of a change of the counters. */
+		static void Notify(Control& control)
+		{
+			pthread_cond_broadcast(&control.condition);
+		}
+};
+
+#endif
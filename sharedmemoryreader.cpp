@@ -0,0 +1,149 @@
+#include "sharedmemoryreader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+	/** Try to map a complete segment; returns nullptr when it does not exist or is not complete yet. */
+	char* tryMapSegment(const std::string& name, SharedMemoryFormat::Header& header)
+	{
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if(fd < 0)
+		{
+			if(errno == ENOENT)
+				return nullptr;
+			throw std::runtime_error("Could not open shared memory segment " + name + ": " + std::strerror(errno));
+		}
+		struct stat segmentStat;
+		if(fstat(fd, &segmentStat) != 0 || size_t(segmentStat.st_size) < sizeof(header))
+		{
+			close(fd);
+			return nullptr;
+		}
+		void* mapping = mmap(nullptr, segmentStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(mapping == MAP_FAILED)
+			throw std::runtime_error("Could not map shared memory segment " + name + ": " + std::strerror(errno));
+		char* segment = static_cast<char*>(mapping);
+		if(std::memcmp(segment, SharedMemoryFormat::FileIdentifier(), 4) != 0)
+		{
+			munmap(mapping, segmentStat.st_size);
+			return nullptr;
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		std::memcpy(&header, segment, sizeof(header));
+		if(header.versionMajor != SharedMemoryFormat::VersionMajor)
+		{
+			munmap(mapping, segmentStat.st_size);
+			throw std::runtime_error("Shared memory segment " + name + " has an unsupported version");
+		}
+		if(header.totalSize != uint64_t(segmentStat.st_size))
+		{
+			munmap(mapping, segmentStat.st_size);
+			throw std::runtime_error("Shared memory segment " + name + " has an inconsistent size");
+		}
+		return segment;
+	}
+}
+
+SharedMemoryReader::SharedMemoryReader(const std::string& name, double timeoutSeconds) :
+	_name(name),
+	_segment(nullptr),
+	_sequence(0),
+	_hasTimestep(false),
+	_isAtEnd(false)
+{
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while((_segment = tryMapSegment(name, _header)) == nullptr)
+	{
+		if(timeoutSeconds > 0.0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > timeoutSeconds)
+			throw std::runtime_error("Timeout while waiting for shared memory segment " + name);
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	_metadata = ColumnarFormat::Metadata::FromText(std::string(_segment + _header.metadataOffset, _header.metadataSize));
+
+	SharedMemoryFormat::Control& c = control();
+	SharedMemoryFormat::Lock(c);
+	_sequence = c.readSequence;
+	c.isConsumerAttached = 1;
+	SharedMemoryFormat::Notify(c);
+	SharedMemoryFormat::Unlock(c);
+}
+
+SharedMemoryReader::~SharedMemoryReader()
+{
+	try {
+		release();
+		SharedMemoryFormat::Lock(control());
+		control().isConsumerAttached = 0;
+		SharedMemoryFormat::Unlock(control());
+	} catch(std::exception&) {
+		// Nothing to do: the writer will wait for a new consumer
+	}
+	munmap(_segment, _header.totalSize);
+	if(_isAtEnd)
+		shm_unlink(_name.c_str());
+}
+
+bool SharedMemoryReader::Next(Timestep& timestep)
+{
+	release();
+	SharedMemoryFormat::Control& c = control();
+	SharedMemoryFormat::Lock(c);
+	while(c.writeSequence == _sequence && !c.isFinished)
+		SharedMemoryFormat::Wait(c);
+	const bool isAvailable = c.writeSequence != _sequence;
+	SharedMemoryFormat::Unlock(c);
+	if(!isAvailable)
+	{
+		_isAtEnd = true;
+		return false;
+	}
+
+	const char* slot = _segment + _header.slotsOffset + (_sequence % _header.slotCount) * _header.slotSize;
+	const SharedMemoryFormat::SlotHeader* slotHeader = reinterpret_cast<const SharedMemoryFormat::SlotHeader*>(slot);
+	if(slotHeader->sequence != _sequence)
+		throw std::runtime_error("Shared memory segment " + _name + " is corrupted: slot has an unexpected sequence number");
+	timestep.rowCount = slotHeader->rowCount;
+	timestep.channelCount = _header.channelCount;
+	timestep.polarizationCount = _header.polarizationCount;
+	timestep.times = reinterpret_cast<const double*>(slot + _header.slotColumnOffsets[ColumnarFormat::Time]);
+	timestep.timeCentroids = reinterpret_cast<const double*>(slot + _header.slotColumnOffsets[ColumnarFormat::TimeCentroid]);
+	timestep.intervals = reinterpret_cast<const double*>(slot + _header.slotColumnOffsets[ColumnarFormat::Interval]);
+	timestep.antennas = reinterpret_cast<const uint32_t*>(slot + _header.slotColumnOffsets[ColumnarFormat::Antennas]);
+	timestep.uvws = reinterpret_cast<const double*>(slot + _header.slotColumnOffsets[ColumnarFormat::UVW]);
+	timestep.data = reinterpret_cast<const std::complex<float>*>(slot + _header.slotColumnOffsets[ColumnarFormat::Data]);
+	timestep.flags = reinterpret_cast<const unsigned char*>(slot + _header.slotColumnOffsets[ColumnarFormat::Flags]);
+	timestep.weights = reinterpret_cast<const float*>(slot + _header.slotColumnOffsets[ColumnarFormat::Weights]);
+	_hasTimestep = true;
+	return true;
+}
+
+void SharedMemoryReader::release()
+{
+	if(_hasTimestep)
+	{
+		_hasTimestep = false;
+		++_sequence;
+		SharedMemoryFormat::Control& c = control();
+		SharedMemoryFormat::Lock(c);
+		c.readSequence = _sequence;
+		SharedMemoryFormat::Notify(c);
+		SharedMemoryFormat::Unlock(c);
+	}
+}
+
+void SharedMemoryReader::Remove(const std::string& name)
+{
+	if(shm_unlink(name.c_str()) != 0 && errno != ENOENT)
+		throw std::runtime_error("Could not remove shared memory segment " + name + ": " + std::strerror(errno));
+}
@@ -0,0 +1,89 @@
+#ifndef SHARED_MEMORY_READER_H
+#define SHARED_MEMORY_READER_H
+
+#include "sharedmemoryformat.h"
+
+#include <complex>
+#include <string>
+
+/**
+ * Reads the timesteps that Cotter publishes in a shared memory segment (written
+ * with "-o <name>.shm"). The data are used in place, without copying:
+ *
+ *   SharedMemoryReader reader("/obs.shm");
+ *   SharedMemoryReader::Timestep timestep;
+ *   while(reader.Next(timestep))
+ *   {
+ *     for(size_t row=0; row!=timestep.rowCount; ++row)
+ *       process(timestep.antennas[row*2], timestep.antennas[row*2+1], timestep.Data(row));
+ *   }
+ *
+ * The pointers of a timestep stay valid until the next call to Next(), which gives
+ * the slot back to the writer. After the last timestep, the segment is removed.
+ */
+class SharedMemoryReader
+{
+	public:
+		struct Timestep
+		{
+			size_t rowCount, channelCount, polarizationCount;
+			const double* times;
+			const double* timeCentroids;
+			const double* intervals;
+			const uint32_t* antennas;
+			const double* uvws;
+			const std::complex<float>* data;
+			const unsigned char* flags;
+			const float* weights;
+
+			size_t ValueCount() const { return channelCount * polarizationCount; }
+			const std::complex<float>* Data(size_t row) const { return data + row * ValueCount(); }
+			const float* Weights(size_t row) const { return weights + row * ValueCount(); }
+			/** Flag of a value of a row; values are indexed by channel * polarizationCount + polarization. */
+			bool Flag(size_t row, size_t value) const
+			{
+				const unsigned char* packed = flags + row * ((ValueCount() + 7) / 8);
+				return (packed[value / 8] & (0x80 >> (value % 8))) != 0;
+			}
+		};
+
+		/**
+		 * Attach to a segment. When the segment does not exist yet, this waits until
+		 * the writer has created it, or until the timeout has passed.
+		 * @param timeoutSeconds Maximum time to wait, or zero to wait indefinitely.
+		 */
+		explicit SharedMemoryReader(const std::string& name, double timeoutSeconds = 0.0);
+		~SharedMemoryReader();
+
+		SharedMemoryReader(const SharedMemoryReader&) = delete;
+		SharedMemoryReader& operator=(const SharedMemoryReader&) = delete;
+
+		const ColumnarFormat::Metadata& Metadata() const { return _metadata; }
+		size_t ChannelCount() const { return _header.channelCount; }
+		size_t PolarizationCount() const { return _header.polarizationCount; }
+
+		/**
+		 * Wait for the next timestep. Returns false when the writer has finished and
+		 * all timesteps have been read.
+		 */
+		bool Next(Timestep& timestep);
+
+		/** Remove a segment, for example one that was left behind without a consumer. */
+		static void Remove(const std::string& name);
+
+	private:
+		void release();
+		SharedMemoryFormat::Control& control() const
+		{
+			return *reinterpret_cast<SharedMemoryFormat::Control*>(_segment + _header.controlOffset);
+		}
+
+		std::string _name;
+		char* _segment;
+		SharedMemoryFormat::Header _header;
+		ColumnarFormat::Metadata _metadata;
+		uint64_t _sequence;
+		bool _hasTimestep, _isAtEnd;
+};
+
+#endif
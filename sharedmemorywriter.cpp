@@ -0,0 +1,189 @@
+#include "sharedmemorywriter.h"
+
+#include "version.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+SharedMemoryWriter::SharedMemoryWriter(const std::string& name, size_t slotCount, size_t slotRowCapacity) :
+	_name(name),
+	_fd(-1),
+	_segment(nullptr),
+	_sequence(0),
+	_rowCount(0),
+	_rowsFilled(0),
+	_hasSlot(false)
+{
+	if(name.size() < 2 || name[0] != '/' || name.find('/', 1) != std::string::npos)
+		throw std::runtime_error("Invalid shared memory name '" + name + "': it should start with a slash and contain no other slashes");
+	if(slotCount < 2)
+		throw std::runtime_error("The shared memory ring needs at least two slots");
+	std::memset(&_header, 0, sizeof(_header));
+	_header.versionMajor = SharedMemoryFormat::VersionMajor;
+	_header.versionMinor = SharedMemoryFormat::VersionMinor;
+	_header.polarizationCount = 4;
+	_header.slotCount = slotCount;
+	_header.slotRowCapacity = slotRowCapacity;
+	std::strncpy(_header.cotterVersion, COTTER_VERSION_STR, sizeof(_header.cotterVersion)-1);
+}
+
+SharedMemoryWriter::~SharedMemoryWriter()
+{
+	if(_segment != nullptr)
+	{
+		try {
+			if(_hasSlot)
+				publishSlot();
+			SharedMemoryFormat::Lock(control());
+			control().isFinished = 1;
+			SharedMemoryFormat::Notify(control());
+			SharedMemoryFormat::Unlock(control());
+		} catch(std::exception& e) {
+			std::cerr << "Error while finishing shared memory segment " << _name << ": " << e.what() << '\n';
+		}
+		munmap(_segment, _header.totalSize);
+	}
+	if(_fd >= 0)
+		close(_fd);
+}
+
+void SharedMemoryWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	if(_segment != nullptr)
+		throw std::runtime_error("The band of a shared memory segment can not change after rows were added");
+	_metadata.bandName = name;
+	_metadata.channels = channels;
+	_metadata.refFreq = refFreq;
+	_metadata.totalBandwidth = totalBandwidth;
+	_metadata.bandFlagRow = flagRow;
+	_header.channelCount = channels.size();
+}
+
+void SharedMemoryWriter::WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params)
+{
+	ColumnarFormat::Metadata::HistoryItem item;
+	item.commandLine = commandLine;
+	item.application = application;
+	item.params = params;
+	_metadata.history.push_back(item);
+}
+
+void SharedMemoryWriter::createSegment()
+{
+	if(_header.channelCount == 0)
+		throw std::runtime_error("WriteBandInfo() must be called before rows are added to a shared memory segment");
+	const std::string metadata = _metadata.ToText();
+	SharedMemoryFormat::Layout(_header, metadata.size());
+
+	// A segment left behind by an earlier run is replaced; consumers that are still
+	// attached to it keep their mapping
+	shm_unlink(_name.c_str());
+	_fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(_fd < 0)
+		throw std::runtime_error("Could not create shared memory segment " + _name + ": " + std::strerror(errno));
+	if(ftruncate(_fd, _header.totalSize) != 0)
+		throw std::runtime_error("Could not allocate " + std::to_string(_header.totalSize/(1024*1024)) + " MB of shared memory for " + _name + ": " + std::strerror(errno));
+	void* mapping = mmap(nullptr, _header.totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if(mapping == MAP_FAILED)
+		throw std::runtime_error("Could not map shared memory segment " + _name + ": " + std::strerror(errno));
+	_segment = static_cast<char*>(mapping);
+
+	SharedMemoryFormat::InitializeControl(control());
+	std::memcpy(_segment + _header.metadataOffset, metadata.data(), metadata.size());
+	std::memcpy(_segment, &_header, sizeof(_header));
+	// The identifier marks the segment as complete, so it should become visible last
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(_segment, SharedMemoryFormat::FileIdentifier(), 4);
+	std::cout << "Publishing timesteps in shared memory segment " << _name << " (" << _header.slotCount << " slots, " << _header.totalSize/(1024*1024) << " MB).\n";
+}
+
+void SharedMemoryWriter::AddRows(size_t count)
+{
+	if(_segment == nullptr)
+		createSegment();
+	else if(_hasSlot)
+		publishSlot();
+	if(count > _header.slotRowCapacity)
+		throw std::runtime_error("Timestep has more rows than fit in a slot of the shared memory segment");
+
+	SharedMemoryFormat::Control& c = control();
+	SharedMemoryFormat::Lock(c);
+	bool isReported = false;
+	while(c.writeSequence - c.readSequence == _header.slotCount)
+	{
+		if(!c.isConsumerAttached && !isReported)
+		{
+			std::cout << "Shared memory segment " << _name << " is full: waiting for a consumer to attach...\n";
+			isReported = true;
+		}
+		SharedMemoryFormat::Wait(c);
+	}
+	SharedMemoryFormat::Unlock(c);
+
+	_rowCount = count;
+	_rowsFilled = 0;
+	_hasSlot = true;
+}
+
+void SharedMemoryWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float* weights)
+{
+	if(!_hasSlot || _rowsFilled == _rowCount)
+		throw std::runtime_error("Shared memory writer received more rows than were added");
+	char* slotData = slot(_sequence);
+	const size_t row = _rowsFilled;
+	const size_t valueCount = _header.channelCount * _header.polarizationCount;
+
+	reinterpret_cast<double*>(slotData + _header.slotColumnOffsets[ColumnarFormat::Time])[row] = time;
+	reinterpret_cast<double*>(slotData + _header.slotColumnOffsets[ColumnarFormat::TimeCentroid])[row] = timeCentroid;
+	reinterpret_cast<double*>(slotData + _header.slotColumnOffsets[ColumnarFormat::Interval])[row] = interval;
+	uint32_t* antennas = reinterpret_cast<uint32_t*>(slotData + _header.slotColumnOffsets[ColumnarFormat::Antennas]);
+	antennas[row*2] = antenna1;
+	antennas[row*2 + 1] = antenna2;
+	double* uvws = reinterpret_cast<double*>(slotData + _header.slotColumnOffsets[ColumnarFormat::UVW]);
+	uvws[row*3] = u;
+	uvws[row*3 + 1] = v;
+	uvws[row*3 + 2] = w;
+	std::memcpy(slotData + _header.slotColumnOffsets[ColumnarFormat::Data] + row * valueCount * sizeof(std::complex<float>), data, valueCount * sizeof(std::complex<float>));
+	std::memcpy(slotData + _header.slotColumnOffsets[ColumnarFormat::Weights] + row * valueCount * sizeof(float), weights, valueCount * sizeof(float));
+
+	const size_t flagRowSize = ColumnarFormat::RowSize(ColumnarFormat::Flags, _header.channelCount, _header.polarizationCount);
+	unsigned char* packed = reinterpret_cast<unsigned char*>(slotData + _header.slotColumnOffsets[ColumnarFormat::Flags] + row * flagRowSize);
+	for(size_t byte=0; byte!=flagRowSize; ++byte)
+	{
+		unsigned char value = 0;
+		const size_t bitEnd = std::min<size_t>(8, valueCount - byte*8);
+		for(size_t bit=0; bit!=bitEnd; ++bit)
+		{
+			if(flags[byte*8 + bit])
+				value |= (unsigned char) (0x80 >> bit);
+		}
+		packed[byte] = value;
+	}
+
+	++_rowsFilled;
+}
+
+void SharedMemoryWriter::publishSlot()
+{
+	if(_rowsFilled != _rowCount)
+		throw std::runtime_error("Shared memory writer received a different number of rows than were added");
+	SharedMemoryFormat::SlotHeader* slotHeader = reinterpret_cast<SharedMemoryFormat::SlotHeader*>(slot(_sequence));
+	slotHeader->sequence = _sequence;
+	slotHeader->rowCount = _rowCount;
+	++_sequence;
+	_hasSlot = false;
+
+	SharedMemoryFormat::Control& c = control();
+	SharedMemoryFormat::Lock(c);
+	c.writeSequence = _sequence;
+	SharedMemoryFormat::Notify(c);
+	SharedMemoryFormat::Unlock(c);
+}
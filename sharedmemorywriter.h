@@ -0,0 +1,100 @@
+#ifndef SHARED_MEMORY_WRITER_H
+#define SHARED_MEMORY_WRITER_H
+
+#include "sharedmemoryformat.h"
+#include "writer.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Publishes timesteps in a POSIX shared memory segment (see SharedMemoryFormat),
+ * so that a consumer on the same node can process them while they are produced,
+ * without going through the file system. Rows are written directly into the slot of
+ * the current timestep; a slot is published at the next AddRows() call, or when the
+ * writer is destructed.
+ *
+ * The segment is created at the first AddRows() call, when all metadata is known.
+ * When the ring is full, AddRows() waits until the consumer gives back a slot; inside
+ * a ThreadedWriter, this holds up the producer like a slow disk would. The segment is
+ * not removed by the writer, so that a consumer can still attach after the writer
+ * has finished; SharedMemoryReader removes it after reading the last timestep.
+ */
+class SharedMemoryWriter : public Writer
+{
+	public:
+		/**
+		 * @param name Name of the shared memory object, starting with a slash.
+		 * @param slotCount Number of timesteps that fit in the ring.
+		 * @param slotRowCapacity Maximum number of rows of a timestep.
+		 */
+		SharedMemoryWriter(const std::string& name, size_t slotCount, size_t slotRowCapacity);
+		virtual ~SharedMemoryWriter() final override;
+
+		virtual void SetArrayLocation(double x, double y, double z) final override
+		{
+			_metadata.hasArrayLocation = true;
+			_metadata.arrayX = x;
+			_metadata.arrayY = y;
+			_metadata.arrayZ = z;
+		}
+
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override
+		{
+			_metadata.antennae = antennae;
+			_metadata.antennaTime = time;
+		}
+		virtual void SetPolarizationCount(size_t polarizationCount) final override
+		{
+			if(_segment != nullptr)
+				throw std::runtime_error("The polarizations of a shared memory segment can not change after rows were added");
+			_header.polarizationCount = polarizationCount;
+		}
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override
+		{
+			_metadata.polarizationFlagRow = flagRow;
+		}
+		virtual void WriteSource(const SourceInfo& source) final override
+		{
+			_metadata.sources.push_back(source);
+		}
+		virtual void WriteField(const FieldInfo& field) final override
+		{
+			_metadata.fields.push_back(field);
+		}
+		virtual void WriteObservation(const ObservationInfo& observation) final override
+		{
+			_metadata.observations.push_back(observation);
+		}
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override;
+
+		virtual void AddRows(size_t count) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float* weights) final override;
+
+		/** Number of bytes of the segment; only known after the first AddRows() call. */
+		size_t SegmentSize() const { return _header.totalSize; }
+
+	private:
+		void createSegment();
+		void publishSlot();
+		char* slot(uint64_t sequence) const
+		{
+			return _segment + _header.slotsOffset + (sequence % _header.slotCount) * _header.slotSize;
+		}
+		SharedMemoryFormat::Control& control() const
+		{
+			return *reinterpret_cast<SharedMemoryFormat::Control*>(_segment + _header.controlOffset);
+		}
+
+		std::string _name;
+		int _fd;
+		char* _segment;
+		SharedMemoryFormat::Header _header;
+		ColumnarFormat::Metadata _metadata;
+		uint64_t _sequence;
+		size_t _rowCount, _rowsFilled;
+		bool _hasSlot;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "sinkwriter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+SinkWriter::SinkWriter(VisibilitySink& sink) :
+	_sink(sink),
+	_channelCount(0),
+	_polarizationCount(4),
+	_rowCount(0),
+	_rowsFilled(0)
+{
+}
+
+SinkWriter::~SinkWriter()
+{
+	try {
+		if(_rowCount != 0)
+			passTimestep();
+		_sink.FinishBand();
+	} catch(std::exception& e) {
+		std::cerr << "Error in visibility sink: " << e.what() << '\n';
+	}
+}
+
+void SinkWriter::WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	_channelCount = channels.size();
+	_sink.StartBand(_antennae, channels);
+}
+
+void SinkWriter::AddRows(size_t count)
+{
+	if(_rowCount != 0)
+		passTimestep();
+	const size_t valueCount = count * _channelCount * _polarizationCount;
+	if(_data.size() < valueCount)
+		_flags.reset(new bool[valueCount]);
+	_times.resize(count);
+	_timeCentroids.resize(count);
+	_intervals.resize(count);
+	_uvws.resize(count * 3);
+	_antenna1.resize(count);
+	_antenna2.resize(count);
+	_data.resize(std::max(valueCount, _data.size()));
+	_weights.resize(std::max(valueCount, _weights.size()));
+	_rowCount = count;
+	_rowsFilled = 0;
+}
+
+void SinkWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float* weights)
+{
+	if(_rowsFilled == _rowCount)
+		throw std::runtime_error("Sink writer received more rows than were added");
+	const size_t row = _rowsFilled, valueCount = _channelCount * _polarizationCount;
+	_times[row] = time;
+	_timeCentroids[row] = timeCentroid;
+	_intervals[row] = interval;
+	_antenna1[row] = antenna1;
+	_antenna2[row] = antenna2;
+	_uvws[row*3] = u;
+	_uvws[row*3 + 1] = v;
+	_uvws[row*3 + 2] = w;
+	std::copy_n(data, valueCount, &_data[row * valueCount]);
+	std::copy_n(flags, valueCount, &_flags[row * valueCount]);
+	std::copy_n(weights, valueCount, &_weights[row * valueCount]);
+	++_rowsFilled;
+}
+
+void SinkWriter::passTimestep()
+{
+	if(_rowsFilled != _rowCount)
+		throw std::runtime_error("Sink writer received a different number of rows than were added");
+	VisibilitySink::Timestep timestep;
+	timestep.rowCount = _rowCount;
+	timestep.channelCount = _channelCount;
+	timestep.polarizationCount = _polarizationCount;
+	timestep.times = _times.data();
+	timestep.timeCentroids = _timeCentroids.data();
+	timestep.intervals = _intervals.data();
+	timestep.antenna1 = _antenna1.data();
+	timestep.antenna2 = _antenna2.data();
+	timestep.uvws = _uvws.data();
+	timestep.data = _data.data();
+	timestep.flags = _flags.get();
+	timestep.weights = _weights.data();
+	_rowCount = 0;
+	_sink.ProcessTimestep(timestep);
+}
@@ -0,0 +1,53 @@
+#ifndef SINK_WRITER_H
+#define SINK_WRITER_H
+
+#include "visibilitysink.h"
+#include "writer.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * Collects the rows of every timestep (one AddRows() call) and hands them to a
+ * VisibilitySink. The timestep is passed on at the next AddRows() call, or when
+ * the writer is destructed.
+ */
+class SinkWriter : public Writer
+{
+	public:
+		explicit SinkWriter(VisibilitySink& sink);
+		virtual ~SinkWriter() final override;
+
+		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override
+		{
+			_antennae = antennae;
+		}
+		virtual void SetPolarizationCount(size_t polarizationCount) final override
+		{
+			_polarizationCount = polarizationCount;
+		}
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override { }
+		virtual void WriteSource(const SourceInfo& source) final override { }
+		virtual void WriteField(const FieldInfo& field) final override { }
+		virtual void WriteObservation(const ObservationInfo& observation) final override { }
+		virtual void WriteHistoryItem(const std::string& commandLine, const std::string& application, const std::vector<std::string>& params) final override { }
+
+		virtual void AddRows(size_t count) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float* weights) final override;
+
+	private:
+		void passTimestep();
+
+		VisibilitySink& _sink;
+		std::vector<AntennaInfo> _antennae;
+		size_t _channelCount, _polarizationCount, _rowCount, _rowsFilled;
+		std::vector<double> _times, _timeCentroids, _intervals, _uvws;
+		std::vector<size_t> _antenna1, _antenna2;
+		std::vector<std::complex<float>> _data;
+		// Not a vector<bool>, because that can't be passed as an array
+		std::unique_ptr<bool[]> _flags;
+		std::vector<float> _weights;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "solutionapplier.h"
+#include "solutionapplierkernel.h"
+#include "solutionfile.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+// Defined in solutionapplieravx2.cpp and solutionapplieravx512.cpp, which are compiled for those instruction sets
+void applySolutionsAVX2(const float* solutionA, const float* solutionB, size_t planeStride, const std::complex<float>* input, std::complex<float>* output, size_t nChannels);
+void applySolutionsAVX512(const float* solutionA, const float* solutionB, size_t planeStride, const std::complex<float>* input, std::complex<float>* output, size_t nChannels);
+void applySolutionsToPlanesAVX2(const float* solutionA, const float* solutionB, size_t planeStride, float* const planes[8], size_t rowStride, size_t nChannels, size_t start, size_t end);
+void applySolutionsToPlanesAVX512(const float* solutionA, const float* solutionB, size_t planeStride, float* const planes[8], size_t rowStride, size_t nChannels, size_t start, size_t end);
+#endif
+
+SolutionApplier::SolutionApplier(const std::string& filename) :
+	_nChannels(0),
+	_planeStride(0),
+	_kernel(&applySolutions<RemainderOps>),
+	_planesKernel(&applySolutionsToPlanes<RemainderOps>),
+	_kernelName("portable")
+{
+	SolutionFile solutionFile;
+	solutionFile.OpenForReading(filename.c_str());
+
+	if(solutionFile.PolarizationCount() != 4)
+		throw std::runtime_error("The provided solution file does not have 4 polarizations, which is not supported. ");
+
+	_nIntervals = solutionFile.IntervalCount();
+	_nAntennas = solutionFile.AntennaCount();
+	_nSolutionChannels = solutionFile.ChannelCount();
+	_startTime = solutionFile.StartTime();
+	_endTime = solutionFile.EndTime();
+	if(_nIntervals == 0 || _nSolutionChannels == 0)
+		throw std::runtime_error("The provided solution file contains no solutions.");
+	if(_nIntervals > 1 && !(_endTime > _startTime))
+		throw std::runtime_error("The provided solution file has multiple intervals, but no valid time range to select them with.");
+
+	// Convert from (interval, antenna, channel, pol, re/im) doubles to
+	// (interval, antenna, plane, channel) floats
+	const std::complex<double>* values = solutionFile.MapSolutions();
+	_solutions.resize(_nIntervals * _nAntennas * 8 * _nSolutionChannels);
+	for(size_t ia = 0; ia != _nIntervals * _nAntennas; ++ia)
+	{
+		float* planes = &_solutions[ia * 8 * _nSolutionChannels];
+		for(size_t ch = 0; ch != _nSolutionChannels; ++ch)
+		{
+			const std::complex<double>* jones = values + (ia * _nSolutionChannels + ch) * 4;
+			for(size_t p = 0; p != 4; ++p)
+			{
+				planes[(p*2) * _nSolutionChannels + ch] = jones[p].real();
+				planes[(p*2+1) * _nSolutionChannels + ch] = jones[p].imag();
+			}
+		}
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+	{
+		_kernel = &applySolutionsAVX512;
+		_planesKernel = &applySolutionsToPlanesAVX512;
+		_kernelName = "AVX-512";
+	}
+	else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		_kernel = &applySolutionsAVX2;
+		_planesKernel = &applySolutionsToPlanesAVX2;
+		_kernelName = "AVX2";
+	}
+#endif
+}
+
+void SolutionApplier::SetChannelCount(size_t nChannels)
+{
+	if(nChannels < _nSolutionChannels || (nChannels % _nSolutionChannels) != 0) {
+		std::ostringstream s;
+		s << "The provided solution file has an incorrect number of channels. Observation has " << nChannels << " channels, and solution file has " << _nSolutionChannels << " channels.";
+		throw std::runtime_error(s.str());
+	}
+	if(nChannels == _nChannels)
+		return;
+
+	// Expanding the solution channels allows the kernel to read the solutions of consecutive
+	// channels with one load. Planes are padded to 64 bytes.
+	_nChannels = nChannels;
+	_planeStride = (nChannels + 15) / 16 * 16;
+	const size_t channelRatio = nChannels / _nSolutionChannels;
+	_table.reset(new float[_nIntervals * _nAntennas * 8 * _planeStride]);
+	for(size_t ia = 0; ia != _nIntervals * _nAntennas; ++ia)
+	{
+		for(size_t plane = 0; plane != 8; ++plane)
+		{
+			const float* source = &_solutions[(ia * 8 + plane) * _nSolutionChannels];
+			float* destination = _table.get() + (ia * 8 + plane) * _planeStride;
+			for(size_t ch = 0; ch != nChannels; ++ch)
+				destination[ch] = source[ch / channelRatio];
+			std::fill(destination + nChannels, destination + _planeStride, 0.0f);
+		}
+	}
+}
+
+size_t SolutionApplier::IntervalIndex(double time) const
+{
+	if(_nIntervals == 1)
+		return 0;
+	const double index = std::floor((time - _startTime) * _nIntervals / (_endTime - _startTime));
+	if(!(index >= 0.0))
+		return 0;
+	return std::min(size_t(index), _nIntervals - 1);
+}
+
+void SolutionApplier::Apply(double time, size_t antenna1, size_t antenna2, const std::complex<float>* input, std::complex<float>* output) const
+{
+	const size_t interval = IntervalIndex(time);
+	_kernel(antennaTable(interval, antenna1), antennaTable(interval, antenna2), _planeStride, input, output, _nChannels);
+}
+
+void SolutionApplier::ApplyToPlanes(size_t interval, size_t antenna1, size_t antenna2, float* const planes[8], size_t rowStride, size_t start, size_t end) const
+{
+	_planesKernel(antennaTable(interval, antenna1), antennaTable(interval, antenna2), _planeStride, planes, rowStride, _nChannels, start, end);
+}
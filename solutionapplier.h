@@ -0,0 +1,87 @@
+#ifndef SOLUTION_APPLIER_H
+#define SOLUTION_APPLIER_H
+
+#include <complex>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Applies the Jones matrices of a solution file to visibilities, i.e. calculates
+ * V' = A V B^H for every channel, with A and B the solutions of the two antennas.
+ *
+ * The solutions are converted once to single precision tables per interval and antenna,
+ * with one plane per real or imaginary part of a matrix element and one value per channel
+ * of the observation. The visibilities of many channels can then be processed per
+ * instruction. The kernel is chosen at runtime: AVX-512, AVX2 or a portable loop.
+ *
+ * The object is read-only after @ref SetChannelCount(), so @ref Apply() may be called
+ * from several threads at once.
+ */
+class SolutionApplier
+{
+	public:
+		/**
+		 * Read all solutions from the file. Solution files with multiple intervals are supported;
+		 * the intervals are assumed to divide the time range in the header into equal parts.
+		 */
+		explicit SolutionApplier(const std::string& filename);
+
+		size_t AntennaCount() const { return _nAntennas; }
+		size_t SolutionChannelCount() const { return _nSolutionChannels; }
+		size_t IntervalCount() const { return _nIntervals; }
+
+		/**
+		 * Prepare the tables for visibilities with the given number of channels, which should
+		 * be a multiple of the number of solution channels.
+		 */
+		void SetChannelCount(size_t nChannels);
+
+		/**
+		 * Apply the solutions of the interval that contains @p time to the visibilities of one
+		 * baseline, with four polarizations per channel. Input and output may be the same.
+		 * @param time Time of the visibilities in the unit of the solution file (MJD seconds).
+		 */
+		void Apply(double time, size_t antenna1, size_t antenna2, const std::complex<float>* input, std::complex<float>* output) const;
+
+		/**
+		 * Apply the solutions of one interval to visibilities stored as 8 planes (the real and
+		 * imaginary parts of the four polarizations) with a row per channel, as in an aoflagger
+		 * ImageSet. Only the samples [start, end) of every row are corrected. Every visibility
+		 * gets exactly the same value as with @ref Apply().
+		 */
+		void ApplyToPlanes(size_t interval, size_t antenna1, size_t antenna2, float* const planes[8], size_t rowStride, size_t start, size_t end) const;
+
+		/** Index of the solution interval that contains @p time. */
+		size_t IntervalIndex(double time) const;
+
+		/** Name of the instruction set that the kernel uses, for reporting. */
+		const char* KernelName() const { return _kernelName; }
+
+		/**
+		 * Signature of the kernels. @p solutionA and @p solutionB point to 8 planes (real and
+		 * imaginary parts of the four matrix elements) of @p planeStride floats each.
+		 */
+		typedef void (*Kernel)(const float* solutionA, const float* solutionB, size_t planeStride, const std::complex<float>* input, std::complex<float>* output, size_t nChannels);
+		typedef void (*PlanesKernel)(const float* solutionA, const float* solutionB, size_t planeStride, float* const planes[8], size_t rowStride, size_t nChannels, size_t start, size_t end);
+
+	private:
+		const float* antennaTable(size_t interval, size_t antenna) const
+		{
+			return _table.get() + (interval * _nAntennas + antenna) * 8 * _planeStride;
+		}
+
+		size_t _nIntervals, _nAntennas, _nSolutionChannels, _nChannels;
+		double _startTime, _endTime;
+		// Per interval, antenna, plane and solution channel
+		std::vector<float> _solutions;
+		// As _solutions, but with a value for every channel of the observation
+		std::unique_ptr<float[]> _table;
+		size_t _planeStride;
+		Kernel _kernel;
+		PlanesKernel _planesKernel;
+		const char* _kernelName;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#if defined(__x86_64__) || defined(__i386__)
+
+// This file is compiled with -mavx2 -mfma; it is only called when the CPU supports both.
+
+#include "solutionapplierkernel.h"
+
+namespace {
+	struct AVX2Ops
+	{
+		typedef __m256 Vector;
+		static const size_t Width = 8;
+		static Vector Load(const float* data) { return _mm256_loadu_ps(data); }
+		static void Store(float* data, Vector value) { _mm256_storeu_ps(data, value); }
+		static Vector Broadcast(float value) { return _mm256_set1_ps(value); }
+		static Vector Add(Vector a, Vector b) { return _mm256_add_ps(a, b); }
+		static Vector Sub(Vector a, Vector b) { return _mm256_sub_ps(a, b); }
+		static Vector Mul(Vector a, Vector b) { return _mm256_mul_ps(a, b); }
+		static Vector MulAdd(Vector a, Vector b, Vector c) { return _mm256_fmadd_ps(a, b, c); }
+		static Vector MulSub(Vector a, Vector b, Vector c) { return _mm256_fmsub_ps(a, b, c); }
+
+		// Every channel has exactly 8 floats, so a block of channels is an 8x8 matrix
+		static void LoadTransposed(const float* data, Vector planes[8])
+		{
+			for(size_t i=0; i!=8; ++i)
+				planes[i] = _mm256_loadu_ps(data + i * 8);
+			transpose8x8(planes);
+		}
+
+		static void StoreTransposed(const Vector planes[8], float* data)
+		{
+			Vector rows[8];
+			for(size_t i=0; i!=8; ++i)
+				rows[i] = planes[i];
+			transpose8x8(rows);
+			for(size_t i=0; i!=8; ++i)
+				_mm256_storeu_ps(data + i * 8, rows[i]);
+		}
+	};
+}
+
+void applySolutionsAVX2(const float* solutionA, const float* solutionB, size_t planeStride, const std::complex<float>* input, std::complex<float>* output, size_t nChannels)
+{
+	applySolutions<AVX2Ops>(solutionA, solutionB, planeStride, input, output, nChannels);
+}
+
+void applySolutionsToPlanesAVX2(const float* solutionA, const float* solutionB, size_t planeStride, float* const planes[8], size_t rowStride, size_t nChannels, size_t start, size_t end)
+{
+	applySolutionsToPlanes<AVX2Ops>(solutionA, solutionB, planeStride, planes, rowStride, nChannels, start, end);
+}
+
+#endif
@@ -0,0 +1,68 @@
+#if defined(__x86_64__) || defined(__i386__)
+
+// This file is compiled with -mavx512f -mavx2 -mfma; it is only called when the CPU supports AVX-512F.
+
+// GCC 12 warns about the _mm512_undefined_*() calls inside its own AVX-512 headers
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+#include "solutionapplierkernel.h"
+
+namespace {
+	struct AVX512Ops
+	{
+		typedef __m512 Vector;
+		static const size_t Width = 16;
+		static Vector Load(const float* data) { return _mm512_loadu_ps(data); }
+		static void Store(float* data, Vector value) { _mm512_storeu_ps(data, value); }
+		static Vector Broadcast(float value) { return _mm512_set1_ps(value); }
+		static Vector Add(Vector a, Vector b) { return _mm512_add_ps(a, b); }
+		static Vector Sub(Vector a, Vector b) { return _mm512_sub_ps(a, b); }
+		static Vector Mul(Vector a, Vector b) { return _mm512_mul_ps(a, b); }
+		static Vector MulAdd(Vector a, Vector b, Vector c) { return _mm512_fmadd_ps(a, b, c); }
+		static Vector MulSub(Vector a, Vector b, Vector c) { return _mm512_fmsub_ps(a, b, c); }
+
+		// The 16 channels are transposed as two 8x8 blocks, which form the low and high halves of the planes
+		static void LoadTransposed(const float* data, Vector planes[8])
+		{
+			__m256 low[8], high[8];
+			for(size_t i=0; i!=8; ++i)
+			{
+				low[i] = _mm256_loadu_ps(data + i * 8);
+				high[i] = _mm256_loadu_ps(data + 64 + i * 8);
+			}
+			transpose8x8(low);
+			transpose8x8(high);
+			for(size_t i=0; i!=8; ++i)
+				planes[i] = _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(low[i])), _mm256_castps_pd(high[i]), 1));
+		}
+
+		static void StoreTransposed(const Vector planes[8], float* data)
+		{
+			__m256 low[8], high[8];
+			for(size_t i=0; i!=8; ++i)
+			{
+				low[i] = _mm512_castps512_ps256(planes[i]);
+				high[i] = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(planes[i]), 1));
+			}
+			transpose8x8(low);
+			transpose8x8(high);
+			for(size_t i=0; i!=8; ++i)
+			{
+				_mm256_storeu_ps(data + i * 8, low[i]);
+				_mm256_storeu_ps(data + 64 + i * 8, high[i]);
+			}
+		}
+	};
+}
+
+void applySolutionsAVX512(const float* solutionA, const float* solutionB, size_t planeStride, const std::complex<float>* input, std::complex<float>* output, size_t nChannels)
+{
+	applySolutions<AVX512Ops>(solutionA, solutionB, planeStride, input, output, nChannels);
+}
+
+void applySolutionsToPlanesAVX512(const float* solutionA, const float* solutionB, size_t planeStride, float* const planes[8], size_t rowStride, size_t nChannels, size_t start, size_t end)
+{
+	applySolutionsToPlanes<AVX512Ops>(solutionA, solutionB, planeStride, planes, rowStride, nChannels, start, end);
+}
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef SOLUTION_APPLIER_KERNEL_H
+#define SOLUTION_APPLIER_KERNEL_H
+
+#include <cmath>
+#include <complex>
+#include <cstddef>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+/*
+ * The Jones sandwich V' = A V B^H, written once for any vector type. This header is
+ * included by translation units that are compiled for different instruction sets, so
+ * everything in it has internal linkage: otherwise the linker could pick e.g. the AVX-512
+ * instantiation of an inline function for the portable kernel.
+ *
+ * An Ops class provides:
+ * - a Vector type of Width floats, with Add, Sub, Mul, MulAdd (a*b+c) and MulSub (a*b-c);
+ * - Load(const float*) and Store(float*, Vector) for Width consecutive floats, and
+ *   Broadcast(float);
+ * - LoadTransposed(const float* visibilities, Vector planes[8]), which loads Width channels
+ *   of four complex visibilities and returns them as planes (real and imaginary parts of the
+ *   four polarizations), and StoreTransposed(const Vector planes[8], float*) for the inverse.
+ */
+namespace {
+
+	struct ScalarOps
+	{
+		typedef float Vector;
+		static const size_t Width = 1;
+		static Vector Load(const float* data) { return *data; }
+		static void Store(float* data, Vector value) { *data = value; }
+		static Vector Broadcast(float value) { return value; }
+		static Vector Add(Vector a, Vector b) { return a + b; }
+		static Vector Sub(Vector a, Vector b) { return a - b; }
+		static Vector Mul(Vector a, Vector b) { return a * b; }
+		static Vector MulAdd(Vector a, Vector b, Vector c) { return a * b + c; }
+		static Vector MulSub(Vector a, Vector b, Vector c) { return a * b - c; }
+		static void LoadTransposed(const float* data, Vector planes[8])
+		{
+			for(size_t i=0; i!=8; ++i)
+				planes[i] = data[i];
+		}
+		static void StoreTransposed(const Vector planes[8], float* data)
+		{
+			for(size_t i=0; i!=8; ++i)
+				data[i] = planes[i];
+		}
+	};
+
+#ifdef __FMA__
+	/**
+	 * Scalar operations for the channels that do not fill a vector. These use fused
+	 * multiply-adds like the vector kernels, so that every visibility is calculated
+	 * identically, whichever kernel or order is used.
+	 */
+	struct FusedScalarOps : public ScalarOps
+	{
+		static Vector MulAdd(Vector a, Vector b, Vector c) { return std::fma(a, b, c); }
+		static Vector MulSub(Vector a, Vector b, Vector c) { return std::fma(a, b, -c); }
+	};
+	typedef FusedScalarOps RemainderOps;
+#else
+	typedef ScalarOps RemainderOps;
+#endif
+
+#ifdef __AVX__
+	/** Transpose an 8x8 matrix of floats that is given as 8 rows. */
+	inline void transpose8x8(__m256 rows[8])
+	{
+		const __m256
+			t0 = _mm256_unpacklo_ps(rows[0], rows[1]), t1 = _mm256_unpackhi_ps(rows[0], rows[1]),
+			t2 = _mm256_unpacklo_ps(rows[2], rows[3]), t3 = _mm256_unpackhi_ps(rows[2], rows[3]),
+			t4 = _mm256_unpacklo_ps(rows[4], rows[5]), t5 = _mm256_unpackhi_ps(rows[4], rows[5]),
+			t6 = _mm256_unpacklo_ps(rows[6], rows[7]), t7 = _mm256_unpackhi_ps(rows[6], rows[7]);
+		const __m256
+			s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2)),
+			s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2)),
+			s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2)),
+			s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+		rows[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+		rows[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+		rows[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+		rows[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+		rows[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+		rows[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+		rows[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+		rows[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+	}
+#endif
+
+	/** out = a*b + c*d for complex a, b, c, d given as (real, imaginary) pairs. */
+	template<typename Ops>
+	inline void complexMulMulAdd(typename Ops::Vector& outR, typename Ops::Vector& outI,
+		typename Ops::Vector aR, typename Ops::Vector aI, typename Ops::Vector bR, typename Ops::Vector bI,
+		typename Ops::Vector cR, typename Ops::Vector cI, typename Ops::Vector dR, typename Ops::Vector dI)
+	{
+		outR = Ops::MulSub(aR, bR, Ops::MulSub(aI, bI, Ops::MulSub(cR, dR, Ops::Mul(cI, dI))));
+		outI = Ops::MulAdd(aR, bI, Ops::MulAdd(aI, bR, Ops::MulAdd(cR, dI, Ops::Mul(cI, dR))));
+	}
+
+	/** out = a*conj(b) + c*conj(d). */
+	template<typename Ops>
+	inline void complexMulConjMulConjAdd(typename Ops::Vector& outR, typename Ops::Vector& outI,
+		typename Ops::Vector aR, typename Ops::Vector aI, typename Ops::Vector bR, typename Ops::Vector bI,
+		typename Ops::Vector cR, typename Ops::Vector cI, typename Ops::Vector dR, typename Ops::Vector dI)
+	{
+		outR = Ops::MulAdd(aR, bR, Ops::MulAdd(aI, bI, Ops::MulAdd(cR, dR, Ops::Mul(cI, dI))));
+		outI = Ops::Sub(Ops::MulSub(aI, bR, Ops::Mul(aR, bI)), Ops::MulSub(cR, dI, Ops::Mul(cI, dR)));
+	}
+
+	/**
+	 * Calculate r = A v B^H. All arguments are 8 planes: the real and imaginary parts of
+	 * element 0 (xx), 1 (xy), 2 (yx) and 3 (yy).
+	 */
+	template<typename Ops>
+	inline void jonesSandwich(const typename Ops::Vector a[8], const typename Ops::Vector b[8], const typename Ops::Vector v[8], typename Ops::Vector r[8])
+	{
+		typename Ops::Vector t[8];
+		// T = A V
+		complexMulMulAdd<Ops>(t[0], t[1], a[0], a[1], v[0], v[1], a[2], a[3], v[4], v[5]);
+		complexMulMulAdd<Ops>(t[2], t[3], a[0], a[1], v[2], v[3], a[2], a[3], v[6], v[7]);
+		complexMulMulAdd<Ops>(t[4], t[5], a[4], a[5], v[0], v[1], a[6], a[7], v[4], v[5]);
+		complexMulMulAdd<Ops>(t[6], t[7], a[4], a[5], v[2], v[3], a[6], a[7], v[6], v[7]);
+		// R = T B^H, i.e. R_ik = sum_j T_ij conj(B_kj)
+		complexMulConjMulConjAdd<Ops>(r[0], r[1], t[0], t[1], b[0], b[1], t[2], t[3], b[2], b[3]);
+		complexMulConjMulConjAdd<Ops>(r[2], r[3], t[0], t[1], b[4], b[5], t[2], t[3], b[6], b[7]);
+		complexMulConjMulConjAdd<Ops>(r[4], r[5], t[4], t[5], b[0], b[1], t[6], t[7], b[2], b[3]);
+		complexMulConjMulConjAdd<Ops>(r[6], r[7], t[4], t[5], b[4], b[5], t[6], t[7], b[6], b[7]);
+	}
+
+	/** Apply the solutions to the channels [channel, channel+Ops::Width). */
+	template<typename Ops>
+	inline void applySolutionBlock(const float* solutionA, const float* solutionB, size_t planeStride, const std::complex<float>* input, std::complex<float>* output, size_t channel)
+	{
+		typedef typename Ops::Vector V;
+		V v[8], a[8], b[8], r[8];
+		Ops::LoadTransposed(reinterpret_cast<const float*>(input + channel * 4), v);
+		for(size_t i=0; i!=8; ++i)
+		{
+			a[i] = Ops::Load(solutionA + i * planeStride + channel);
+			b[i] = Ops::Load(solutionB + i * planeStride + channel);
+		}
+		jonesSandwich<Ops>(a, b, v, r);
+		Ops::StoreTransposed(r, reinterpret_cast<float*>(output + channel * 4));
+	}
+
+	template<typename Ops>
+	void applySolutions(const float* solutionA, const float* solutionB, size_t planeStride, const std::complex<float>* input, std::complex<float>* output, size_t nChannels)
+	{
+		size_t channel = 0;
+		for(; channel + Ops::Width <= nChannels; channel += Ops::Width)
+			applySolutionBlock<Ops>(solutionA, solutionB, planeStride, input, output, channel);
+		// (with a Width of 1, the first loop has done all channels)
+		for(; Ops::Width != 1 && channel != nChannels; ++channel)
+			applySolutionBlock<RemainderOps>(solutionA, solutionB, planeStride, input, output, channel);
+	}
+
+	/** Apply the solutions to the samples [index, index+Ops::Width) of one channel in 8 planes. */
+	template<typename Ops>
+	inline void applySolutionToPlanesBlock(const typename Ops::Vector a[8], const typename Ops::Vector b[8], float* const planes[8], size_t index)
+	{
+		typename Ops::Vector v[8], r[8];
+		for(size_t i=0; i!=8; ++i)
+			v[i] = Ops::Load(planes[i] + index);
+		jonesSandwich<Ops>(a, b, v, r);
+		for(size_t i=0; i!=8; ++i)
+			Ops::Store(planes[i] + index, r[i]);
+	}
+
+	/**
+	 * Apply the solutions to visibilities that are stored as 8 planes of nChannels rows,
+	 * as in an aoflagger ImageSet, for the samples [start, end) of every row. The solutions
+	 * are constant over a row, so the samples of a row are processed per vector.
+	 */
+	template<typename Ops>
+	void applySolutionsToPlanes(const float* solutionA, const float* solutionB, size_t planeStride, float* const planes[8], size_t rowStride, size_t nChannels, size_t start, size_t end)
+	{
+		typedef typename Ops::Vector V;
+		for(size_t channel=0; channel!=nChannels; ++channel)
+		{
+			V a[8], b[8];
+			float aScalar[8], bScalar[8];
+			float* rows[8];
+			for(size_t i=0; i!=8; ++i)
+			{
+				aScalar[i] = solutionA[i * planeStride + channel];
+				bScalar[i] = solutionB[i * planeStride + channel];
+				a[i] = Ops::Broadcast(aScalar[i]);
+				b[i] = Ops::Broadcast(bScalar[i]);
+				rows[i] = planes[i] + channel * rowStride;
+			}
+			size_t index = start;
+			for(; index + Ops::Width <= end; index += Ops::Width)
+				applySolutionToPlanesBlock<Ops>(a, b, rows, index);
+			for(; Ops::Width != 1 && index != end; ++index)
+				applySolutionToPlanesBlock<RemainderOps>(aScalar, bScalar, rows, index);
+		}
+	}
+}
+
+#endif
@@ -10,6 +10,11 @@
 
 #include <stdint.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 /**
  * The solution file is used for storing calibration Jones matrices. The format is as follows:
  *  Bytes |  Description 
@@ -47,7 +52,8 @@ class SolutionFile
 	/** Empty constructor. After constructing, either @ref OpenForReading() should be called or the parameters should
 	 * be initialized and @ref OpenForWriting() or @ref OpenInMemory() should be called.
 	 */
-  SolutionFile() : _outputStream(0), _inputStream(0), _readPointer(nullptr)
+  SolutionFile() : _outputStream(0), _inputStream(0), _readPointer(nullptr),
+		_startTime(0.0), _endTime(0.0), _mappedData(nullptr), _mappedSize(0)
   {
     strcpy(_header.intro, "MWAOCAL");
     _header.fileType = 0; // Complex jones solutions
@@ -59,6 +65,8 @@ class SolutionFile
   ~SolutionFile() {
     delete _outputStream;
     delete _inputStream;
+		if(_mappedData != nullptr)
+			munmap(_mappedData, _mappedSize);
   }
 
   /** Number of antennas stored in file. */
@@ -86,6 +94,11 @@ class SolutionFile
 		_header.intervalCount = intervalCount;
 	}
 
+	/** Start and end time of the solutions, as read by @ref OpenForReading(). The intervals
+	 * divide this time range into equal parts. */
+	double StartTime() const { return _startTime; }
+	double EndTime() const { return _endTime; }
+
 	/** Open a new file on disk for writing. After calling this method,
 	 * data can be appended with the @ref WriteSolution() method.
 	 * @param filename Name of file to write.
@@ -128,11 +141,42 @@ class SolutionFile
 		if(_inputStream->bad())
 			throw std::runtime_error("Error reading input solutions file");
 		_inputStream->read(reinterpret_cast<char*>(&_header), sizeof(_header));
-		double timeStart, timeEnd;
-		_inputStream->read(reinterpret_cast<char*>(&timeStart), sizeof(timeStart));
-		_inputStream->read(reinterpret_cast<char*>(&timeEnd), sizeof(timeEnd)); 
+		_inputStream->read(reinterpret_cast<char*>(&_startTime), sizeof(_startTime));
+		_inputStream->read(reinterpret_cast<char*>(&_endTime), sizeof(_endTime)); 
 		if(_inputStream->bad())
 			throw std::runtime_error("Error reading header from solutions file");
+		_filename = filename;
+	}
+
+	/** Map all solutions of a file opened with @ref OpenForReading() into memory, instead of
+	 * reading them one by one with @ref ReadNextSolution(). The solutions are ordered as in the
+	 * file. The returned pointer stays valid until this object is destructed.
+	 */
+	const std::complex<double>* MapSolutions()
+	{
+		if(_mappedData == nullptr)
+		{
+			const size_t dataOffset = sizeof(_header) + sizeof(double)*2;
+			const size_t solutionCount = size_t(_header.intervalCount) * _header.antennaCount * _header.channelCount * _header.polarizationCount;
+			int fd = open(_filename.c_str(), O_RDONLY);
+			if(fd < 0)
+				throw std::runtime_error("Error opening solutions file " + _filename);
+			struct stat fileStat;
+			if(fstat(fd, &fileStat) != 0 || size_t(fileStat.st_size) < dataOffset + solutionCount * sizeof(std::complex<double>))
+			{
+				close(fd);
+				throw std::runtime_error("Solutions file " + _filename + " is shorter than its header specifies");
+			}
+			void* data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if(data == MAP_FAILED)
+				throw std::runtime_error("Could not map solutions file " + _filename + " into memory");
+			// All solutions are converted right away
+			madvise(data, fileStat.st_size, MADV_WILLNEED);
+			_mappedData = data;
+			_mappedSize = fileStat.st_size;
+		}
+		return reinterpret_cast<const std::complex<double>*>(static_cast<const char*>(_mappedData) + sizeof(_header) + sizeof(double)*2);
 	}
 
 	/** Read a complex solution from the file.
@@ -181,6 +225,13 @@ class SolutionFile
   std::ifstream *_inputStream;
 	std::vector<std::complex<double> > _data;
 	std::complex<double>* _readPointer;
+	double _startTime, _endTime;
+	std::string _filename;
+	void* _mappedData;
+	size_t _mappedSize;
+
+	SolutionFile(const SolutionFile&) = delete;
+	void operator=(const SolutionFile&) = delete;
 };
 
 #endif
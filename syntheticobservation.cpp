@@ -0,0 +1,247 @@
+#include "syntheticobservation.h"
+
+#include "gpufilereader.h"
+
+#include <fitsio.h>
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	// 2013-10-15T13:48:32 UTC; the metafits and the gpubox files should agree on this
+	const int startGPSTime = 1065880128;
+	const long startUnixTime = 1381844912;
+	const char startDate[] = "2013-10-15T13:48:32";
+}
+
+SyntheticObservation::Parameters::Parameters() :
+	activeTileCount(TileCount),
+	channelsPerSubband(8),
+	scanCount(8),
+	integrationTime(2.0),
+	centreSubbandNumber(121),
+	noiseSigma(1.0),
+	autoCorrelationPower(100.0),
+	rfiProbability(0.01),
+	rfiStrength(50.0),
+	seed(1)
+{ }
+
+SyntheticObservation::SyntheticObservation(const Parameters& parameters) :
+	_parameters(parameters)
+{
+	if(_parameters.activeTileCount == 0 || _parameters.activeTileCount > TileCount)
+		throw std::runtime_error("The number of active tiles of a synthetic observation should be between 1 and 128");
+	if(_parameters.channelsPerSubband == 0 || _parameters.scanCount == 0)
+		throw std::runtime_error("A synthetic observation needs at least one channel and one scan");
+	if(_parameters.centreSubbandNumber < SubbandCount/2 + 1 || _parameters.centreSubbandNumber + SubbandCount/2 > 255)
+		throw std::runtime_error("The centre subband of a synthetic observation should be between 13 and 244");
+
+	// The products in the files are ordered by PFB output; the metafits file below
+	// assigns input 2*tile+pol, so that the autos can be found with the PFB mapping
+	_productType.resize(BaselineCount() * 4);
+	size_t index = 0;
+	for(size_t antenna1=0; antenna1!=TileCount; ++antenna1)
+	{
+		for(size_t antenna2=0; antenna2<=antenna1; ++antenna2)
+		{
+			for(size_t p=0; p!=4; ++p)
+			{
+				const size_t
+					inputA = GPUFileReader::PFBOutputToInput(antenna2*2 + (p%2)),
+					inputB = GPUFileReader::PFBOutputToInput(antenna1*2 + (p/2));
+				if(inputA/2 != inputB/2)
+					_productType[index] = 0;
+				else
+					_productType[index] = (inputA%2 == inputB%2) ? 1 : 2;
+				++index;
+			}
+		}
+	}
+}
+
+void SyntheticObservation::WriteMetaFits(const std::string& filename) const
+{
+	fitsfile* fptr;
+	int status = 0;
+	// The exclamation mark makes cfitsio overwrite an existing file
+	if(fits_create_file(&fptr, ("!" + filename).c_str(), &status))
+		throwError(status, "Could not create metafits file " + filename);
+	fits_create_img(fptr, BYTE_IMG, 0, 0, &status);
+	checkStatus(status);
+
+	const size_t firstSubband = _parameters.centreSubbandNumber - SubbandCount/2;
+	std::ostringstream channelsStr, delaysStr;
+	for(size_t sb=0; sb!=SubbandCount; ++sb)
+		channelsStr << (sb==0 ? "" : ",") << (firstSubband + sb);
+	for(size_t i=0; i!=16; ++i)
+		delaysStr << (i==0 ? "" : ",") << 0;
+
+	int gpsTime = startGPSTime, centreChannel = _parameters.centreSubbandNumber,
+		scanCount = _parameters.scanCount, inputCount = TileCount*2, channelCount = ChannelCount(), calibrator = 0;
+	double
+		ra = 0.0, dec = -27.0,
+		integrationTime = _parameters.integrationTime,
+		bandwidth = SubbandCount * 1.28,
+		centralFrequency = (double(_parameters.centreSubbandNumber) - 0.5) * 1.28;
+	fits_write_key(fptr, TINT, "GPSTIME", &gpsTime, "[s] GPS time of observation start", &status);
+	fits_write_key(fptr, TSTRING, "FILENAME", const_cast<char*>("synthetic"), "Name of observation", &status);
+	fits_write_key(fptr, TSTRING, "DATE-OBS", const_cast<char*>(startDate), "Date of observation", &status);
+	fits_write_key(fptr, TDOUBLE, "RA", &ra, "[deg] RA of pointing centre", &status);
+	fits_write_key(fptr, TDOUBLE, "DEC", &dec, "[deg] Dec of pointing centre", &status);
+	fits_write_key(fptr, TDOUBLE, "RAPHASE", &ra, "[deg] RA of desired phase centre", &status);
+	fits_write_key(fptr, TDOUBLE, "DECPHASE", &dec, "[deg] DEC of desired phase centre", &status);
+	fits_write_key(fptr, TSTRING, "GRIDNAME", const_cast<char*>("sweet"), "Name of pointing grid used", &status);
+	fits_write_key(fptr, TSTRING, "CREATOR", const_cast<char*>("cotter"), "Observation creator", &status);
+	fits_write_key(fptr, TSTRING, "PROJECT", const_cast<char*>("C001"), "Project ID", &status);
+	fits_write_key(fptr, TSTRING, "MODE", const_cast<char*>("HW_LFILES"), "Observation mode", &status);
+	fits_write_key(fptr, TSTRING, "DELAYS", const_cast<char*>(delaysStr.str().c_str()), "Beamformer delays", &status);
+	fits_write_key(fptr, TLOGICAL, "CALIBRAT", &calibrator, "Intended for calibration", &status);
+	fits_write_key(fptr, TINT, "CENTCHAN", &centreChannel, "Centre coarse channel", &status);
+	fits_write_key(fptr, TDOUBLE, "INTTIME", &integrationTime, "[s] Individual integration time", &status);
+	fits_write_key(fptr, TINT, "NSCANS", &scanCount, "Number of time instants in correlation products", &status);
+	fits_write_key(fptr, TINT, "NINPUTS", &inputCount, "Number of inputs into the correlation products", &status);
+	fits_write_key(fptr, TINT, "NCHANS", &channelCount, "Number of fine channels in spectrum", &status);
+	fits_write_key(fptr, TDOUBLE, "BANDWDTH", &bandwidth, "[MHz] Total bandwidth", &status);
+	fits_write_key(fptr, TDOUBLE, "FREQCENT", &centralFrequency, "[MHz] Centre frequency", &status);
+	// Longer than a normal keyword value, hence written with CONTINUE cards
+	fits_write_key_longstr(fptr, "CHANNELS", const_cast<char*>(channelsStr.str().c_str()), "Coarse channels", &status);
+	fits_write_key(fptr, TSTRING, "TELESCOP", const_cast<char*>("MWA"), "", &status);
+	checkStatus(status);
+
+	const char* columnNames[] = {"Input", "Antenna", "Tile", "TileName", "Pol", "Rx", "Slot", "Flag", "Length", "East", "North", "Height", "Gains"};
+	const char* columnFormats[] = {"1I", "1I", "1I", "8A", "1A", "1I", "1I", "1I", "14A", "1E", "1E", "1E", "24I"};
+	const char* columnUnits[] = {"", "", "", "", "", "", "", "", "", "m", "m", "m", ""};
+	fits_create_tbl(fptr, BINARY_TBL, 0, 13,
+		const_cast<char**>(columnNames),
+		const_cast<char**>(columnFormats),
+		const_cast<char**>(columnUnits),
+		"TILEDATA", &status);
+	checkStatus(status);
+
+	std::mt19937 rng(_parameters.seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	int gains[24];
+	for(size_t sb=0; sb!=24; ++sb)
+		gains[sb] = 64;
+	for(size_t tile=0; tile!=TileCount; ++tile)
+	{
+		// Tiles are spread uniformly over a disc of 1.5 km, as in the extended array
+		const double
+			radius = 1500.0 * std::sqrt(uniform(rng)),
+			angle = 2.0 * M_PI * uniform(rng);
+		double
+			east = radius * std::cos(angle),
+			north = radius * std::sin(angle),
+			height = 377.0 + uniform(rng),
+			cableLength = 90.0 + 410.0 * uniform(rng);
+		char tileName[16], length[32];
+		std::snprintf(tileName, sizeof tileName, "Tile%03d", int(tile+1));
+		std::snprintf(length, sizeof length, "EL_%.2f", cableLength);
+		for(size_t pol=0; pol!=2; ++pol)
+		{
+			const int row = tile*2 + pol + 1;
+			int input = tile*2 + pol, antenna = tile, tileNumber = tile+1,
+				rx = tile/8 + 1, slot = tile%8 + 1, flag = (tile >= _parameters.activeTileCount) ? 1 : 0;
+			const char* tileNamePtr = tileName;
+			const char* polPtr = (pol == 0) ? "X" : "Y";
+			const char* lengthPtr = length;
+			fits_write_col_int(fptr, 1, row, 1, 1, &input, &status);
+			fits_write_col_int(fptr, 2, row, 1, 1, &antenna, &status);
+			fits_write_col_int(fptr, 3, row, 1, 1, &tileNumber, &status);
+			fits_write_col_str(fptr, 4, row, 1, 1, const_cast<char**>(&tileNamePtr), &status);
+			fits_write_col_str(fptr, 5, row, 1, 1, const_cast<char**>(&polPtr), &status);
+			fits_write_col_int(fptr, 6, row, 1, 1, &rx, &status);
+			fits_write_col_int(fptr, 7, row, 1, 1, &slot, &status);
+			fits_write_col_int(fptr, 8, row, 1, 1, &flag, &status);
+			fits_write_col_str(fptr, 9, row, 1, 1, const_cast<char**>(&lengthPtr), &status);
+			fits_write_col_dbl(fptr, 10, row, 1, 1, &east, &status);
+			fits_write_col_dbl(fptr, 11, row, 1, 1, &north, &status);
+			fits_write_col_dbl(fptr, 12, row, 1, 1, &height, &status);
+			fits_write_col_int(fptr, 13, row, 1, 24, gains, &status);
+			checkStatus(status);
+		}
+	}
+
+	if(fits_close_file(fptr, &status))
+		throwError(status, "Could not close metafits file " + filename);
+}
+
+std::vector<std::string> SyntheticObservation::WriteGPUBoxFiles(const std::string& prefix) const
+{
+	std::vector<std::string> filenames;
+	for(size_t gpuBox=0; gpuBox!=SubbandCount; ++gpuBox)
+	{
+		char suffix[32];
+		std::snprintf(suffix, sizeof suffix, "_gpubox%02d_00.fits", int(gpuBox+1));
+		filenames.push_back(prefix + suffix);
+		writeGPUBoxFile(filenames.back(), gpuBox);
+	}
+	return filenames;
+}
+
+void SyntheticObservation::writeGPUBoxFile(const std::string& filename, size_t gpuBoxIndex) const
+{
+	fitsfile* fptr;
+	int status = 0;
+	if(fits_create_file(&fptr, ("!" + filename).c_str(), &status))
+		throwError(status, "Could not create gpubox file " + filename);
+	fits_create_img(fptr, BYTE_IMG, 0, 0, &status);
+	long time = startUnixTime;
+	int milliTime = 0;
+	fits_write_key(fptr, TLONG, "TIME", &time, "Unix time (seconds)", &status);
+	fits_write_key(fptr, TINT, "MILLITIM", &milliTime, "Milliseconds since TIME", &status);
+	checkStatus(status);
+
+	// Every file has its own generator, so that the files do not depend on each other
+	std::mt19937 rng(_parameters.seed * 1000 + gpuBoxIndex + 1);
+	std::normal_distribution<float> noise(0.0, _parameters.noiseSigma);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	const size_t
+		productCount = BaselineCount() * 4,
+		channelCount = _parameters.channelsPerSubband;
+	const float autoPower = _parameters.autoCorrelationPower, rfiAmplitude = _parameters.rfiStrength * _parameters.noiseSigma;
+	std::vector<float> data(productCount * 2 * channelCount);
+	long naxes[2] = { long(productCount * 2), long(channelCount) };
+	for(size_t scan=0; scan!=_parameters.scanCount; ++scan)
+	{
+		float* value = data.data();
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			const float rfi = (uniform(rng) < _parameters.rfiProbability) ? rfiAmplitude : 0.0;
+			for(size_t product=0; product!=productCount; ++product)
+			{
+				switch(_productType[product])
+				{
+					case 0:
+						value[0] = noise(rng) + rfi;
+						value[1] = noise(rng);
+						break;
+					case 1:
+						value[0] = autoPower + rfi + noise(rng);
+						value[1] = 0.0;
+						break;
+					default:
+						value[0] = noise(rng);
+						value[1] = noise(rng);
+						break;
+				}
+				value += 2;
+			}
+		}
+
+		fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+		time = startUnixTime + long(scan * _parameters.integrationTime);
+		milliTime = int(std::fmod(scan * _parameters.integrationTime, 1.0) * 1000.0);
+		fits_write_key(fptr, TLONG, "TIME", &time, "Unix time (seconds)", &status);
+		fits_write_key(fptr, TINT, "MILLITIM", &milliTime, "Milliseconds since TIME", &status);
+		fits_write_img(fptr, TFLOAT, 1, data.size(), data.data(), &status);
+		checkStatus(status);
+	}
+
+	if(fits_close_file(fptr, &status))
+		throwError(status, "Could not close gpubox file " + filename);
+}
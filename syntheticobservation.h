@@ -0,0 +1,69 @@
+#ifndef SYNTHETIC_OBSERVATION_H
+#define SYNTHETIC_OBSERVATION_H
+
+#include "fitsuser.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * Writes a synthetic observation: a metafits file and the gpubox files of the
+ * legacy correlator, in the format that MetaFitsFile and GPUFileReader read. The
+ * visibilities are Gaussian noise, with a constant power on the auto-correlations,
+ * plus RFI that hits all cross-correlations of a channel and scan at once.
+ *
+ * The correlator format always has 128 tiles (the PFB mapping of the reader
+ * assumes 256 inputs); the array size is set by the number of unflagged tiles.
+ * All 24 coarse channels are written, each to its own gpubox file with one HDU
+ * per scan. The data is generated from the seed, so the same parameters always
+ * give the same files.
+ */
+class SyntheticObservation : private FitsUser
+{
+	public:
+		struct Parameters
+		{
+			/** Number of tiles that are not flagged in the metafits file, at most TileCount. */
+			size_t activeTileCount;
+			size_t channelsPerSubband, scanCount;
+			/** Integration time in seconds. */
+			double integrationTime;
+			/** Number of the central coarse channel; the band covers 12 channels below and 11 above it. */
+			size_t centreSubbandNumber;
+			/** Standard deviation of the real and imaginary noise, and the level of the auto-correlations. */
+			double noiseSigma, autoCorrelationPower;
+			/** Chance that a channel of a scan contains RFI, and its amplitude in units of noiseSigma. */
+			double rfiProbability, rfiStrength;
+			unsigned seed;
+
+			Parameters();
+		};
+
+		static const size_t TileCount = 128, SubbandCount = 24;
+
+		explicit SyntheticObservation(const Parameters& parameters);
+
+		void WriteMetaFits(const std::string& filename) const;
+
+		/**
+		 * Writes the files <prefix>_gpuboxNN_00.fits and returns their names,
+		 * ordered by gpubox number.
+		 */
+		std::vector<std::string> WriteGPUBoxFiles(const std::string& prefix) const;
+
+		size_t BaselineCount() const { return TileCount * (TileCount + 1) / 2; }
+		size_t ChannelCount() const { return _parameters.channelsPerSubband * SubbandCount; }
+		/** Size of the visibilities in all gpubox files. */
+		size_t DataBytes() const { return BaselineCount() * 4 * ChannelCount() * _parameters.scanCount * sizeof(float) * 2; }
+		const Parameters& GetParameters() const { return _parameters; }
+
+	private:
+		void writeGPUBoxFile(const std::string& filename, size_t gpuBoxIndex) const;
+
+		Parameters _parameters;
+		/** Per correlation product of the files: 0 for cross-correlations, 1 for parallel-hand and 2 for cross-hand autos. */
+		std::vector<unsigned char> _productType;
+};
+
+#endif
@@ -1,17 +1,22 @@
 #include "threadedwriter.h"
+#include "metrics.h"
+#include "tracer.h"
 
-#include <boost/mem_fn.hpp>
+#include <functional>
 
-ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter) :
+ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter, ThreadPool& threadPool) :
 	ForwardingWriter(std::move(parentWriter)),
 	_isWriterReady(false),
 	_isBufferReady(false),
 	_isFinishing(false),
+	_polarizationCount(4),
 	_bufferedData(0),
 	_bufferedFlags(0),
 	_bufferedWeights(0),
-	_thread(&ThreadedWriter::writerThreadFunc, this)
+	_bufferBytes(MemoryAccounting::WriterQueueCategory),
+	_writerTask(threadPool)
 {
+	_writerTask.RunLongRunning(std::bind(&ThreadedWriter::writerThreadFunc, this));
 }
 
 ThreadedWriter::~ThreadedWriter()
@@ -22,19 +27,26 @@ ThreadedWriter::~ThreadedWriter()
 	}
 	
 	_bufferChangeCondition.notify_all();
-	_thread.join();
+	_writerTask.Wait();
 	
 	delete[] _bufferedData;
 	delete[] _bufferedFlags;
 	delete[] _bufferedWeights;
 }
 
+void ThreadedWriter::SetPolarizationCount(size_t polarizationCount)
+{
+	_polarizationCount = polarizationCount;
+	ForwardingWriter::SetPolarizationCount(polarizationCount);
+}
+
 void ThreadedWriter::WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow)
 {
-	_arraySize = channels.size() * 4;
+	_arraySize = channels.size() * _polarizationCount;
 	_bufferedData = new std::complex<float>[_arraySize];
 	_bufferedFlags = new bool[_arraySize];
 	_bufferedWeights = new float[_arraySize];
+	_bufferBytes.Set(_arraySize * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float)));
 	
 	ForwardingWriter::WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
 }
@@ -44,8 +56,10 @@ void ThreadedWriter::AddRows(size_t rowCount)
 	std::unique_lock<std::mutex> lock(_mutex);
 	
 	// Wait until the writer is ready AND the buffer is empty
-	while(!_isWriterReady || _isBufferReady)
+	while((!_isWriterReady || _isBufferReady) && !_writerException)
 		_bufferChangeCondition.wait(lock);
+	if(_writerException)
+		std::rethrow_exception(_writerException);
 	
 	// Just keep mutex locked (might take time, but this method is not called so often...)
 	ParentWriter().AddRows(rowCount);
@@ -55,9 +69,16 @@ void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1,
 {
 	std::unique_lock<std::mutex> lock(_mutex);
 	
-	// Wait until the writer is ready AND the buffer is empty (=not ready)
-	while(!_isWriterReady || _isBufferReady)
-		_bufferChangeCondition.wait(lock);
+	// Wait until the writer is ready AND the buffer is empty (=not ready). Only
+	// actual waits are traced, to keep the number of spans down.
+	if((!_isWriterReady || _isBufferReady) && !_writerException)
+	{
+		TraceSpan waitSpan(Tracer::QueueWaitStage);
+		while((!_isWriterReady || _isBufferReady) && !_writerException)
+			_bufferChangeCondition.wait(lock);
+	}
+	if(_writerException)
+		std::rethrow_exception(_writerException);
 	
 	_bufferedTime = time;
 	_bufferedTimeCentroid = timeCentroid;
@@ -71,6 +92,7 @@ void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1,
 	memcpy(_bufferedFlags, flags, _arraySize * sizeof(bool));
 	memcpy(_bufferedWeights, weights, _arraySize * sizeof(float));
 	
+	Metrics::AddWriterQueueDepth(1);
 	_isBufferReady = true;
 	_bufferChangeCondition.notify_all();
 }
@@ -93,9 +115,21 @@ void ThreadedWriter::writerThreadFunc()
 		{
 			lock.unlock();
 			
-			ParentWriter().WriteRow(_bufferedTime, _bufferedTimeCentroid, _bufferedAntenna1, _bufferedAntenna2, _bufferedU, _bufferedV, _bufferedW, _bufferedInterval, _bufferedData, _bufferedFlags, _bufferedWeights);
+			try {
+				TraceSpan putSpan(Tracer::StoragePutStage);
+				ParentWriter().WriteRow(_bufferedTime, _bufferedTimeCentroid, _bufferedAntenna1, _bufferedAntenna2, _bufferedU, _bufferedV, _bufferedW, _bufferedInterval, _bufferedData, _bufferedFlags, _bufferedWeights);
+			} catch(...) {
+				// Hand the error over to the producer, which would otherwise wait forever
+				lock.lock();
+				_writerException = std::current_exception();
+				Metrics::AddWriterQueueDepth(-1);
+				_isBufferReady = false;
+				_bufferChangeCondition.notify_all();
+				return;
+			}
 			
 			lock.lock();
+			Metrics::AddWriterQueueDepth(-1);
 			_isBufferReady = false;
 		}
 	}
@@ -2,21 +2,25 @@
 #define THREADED_WRITER_H
 
 #include "forwardingwriter.h"
+#include "memoryaccounting.h"
+#include "threadpool.h"
 
 #include <string.h>
 
 #include <condition_variable>
+#include <exception>
 #include <memory>
 #include <mutex>
-#include <thread>
 
 class ThreadedWriter : public ForwardingWriter
 {
 	public:
-		ThreadedWriter(std::unique_ptr<Writer>&& parentWriter);
+		ThreadedWriter(std::unique_ptr<Writer>&& parentWriter, ThreadPool& threadPool);
 		
 		virtual ~ThreadedWriter() final override;
 		
+		virtual void SetPolarizationCount(size_t polarizationCount) final override;
+		
 		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override;
 		
 		virtual void AddRows(size_t rowCount) final override;
@@ -27,8 +31,9 @@ class ThreadedWriter : public ForwardingWriter
 		std::condition_variable _bufferChangeCondition;
 		std::mutex _mutex;
 		bool _isWriterReady, _isBufferReady, _isFinishing;
+		std::exception_ptr _writerException;
 		
-		size_t _arraySize;
+		size_t _polarizationCount, _arraySize;
 		double _bufferedTime, _bufferedTimeCentroid;
 		size_t _bufferedAntenna1, _bufferedAntenna2;
 		double _bufferedU, _bufferedV, _bufferedW;
@@ -36,9 +41,11 @@ class ThreadedWriter : public ForwardingWriter
 		std::complex<float> *_bufferedData;
 		bool *_bufferedFlags;
 		float *_bufferedWeights;
+		TrackedBytes _bufferBytes;
 		
-		// Last property, because it needs to be constructed after fields have been initialized
-		std::thread _thread;
+		// The writer loop blocks for the lifetime of the writer, and therefore runs
+		// as a long-running task on a service thread of the pool.
+		ThreadPool::TaskGroup _writerTask;
 		
 		void writerThreadFunc();
 };
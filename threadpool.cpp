@@ -0,0 +1,189 @@
+#include "threadpool.h"
+#include "numatopology.h"
+#include "tracer.h"
+
+#include <algorithm>
+#include <memory>
+
+namespace {
+	thread_local const ThreadPool* currentPool = nullptr;
+	thread_local size_t currentWorkerIndex = 0;
+	thread_local size_t currentWorkerNode = 0;
+}
+
+ThreadPool::ThreadPool(size_t threadCount, size_t queueCapacity, const NUMATopology* topology) :
+	_nextNode(0),
+	_idleServiceThreadCount(0),
+	_isFinishing(false)
+{
+	if(threadCount == 0)
+		threadCount = 1;
+	size_t nodeCount = 1;
+	if(topology != nullptr)
+		nodeCount = std::min(topology->NodeCount(), threadCount);
+	for(size_t node=0; node!=nodeCount; ++node)
+		_nodeTasks.emplace_back(new ao::lockfree_lane<std::function<void()>>(std::max<size_t>(queueCapacity, 1)));
+	_workers.reserve(threadCount);
+	for(size_t i=0; i!=threadCount; ++i)
+	{
+		// Workers are assigned to nodes round-robin, which spreads them evenly
+		const size_t node = i % nodeCount;
+		std::vector<int> cpus;
+		if(nodeCount > 1)
+			cpus = topology->NodeCPUs(node);
+		_workers.emplace_back(&ThreadPool::workerThreadFunc, this, i, node, cpus);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	for(std::unique_ptr<ao::lockfree_lane<std::function<void()>>>& tasks : _nodeTasks)
+		tasks->write_end();
+	for(std::thread& t : _workers)
+		t.join();
+
+	{
+		std::lock_guard<std::mutex> lock(_serviceMutex);
+		_isFinishing = true;
+	}
+	_serviceCondition.notify_all();
+	for(std::thread& t : _serviceThreads)
+		t.join();
+}
+
+size_t ThreadPool::WorkerIndex() const
+{
+	if(currentPool == this)
+		return currentWorkerIndex;
+	else
+		return _workers.size();
+}
+
+size_t ThreadPool::CurrentNode() const
+{
+	if(currentPool == this)
+		return currentWorkerNode;
+	else
+		return 0;
+}
+
+void ThreadPool::workerThreadFunc(size_t workerIndex, size_t node, std::vector<int> cpus)
+{
+	currentPool = this;
+	currentWorkerIndex = workerIndex;
+	currentWorkerNode = node;
+	Tracer::SetThreadName("worker " + std::to_string(workerIndex) + " (node " + std::to_string(node) + ")");
+	if(!cpus.empty())
+		NUMATopology::PinCurrentThread(cpus);
+	ao::lockfree_lane<std::function<void()>>& tasks = *_nodeTasks[node];
+	std::function<void()> task;
+	while(tasks.read(task))
+	{
+		task();
+		// Release whatever the task captured before blocking on the next one
+		task = nullptr;
+	}
+}
+
+void ThreadPool::runLongRunning(std::function<void()>&& task)
+{
+	std::lock_guard<std::mutex> lock(_serviceMutex);
+	_serviceTasks.emplace_back(std::move(task));
+	// Spawn a new service thread only when none is waiting for work
+	if(_idleServiceThreadCount < _serviceTasks.size())
+		_serviceThreads.emplace_back(&ThreadPool::serviceThreadFunc, this);
+	else
+		_serviceCondition.notify_one();
+}
+
+void ThreadPool::serviceThreadFunc()
+{
+	Tracer::SetThreadName("service");
+	std::unique_lock<std::mutex> lock(_serviceMutex);
+	while(true)
+	{
+		while(_serviceTasks.empty() && !_isFinishing)
+		{
+			++_idleServiceThreadCount;
+			_serviceCondition.wait(lock);
+			--_idleServiceThreadCount;
+		}
+		if(_serviceTasks.empty())
+			break;
+		std::function<void()> task(std::move(_serviceTasks.front()));
+		_serviceTasks.pop_front();
+		lock.unlock();
+
+		task();
+		task = nullptr;
+
+		lock.lock();
+	}
+}
+
+ThreadPool::TaskGroup::~TaskGroup()
+{
+	waitForAll();
+}
+
+std::function<void()> ThreadPool::TaskGroup::wrap(std::function<void()>&& task)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		++_pendingCount;
+	}
+	// The task is moved into the closure, which is in turn moved into the queue
+	std::shared_ptr<std::function<void()>> taskPtr(new std::function<void()>(std::move(task)));
+	return [this, taskPtr]()
+	{
+		std::exception_ptr exception;
+		try {
+			(*taskPtr)();
+		} catch(...) {
+			exception = std::current_exception();
+		}
+		// Destruct the captured state before signalling, as the owner might
+		// otherwise release resources the task still refers to.
+		*taskPtr = nullptr;
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(exception && !_exception)
+			_exception = exception;
+		--_pendingCount;
+		if(_pendingCount == 0)
+			_finishedCondition.notify_all();
+	};
+}
+
+void ThreadPool::TaskGroup::Run(std::function<void()> task)
+{
+	_pool.run(wrap(std::move(task)));
+}
+
+void ThreadPool::TaskGroup::RunOnNode(size_t node, std::function<void()> task)
+{
+	_pool.run(wrap(std::move(task)), node);
+}
+
+void ThreadPool::TaskGroup::RunLongRunning(std::function<void()> task)
+{
+	_pool.runLongRunning(wrap(std::move(task)));
+}
+
+void ThreadPool::TaskGroup::waitForAll()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(_pendingCount != 0)
+		_finishedCondition.wait(lock);
+}
+
+void ThreadPool::TaskGroup::Wait()
+{
+	waitForAll();
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(_exception)
+	{
+		std::exception_ptr exception = _exception;
+		_exception = nullptr;
+		std::rethrow_exception(exception);
+	}
+}
@@ -0,0 +1,147 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "lockfree_lane.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Process-wide set of worker threads that live for the whole run. The
+ * reader, the baseline processing and the writers all submit their work to
+ * the same pool, so that threads are no longer created and joined for every
+ * chunk, and so that the number of busy cores stays bounded by the thread
+ * count even when stages overlap.
+ *
+ * Work is submitted through a TaskGroup, which allows the submitter to wait
+ * for exactly the tasks it has submitted. Tasks that block for the lifetime of
+ * an object (e.g. the consumer loop of a ThreadedWriter) should be started with
+ * TaskGroup::RunLongRunning(): those run on separate service threads, which are
+ * kept alive and reused after the task finishes, so that they never occupy
+ * one of the workers.
+ *
+ * When a NUMA topology is given, the workers are spread over the nodes and
+ * pinned to the CPUs of their node. Every node then has its own queue, and
+ * TaskGroup::RunOnNode() can be used to run a task on a worker of a particular
+ * node. Tasks submitted with TaskGroup::Run() are distributed round-robin over
+ * the nodes.
+ *
+ * Tasks should not wait on other tasks of the same pool, as that might
+ * deadlock when all workers are waiting.
+ */
+class ThreadPool
+{
+	public:
+		class TaskGroup;
+
+		/**
+		 * @param threadCount Number of workers.
+		 * @param queueCapacity Number of tasks that can be queued (per node) before submitting blocks.
+		 * @param topology When set, workers are spread over and pinned to the NUMA nodes.
+		 */
+		ThreadPool(size_t threadCount, size_t queueCapacity, const class NUMATopology* topology = nullptr);
+		~ThreadPool();
+
+		size_t ThreadCount() const { return _workers.size(); }
+		size_t NodeCount() const { return _nodeTasks.size(); }
+
+		/**
+		 * Index of the calling thread in this pool, in the range [0, ThreadCount()).
+		 * Threads that are not workers of this pool (including the main thread and the
+		 * service threads) get index ThreadCount(). Hence, per-worker scratch space
+		 * should be sized to ThreadCount()+1.
+		 */
+		size_t WorkerIndex() const;
+
+		/** The node of the calling worker. Threads that are not workers of this pool get node 0. */
+		size_t CurrentNode() const;
+
+		/** Number of tasks that are queued and not yet started; an estimate while tasks are submitted. */
+		size_t QueuedTaskCount() const
+		{
+			size_t count = 0;
+			for(const std::unique_ptr<ao::lockfree_lane<std::function<void()>>>& tasks : _nodeTasks)
+				count += tasks->size();
+			return count;
+		}
+
+	private:
+		friend class TaskGroup;
+
+		void run(std::function<void()>&& task)
+		{
+			run(std::move(task), _nextNode.fetch_add(1, std::memory_order_relaxed) % _nodeTasks.size());
+		}
+		void run(std::function<void()>&& task, size_t node)
+		{
+			_nodeTasks[node]->write(std::move(task));
+		}
+		void runLongRunning(std::function<void()>&& task);
+		void workerThreadFunc(size_t workerIndex, size_t node, std::vector<int> cpus);
+		void serviceThreadFunc();
+
+		// One queue per NUMA node, or a single queue without NUMA
+		std::vector<std::unique_ptr<ao::lockfree_lane<std::function<void()>>>> _nodeTasks;
+		std::atomic<size_t> _nextNode;
+		std::vector<std::thread> _workers;
+
+		std::mutex _serviceMutex;
+		std::condition_variable _serviceCondition;
+		std::deque<std::function<void()>> _serviceTasks;
+		std::vector<std::thread> _serviceThreads;
+		size_t _idleServiceThreadCount;
+		bool _isFinishing;
+
+		ThreadPool(const ThreadPool&) = delete;
+		void operator=(const ThreadPool&) = delete;
+};
+
+/**
+ * A set of tasks submitted to a ThreadPool that can be waited for together.
+ * If one of the tasks throws, the first exception is stored and rethrown
+ * by Wait(). The destructor waits for all tasks, but does not rethrow.
+ */
+class ThreadPool::TaskGroup
+{
+	public:
+		explicit TaskGroup(ThreadPool& pool) : _pool(pool), _pendingCount(0) { }
+		~TaskGroup();
+
+		/** Queue a short task on the workers of the pool. */
+		void Run(std::function<void()> task);
+
+		/** Queue a short task on a worker of the given NUMA node. */
+		void RunOnNode(size_t node, std::function<void()> task);
+
+		/** Start a task that can block for a long time on a service thread. */
+		void RunLongRunning(std::function<void()> task);
+
+		/** Wait for all tasks that have been submitted so far, and rethrow
+		 * the exception of the first failed task, if any. */
+		void Wait();
+
+		ThreadPool& Pool() const { return _pool; }
+
+	private:
+		std::function<void()> wrap(std::function<void()>&& task);
+		void waitForAll();
+
+		ThreadPool& _pool;
+		std::mutex _mutex;
+		std::condition_variable _finishedCondition;
+		size_t _pendingCount;
+		std::exception_ptr _exception;
+
+		TaskGroup(const TaskGroup&) = delete;
+		void operator=(const TaskGroup&) = delete;
+};
+
+#endif
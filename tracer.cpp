@@ -0,0 +1,343 @@
+#include "tracer.h"
+
+#include "perfcounters.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+std::atomic<bool> Tracer::_isEnabled(false);
+
+namespace {
+	struct Event
+	{
+		int64_t start, duration;
+		Tracer::Stage stage;
+	};
+
+	struct StageTotals
+	{
+		uint64_t count;
+		int64_t total, max;
+	};
+
+	// Spans that are nested deeper than this are not counted
+	const size_t maxCounterDepth = 16;
+
+	/** Written only by its own thread, read by the exports. */
+	struct ThreadBuffer
+	{
+		size_t threadIndex;
+		std::string name;
+		std::vector<Event> events;
+		std::atomic<uint64_t> eventCount;
+		StageTotals totals[Tracer::StageCount];
+		size_t depth;
+		int64_t busy;
+		// Only set when the counters are enabled and could be opened
+		std::unique_ptr<PerfCounters> counters;
+		uint64_t counterStarts[maxCounterDepth][PerfCounters::CounterCount];
+		uint64_t stageCounters[Tracer::StageCount][PerfCounters::CounterCount];
+		uint64_t busyCounters[PerfCounters::CounterCount];
+	};
+
+	std::mutex registryMutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> registry;
+	size_t eventsPerThread = 0;
+	bool isCountingEnabled = false;
+	std::string counterError;
+	std::chrono::steady_clock::time_point epoch;
+
+	thread_local ThreadBuffer* currentBuffer = nullptr;
+	thread_local std::string currentName;
+
+	ThreadBuffer& threadBuffer()
+	{
+		if(currentBuffer == nullptr)
+		{
+			std::unique_ptr<ThreadBuffer> buffer(new ThreadBuffer());
+			buffer->events.resize(eventsPerThread);
+			buffer->eventCount = 0;
+			std::fill_n(buffer->totals, size_t(Tracer::StageCount), StageTotals{0, 0, 0});
+			buffer->depth = 0;
+			buffer->busy = 0;
+			std::fill_n(&buffer->stageCounters[0][0], size_t(Tracer::StageCount) * PerfCounters::CounterCount, uint64_t(0));
+			std::fill_n(buffer->busyCounters, size_t(PerfCounters::CounterCount), uint64_t(0));
+			if(isCountingEnabled)
+				buffer->counters.reset(new PerfCounters());
+			std::lock_guard<std::mutex> lock(registryMutex);
+			if(buffer->counters && !buffer->counters->IsOpen())
+			{
+				if(counterError.empty())
+					counterError = buffer->counters->Error();
+				buffer->counters.reset();
+			}
+			buffer->threadIndex = registry.size();
+			buffer->name = currentName.empty() ? "thread " + std::to_string(registry.size()) : currentName;
+			currentBuffer = buffer.get();
+			registry.emplace_back(std::move(buffer));
+		}
+		return *currentBuffer;
+	}
+
+	int64_t nanoseconds(std::chrono::steady_clock::duration duration)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+	}
+
+	void writeCounterHeader(std::ostream& stream, const char* firstColumn)
+	{
+		stream << std::left << std::setw(24) << firstColumn << std::right << std::setw(10) << "Gcycles" << std::setw(10) << "Ginstr"
+			<< std::setw(8) << "IPC" << std::setw(10) << "miss (%)" << std::setw(8) << "MPKI" << std::setw(10) << "GB/s" << '\n';
+	}
+
+	void writeCounterRow(std::ostream& stream, const std::string& name, const uint64_t* counters, int64_t duration)
+	{
+		const double
+			cycles = counters[PerfCounters::Cycles],
+			instructions = counters[PerfCounters::Instructions],
+			references = counters[PerfCounters::CacheReferences],
+			misses = counters[PerfCounters::CacheMisses],
+			seconds = duration * 1e-9;
+		stream << "  " << std::left << std::setw(22) << name << std::right
+			<< std::setw(10) << cycles * 1e-9 << std::setw(10) << instructions * 1e-9
+			<< std::setw(8) << (cycles > 0.0 ? instructions / cycles : 0.0)
+			<< std::setw(10) << (references > 0.0 ? 100.0 * misses / references : 0.0)
+			<< std::setw(8) << (instructions > 0.0 ? 1000.0 * misses / instructions : 0.0)
+			<< std::setw(10) << (seconds > 0.0 ? misses * PerfCounters::CacheLineSize * 1e-9 / seconds : 0.0) << '\n';
+	}
+}
+
+void Tracer::Enable(size_t eventCount)
+{
+	std::lock_guard<std::mutex> lock(registryMutex);
+	if(eventCount == 0)
+		throw std::runtime_error("The trace buffers need room for at least one event");
+	eventsPerThread = eventCount;
+	epoch = std::chrono::steady_clock::now();
+	_isEnabled = true;
+}
+
+void Tracer::EnableCounters()
+{
+	std::lock_guard<std::mutex> lock(registryMutex);
+	isCountingEnabled = true;
+}
+
+void Tracer::SetThreadName(const std::string& name)
+{
+	currentName = name;
+	if(currentBuffer != nullptr)
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		currentBuffer->name = name;
+	}
+}
+
+void Tracer::Begin()
+{
+	ThreadBuffer& buffer = threadBuffer();
+	if(buffer.counters && buffer.depth < maxCounterDepth)
+		buffer.counters->Read(buffer.counterStarts[buffer.depth]);
+	++buffer.depth;
+}
+
+void Tracer::End(Stage stage, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	ThreadBuffer& buffer = threadBuffer();
+	const int64_t duration = nanoseconds(end - start);
+	const uint64_t index = buffer.eventCount.load(std::memory_order_relaxed);
+	Event& event = buffer.events[index % buffer.events.size()];
+	event.start = nanoseconds(start - epoch);
+	event.duration = duration;
+	event.stage = stage;
+	buffer.eventCount.store(index + 1, std::memory_order_release);
+
+	StageTotals& totals = buffer.totals[stage];
+	++totals.count;
+	totals.total += duration;
+	totals.max = std::max(totals.max, duration);
+	// Only the outermost spans count as busy time, so that nested spans are not counted twice
+	--buffer.depth;
+	if(buffer.depth == 0)
+		buffer.busy += duration;
+
+	if(buffer.counters && buffer.depth < maxCounterDepth)
+	{
+		uint64_t values[PerfCounters::CounterCount];
+		buffer.counters->Read(values);
+		for(size_t c=0; c!=PerfCounters::CounterCount; ++c)
+		{
+			const uint64_t delta = values[c] - buffer.counterStarts[buffer.depth][c];
+			buffer.stageCounters[stage][c] += delta;
+			if(buffer.depth == 0)
+				buffer.busyCounters[c] += delta;
+		}
+	}
+}
+
+const char* Tracer::StageName(Stage stage)
+{
+	switch(stage)
+	{
+		case ChunkStage: return "chunk";
+		case ReadStage: return "read";
+		case FileOpenStage: return "file open";
+		case HDUReadStage: return "HDU read";
+		case BufferWaitStage: return "GPU buffer wait";
+		case ShuffleStage: return "shuffle";
+		case DecompressStage: return "decompress";
+		case ProcessStage: return "process";
+		case CorrectionStage: return "correction";
+		case FlaggingStage: return "flagging";
+		case StatisticsStage: return "statistics";
+		case SolutionsStage: return "solutions";
+		case WriteStage: return "write";
+		case RowBuildStage: return "row build";
+		case QueueWaitStage: return "writer queue wait";
+		case StoragePutStage: return "storage put";
+		case StageCount: break;
+	}
+	return "unknown";
+}
+
+void Tracer::WriteChromeTrace(const std::string& filename)
+{
+	std::ofstream file(filename);
+	if(!file)
+		throw std::runtime_error("Could not open " + filename + " for writing the trace");
+	std::lock_guard<std::mutex> lock(registryMutex);
+	uint64_t droppedCount = 0;
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" << std::fixed << std::setprecision(3);
+	bool isFirst = true;
+	for(const std::unique_ptr<ThreadBuffer>& buffer : registry)
+	{
+		// The name is escaped by leaving out the characters that would need it
+		std::string name;
+		for(char c : buffer->name)
+		{
+			if(c != '"' && c != '\\' && c >= ' ')
+				name += c;
+		}
+		if(!isFirst)
+			file << ",\n";
+		isFirst = false;
+		file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadIndex << ",\"args\":{\"name\":\"" << name << "\"}}";
+
+		const uint64_t eventCount = buffer->eventCount.load(std::memory_order_acquire);
+		const uint64_t capacity = buffer->events.size();
+		const uint64_t first = eventCount > capacity ? eventCount - capacity : 0;
+		droppedCount += first;
+		for(uint64_t i=first; i!=eventCount; ++i)
+		{
+			const Event& event = buffer->events[i % capacity];
+			file << ",\n{\"name\":\"" << StageName(event.stage) << "\",\"cat\":\"cotter\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadIndex
+				<< ",\"ts\":" << event.start * 1e-3 << ",\"dur\":" << event.duration * 1e-3 << '}';
+		}
+	}
+	file << "\n],\"otherData\":{\"droppedEvents\":" << droppedCount << "}}\n";
+	if(!file)
+		throw std::runtime_error("Error while writing trace to " + filename);
+}
+
+Tracer::StageTotal Tracer::Total(Stage stage)
+{
+	std::lock_guard<std::mutex> lock(registryMutex);
+	uint64_t spanCount = 0;
+	int64_t total = 0;
+	for(const std::unique_ptr<ThreadBuffer>& buffer : registry)
+	{
+		spanCount += buffer->totals[stage].count;
+		total += buffer->totals[stage].total;
+	}
+	return StageTotal{spanCount, total * 1e-9};
+}
+
+void Tracer::WriteSummary(std::ostream& stream)
+{
+	std::lock_guard<std::mutex> lock(registryMutex);
+	const std::ios_base::fmtflags oldFlags = stream.flags();
+	const std::streamsize oldPrecision = stream.precision();
+	stream << std::fixed << std::setprecision(3);
+
+	stream << "Trace summary per stage (nested stages are included in their parents):\n"
+		<< std::left << std::setw(20) << "  stage" << std::right << std::setw(12) << "spans" << std::setw(12) << "total (s)"
+		<< std::setw(12) << "mean (ms)" << std::setw(12) << "max (ms)" << std::setw(10) << "threads" << '\n';
+	for(size_t s=0; s!=StageCount; ++s)
+	{
+		StageTotals sum{0, 0, 0};
+		size_t threadCount = 0;
+		for(const std::unique_ptr<ThreadBuffer>& buffer : registry)
+		{
+			const StageTotals& totals = buffer->totals[s];
+			if(totals.count != 0)
+			{
+				sum.count += totals.count;
+				sum.total += totals.total;
+				sum.max = std::max(sum.max, totals.max);
+				++threadCount;
+			}
+		}
+		if(sum.count != 0)
+		{
+			stream << std::left << std::setw(20) << ("  " + std::string(StageName(Stage(s)))) << std::right
+				<< std::setw(12) << sum.count << std::setw(12) << sum.total * 1e-9
+				<< std::setw(12) << sum.total * 1e-6 / sum.count << std::setw(12) << sum.max * 1e-6
+				<< std::setw(10) << threadCount << '\n';
+		}
+	}
+
+	const double wallSeconds = nanoseconds(std::chrono::steady_clock::now() - epoch) * 1e-9;
+	stream << "Busy time per thread, out of " << wallSeconds << " s:\n";
+	for(const std::unique_ptr<ThreadBuffer>& buffer : registry)
+	{
+		const double busySeconds = buffer->busy * 1e-9;
+		stream << "  " << std::left << std::setw(24) << buffer->name << std::right << std::setw(12) << busySeconds << " s"
+			<< std::setw(8) << std::setprecision(1) << (wallSeconds > 0.0 ? 100.0 * busySeconds / wallSeconds : 0.0) << " %\n"
+			<< std::setprecision(3);
+	}
+
+	if(isCountingEnabled)
+	{
+		if(!counterError.empty())
+			stream << "Hardware counters are missing for some threads: " << counterError << ".\n";
+		// The times are only summed over the threads with counters, so that the bandwidths are consistent
+		bool wasMultiplexed = false;
+		stream << "Hardware counters per stage (user space; GB/s is the memory traffic of the\n"
+			"cache misses per second of the stage on one thread):\n";
+		writeCounterHeader(stream, "  stage");
+		for(size_t s=0; s!=StageCount; ++s)
+		{
+			uint64_t sum[PerfCounters::CounterCount] = { };
+			int64_t duration = 0;
+			for(const std::unique_ptr<ThreadBuffer>& buffer : registry)
+			{
+				if(buffer->counters && buffer->totals[s].count != 0)
+				{
+					for(size_t c=0; c!=PerfCounters::CounterCount; ++c)
+						sum[c] += buffer->stageCounters[s][c];
+					duration += buffer->totals[s].total;
+					wasMultiplexed = wasMultiplexed || buffer->counters->WasMultiplexed();
+				}
+			}
+			if(duration != 0)
+				writeCounterRow(stream, StageName(Stage(s)), sum, duration);
+		}
+		stream << "Hardware counters per thread, over its busy time:\n";
+		writeCounterHeader(stream, "  thread");
+		for(const std::unique_ptr<ThreadBuffer>& buffer : registry)
+		{
+			if(buffer->counters && buffer->busy != 0)
+				writeCounterRow(stream, buffer->name, buffer->busyCounters, buffer->busy);
+		}
+		if(wasMultiplexed)
+			stream << "WARNING: the counters were shared with other perf events and did not run all the time, so the values are too low.\n";
+	}
+	stream.flags(oldFlags);
+	stream.precision(oldPrecision);
+}
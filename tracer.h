@@ -0,0 +1,126 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/**
+ * Records spans of the pipeline stages, to see which thread does what and when.
+ * Every thread records in its own ring buffer, so recording takes no locks. The
+ * buffers keep the most recent spans for the Chrome trace-event export (which can
+ * be opened in chrome://tracing or Perfetto); the per-stage totals of the summary
+ * are counted separately and include spans that were overwritten.
+ *
+ * With EnableCounters(), every thread also reads its hardware counters (see PerfCounters)
+ * at the start and end of its spans, and the summary then shows the cycles, instructions
+ * and cache misses per stage and per thread.
+ *
+ * Recording is off until Enable() is called. When Cotter is configured with
+ * -DENABLE_TRACING=OFF, COTTER_TRACING is not defined and the spans compile to nothing.
+ *
+ * The exports read the buffers of all threads, and should only be called while no
+ * spans are being recorded.
+ */
+class Tracer
+{
+	public:
+		enum Stage {
+			ChunkStage, ReadStage, FileOpenStage, HDUReadStage, BufferWaitStage, ShuffleStage, DecompressStage,
+			ProcessStage, CorrectionStage, FlaggingStage, StatisticsStage, SolutionsStage,
+			WriteStage, RowBuildStage, QueueWaitStage, StoragePutStage,
+			StageCount
+		};
+
+		struct StageTotal
+		{
+			uint64_t spanCount;
+			/** Summed over all threads, so with parallel spans this can exceed the wall time. */
+			double seconds;
+		};
+
+		/** Should be called before the threads that are traced start recording. */
+		static void Enable(size_t eventsPerThread);
+		static bool IsEnabled() { return _isEnabled.load(std::memory_order_relaxed); }
+		/**
+		 * Also count the hardware events of the spans. Should be called before the threads
+		 * that are traced start recording; threads for which the counters can't be opened
+		 * only record times.
+		 */
+		static void EnableCounters();
+		static bool IsCompiledIn()
+		{
+#ifdef COTTER_TRACING
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		/** Name of the calling thread in the exports; can be called before Enable(). */
+		static void SetThreadName(const std::string& name);
+
+		/** Used by TraceSpan. */
+		static void Begin();
+		static void End(Stage stage, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+		static void WriteChromeTrace(const std::string& filename);
+		static void WriteSummary(std::ostream& stream);
+		/** Totals of a stage since Enable(), e.g. to compute the throughput of a stage. */
+		static StageTotal Total(Stage stage);
+
+		static const char* StageName(Stage stage);
+
+	private:
+		static std::atomic<bool> _isEnabled;
+};
+
+#ifdef COTTER_TRACING
+/**
+ * Records a span from its construction until End() is called or it is destructed.
+ * Spans of one thread should be nested.
+ */
+class TraceSpan
+{
+	public:
+		explicit TraceSpan(Tracer::Stage stage) : _stage(stage), _isActive(Tracer::IsEnabled())
+		{
+			if(_isActive)
+			{
+				Tracer::Begin();
+				_start = std::chrono::steady_clock::now();
+			}
+		}
+
+		~TraceSpan() { End(); }
+
+		void End()
+		{
+			if(_isActive)
+			{
+				Tracer::End(_stage, _start, std::chrono::steady_clock::now());
+				_isActive = false;
+			}
+		}
+
+		TraceSpan(const TraceSpan&) = delete;
+		TraceSpan& operator=(const TraceSpan&) = delete;
+
+	private:
+		Tracer::Stage _stage;
+		bool _isActive;
+		std::chrono::steady_clock::time_point _start;
+};
+#else
+class TraceSpan
+{
+	public:
+		explicit TraceSpan(Tracer::Stage) { }
+		void End() { }
+};
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef VISIBILITY_SINK_H
+#define VISIBILITY_SINK_H
+
+#include "writer.h"
+
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Receives the visibilities of Cotter's pipeline in a program that embeds Cotter,
+ * instead of having them written to a file (see Cotter::SetVisibilitySink()).
+ * All pointers are views into Cotter's buffers that are only valid during the call.
+ *
+ * There are two stages at which data can be received:
+ * - per baseline, for all timesteps of a chunk, directly from the buffers in which Cotter
+ *   processes the baselines. This is after the conjugation, cable length and passband
+ *   corrections, flagging and (with Cotter::SetApplyInBaselineProcessing()) the
+ *   solutions, but before the geometric phase correction and averaging;
+ * - per timestep, with the rows as they would be written to an output file, i.e. after all
+ *   corrections, averaging and solutions.
+ */
+class VisibilitySink
+{
+	public:
+		struct BaselineBlock
+		{
+			size_t antenna1, antenna2;
+			/** Index of the first timestep of the observation in this block. */
+			size_t timestepStart;
+			size_t timestepCount, channelCount;
+			/** Times of the timesteps, in MJD seconds, and frequencies of the channels in Hz. */
+			const double* times;
+			const double* channelFrequencies;
+			/**
+			 * Real and imaginary planes of XX, XY, YX and YY, in that order. The value of a
+			 * channel and timestep is planes[i][channel * stride + timestep].
+			 */
+			const float* planes[8];
+			size_t stride;
+			/** Flags, shared by the polarizations, indexed as flags[channel * flagStride + timestep]. */
+			const bool* flags;
+			size_t flagStride;
+		};
+
+		struct Timestep
+		{
+			/** Rows of the timestep, channels after averaging, and polarizations (see Cotter::SetPolarizationCount()). */
+			size_t rowCount, channelCount, polarizationCount;
+			/** Per row; uvws has three values per row. */
+			const double* times;
+			const double* timeCentroids;
+			const double* intervals;
+			const size_t* antenna1;
+			const size_t* antenna2;
+			const double* uvws;
+			/** Per row channelCount x polarizationCount values, as in Writer::WriteRow(). */
+			const std::complex<float>* data;
+			const bool* flags;
+			const float* weights;
+		};
+
+		virtual ~VisibilitySink() { }
+
+		/** Called at the start of every contiguous band, with the antennae and the output channels. */
+		virtual void StartBand(const std::vector<Writer::AntennaInfo>& antennae, const std::vector<Writer::ChannelInfo>& channels) { }
+
+		/** Called concurrently from the worker threads, so implementations should be thread safe. */
+		virtual void ProcessBaseline(const BaselineBlock& block) { }
+
+		/** Called from a single thread, in order of time. */
+		virtual void ProcessTimestep(const Timestep& timestep) { }
+
+		/** Called after the last timestep of a band. */
+		virtual void FinishBand() { }
+
+		/**
+		 * When false, Cotter skips the geometric correction, averaging and everything else
+		 * of the timestep stage, which saves time when only baselines are used.
+		 */
+		virtual bool WantsTimesteps() const { return true; }
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <complex>
+#include <stdexcept>
 
 class Writer
 {
@@ -63,6 +64,16 @@ class Writer
 		virtual void SetArrayLocation(double x, double y, double z) { }
 		virtual void SetOffsetsPerGPUBox(const std::vector<int>& offsets) { }
 		
+		/**
+		 * Set the number of polarizations per channel in the rows that are written. Should be
+		 * called before WriteBandInfo(). 4 means XX, XY, YX, YY (the default) and 2 means XX, YY.
+		 */
+		virtual void SetPolarizationCount(size_t polarizationCount)
+		{
+			if(polarizationCount != 4)
+				throw std::runtime_error("This output format can only be written with four polarizations");
+		}
+		
 		virtual void WriteBandInfo(const std::string &name, const std::vector<ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) = 0;
 		virtual void WriteAntennae(const std::vector<AntennaInfo> &antennae, double time) = 0;
 		virtual void WritePolarizationForLinearPols(bool flagRow) = 0;
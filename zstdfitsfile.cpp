@@ -0,0 +1,229 @@
+#include "zstdfitsfile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+	const size_t fitsBlockSize = 2880, fitsCardSize = 80;
+
+	std::string trim(const std::string& str)
+	{
+		const size_t first = str.find_first_not_of(' ');
+		if(first == std::string::npos)
+			return std::string();
+		return str.substr(first, str.find_last_not_of(' ') - first + 1);
+	}
+
+	/** Parses the value of a card, e.g. "NAXIS1  =                 1024 / comment". */
+	std::string cardValue(const char* card)
+	{
+		const std::string value(card + 10, fitsCardSize - 10);
+		const size_t quote = value.find('\'');
+		if(quote != std::string::npos && trim(value.substr(0, quote)).empty())
+		{
+			const size_t endQuote = value.find('\'', quote + 1);
+			return trim(value.substr(quote + 1, endQuote == std::string::npos ? std::string::npos : endQuote - quote - 1));
+		}
+		return trim(value.substr(0, value.find('/')));
+	}
+}
+
+ZstdFitsFile::ZstdFitsFile(const std::string& filename) :
+	_filename(filename),
+	_data(nullptr),
+	_size(0),
+	_context(nullptr),
+	_inputPosition(0),
+	_position(0),
+	_nextHDU(1)
+{
+#ifndef HAVE_ZSTD
+	throw std::runtime_error("File " + filename + " is compressed with zstd, but Cotter was built without zstd support");
+#else
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		throw std::runtime_error("Cannot open file " + filename);
+	struct stat fileStatus;
+	if(fstat(fd, &fileStatus) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("Cannot determine size of file " + filename);
+	}
+	_size = fileStatus.st_size;
+	void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		throw std::runtime_error("Cannot map file " + filename);
+	_data = static_cast<const unsigned char*>(data);
+	madvise(data, _size, MADV_SEQUENTIAL);
+	_context = ZSTD_createDCtx();
+	if(_context == nullptr)
+	{
+		munmap(data, _size);
+		throw std::runtime_error("Cannot create zstd decompression context");
+	}
+#endif
+}
+
+ZstdFitsFile::~ZstdFitsFile()
+{
+#ifdef HAVE_ZSTD
+	ZSTD_freeDCtx(_context);
+	munmap(const_cast<unsigned char*>(_data), _size);
+#endif
+}
+
+bool ZstdFitsFile::IsZstdFile(const std::string& filename)
+{
+	// The frame magic number 0xFD2FB528, stored little endian
+	const unsigned char magic[4] = { 0x28, 0xB5, 0x2F, 0xFD };
+	unsigned char identifier[4] = { 0, 0, 0, 0 };
+	FILE* file = std::fopen(filename.c_str(), "rb");
+	if(file == 0)
+		return false;
+	size_t identifierSize = std::fread(identifier, 1, 4, file);
+	std::fclose(file);
+	return identifierSize == 4 && std::memcmp(identifier, magic, 4) == 0;
+}
+
+size_t ZstdFitsFile::decompress(char* destination, size_t size)
+{
+#ifdef HAVE_ZSTD
+	ZSTD_outBuffer output = { destination, size, 0 };
+	while(output.pos != output.size)
+	{
+		ZSTD_inBuffer input = { _data, _size, _inputPosition };
+		const size_t previousOutputPos = output.pos;
+		const size_t result = ZSTD_decompressStream(_context, &output, &input);
+		if(ZSTD_isError(result))
+			throw std::runtime_error("Error decompressing " + _filename + ": " + ZSTD_getErrorName(result));
+		_inputPosition = input.pos;
+		// The decompressor may still hold output after the last input was consumed
+		if(_inputPosition == _size && output.pos == previousOutputPos)
+			break;
+	}
+	_position += output.pos;
+	return output.pos;
+#else
+	(void) destination;
+	(void) size;
+	return 0;
+#endif
+}
+
+void ZstdFitsFile::read(char* destination, size_t size)
+{
+	if(decompress(destination, size) != size)
+		throw std::runtime_error("Compressed file " + _filename + " ends unexpectedly: is it truncated?");
+}
+
+void ZstdFitsFile::Skip(uint64_t size)
+{
+	_skipBuffer.resize(size_t(1) << 20);
+	while(size != 0)
+	{
+		const size_t part = std::min<uint64_t>(size, _skipBuffer.size());
+		read(_skipBuffer.data(), part);
+		size -= part;
+	}
+}
+
+void ZstdFitsFile::rewind()
+{
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx_reset(_context, ZSTD_reset_session_only);
+#endif
+	_inputPosition = 0;
+	_position = 0;
+	_nextHDU = 1;
+}
+
+bool ZstdFitsFile::ReadHeader(Keywords& keywords)
+{
+	keywords.clear();
+	char block[fitsBlockSize];
+	bool isFirstBlock = true;
+	while(true)
+	{
+		const size_t blockSize = decompress(block, fitsBlockSize);
+		if(blockSize == 0 && isFirstBlock)
+			return false;
+		if(blockSize != fitsBlockSize)
+			throw std::runtime_error("Compressed file " + _filename + " ends unexpectedly: is it truncated?");
+		isFirstBlock = false;
+		for(size_t cardIndex=0; cardIndex!=fitsBlockSize/fitsCardSize; ++cardIndex)
+		{
+			const char* card = block + cardIndex*fitsCardSize;
+			const std::string name = trim(std::string(card, 8));
+			if(name == "END")
+				return true;
+			if(card[8] == '=' && card[9] == ' ')
+				keywords[name] = cardValue(card);
+		}
+	}
+}
+
+uint64_t ZstdFitsFile::PaddedDataSize(const Keywords& keywords)
+{
+	const long axisCount = IntValue(keywords, "NAXIS");
+	if(axisCount == 0)
+		return 0;
+	uint64_t size = std::abs(IntValue(keywords, "BITPIX")) / 8;
+	for(long axis=1; axis<=axisCount; ++axis)
+		size *= IntValue(keywords, "NAXIS" + std::to_string(axis));
+	Keywords::const_iterator pcount = keywords.find("PCOUNT");
+	if(pcount != keywords.end())
+		size += std::atol(pcount->second.c_str());
+	return (size + fitsBlockSize - 1) / fitsBlockSize * fitsBlockSize;
+}
+
+long ZstdFitsFile::IntValue(const Keywords& keywords, const std::string& name)
+{
+	Keywords::const_iterator keyword = keywords.find(name);
+	if(keyword == keywords.end())
+		throw std::runtime_error("Keyword " + name + " is missing in FITS header");
+	return std::atol(keyword->second.c_str());
+}
+
+void ZstdFitsFile::ReadImage(size_t hduNumber, size_t firstPixel, size_t pixelCount, float* destination)
+{
+	if(hduNumber < _nextHDU)
+		rewind();
+	Keywords keywords;
+	while(_nextHDU < hduNumber)
+	{
+		if(!ReadHeader(keywords))
+			throw std::runtime_error("Compressed file " + _filename + " has fewer HDUs than expected");
+		Skip(PaddedDataSize(keywords));
+		++_nextHDU;
+	}
+	if(!ReadHeader(keywords))
+		throw std::runtime_error("Compressed file " + _filename + " has fewer HDUs than expected");
+	const uint64_t dataSize = PaddedDataSize(keywords);
+	if(IntValue(keywords, "BITPIX") != -32 || keywords.count("BSCALE") != 0 || keywords.count("BZERO") != 0)
+		throw std::runtime_error("The images in compressed file " + _filename + " are not 32-bit floats");
+	if((firstPixel + pixelCount) * sizeof(float) > dataSize)
+		throw std::runtime_error("Image in compressed file " + _filename + " is smaller than expected");
+	Skip(firstPixel * sizeof(float));
+	read(reinterpret_cast<char*>(destination), pixelCount * sizeof(float));
+	Skip(dataSize - (firstPixel + pixelCount) * sizeof(float));
+	++_nextHDU;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// FITS stores big-endian floats
+	uint32_t* words = reinterpret_cast<uint32_t*>(destination);
+	for(size_t i=0; i!=pixelCount; ++i)
+		words[i] = __builtin_bswap32(words[i]);
+#endif
+}
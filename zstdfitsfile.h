@@ -0,0 +1,74 @@
+#ifndef ZSTD_FITS_FILE_H
+#define ZSTD_FITS_FILE_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Reads a FITS file that was compressed as a whole with zstd, e.g. a gpubox file
+ * compressed with 'zstd'. A zstd stream can't be read from an arbitrary position,
+ * so the HDUs are decompressed in order: reading an earlier HDU restarts the
+ * decompression, and skipped HDUs are still decompressed. The compressed file is
+ * memory mapped.
+ *
+ * Only available when Cotter was built with zstd (HAVE_ZSTD); otherwise the
+ * constructor throws.
+ */
+class ZstdFitsFile
+{
+	public:
+		typedef std::map<std::string, std::string> Keywords;
+
+		explicit ZstdFitsFile(const std::string& filename);
+		~ZstdFitsFile();
+
+		ZstdFitsFile(const ZstdFitsFile&) = delete;
+		ZstdFitsFile& operator=(const ZstdFitsFile&) = delete;
+
+		/** Whether the file starts with the zstd magic number. */
+		static bool IsZstdFile(const std::string& filename);
+
+		/**
+		 * Reads the header that starts at the current position, and moves to the start of
+		 * its data. The values of the keywords are trimmed, and strings are unquoted.
+		 * @returns false when at the end of the file.
+		 */
+		bool ReadHeader(Keywords& keywords);
+		/** Skips the given number of decompressed bytes. */
+		void Skip(uint64_t size);
+		/** Position in the decompressed file. */
+		uint64_t Position() const { return _position; }
+
+		/**
+		 * Reads floats from the image of an HDU, which should be an uncompressed
+		 * 32-bit float image, and leaves the file at the start of the next HDU.
+		 * @param hduNumber One-based HDU number, as used by cfitsio.
+		 * @param firstPixel Index of the first float to read, zero-based.
+		 */
+		void ReadImage(size_t hduNumber, size_t firstPixel, size_t pixelCount, float* destination);
+
+		/** Size of the data unit of an HDU with the given header, padded to whole FITS blocks. */
+		static uint64_t PaddedDataSize(const Keywords& keywords);
+		/** Integer value of a keyword; throws when it is missing. */
+		static long IntValue(const Keywords& keywords, const std::string& name);
+
+	private:
+		size_t decompress(char* destination, size_t size);
+		void read(char* destination, size_t size);
+		void rewind();
+
+		std::string _filename;
+		const unsigned char* _data;
+		size_t _size;
+		struct ZSTD_DCtx_s* _context;
+		size_t _inputPosition;
+		uint64_t _position;
+		// The HDU of which the header starts at the current position
+		size_t _nextHDU;
+		std::vector<char> _skipBuffer;
+};
+
+#endif